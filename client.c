@@ -19,6 +19,7 @@
 #include "ptp.h"
 #include "ptp-pima.h"
 #include "ptp-sony.h"
+#include "ptp-group.h"
 #include "timer.h"
 #include "usb.h"
 
@@ -27,14 +28,22 @@
 #define IMAGE_COUNT 30			// Minimal number of images to capture
 //#define OBJECT_POLL_PENDING	// Define to poll the "Pending images" property instead of polling events
 #define USE_EVENT_CALLBACK		// Define to use the event callback instead of polling
+#define TRANSACTION_TIMEOUT 10000	// Transaction deadline in ms, 0 to wait forever
+#define CAMERA_VID 0x054C
+#define CAMERA_PID 0x094E
+#define CAMERA_LIST_SIZE 16
+#define TRACE_MAX_DATA (64 * 1024)	// Object data kept per data phase when recording a trace
+#define GROUP_OBJECT_TIMEOUT 5000	// ms to wait for each camera's image after a group trigger
 
 
 #ifndef USE_EVENT_CALLBACK
 sem_t sem_stop_polling;
 #endif
 
-sem_t sem_objects, sem_quit;
+sem_t sem_objects, sem_quit, sem_cancel;
+volatile int stop_cancel = 0;
 uint8_t print_log = 1;
+int link_mbps = 0;
 
 void plog(int ret, const char *desc)
 {
@@ -47,6 +56,28 @@ void plog(int ret, const char *desc)
 void sig_handler(int signum)
 {
 	sem_post(&sem_quit);
+	sem_post(&sem_cancel);
+}
+
+// Aborts the transaction in progress on Ctrl+C, which cannot be done from 
+// the signal handler itself
+void *cancel_thread(void *ptpdev)
+{
+	ptp_device *dev = (ptp_device *)ptpdev;
+	
+	while (1)
+	{
+		while (sem_wait(&sem_cancel) != 0 && errno == EINTR);
+		
+		if (stop_cancel)
+		{
+			break;
+		}
+		
+		ptp_cancel(dev);
+	}
+	
+	return NULL;
 }
 
 int wait_quit(long timeout_ms)
@@ -139,23 +170,21 @@ void *poll_events(void *ptpdev)
 #endif
 
 #ifdef IMAGE_PATH
-void save_image(void *data, int size, int index)
+FILE *open_image(int index)
 {
-	FILE *f;
 	char fname[256] = { };
 	
 	snprintf(fname, sizeof(fname) - 1, "%s/output-%d.jpg", IMAGE_PATH, index);
 	
-	f = fopen(fname, "wb");
-	fwrite(data, 1, size, f);
-	fclose(f);
+	return fopen(fname, "wb");
 }
 #endif
 
 int transfer_image(ptp_device *dev, uint32_t object_handle, int index)
 {
 	int retval;
-	void *image_data;
+	ptp_data_sink sink;
+	FILE *f = NULL;
 	timer tm;
 	
 	timer_start(&tm);
@@ -169,8 +198,20 @@ int transfer_image(ptp_device *dev, uint32_t object_handle, int index)
 		return retval;
 	}
 	
+	#ifdef IMAGE_PATH
+	// Save the image while it is being transferred
+	f = open_image(index);
+	#endif
+	
+	ptp_sink_init_file(&sink, f);
+	
 	// Get the object's data
-	retval = ptp_pima_get_object(dev, object_handle, &image_data);
+	retval = ptp_pima_get_object_stream(dev, object_handle, &sink);
+	
+	if (f)
+	{
+		fclose(f);
+	}
 	
 	if (retval >= 0)
 	{
@@ -191,18 +232,22 @@ int transfer_image(ptp_device *dev, uint32_t object_handle, int index)
 		
 		printf("Transfer rate: %.2f MB/s\n", rate);
 		
-		#ifdef IMAGE_PATH
-		// Save the image
-		save_image(image_data, retval, index);
-		#endif
+		rate = ptp_get_data_rate(dev);
 		
-		free(image_data);
+		if (link_mbps > 0)
+		{
+			printf("Data phase:    %.2f MB/s (%.1f%% of %d Mbps link)\n", rate, 100.0 * (rate * 1024.0 * 1024.0 * 8.0) / (link_mbps * 1000000.0), link_mbps);
+		}
+		else
+		{
+			printf("Data phase:    %.2f MB/s\n", rate);
+		}
 		
 		retval = PTP_OK;
 	}
 	else
 	{
-		plog(retval, "ptp_pima_get_object()");
+		plog(retval, "ptp_pima_get_object_stream()");
 	}
 	
 	return retval;
@@ -327,6 +372,66 @@ void take_pictures(ptp_device *dev, int count)
 	}
 }
 
+void print_latency(ptp_device *ptpdev)
+{
+	ptp_latency control, data;
+	ptp_recovery recovery;
+	ptp_stats *stats;
+	uint64_t phases, second;
+	
+	ptp_get_latency(ptpdev, &control, &data);
+	ptp_get_recv_stats(ptpdev, &phases, &second);
+	ptp_get_recovery_stats(ptpdev, &recovery);
+	
+	if (control.count > 0)
+	{
+		printf(
+			"Control round trip: %llu us avg, %llu us min, %llu us max (%llu transactions)\n", 
+			(unsigned long long)(control.total_usec / control.count), 
+			(unsigned long long)control.min_usec, 
+			(unsigned long long)control.max_usec, 
+			(unsigned long long)control.count
+		);
+	}
+	
+	if (data.count > 0)
+	{
+		printf(
+			"Data round trip:    %llu us avg, %llu us min, %llu us max (%llu transactions)\n", 
+			(unsigned long long)(data.total_usec / data.count), 
+			(unsigned long long)data.min_usec, 
+			(unsigned long long)data.max_usec, 
+			(unsigned long long)data.count
+		);
+	}
+	
+	if (phases > 0)
+	{
+		printf("Data phases:        %llu, %llu needed a second transfer\n", (unsigned long long)phases, (unsigned long long)second);
+	}
+	
+	if (recovery.count > 0)
+	{
+		printf(
+			"Pipe recoveries:    %llu (%llu resets, %llu failed), %llu us avg, %llu us max\n", 
+			(unsigned long long)recovery.count, 
+			(unsigned long long)recovery.resets, 
+			(unsigned long long)recovery.failures, 
+			(unsigned long long)(recovery.total_usec / recovery.count), 
+			(unsigned long long)recovery.max_usec
+		);
+	}
+	
+	stats = malloc(sizeof(*stats));
+	
+	if (stats && ptp_device_get_stats(ptpdev, stats, 0) == PTP_OK)
+	{
+		ptp_stats_print(stats, stdout);
+	}
+	
+	free(stats);
+}
+
 void wait_property(ptp_device *ptpdev)
 {
 	int retval;
@@ -402,6 +507,7 @@ int print_device_props(ptp_device *ptpdev)
 	if (ret != PTP_OK)
 	{
 		plog(ret, "ptp_sony_get_all_dev_prop_data()");
+		ptp_pima_proplist_free(list);
 		return ret;
 	}
 	
@@ -416,21 +522,52 @@ int print_device_props(ptp_device *ptpdev)
 	return PTP_OK;
 }
 
+// Prints the properties that changed since the previous poll
 void poll_device_props(ptp_device *ptpdev)
 {
+	ptp_sony_prop_table *table;
+	ptp_pima_prop_desc *desc;
+	uint32_t printed = 0, i;
 	int ret;
 	
+	ret = ptp_sony_proptable_create(ptpdev, &table);
+	
+	if (ret != PTP_OK)
+	{
+		plog(ret, "ptp_sony_proptable_create");
+		return;
+	}
+	
 	do
 	{
-		printf("\nDevice properties:\n");
-		ret = print_device_props(ptpdev);
+		ret = ptp_sony_proptable_refresh(table);
 		
-		if (ret != PTP_OK)
+		if (ret < 0)
+		{
+			plog(ret, "ptp_sony_proptable_refresh");
+			break;
+		}
+		
+		if (table->generation != printed)
 		{
-			return;
+			printf("\nDevice properties:\n");
+			
+			for (i = 0; i < table->count; i++)
+			{
+				desc = ptp_sony_proptable_get_prop(table, table->codes[i]);
+				
+				if (desc && ptp_sony_proptable_generation(table, table->codes[i]) > printed)
+				{
+					ptp_sony_print_prop_desc(desc);
+				}
+			}
+			
+			printed = table->generation;
 		}
 	}
 	while (!wait_quit(500));
+	
+	ptp_sony_proptable_free(table);
 }
 
 void print_libusb_version(void)
@@ -440,9 +577,142 @@ void print_libusb_version(void)
 	printf("Using libusb version %d.%d.%d.%d\n", v->major, v->minor, v->micro, v->nano);
 }
 
-void print_device_speed(usb_device_handle *usbdev)
+void print_cameras(usb_context *ctx)
+{
+	usb_device_info list[CAMERA_LIST_SIZE];
+	int count, i;
+	
+	count = usb_enumerate(ctx, CAMERA_VID, CAMERA_PID, list, CAMERA_LIST_SIZE);
+	
+	if (count < 0)
+	{
+		printf("usb_enumerate: %d\n", count);
+		return;
+	}
+	
+	printf("%d camera(s) attached\n", count);
+	
+	for (i = 0; i < count && i < CAMERA_LIST_SIZE; i++)
+	{
+		printf("  %s serial=%s\n", list[i].path, list[i].serial[0] ? list[i].serial : "(none)");
+	}
+}
+
+// Downloads the image each camera took in the group shot
+int group_download(ptp_device *dev, int index, void *ctx)
+{
+	ptp_group_shot *shots = ctx;
+	ptp_data_sink sink;
+	FILE *f = NULL;
+	int retval;
+	
+	if (shots[index].result != PTP_OK)
+	{
+		return shots[index].result;
+	}
+	
+	retval = ptp_pima_get_object_info(dev, shots[index].object_handle, NULL);
+	
+	if (retval != PTP_OK)
+	{
+		return retval;
+	}
+	
+	#ifdef IMAGE_PATH
+	f = open_image(index);
+	#endif
+	
+	ptp_sink_init_file(&sink, f);
+	retval = ptp_pima_get_object_stream(dev, shots[index].object_handle, &sink);
+	
+	if (f)
+	{
+		fclose(f);
+	}
+	
+	return (retval < 0) ? retval : PTP_OK;
+}
+
+// Drives every attached camera at once: one synchronized shot, after which 
+// each camera downloads its image from its own thread
+int run_group(usb_context *ctx)
+{
+	usb_device_info list[CAMERA_LIST_SIZE];
+	usb_device_handle *usbdev[PTP_GROUP_MAX_DEVICES];
+	ptp_device *ptpdev[PTP_GROUP_MAX_DEVICES];
+	ptp_group_shot shots[PTP_GROUP_MAX_DEVICES];
+	ptp_group group;
+	int count, opened = 0, i, ret;
+	
+	count = usb_enumerate(ctx, CAMERA_VID, CAMERA_PID, list, CAMERA_LIST_SIZE);
+	
+	if (count < 0)
+	{
+		printf("usb_enumerate: %d\n", count);
+		return 1;
+	}
+	
+	ptp_group_init(&group);
+	
+	for (i = 0; i < count && i < CAMERA_LIST_SIZE && opened < PTP_GROUP_MAX_DEVICES; i++)
+	{
+		usbdev[opened] = usb_open_device_with_path(ctx, list[i].path);
+		
+		if (!usbdev[opened])
+		{
+			printf("Camera at %s could not be opened\n", list[i].path);
+			continue;
+		}
+		
+		ret = ptp_device_init(&ptpdev[opened], usbdev[opened], NULL, NULL);
+		
+		if (ret != PTP_OK)
+		{
+			printf("ptp_device_init(%s): %d\n", list[i].path, ret);
+			usb_close(usbdev[opened]);
+			continue;
+		}
+		
+		ptp_set_timeout(ptpdev[opened], TRANSACTION_TIMEOUT);
+		plog(ptp_sony_handshake(ptpdev[opened]), list[i].path);
+		ptp_group_add(&group, ptpdev[opened], PTP_GROUP_NO_CPU);
+		opened++;
+	}
+	
+	if (opened == 0)
+	{
+		printf("Camera not detected\n");
+		return 1;
+	}
+	
+	printf("Triggering %d camera(s)\n", opened);
+	
+	ret = ptp_group_trigger(&group, shots, GROUP_OBJECT_TIMEOUT);
+	plog(ret, "ptp_group_trigger");
+	ptp_group_print_skew(&group, shots);
+	
+	ret = ptp_group_start(&group, group_download, shots);
+	
+	if (ret == PTP_OK)
+	{
+		ret = ptp_group_wait(&group);
+	}
+	
+	ptp_group_print_rates(&group);
+	
+	for (i = 0; i < opened; i++)
+	{
+		ptp_device_free(ptpdev[i]);
+		usb_close(usbdev[i]);
+	}
+	
+	return (ret == PTP_OK) ? 0 : 1;
+}
+
+int print_device_speed(usb_device_handle *usbdev)
 {
 	libusb_device *dev;
+	int mbps = 0;
 	
 	dev = libusb_get_device(usbdev->handle);
 	
@@ -457,18 +727,22 @@ void print_device_speed(usb_device_handle *usbdev)
 		{
 		case LIBUSB_SPEED_LOW:
 			s = "low speed (1.5Mbps)";
+			mbps = 1;
 			break;
 			
 		case LIBUSB_SPEED_FULL:
 			s = "full speed (12Mbps)";
+			mbps = 12;
 			break;
 			
 		case LIBUSB_SPEED_HIGH:
 			s = "high speed (480Mbps)";
+			mbps = 480;
 			break;
 			
 		case LIBUSB_SPEED_SUPER:
 			s = "super speed (5Gbps)";
+			mbps = 5000;
 			break;
 			
 		case LIBUSB_SPEED_UNKNOWN:
@@ -479,6 +753,9 @@ void print_device_speed(usb_device_handle *usbdev)
 		
 		printf("Device is operating at %s\n", s);
 	}
+	
+	// Returns the signalling rate in Mbps, 0 if unknown
+	return mbps;
 }
 
 int main(int argc, char **argv)
@@ -492,6 +769,8 @@ int main(int argc, char **argv)
 	usb_device_handle *usbdev;
 	ptp_device *ptpdev;
 	ptp_pima_device_info *devinfo;
+	pthread_t thread_cancel;
+	int thread_cancel_valid;
 	#ifndef USE_EVENT_CALLBACK
 	pthread_t thread_poll;
 	#endif
@@ -513,6 +792,16 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 	
+	ret = sem_init(&sem_cancel, 0, 0);
+	
+	if (ret)
+	{
+		printf("sem_init: %d\n", errno);
+		sem_destroy(&sem_quit);
+		sem_destroy(&sem_objects);
+		exit(1);
+	}
+	
 	sigemptyset(&sigact.sa_mask);
 	sigact.sa_flags = 0;
 	sigact.sa_handler = sig_handler;
@@ -530,6 +819,7 @@ int main(int argc, char **argv)
 	if (ret)
 	{
 		printf("sem_init: %d\n", errno);
+		sem_destroy(&sem_cancel);
 		sem_destroy(&sem_quit);
 		sem_destroy(&sem_objects);
 		exit(1);
@@ -543,6 +833,7 @@ int main(int argc, char **argv)
 		#ifndef USE_EVENT_CALLBACK
 		sem_destroy(&sem_stop_polling);
 		#endif
+		sem_destroy(&sem_cancel);
 		sem_destroy(&sem_quit);
 		sem_destroy(&sem_objects);
 		exit(1);
@@ -583,7 +874,32 @@ int main(int argc, char **argv)
 	
 	//libusb_free_device_list(list, 1);
 	
-	usbdev = usb_open_device_with_vid_pid(ctx, 0x054C, 0x094E);
+	print_cameras(ctx);
+	
+	// "all" drives every attached camera as a group
+	if (argc > 1 && strcmp(argv[1], "all") == 0)
+	{
+		ret = run_group(ctx);
+		usb_exit(ctx);
+		#ifndef USE_EVENT_CALLBACK
+		sem_destroy(&sem_stop_polling);
+		#endif
+		sem_destroy(&sem_cancel);
+		sem_destroy(&sem_quit);
+		sem_destroy(&sem_objects);
+		
+		return ret;
+	}
+	
+	// An optional serial number selects one of several attached cameras
+	if (argc > 1)
+	{
+		usbdev = usb_open_device_with_serial(ctx, CAMERA_VID, CAMERA_PID, argv[1]);
+	}
+	else
+	{
+		usbdev = usb_open_device_with_vid_pid(ctx, CAMERA_VID, CAMERA_PID);
+	}
 	
 	if (usbdev == NULL)
 	{
@@ -592,12 +908,13 @@ int main(int argc, char **argv)
 		#ifndef USE_EVENT_CALLBACK
 		sem_destroy(&sem_stop_polling);
 		#endif
+		sem_destroy(&sem_cancel);
 		sem_destroy(&sem_quit);
 		sem_destroy(&sem_objects);
 		exit(1);
 	}
 	
-	print_device_speed(usbdev);
+	link_mbps = print_device_speed(usbdev);
 	
 	#ifdef USE_EVENT_CALLBACK
 	ret = ptp_device_init(&ptpdev, usbdev, event_callback, NULL);
@@ -613,11 +930,18 @@ int main(int argc, char **argv)
 		#ifndef USE_EVENT_CALLBACK
 		sem_destroy(&sem_stop_polling);
 		#endif
+		sem_destroy(&sem_cancel);
 		sem_destroy(&sem_quit);
 		sem_destroy(&sem_objects);
 		exit(1);
 	}
 	
+	// An optional second argument records the session for tracereplay
+	if (argc > 2 && ptp_trace_start(ptpdev, argv[2], TRACE_MAX_DATA) != PTP_OK)
+	{
+		printf("Could not record a trace to %s\n", argv[2]);
+	}
+	
 	#ifndef USE_EVENT_CALLBACK
 	// Polling mode, create the polling thread
 	ret = pthread_create(&thread_poll, NULL, poll_events, ptpdev);
@@ -631,18 +955,30 @@ int main(int argc, char **argv)
 		#ifndef USE_EVENT_CALLBACK
 		sem_destroy(&sem_stop_polling);
 		#endif
+		sem_destroy(&sem_cancel);
 		sem_destroy(&sem_quit);
 		sem_destroy(&sem_objects);
 		exit(1);
 	}
 	#endif
 	
+	ptp_set_timeout(ptpdev, TRANSACTION_TIMEOUT);
+	
+	ret = pthread_create(&thread_cancel, NULL, cancel_thread, ptpdev);
+	thread_cancel_valid = (ret == 0);
+	
+	if (ret)
+	{
+		printf("Warning: Could not create cancel thread\n");
+	}
+	
 	// Initialize the camera
 	plog(ptp_sony_sdio_connect(ptpdev, 1, 0, 0), "ptp_sony_sdio_connect(1, 0, 0)");
 	plog(ptp_sony_sdio_connect(ptpdev, 2, 0, 0), "ptp_sony_sdio_connect(2, 0, 0)");
 	plog(ptp_sony_get_sdio_ext_devinfo(ptpdev, 200, NULL), "ptp_sony_get_sdio_ext_devinfo(200 #1)");
 	plog(ptp_sony_get_sdio_ext_devinfo(ptpdev, 200, NULL), "ptp_sony_get_sdio_ext_devinfo(200 #2)");
 	plog(ptp_sony_sdio_connect(ptpdev, 3, 0, 0), "ptp_sony_sdio_connect(3, 0, 0)");
+	print_latency(ptpdev);
 	
 	// Create a device info object
 	plog(ret = ptp_pima_devinfo_create(&devinfo), "ptp_pima_devinfo_create");
@@ -674,6 +1010,8 @@ int main(int argc, char **argv)
 	
 	poll_device_props(ptpdev);
 	
+	print_latency(ptpdev);
+	
 	printf("Closing...\n");
 	
 	#ifndef USE_EVENT_CALLBACK
@@ -681,12 +1019,20 @@ int main(int argc, char **argv)
 	pthread_join(thread_poll, NULL);
 	#endif
 	
+	if (thread_cancel_valid)
+	{
+		stop_cancel = 1;
+		sem_post(&sem_cancel);
+		pthread_join(thread_cancel, NULL);
+	}
+	
 	ptp_device_free(ptpdev);
 	usb_close(usbdev);
 	usb_exit(ctx);
 	#ifndef USE_EVENT_CALLBACK
 	sem_destroy(&sem_stop_polling);
 	#endif
+	sem_destroy(&sem_cancel);
 	sem_destroy(&sem_quit);
 	sem_destroy(&sem_objects);
 	
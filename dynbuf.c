@@ -54,9 +54,11 @@ void * dynbuf_append(dynbuf *buf, void *data, size_t size)
 	if (rem < size)
 	{
 		size_t new_size = buf->size + size + 1024;
-		void *new_data, *prev_data;
+		uintptr_t prev_data;
+		void *new_data;
 		
-		prev_data = buf->data;
+		// The old address is only kept as a number, it is dead after realloc()
+		prev_data = (uintptr_t)buf->data;
 		new_data = realloc(buf->data, new_size);
 		
 		if (!new_data)
@@ -67,7 +69,7 @@ void * dynbuf_append(dynbuf *buf, void *data, size_t size)
 		buf->data = new_data;
 		buf->maxsize = new_size;
 		
-		offset = new_data - prev_data;
+		offset = (ssize_t)((uintptr_t)new_data - prev_data);
 	}
 	
 	dst = (uint8_t *)(buf->data) + buf->size;
@@ -91,6 +93,45 @@ void * dynbuf_append(dynbuf *buf, void *data, size_t size)
 	return dst;
 }
 
+// Grows the buffer to hold at least 'maxsize' bytes in a single move, so 
+// that appends up to that size never reallocate
+int dynbuf_reserve(dynbuf *buf, size_t maxsize)
+{
+	uintptr_t prev_data;
+	void *new_data;
+	ssize_t offset;
+	
+	if (!buf)
+	{
+		return DYNBUF_ERROR_PARAM;
+	}
+	
+	if (maxsize <= buf->maxsize)
+	{
+		return DYNBUF_OK;
+	}
+	
+	prev_data = (uintptr_t)buf->data;
+	new_data = realloc(buf->data, maxsize);
+	
+	if (!new_data)
+	{
+		return DYNBUF_ERROR_MEMORY;
+	}
+	
+	buf->data = new_data;
+	buf->maxsize = maxsize;
+	
+	offset = (ssize_t)((uintptr_t)new_data - prev_data);
+	
+	if (offset != 0 && buf->adjust_callback)
+	{
+		buf->adjust_callback(buf, offset, buf->context);
+	}
+	
+	return DYNBUF_OK;
+}
+
 int dynbuf_clear(dynbuf *buf)
 {
 	if (!buf)
@@ -111,8 +152,9 @@ int dynbuf_trunc(dynbuf *buf)
 	
 	if (buf->size < buf->maxsize)
 	{
-		void *prev_data = buf->data;
+		uintptr_t prev_data = (uintptr_t)buf->data;
 		void *new_data = realloc(buf->data, buf->size);
+		ssize_t offset;
 		
 		if (!new_data)
 		{
@@ -121,10 +163,11 @@ int dynbuf_trunc(dynbuf *buf)
 		
 		buf->data = new_data;
 		buf->maxsize = buf->size;
+		offset = (ssize_t)((uintptr_t)new_data - prev_data);
 		
-		if (buf->adjust_callback && new_data != prev_data)
+		if (offset != 0 && buf->adjust_callback)
 		{
-			buf->adjust_callback(buf, new_data - prev_data, buf->context);
+			buf->adjust_callback(buf, offset, buf->context);
 		}
 	}
 	
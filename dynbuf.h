@@ -29,6 +29,7 @@ typedef struct _dynbuf_adjust_context
 dynbuf * dynbuf_create(size_t maxsize, dynbuf_adjust_callback_t adjust_callback, void *context);
 void dynbuf_free(dynbuf *buf);
 void * dynbuf_append(dynbuf *buf, void *data, size_t size);
+int dynbuf_reserve(dynbuf *buf, size_t maxsize);
 int dynbuf_clear(dynbuf *buf);
 int dynbuf_trunc(dynbuf *buf);
 void dynbuf_adjust_begin(dynbuf_adjust_context *context, dynbuf *buf);
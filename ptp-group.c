@@ -0,0 +1,492 @@
+#define _GNU_SOURCE
+#include "ptp-group.h"
+#include "ptp-sony.h"
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+
+#define PTP_GROUP_MB	(1024.0 * 1024.0)
+
+static double ptp_group_elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *ptp_group_thread_proc(void *p)
+{
+	ptp_group_member *member = p;
+	ptp_group *group = member->group;
+	
+	member->result = group->proc(member->dev, (int)(member - group->members), group->ctx);
+	
+	clock_gettime(CLOCK_MONOTONIC, &member->time_end);
+	member->bytes = ptp_get_bytes_in(member->dev) - member->bytes_start;
+	
+	return NULL;
+}
+
+void ptp_group_init(ptp_group *group)
+{
+	memset(group, 0, sizeof(ptp_group));
+}
+
+// Adds a device to the group. 'cpu' pins its thread to one CPU, 
+// PTP_GROUP_NO_CPU leaves placement to the scheduler.
+int ptp_group_add(ptp_group *group, ptp_device *dev, int cpu)
+{
+	ptp_group_member *member;
+	
+	if (!group || !dev || group->running)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	if (group->count >= PTP_GROUP_MAX_DEVICES)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	member = &group->members[group->count++];
+	memset(member, 0, sizeof(ptp_group_member));
+	member->dev = dev;
+	member->cpu = cpu;
+	member->group = group;
+	
+	return PTP_OK;
+}
+
+// Starts one thread per device running 'proc'. The devices' transfer 
+// counters are sampled here so ptp_group_get_*_rate() cover this run only.
+int ptp_group_start(ptp_group *group, ptp_group_proc proc, void *ctx)
+{
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	ptp_group_member *member;
+	int i, retval;
+	
+	if (!group || !proc || group->running || group->count == 0)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	group->proc = proc;
+	group->ctx = ctx;
+	group->running = 1;
+	
+	clock_gettime(CLOCK_MONOTONIC, &group->time_start);
+	
+	for (i = 0; i < group->count; i++)
+	{
+		member = &group->members[i];
+		member->result = PTP_OK;
+		member->bytes = 0;
+		member->bytes_start = ptp_get_bytes_in(member->dev);
+		member->time_end = group->time_start;
+		
+		pthread_attr_init(&attr);
+		
+		if (member->cpu != PTP_GROUP_NO_CPU)
+		{
+			CPU_ZERO(&cpus);
+			CPU_SET(member->cpu, &cpus);
+			retval = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+			
+			if (retval)
+			{
+				fprintf(stderr, "[ptp_group_start] Could not pin device %d to CPU %d: %d\n", i, member->cpu, retval);
+			}
+		}
+		
+		retval = pthread_create(&member->thread, &attr, ptp_group_thread_proc, member);
+		pthread_attr_destroy(&attr);
+		
+		member->thread_valid = (retval == 0);
+		
+		if (retval)
+		{
+			fprintf(stderr, "[ptp_group_start] pthread_create: %d\n", retval);
+			member->result = PTP_ERROR_MEMORY;
+		}
+	}
+	
+	return PTP_OK;
+}
+
+// Waits for all device threads. Returns the first error any of them returned.
+int ptp_group_wait(ptp_group *group)
+{
+	ptp_group_member *member;
+	int i, retval = PTP_OK;
+	
+	if (!group || !group->running)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	for (i = 0; i < group->count; i++)
+	{
+		member = &group->members[i];
+		
+		if (member->thread_valid)
+		{
+			pthread_join(member->thread, NULL);
+			member->thread_valid = 0;
+		}
+		
+		if (retval == PTP_OK && member->result < 0)
+		{
+			retval = member->result;
+		}
+	}
+	
+	group->running = 0;
+	
+	return retval;
+}
+
+// MB/s received by one device during the last run
+double ptp_group_get_data_rate(const ptp_group *group, int index)
+{
+	const ptp_group_member *member;
+	double sec;
+	
+	if (!group || index < 0 || index >= group->count)
+	{
+		return 0.0;
+	}
+	
+	member = &group->members[index];
+	sec = ptp_group_elapsed(&group->time_start, &member->time_end);
+	
+	if (sec <= 0.0)
+	{
+		return 0.0;
+	}
+	
+	return ((double)member->bytes / sec) / PTP_GROUP_MB;
+}
+
+// MB/s received by all devices together, over the time until the last 
+// device finished
+double ptp_group_get_total_rate(const ptp_group *group)
+{
+	const struct timespec *end;
+	uint64_t bytes = 0;
+	double sec;
+	int i;
+	
+	if (!group || group->count == 0)
+	{
+		return 0.0;
+	}
+	
+	end = &group->time_start;
+	
+	for (i = 0; i < group->count; i++)
+	{
+		bytes += group->members[i].bytes;
+		
+		if (ptp_group_elapsed(end, &group->members[i].time_end) > 0.0)
+		{
+			end = &group->members[i].time_end;
+		}
+	}
+	
+	sec = ptp_group_elapsed(&group->time_start, end);
+	
+	if (sec <= 0.0)
+	{
+		return 0.0;
+	}
+	
+	return ((double)bytes / sec) / PTP_GROUP_MB;
+}
+
+void ptp_group_print_rates(const ptp_group *group)
+{
+	double total, sum = 0.0, rate;
+	int i;
+	
+	if (!group)
+	{
+		return;
+	}
+	
+	for (i = 0; i < group->count; i++)
+	{
+		rate = ptp_group_get_data_rate(group, i);
+		sum += rate;
+		printf("Device %d: %.2f MB/s (%llu bytes, result %d)\n", i, rate, 
+			(unsigned long long)group->members[i].bytes, group->members[i].result);
+	}
+	
+	total = ptp_group_get_total_rate(group);
+	
+	// Equal to the sum when the devices do not hold each other back
+	printf("Aggregate: %.2f MB/s, sum of devices %.2f MB/s\n", total, sum);
+}
+
+typedef struct _ptp_group_trigger_ctx
+{
+	ptp_group_shot *shots;
+	int object_timeout;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int armed;
+	int release;
+	volatile int fire;
+} ptp_group_trigger_ctx;
+
+static int64_t ptp_group_usec(const struct timespec *from, const struct timespec *to)
+{
+	return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static void ptp_group_release_shutter(ptp_device *dev)
+{
+	ptp_sony_set_control_device_b_u16(dev, PTP_DPC_SONY_CTRL_Shutter, 1);
+	ptp_sony_set_control_device_b_u16(dev, PTP_DPC_SONY_CTRL_AFLock, 1);
+}
+
+static int ptp_group_trigger_proc(ptp_device *dev, int index, void *p)
+{
+	ptp_group_trigger_ctx *trig = p;
+	ptp_group_shot *shot = &trig->shots[index];
+	ptp_event event;
+	int retval;
+	
+	// Keeps the ObjectAdded that may arrive before the wait below starts
+	ptp_event_subscribe(dev);
+	
+	// Half-press, then drop events left over from earlier shots
+	retval = ptp_sony_set_control_device_b_u16(dev, PTP_DPC_SONY_CTRL_AFLock, 2);
+	clock_gettime(CLOCK_MONOTONIC, &shot->armed);
+	
+	while (ptp_event_get_timed(dev, &event, 0) == PTP_OK);
+	
+	pthread_mutex_lock(&trig->mutex);
+	trig->armed++;
+	pthread_cond_broadcast(&trig->cond);
+	
+	while (!trig->release)
+	{
+		pthread_cond_wait(&trig->cond, &trig->mutex);
+	}
+	
+	pthread_mutex_unlock(&trig->mutex);
+	
+	// The wakeups above are spread over scheduler latency, spinning here 
+	// lines the threads up on the store that fires them
+	while (!__atomic_load_n(&trig->fire, __ATOMIC_ACQUIRE));
+	
+	if (retval != PTP_OK)
+	{
+		shot->result = retval;
+		ptp_group_release_shutter(dev);
+		ptp_event_unsubscribe(dev);
+		return retval;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &shot->send);
+	retval = ptp_sony_set_control_device_b_u16(dev, PTP_DPC_SONY_CTRL_Shutter, 2);
+	clock_gettime(CLOCK_MONOTONIC, &shot->sent);
+	
+	if (retval == PTP_OK)
+	{
+		do
+		{
+			retval = ptp_event_get_timed(dev, &event, trig->object_timeout);
+		}
+		while (retval == PTP_OK && event.params.code != PTP_EC_SONY_ObjectAdded);
+		
+		if (retval == PTP_OK)
+		{
+			shot->object = event.timestamp;
+			shot->object_handle = (event.params.num_params > 0) ? event.params.params[0] : 0xFFFFC001;
+		}
+	}
+	
+	ptp_group_release_shutter(dev);
+	ptp_event_unsubscribe(dev);
+	
+	shot->result = retval;
+	
+	return retval;
+}
+
+// Fires the shutter of all cameras of the group at once. Each camera is 
+// half-pressed from its own thread first, and the shutter commands only go 
+// out once every camera is armed. 'shots' receives one timeline per device.
+int ptp_group_trigger(ptp_group *group, ptp_group_shot *shots, int object_timeout)
+{
+	ptp_group_trigger_ctx trig;
+	struct timespec ts;
+	int i, threads, retval;
+	
+	if (!group || !shots || group->running || group->count == 0)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	memset(shots, 0, sizeof(ptp_group_shot) * group->count);
+	memset(&trig, 0, sizeof(trig));
+	trig.shots = shots;
+	trig.object_timeout = object_timeout;
+	
+	pthread_mutex_init(&trig.mutex, NULL);
+	pthread_cond_init(&trig.cond, NULL);
+	
+	retval = ptp_group_start(group, ptp_group_trigger_proc, &trig);
+	
+	if (retval != PTP_OK)
+	{
+		pthread_cond_destroy(&trig.cond);
+		pthread_mutex_destroy(&trig.mutex);
+		return retval;
+	}
+	
+	for (i = 0, threads = 0; i < group->count; i++)
+	{
+		if (group->members[i].thread_valid)
+		{
+			threads++;
+		}
+		else
+		{
+			shots[i].result = group->members[i].result;
+		}
+	}
+	
+	pthread_mutex_lock(&trig.mutex);
+	
+	while (trig.armed < threads)
+	{
+		pthread_cond_wait(&trig.cond, &trig.mutex);
+	}
+	
+	trig.release = 1;
+	pthread_cond_broadcast(&trig.cond);
+	pthread_mutex_unlock(&trig.mutex);
+	
+	ts.tv_sec = 0;
+	ts.tv_nsec = PTP_GROUP_TRIGGER_SPIN_USEC * 1000;
+	nanosleep(&ts, NULL);
+	
+	__atomic_store_n(&trig.fire, 1, __ATOMIC_RELEASE);
+	
+	retval = ptp_group_wait(group);
+	
+	pthread_cond_destroy(&trig.cond);
+	pthread_mutex_destroy(&trig.mutex);
+	
+	return retval;
+}
+
+// Prints each camera's timeline relative to the earliest shutter command, 
+// and the spread of the send and ObjectAdded times over the group
+void ptp_group_print_skew(const ptp_group *group, const ptp_group_shot *shots)
+{
+	const struct timespec *base = NULL;
+	int64_t send_min = 0, send_max = 0, obj_min = 0, obj_max = 0, t;
+	int i, objects = 0, sends = 0;
+	
+	if (!group || !shots)
+	{
+		return;
+	}
+	
+	for (i = 0; i < group->count; i++)
+	{
+		if (shots[i].send.tv_sec && (!base || ptp_group_usec(&shots[i].send, base) > 0))
+		{
+			base = &shots[i].send;
+		}
+	}
+	
+	if (!base)
+	{
+		printf("No shutter command was sent\n");
+		return;
+	}
+	
+	for (i = 0; i < group->count; i++)
+	{
+		if (!shots[i].send.tv_sec)
+		{
+			printf("Device %d: not fired (result %d)\n", i, shots[i].result);
+			continue;
+		}
+		
+		t = ptp_group_usec(base, &shots[i].send);
+		send_min = (sends == 0 || t < send_min) ? t : send_min;
+		send_max = (sends == 0 || t > send_max) ? t : send_max;
+		sends++;
+		
+		printf("Device %d: send +%lld us, ack +%lld us", i, 
+			(long long)t, (long long)ptp_group_usec(base, &shots[i].sent));
+		
+		if (shots[i].object.tv_sec)
+		{
+			t = ptp_group_usec(base, &shots[i].object);
+			obj_min = (objects == 0 || t < obj_min) ? t : obj_min;
+			obj_max = (objects == 0 || t > obj_max) ? t : obj_max;
+			objects++;
+			
+			printf(", object 0x%08X +%lld us\n", shots[i].object_handle, (long long)t);
+		}
+		else
+		{
+			printf(", no object (result %d)\n", shots[i].result);
+		}
+	}
+	
+	printf("Send skew: %lld us over %d camera(s)\n", (long long)(send_max - send_min), sends);
+	
+	if (objects > 1)
+	{
+		printf("ObjectAdded skew: %lld us over %d camera(s)\n", (long long)(obj_max - obj_min), objects);
+	}
+}
+
+// Spread of the shutter send and ObjectAdded times over the group, in us. 
+// Each is -1 when fewer than two cameras got that far.
+void ptp_group_get_skew(const ptp_group *group, const ptp_group_shot *shots, int64_t *send_skew, int64_t *object_skew)
+{
+	const struct timespec *send_min = NULL, *send_max = NULL, *obj_min = NULL, *obj_max = NULL;
+	int i, sends = 0, objects = 0;
+	
+	*send_skew = -1;
+	*object_skew = -1;
+	
+	if (!group || !shots)
+	{
+		return;
+	}
+	
+	for (i = 0; i < group->count; i++)
+	{
+		if (shots[i].send.tv_sec)
+		{
+			send_min = (!send_min || ptp_group_usec(&shots[i].send, send_min) > 0) ? &shots[i].send : send_min;
+			send_max = (!send_max || ptp_group_usec(send_max, &shots[i].send) > 0) ? &shots[i].send : send_max;
+			sends++;
+		}
+		
+		if (shots[i].object.tv_sec)
+		{
+			obj_min = (!obj_min || ptp_group_usec(&shots[i].object, obj_min) > 0) ? &shots[i].object : obj_min;
+			obj_max = (!obj_max || ptp_group_usec(obj_max, &shots[i].object) > 0) ? &shots[i].object : obj_max;
+			objects++;
+		}
+	}
+	
+	if (sends > 1)
+	{
+		*send_skew = ptp_group_usec(send_min, send_max);
+	}
+	
+	if (objects > 1)
+	{
+		*object_skew = ptp_group_usec(obj_min, obj_max);
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef __PTP_GROUP_H__
+#define __PTP_GROUP_H__
+
+#include <time.h>
+#include <pthread.h>
+#include "ptp.h"
+
+#define PTP_GROUP_MAX_DEVICES		16
+#define PTP_GROUP_NO_CPU			-1
+#define PTP_GROUP_TRIGGER_SPIN_USEC	2000	// Time for all threads to reach the spin before firing
+
+// Runs in the device's own thread, 'index' is the device's position in the group
+typedef int (*ptp_group_proc)(ptp_device *dev, int index, void *ctx);
+
+typedef struct _ptp_group_member
+{
+	ptp_device *dev;
+	int cpu;
+	pthread_t thread;
+	int thread_valid;
+	int result;
+	uint64_t bytes_start;
+	uint64_t bytes;
+	struct timespec time_end;
+	struct _ptp_group *group;
+} ptp_group_member;
+
+// A set of cameras driven concurrently, each from its own thread. The 
+// devices may share one usb_context, whose single event thread completes 
+// the transfers of all of them.
+typedef struct _ptp_group
+{
+	ptp_group_member members[PTP_GROUP_MAX_DEVICES];
+	int count;
+	ptp_group_proc proc;
+	void *ctx;
+	int running;
+	struct timespec time_start;
+} ptp_group;
+
+// Timeline of one camera in a group trigger, on CLOCK_MONOTONIC
+typedef struct _ptp_group_shot
+{
+	int result;
+	uint32_t object_handle;
+	struct timespec armed;		// Half-press acknowledged
+	struct timespec send;		// Shutter command about to be sent
+	struct timespec sent;		// Shutter command acknowledged
+	struct timespec object;		// ObjectAdded received
+} ptp_group_shot;
+
+void ptp_group_init(ptp_group *group);
+int ptp_group_add(ptp_group *group, ptp_device *dev, int cpu);
+int ptp_group_start(ptp_group *group, ptp_group_proc proc, void *ctx);
+int ptp_group_wait(ptp_group *group);
+double ptp_group_get_data_rate(const ptp_group *group, int index);
+double ptp_group_get_total_rate(const ptp_group *group);
+void ptp_group_print_rates(const ptp_group *group);
+int ptp_group_trigger(ptp_group *group, ptp_group_shot *shots, int object_timeout);
+void ptp_group_print_skew(const ptp_group *group, const ptp_group_shot *shots);
+void ptp_group_get_skew(const ptp_group *group, const ptp_group_shot *shots, int64_t *send_skew, int64_t *object_skew);
+
+#endif // __PTP_GROUP_H__
@@ -140,6 +140,12 @@ int ptp_pima_get_device_info(ptp_device *dev, ptp_pima_device_info *info)
 		return retval;
 	}
 	
+	if (params_in.code != PTP_RC_OK)
+	{
+		free(data);
+		return PTP_ERROR_RC;
+	}
+	
 	if (info)
 	{
 		ptp_pima_decode_context ctx;
@@ -148,7 +154,7 @@ int ptp_pima_get_device_info(ptp_device *dev, ptp_pima_device_info *info)
 		ctx.size = data_size;
 		ctx.buf = info->buf;
 		
-		retval = ptp_pima_decode_device_info(&ctx, info);
+		retval = ptp_pima_decode_device_info_sized(&ctx, info);
 		
 		if (retval != PTP_OK)
 		{
@@ -159,11 +165,6 @@ int ptp_pima_get_device_info(ptp_device *dev, ptp_pima_device_info *info)
 	
 	free(data);
 	
-	if (params_in.code != PTP_RC_OK)
-	{
-		return PTP_ERROR_RC;
-	}
-	
 	return PTP_OK;
 }
 
@@ -186,6 +187,13 @@ int ptp_pima_get_object_info(ptp_device *dev, uint32_t object_handle, ptp_pima_o
 		return retval;
 	}
 	
+	if (params_in.code != PTP_RC_OK)
+	{
+		printf("PTP result code: %04X\n", params_in.code);
+		free(data);
+		return PTP_ERROR_RC;
+	}
+	
 	if (info)
 	{
 		ptp_pima_decode_context ctx;
@@ -194,7 +202,7 @@ int ptp_pima_get_object_info(ptp_device *dev, uint32_t object_handle, ptp_pima_o
 		ctx.size = data_size;
 		ctx.buf = info->buf;
 		
-		retval = ptp_pima_decode_object_info(&ctx, info);
+		retval = ptp_pima_decode_object_info_sized(&ctx, info);
 		
 		if (retval != PTP_OK)
 		{
@@ -205,12 +213,6 @@ int ptp_pima_get_object_info(ptp_device *dev, uint32_t object_handle, ptp_pima_o
 	
 	free(data);
 	
-	if (params_in.code != PTP_RC_OK)
-	{
-		printf("PTP result code: %04X\n", params_in.code);
-		return PTP_ERROR_RC;
-	}
-	
 	return PTP_OK;
 }
 
@@ -250,6 +252,150 @@ int ptp_pima_get_object(ptp_device *dev, uint32_t object_handle, void **object_d
 	return data_size;
 }
 
+int ptp_pima_get_object_stream(ptp_device *dev, uint32_t object_handle, const ptp_data_sink *sink)
+{
+	ptp_params params_out, params_in;
+	int retval;
+	uint32_t data_size;
+	
+	if (!sink)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	params_out.code = PTP_OP_PIMA_GetObject;
+	params_out.num_params = 1;
+	params_out.params[0] = object_handle;
+	
+	retval = ptp_transact_stream(dev, &params_out, &params_in, sink, &data_size);
+	
+	if (retval != PTP_OK)
+	{
+		return retval;
+	}
+	
+	if (params_in.code != PTP_RC_OK)
+	{
+		return PTP_ERROR_RC;
+	}
+	
+	return data_size;
+}
+
+static int ptp_pima_prop_result(uint16_t code)
+{
+	switch (code)
+	{
+	case PTP_RC_OK:
+		return PTP_OK;
+	case PTP_RC_DEVICEPROP_NOT_SUPPORTED:
+		return PTP_ERROR_NOT_FOUND;
+	default:
+		return PTP_ERROR_RC;
+	}
+}
+
+// Receives into 'recv' and decodes into 'buf', both caller owned so that a 
+// poll can reuse them. The descriptor points into 'buf'.
+int ptp_pima_get_device_prop_desc(ptp_device *dev, ptp_pima_prop_code code, ptp_buffer *recv, dynbuf *buf, ptp_pima_prop_desc *desc)
+{
+	ptp_params params_out, params_in;
+	ptp_pima_decode_context ctx;
+	
+	if (!recv || !buf || !desc)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	params_out.code = PTP_OP_PIMA_GetDevicePropDesc;
+	params_out.num_params = 1;
+	params_out.params[0] = code;
+	
+	cr(ptp_transact_buffer(dev, &params_out, &params_in, recv));
+	cr(ptp_pima_prop_result(params_in.code));
+	
+	ctx.ptr = recv->data;
+	ctx.size = recv->size;
+	ctx.buf = buf;
+	
+	return ptp_pima_decode_prop_desc_sized(&ctx, desc);
+}
+
+// The data phase carries no type, 'type' has to be known from a descriptor
+int ptp_pima_get_device_prop_value(ptp_device *dev, ptp_pima_prop_code code, ptp_pima_type_code type, ptp_buffer *recv, dynbuf *buf, ptp_pima_prop_value *value)
+{
+	ptp_params params_out, params_in;
+	ptp_pima_decode_context ctx;
+	int retval;
+	
+	if (!recv || !buf || !value)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	params_out.code = PTP_OP_PIMA_GetDevicePropValue;
+	params_out.num_params = 1;
+	params_out.params[0] = code;
+	
+	cr(ptp_transact_buffer(dev, &params_out, &params_in, recv));
+	cr(ptp_pima_prop_result(params_in.code));
+	
+	ctx.ptr = recv->data;
+	ctx.size = recv->size;
+	ctx.buf = buf;
+	
+	retval = ptp_pima_decode_prop_value_sized(&ctx, type, value);
+	
+	// Too few or too many bytes mean the property has another type
+	if (retval == PTP_ERROR_DATA_LEN || (retval == PTP_OK && ctx.size != 0))
+	{
+		return PTP_ERROR_PROP_TYPE;
+	}
+	
+	return retval;
+}
+
+// Copies a little endian field of 'size' bytes into host order. 128 bit 
+// values are stored as two 64 bit halves, low half first.
+static inline void ptp_pima_copy_int(void *p, const void *src, size_t size)
+{
+	uint16_t v16;
+	uint32_t v32;
+	uint64_t v64[2];
+	
+	switch (size)
+	{
+	case sizeof(uint16_t):
+		memcpy(&v16, src, sizeof(v16));
+		v16 = dtoh16(v16);
+		memcpy(p, &v16, sizeof(v16));
+		break;
+		
+	case sizeof(uint32_t):
+		memcpy(&v32, src, sizeof(v32));
+		v32 = dtoh32(v32);
+		memcpy(p, &v32, sizeof(v32));
+		break;
+		
+	case sizeof(uint64_t):
+		memcpy(v64, src, sizeof(uint64_t));
+		v64[0] = dtoh64(v64[0]);
+		memcpy(p, v64, sizeof(uint64_t));
+		break;
+		
+	case sizeof(uint128_t):
+		memcpy(v64, src, sizeof(v64));
+		v64[0] = dtoh64(v64[0]);
+		v64[1] = dtoh64(v64[1]);
+		memcpy(p, v64, sizeof(v64));
+		break;
+		
+	default:
+		memcpy(p, src, size);
+		break;
+	}
+}
+
 int ptp_pima_decode_int(ptp_pima_decode_context *ctx, void *p, size_t size)
 {
 	if (size > sizeof(uint128_t))
@@ -262,9 +408,7 @@ int ptp_pima_decode_int(ptp_pima_decode_context *ctx, void *p, size_t size)
 		return PTP_ERROR_DATA_LEN;
 	}
 	
-	memcpy(p, ctx->ptr, size);
-	
-	// TODO: Flip on big endian systems
+	ptp_pima_copy_int(p, ctx->ptr, size);
 	
 	ctx->ptr = (void *)(((uint8_t *)ctx->ptr) + size);
 	ctx->size -= size;
@@ -347,43 +491,49 @@ int ptp_pima_decode_int_array(ptp_pima_decode_context *ctx, size_t elem_size, in
 	return PTP_OK;
 }
 
-int ptp_pima_decode_basic_value(ptp_pima_decode_context *ctx, ptp_pima_type_code type, ptp_pima_basic_value *value)
+// Size of a basic type on the wire, 0 if the type is unknown
+static size_t ptp_pima_basic_size(ptp_pima_type_code type)
 {
-	size_t size;
-	
-	if (!ctx || !value)
-	{
-		return PTP_ERROR_PARAM;
-	}
-	
 	switch (type)
 	{
 	case PTP_DTC_UINT8:
 	case PTP_DTC_INT8:
-		size = sizeof(uint8_t);
-		break;
+		return sizeof(uint8_t);
 		
 	case PTP_DTC_UINT16:
 	case PTP_DTC_INT16:
-		size = sizeof(uint16_t);
-		break;
+		return sizeof(uint16_t);
 		
 	case PTP_DTC_UINT32:
 	case PTP_DTC_INT32:
-		size = sizeof(uint32_t);
-		break;
+		return sizeof(uint32_t);
 		
 	case PTP_DTC_UINT64:
 	case PTP_DTC_INT64:
-		size = sizeof(uint64_t);
-		break;
+		return sizeof(uint64_t);
 		
 	case PTP_DTC_UINT128:
 	case PTP_DTC_INT128:
-		size = sizeof(uint128_t);
-		break;
+		return sizeof(uint128_t);
 		
 	default:
+		return 0;
+	}
+}
+
+int ptp_pima_decode_basic_value(ptp_pima_decode_context *ctx, ptp_pima_type_code type, ptp_pima_basic_value *value)
+{
+	size_t size;
+	
+	if (!ctx || !value)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	size = ptp_pima_basic_size(type);
+	
+	if (size == 0)
+	{
 		return PTP_ERROR_PARAM;
 	}
 	
@@ -633,6 +783,436 @@ int ptp_pima_decode_object_info(ptp_pima_decode_context *ctx, ptp_pima_object_in
 	return PTP_OK;
 }
 
+static int ptp_pima_skip(ptp_pima_decode_context *ctx, size_t size)
+{
+	if (ctx->size < size)
+	{
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	ctx->ptr = (void *)(((uint8_t *)ctx->ptr) + size);
+	ctx->size -= size;
+	
+	return PTP_OK;
+}
+
+// Skips 'count' elements of 'elem_size' bytes, checking the count before 
+// multiplying so that a corrupt count can not wrap around
+static int ptp_pima_skip_array(ptp_pima_decode_context *ctx, size_t elem_size, size_t count)
+{
+	if (elem_size != 0 && count > ctx->size / elem_size)
+	{
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	return ptp_pima_skip(ctx, elem_size * count);
+}
+
+int ptp_pima_size_string(ptp_pima_decode_context *ctx, size_t *size)
+{
+	uint8_t count;
+	
+	if (!ctx || !size)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cr(ptp_pima_decode_int(ctx, &count, sizeof(count)));
+	cr(ptp_pima_skip_array(ctx, sizeof(uint16_t), count));
+	
+	*size += sizeof(wchar_t) * (size_t)(count + 1);
+	
+	return PTP_OK;
+}
+
+// Arrays may be appended to a previous one (see ptp_pima_decode_int_array), 
+// so only the element count is returned and the caller does the sizing
+int ptp_pima_size_int_array(ptp_pima_decode_context *ctx, size_t elem_size, uint32_t *count)
+{
+	if (!ctx || !count)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cr(ptp_pima_decode_int(ctx, count, sizeof(*count)));
+	
+	return ptp_pima_skip_array(ctx, elem_size, *count);
+}
+
+int ptp_pima_size_prop_value(ptp_pima_decode_context *ctx, ptp_pima_type_code type, size_t *size)
+{
+	if (!ctx || !size)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	if (type == PTP_DTC_STR)
+	{
+		uint8_t count;
+		
+		cr(ptp_pima_decode_int(ctx, &count, sizeof(count)));
+		cr(ptp_pima_skip_array(ctx, sizeof(uint16_t), count));
+		
+		*size += sizeof(ptp_pima_basic_value) * (size_t)(count + 1);
+	}
+	else if (type & PTP_DTC_ARRAY_MASK)
+	{
+		size_t elem_size = ptp_pima_basic_size(type & ~PTP_DTC_ARRAY_MASK);
+		uint32_t count;
+		
+		cr(ptp_pima_decode_int(ctx, &count, sizeof(count)));
+		
+		if (elem_size == 0 && count > 0)
+		{
+			return PTP_ERROR_PARAM;
+		}
+		
+		cr(ptp_pima_skip_array(ctx, elem_size, count));
+		
+		*size += sizeof(ptp_pima_basic_value) * (size_t)count;
+	}
+	else
+	{
+		size_t elem_size = ptp_pima_basic_size(type);
+		
+		if (elem_size == 0)
+		{
+			return PTP_ERROR_PARAM;
+		}
+		
+		cr(ptp_pima_skip(ctx, elem_size));
+		
+		*size += sizeof(ptp_pima_basic_value);
+	}
+	
+	return PTP_OK;
+}
+
+int ptp_pima_size_prop_form(ptp_pima_decode_context *ctx, ptp_pima_type_code type, size_t *size)
+{
+	uint16_t i, count;
+	size_t elem_size;
+	uint8_t flag;
+	
+	if (!ctx || !size)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cr(ptp_pima_decode_int(ctx, &flag, sizeof(uint8_t)));
+	
+	if (flag == PTP_FORM_NONE)
+	{
+		return PTP_OK;
+	}
+	
+	*size += sizeof(ptp_pima_prop_form);
+	
+	if (flag == PTP_FORM_RANGE)
+	{
+		count = 3;
+	}
+	else if (flag == PTP_FORM_ENUM)
+	{
+		cr(ptp_pima_decode_int(ctx, &count, sizeof(count)));
+		
+		*size += sizeof(ptp_pima_prop_value) * (size_t)count;
+	}
+	else
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	// Scalar values all have the same size, skip them in one step
+	elem_size = (type & PTP_DTC_ARRAY_MASK) ? 0 : ptp_pima_basic_size(type);
+	
+	if (elem_size != 0)
+	{
+		cr(ptp_pima_skip_array(ctx, elem_size, count));
+		
+		*size += sizeof(ptp_pima_basic_value) * (size_t)count;
+		
+		return PTP_OK;
+	}
+	
+	for (i = 0; i < count; i++)
+	{
+		cr(ptp_pima_size_prop_value(ctx, type, size));
+	}
+	
+	return PTP_OK;
+}
+
+int ptp_pima_size_prop_desc(ptp_pima_decode_context *ctx, size_t *size)
+{
+	uint16_t type;
+	
+	if (!ctx || !size)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cr(ptp_pima_skip(ctx, sizeof(uint16_t)));
+	cr(ptp_pima_decode_int(ctx, &type, sizeof(uint16_t)));
+	cr(ptp_pima_skip(ctx, sizeof(uint8_t)));
+	
+	cr(ptp_pima_size_prop_value(ctx, type, size));
+	cr(ptp_pima_size_prop_value(ctx, type, size));
+	cr(ptp_pima_size_prop_form(ctx, type, size));
+	
+	return PTP_OK;
+}
+
+int ptp_pima_size_device_info(ptp_pima_decode_context *ctx, size_t *size)
+{
+	uint32_t count;
+	int i;
+	
+	if (!ctx || !size)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	// Version, vendor extension ID and version
+	cr(ptp_pima_skip(ctx, sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t)));
+	cr(ptp_pima_size_string(ctx, size));
+	cr(ptp_pima_skip(ctx, sizeof(uint16_t)));
+	
+	// Operations, events, properties, capture and image formats
+	for (i = 0; i < 5; i++)
+	{
+		cr(ptp_pima_size_int_array(ctx, sizeof(uint16_t), &count));
+		*size += sizeof(uint16_t) * (size_t)count;
+	}
+	
+	// Manufacturer, model, device version and serial number
+	for (i = 0; i < 4; i++)
+	{
+		cr(ptp_pima_size_string(ctx, size));
+	}
+	
+	return PTP_OK;
+}
+
+int ptp_pima_size_object_info(ptp_pima_decode_context *ctx, size_t *size)
+{
+	int i;
+	
+	if (!ctx || !size)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	// Storage ID up to and including the sequence number
+	cr(ptp_pima_skip(ctx, 11 * sizeof(uint32_t) + 4 * sizeof(uint16_t)));
+	
+	// File name, capture date, modification date and keywords
+	for (i = 0; i < 4; i++)
+	{
+		cr(ptp_pima_size_string(ctx, size));
+	}
+	
+	return PTP_OK;
+}
+
+// Runs the sizing pass on a copy of 'ctx' and grows the context's dynbuf 
+// once to fit, so the decode that follows never moves it and never calls 
+// the adjust callbacks. Results that were cleared before decoding are 
+// sized exactly, anything else still grows as needed.
+int ptp_pima_reserve(const ptp_pima_decode_context *ctx, ptp_pima_size_func size_func)
+{
+	ptp_pima_decode_context sctx;
+	size_t size = 0;
+	
+	if (!ctx || !ctx->buf || !size_func)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	sctx = *ctx;
+	
+	cr(size_func(&sctx, &size));
+	
+	if (dynbuf_reserve(ctx->buf, ctx->buf->size + size) != DYNBUF_OK)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	return PTP_OK;
+}
+
+// Second pass of the sized decoders. The data has already been validated 
+// by the sizing pass and the dynbuf reserved to fit, so fields are read 
+// without length checks and nothing in the dynbuf moves while filling.
+static inline void ptp_pima_fill_int(ptp_pima_decode_context *ctx, void *p, size_t size)
+{
+	ptp_pima_copy_int(p, ctx->ptr, size);
+	
+	ctx->ptr = (void *)(((uint8_t *)ctx->ptr) + size);
+	ctx->size -= size;
+}
+
+static inline void *ptp_pima_fill_take(ptp_pima_decode_context *ctx, size_t size)
+{
+	dynbuf *buf = ctx->buf;
+	void *p = ((uint8_t *)buf->data) + buf->size;
+	
+	memset(p, 0, size);
+	buf->size += size;
+	
+	return p;
+}
+
+static void ptp_pima_fill_values(ptp_pima_decode_context *ctx, ptp_pima_basic_value *values, uint32_t count, size_t elem_size)
+{
+	uint32_t i;
+	
+	for (i = 0; i < count; i++)
+	{
+		switch (elem_size)
+		{
+		case sizeof(uint8_t):
+			ptp_pima_fill_int(ctx, &values[i], sizeof(uint8_t));
+			break;
+			
+		case sizeof(uint16_t):
+			ptp_pima_fill_int(ctx, &values[i], sizeof(uint16_t));
+			break;
+			
+		case sizeof(uint32_t):
+			ptp_pima_fill_int(ctx, &values[i], sizeof(uint32_t));
+			break;
+			
+		case sizeof(uint64_t):
+			ptp_pima_fill_int(ctx, &values[i], sizeof(uint64_t));
+			break;
+			
+		default:
+			ptp_pima_fill_int(ctx, &values[i], sizeof(uint128_t));
+			break;
+		}
+	}
+}
+
+void ptp_pima_fill_prop_value(ptp_pima_decode_context *ctx, ptp_pima_type_code type, ptp_pima_prop_value *value)
+{
+	uint32_t count;
+	
+	if (type == PTP_DTC_STR)
+	{
+		uint8_t len;
+		
+		ptp_pima_fill_int(ctx, &len, sizeof(len));
+		
+		value->value = ptp_pima_fill_take(ctx, sizeof(ptp_pima_basic_value) * (size_t)(len + 1));
+		value->count = len;
+		
+		ptp_pima_fill_values(ctx, value->value, len, sizeof(uint16_t));
+	}
+	else if (type & PTP_DTC_ARRAY_MASK)
+	{
+		ptp_pima_fill_int(ctx, &count, sizeof(count));
+		
+		value->value = ptp_pima_fill_take(ctx, sizeof(ptp_pima_basic_value) * (size_t)count);
+		value->count = count;
+		
+		ptp_pima_fill_values(ctx, value->value, count, ptp_pima_basic_size(type & ~PTP_DTC_ARRAY_MASK));
+	}
+	else
+	{
+		value->value = ptp_pima_fill_take(ctx, sizeof(ptp_pima_basic_value));
+		value->count = 1;
+		
+		ptp_pima_fill_values(ctx, value->value, 1, ptp_pima_basic_size(type));
+	}
+}
+
+void ptp_pima_fill_prop_form(ptp_pima_decode_context *ctx, ptp_pima_type_code type, ptp_pima_prop_form **form)
+{
+	ptp_pima_prop_form *f;
+	uint16_t i, count;
+	uint8_t flag;
+	
+	*form = NULL;
+	
+	ptp_pima_fill_int(ctx, &flag, sizeof(flag));
+	
+	if (flag == PTP_FORM_NONE)
+	{
+		return;
+	}
+	
+	f = ptp_pima_fill_take(ctx, sizeof(ptp_pima_prop_form));
+	f->type = flag;
+	*form = f;
+	
+	if (flag == PTP_FORM_RANGE)
+	{
+		ptp_pima_fill_prop_value(ctx, type, &f->range.min);
+		ptp_pima_fill_prop_value(ctx, type, &f->range.max);
+		ptp_pima_fill_prop_value(ctx, type, &f->range.step);
+		return;
+	}
+	
+	ptp_pima_fill_int(ctx, &count, sizeof(count));
+	
+	f->penum.values = ptp_pima_fill_take(ctx, sizeof(ptp_pima_prop_value) * (size_t)count);
+	f->penum.count = count;
+	
+	for (i = 0; i < count; i++)
+	{
+		ptp_pima_fill_prop_value(ctx, type, &f->penum.values[i]);
+	}
+}
+
+// A decode into a reserved dynbuf never moves it, so the regular decoders 
+// are used for the second pass of these small datasets
+int ptp_pima_decode_device_info_sized(ptp_pima_decode_context *ctx, ptp_pima_device_info *info)
+{
+	cr(ptp_pima_reserve(ctx, ptp_pima_size_device_info));
+	
+	return ptp_pima_decode_device_info(ctx, info);
+}
+
+int ptp_pima_decode_object_info_sized(ptp_pima_decode_context *ctx, ptp_pima_object_info *info)
+{
+	cr(ptp_pima_reserve(ctx, ptp_pima_size_object_info));
+	
+	return ptp_pima_decode_object_info(ctx, info);
+}
+
+int ptp_pima_decode_prop_desc_sized(ptp_pima_decode_context *ctx, ptp_pima_prop_desc *desc)
+{
+	cr(ptp_pima_reserve(ctx, ptp_pima_size_prop_desc));
+	
+	return ptp_pima_decode_prop_desc(ctx, desc);
+}
+
+// The sizing pass needs the type, so this one reserves by hand
+int ptp_pima_decode_prop_value_sized(ptp_pima_decode_context *ctx, ptp_pima_type_code type, ptp_pima_prop_value *value)
+{
+	ptp_pima_decode_context sctx;
+	size_t size = 0;
+	
+	if (!ctx || !ctx->buf || !value)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	sctx = *ctx;
+	
+	cr(ptp_pima_size_prop_value(&sctx, type, &size));
+	
+	if (dynbuf_reserve(ctx->buf, ctx->buf->size + size) != DYNBUF_OK)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	ptp_pima_fill_prop_value(ctx, type, value);
+	
+	return PTP_OK;
+}
+
 void ptp_pima_adjust_prop_value(dynbuf *buf, ssize_t offset, ptp_pima_prop_value *value)
 {
 	if (value->value)
@@ -771,6 +1351,18 @@ void ptp_pima_devinfo_free(ptp_pima_device_info *info)
 	}
 }
 
+void ptp_pima_devinfo_clear(ptp_pima_device_info *info)
+{
+	if (info)
+	{
+		dynbuf *buf = info->buf;
+		
+		memset(info, 0, sizeof(*info));
+		info->buf = buf;
+		dynbuf_clear(buf);
+	}
+}
+
 int ptp_pima_objinfo_create(ptp_pima_object_info **info)
 {
 	ptp_pima_object_info *inf;
@@ -809,6 +1401,18 @@ void ptp_pima_objinfo_free(ptp_pima_object_info *info)
 	}
 }
 
+void ptp_pima_objinfo_clear(ptp_pima_object_info *info)
+{
+	if (info)
+	{
+		dynbuf *buf = info->buf;
+		
+		memset(info, 0, sizeof(*info));
+		info->buf = buf;
+		dynbuf_clear(buf);
+	}
+}
+
 int ptp_pima_proplist_create(ptp_pima_prop_desc_list **list)
 {
 	ptp_pima_prop_desc_list *l;
@@ -838,6 +1442,20 @@ int ptp_pima_proplist_create(ptp_pima_prop_desc_list **list)
 	return PTP_OK;
 }
 
+// Lays the list out in 'buf', which the caller keeps ownership of, e.g. a 
+// device arena's decode buffer. Such a list is not freed with 
+// ptp_pima_proplist_free().
+void ptp_pima_proplist_init(ptp_pima_prop_desc_list *list, dynbuf *buf)
+{
+	if (list && buf)
+	{
+		list->buf = buf;
+		buf->adjust_callback = ptp_pima_adjust_prop_desc_list;
+		buf->context = list;
+		ptp_pima_proplist_clear(list);
+	}
+}
+
 void ptp_pima_proplist_free(ptp_pima_prop_desc_list *list)
 {
 	if (list)
@@ -26,6 +26,10 @@ typedef uint16_t	ptp_pima_type_code;
 typedef uint16_t	ptp_pima_op_code;
 
 #define PTP_RC_OK					0x2001
+#define PTP_RC_OPERATION_NOT_SUPPORTED	0x2005
+#define PTP_RC_INVALID_OBJECT_HANDLE	0x2009
+#define PTP_RC_DEVICEPROP_NOT_SUPPORTED	0x200A
+#define PTP_RC_DEVICE_BUSY			0x2019
 #define PTP_RC_SESSION_ALREADY_OPEN	0x201E
 
 #define PTP_OP_PIMA_GetDeviceInfo		0x1001
@@ -137,6 +141,10 @@ typedef struct _ptp_pima_decode_context
 	void *adjlist[3];
 } ptp_pima_decode_context;
 
+// Sizing pass: walks a dataset the way the matching decoder does and adds 
+// the number of bytes the decoder will append to the dynbuf to '*size'
+typedef int (*ptp_pima_size_func)(ptp_pima_decode_context *ctx, size_t *size);
+
 typedef struct _ptp_pima_code_name
 {
 	uint16_t code;
@@ -258,6 +266,9 @@ int ptp_pima_close_session(ptp_device *dev);
 int ptp_pima_get_device_info(ptp_device *dev, ptp_pima_device_info *info);
 int ptp_pima_get_object_info(ptp_device *dev, uint32_t object_handle, ptp_pima_object_info *info);
 int ptp_pima_get_object(ptp_device *dev, uint32_t object_handle, void **object_data);
+int ptp_pima_get_object_stream(ptp_device *dev, uint32_t object_handle, const ptp_data_sink *sink);
+int ptp_pima_get_device_prop_desc(ptp_device *dev, ptp_pima_prop_code code, ptp_buffer *recv, dynbuf *buf, ptp_pima_prop_desc *desc);
+int ptp_pima_get_device_prop_value(ptp_device *dev, ptp_pima_prop_code code, ptp_pima_type_code type, ptp_buffer *recv, dynbuf *buf, ptp_pima_prop_value *value);
 
 int ptp_pima_decode_int(ptp_pima_decode_context *ctx, void *p, size_t size);
 int ptp_pima_decode_string(ptp_pima_decode_context *ctx, wchar_t **str);
@@ -269,12 +280,30 @@ int ptp_pima_decode_prop_form(ptp_pima_decode_context *ctx, ptp_pima_type_code t
 int ptp_pima_decode_prop_desc(ptp_pima_decode_context *ctx, ptp_pima_prop_desc *desc);
 int ptp_pima_decode_device_info(ptp_pima_decode_context *ctx, ptp_pima_device_info *info);
 int ptp_pima_decode_object_info(ptp_pima_decode_context *ctx, ptp_pima_object_info *info);
+int ptp_pima_decode_device_info_sized(ptp_pima_decode_context *ctx, ptp_pima_device_info *info);
+int ptp_pima_decode_object_info_sized(ptp_pima_decode_context *ctx, ptp_pima_object_info *info);
+int ptp_pima_decode_prop_desc_sized(ptp_pima_decode_context *ctx, ptp_pima_prop_desc *desc);
+int ptp_pima_decode_prop_value_sized(ptp_pima_decode_context *ctx, ptp_pima_type_code type, ptp_pima_prop_value *value);
+
+int ptp_pima_size_string(ptp_pima_decode_context *ctx, size_t *size);
+int ptp_pima_size_int_array(ptp_pima_decode_context *ctx, size_t elem_size, uint32_t *count);
+int ptp_pima_size_prop_value(ptp_pima_decode_context *ctx, ptp_pima_type_code type, size_t *size);
+int ptp_pima_size_prop_form(ptp_pima_decode_context *ctx, ptp_pima_type_code type, size_t *size);
+int ptp_pima_size_prop_desc(ptp_pima_decode_context *ctx, size_t *size);
+int ptp_pima_size_device_info(ptp_pima_decode_context *ctx, size_t *size);
+int ptp_pima_size_object_info(ptp_pima_decode_context *ctx, size_t *size);
+int ptp_pima_reserve(const ptp_pima_decode_context *ctx, ptp_pima_size_func size_func);
+void ptp_pima_fill_prop_value(ptp_pima_decode_context *ctx, ptp_pima_type_code type, ptp_pima_prop_value *value);
+void ptp_pima_fill_prop_form(ptp_pima_decode_context *ctx, ptp_pima_type_code type, ptp_pima_prop_form **form);
 
 int ptp_pima_devinfo_create(ptp_pima_device_info **info);
 void ptp_pima_devinfo_free(ptp_pima_device_info *info);
+void ptp_pima_devinfo_clear(ptp_pima_device_info *info);
 int ptp_pima_objinfo_create(ptp_pima_object_info **info);
 void ptp_pima_objinfo_free(ptp_pima_object_info *info);
+void ptp_pima_objinfo_clear(ptp_pima_object_info *info);
 int ptp_pima_proplist_create(ptp_pima_prop_desc_list **list);
+void ptp_pima_proplist_init(ptp_pima_prop_desc_list *list, dynbuf *buf);
 void ptp_pima_proplist_free(ptp_pima_prop_desc_list *list);
 void ptp_pima_proplist_clear(ptp_pima_prop_desc_list *list);
 ptp_pima_prop_desc * ptp_pima_proplist_get_prop(ptp_pima_prop_desc_list *list, ptp_pima_prop_code code);
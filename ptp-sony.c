@@ -1,10 +1,10 @@
 #include "ptp-sony.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/time.h>
 #include "timer.h"
 
-#define PTP_SONY_READ_OPT					0
 #define PTP_SONY_ADJUST_PROP_TIMEOUT_SEC	5
 
 static const ptp_pima_code_name g_prop_names[] = {
@@ -91,6 +91,12 @@ int ptp_sony_get_sdio_ext_devinfo(ptp_device *dev, uint32_t version, ptp_pima_de
 		return retval;
 	}
 	
+	if (params_in.code != PTP_RC_OK)
+	{
+		free(data);
+		return PTP_ERROR_RC;
+	}
+	
 	if (info)
 	{
 		ptp_pima_decode_context ctx;
@@ -99,7 +105,7 @@ int ptp_sony_get_sdio_ext_devinfo(ptp_device *dev, uint32_t version, ptp_pima_de
 		ctx.size = data_size;
 		ctx.buf = info->buf;
 		
-		retval = ptp_sony_decode_device_info(&ctx, info);
+		retval = ptp_sony_decode_device_info_sized(&ctx, info);
 		
 		if (retval != PTP_OK)
 		{
@@ -110,86 +116,105 @@ int ptp_sony_get_sdio_ext_devinfo(ptp_device *dev, uint32_t version, ptp_pima_de
 	
 	free(data);
 	
-	if (params_in.code != PTP_RC_OK)
-	{
-		return PTP_ERROR_RC;
-	}
-	
 	return PTP_OK;
 }
 
-int ptp_sony_get_all_dev_prop_data(ptp_device *dev, ptp_pima_prop_desc_list *list)
+// Reads all the properties with the device's arena held, receiving into its 
+// buffer instead of a fresh one per poll
+static int ptp_sony_read_all_dev_prop_data(ptp_device *dev, ptp_arena *arena, ptp_pima_prop_desc_list *list)
 {
 	ptp_params params_out, params_in;
-	void *data;
 	int retval;
-	uint32_t data_size;
 	
 	params_out.code = PTP_OP_SONY_GETALLDEVPROPDATA;
 	params_out.num_params = 0;
 	
-	retval = ptp_transact(dev, &params_out, NULL, 0, &params_in, &data, &data_size);
+	retval = ptp_transact_buffer(dev, &params_out, &params_in, arena->recv);
 	
 	if (retval != PTP_OK)
 	{
 		return retval;
 	}
 	
+	// A rejected request comes without data, there is nothing to decode
+	if (params_in.code != PTP_RC_OK)
+	{
+		return PTP_ERROR_RC;
+	}
+	
 	if (list)
 	{
 		ptp_pima_decode_context ctx;
 		
-		ctx.ptr = data;
-		ctx.size = data_size;
+		ctx.ptr = arena->recv->data;
+		ctx.size = arena->recv->size;
 		ctx.buf = list->buf;
 		
-		retval = ptp_sony_decode_prop_desc_list(&ctx, list);
+		retval = ptp_sony_decode_prop_desc_list_sized(&ctx, list);
 		
 		if (retval != PTP_OK)
 		{
-			free(data);
 			return retval;
 		}
 	}
 	
-	free(data);
+	return PTP_OK;
+}
+
+int ptp_sony_get_all_dev_prop_data(ptp_device *dev, ptp_pima_prop_desc_list *list)
+{
+	ptp_arena *arena;
+	int retval;
 	
-	if (params_in.code != PTP_RC_OK)
+	retval = ptp_arena_acquire(dev, &arena);
+	
+	if (retval != PTP_OK)
 	{
-		return PTP_ERROR_RC;
+		return retval;
 	}
 	
-	return PTP_OK;
+	retval = ptp_sony_read_all_dev_prop_data(dev, arena, list);
+	ptp_arena_release(dev, arena);
+	
+	return retval;
 }
 
 int ptp_sony_set_control_device(ptp_device *dev, uint16_t opcode, uint32_t propcode, void *value, int size)
 {
 	ptp_params params_out, params_in;
 	int retval;
-	#if __BYTE_ORDER == BIG_ENDIAN
-	char buf[sizeof(uint128_t)];
+	uint8_t *payload;
+	#if __BYTE_ORDER == __BIG_ENDIAN
 	int i;
 	#endif
 	
-	#if __BYTE_ORDER == __BIG_ENDIAN
-	if (size > sizeof(buf))
+	if (size < 0 || size > sizeof(uint128_t))
 	{
 		return PTP_ERROR_DATA_LEN;
 	}
 	
-	for (i = 0; i < size; i++)
+	// Encode the value straight into the device's transmit buffer
+	payload = ptp_get_send_payload(dev, size);
+	
+	if (!payload)
 	{
-		buf[i] = ((char *)value)[size - i - 1];
+		return PTP_ERROR_MEMORY;
 	}
 	
-	value = buf;
+	#if __BYTE_ORDER == __BIG_ENDIAN
+	for (i = 0; i < size; i++)
+	{
+		payload[i] = ((uint8_t *)value)[size - i - 1];
+	}
+	#else
+	memcpy(payload, value, size);
 	#endif
 	
 	params_out.code = opcode;
 	params_out.num_params = 1;
 	params_out.params[0] = propcode;
 	
-	retval = ptp_transact(dev, &params_out, value, size, &params_in, NULL, NULL);
+	retval = ptp_transact(dev, &params_out, payload, size, &params_in, NULL, NULL);
 	
 	if (retval != PTP_OK)
 	{
@@ -260,6 +285,200 @@ ptp_pima_prop_desc *ptp_sony_get_property(ptp_device *dev, ptp_pima_prop_desc_li
 	return ptp_pima_proplist_get_prop(list, propcode);
 }
 
+// Decodes only 'code' out of a fresh GetAllDevPropData, through the index 
+// kept in the arena. The values are laid out in 'buf'.
+static int ptp_sony_read_indexed_prop(ptp_device *dev, ptp_arena *arena, ptp_pima_prop_code code, dynbuf *buf, ptp_pima_prop_desc *desc)
+{
+	ptp_sony_prop_index *index;
+	
+	cr(ptp_sony_read_all_dev_prop_data(dev, arena, NULL));
+	cr(ptp_sony_index_prop_data(arena->index, arena->recv->data, arena->recv->size, &index));
+	
+	dynbuf_clear(buf);
+	
+	return ptp_sony_decode_indexed_prop(index, arena->recv->data, code, buf, desc);
+}
+
+// Sony's own GetDevicePropDesc, the descriptor comes in the same layout as 
+// in GetAllDevPropData
+static int ptp_sony_read_prop_desc(ptp_device *dev, ptp_arena *arena, ptp_pima_prop_code code, dynbuf *buf, ptp_pima_prop_desc *desc)
+{
+	ptp_params params_out, params_in;
+	ptp_pima_decode_context ctx;
+	
+	params_out.code = PTP_OP_SONY_GETDEVICEPROPDESC;
+	params_out.num_params = 1;
+	params_out.params[0] = code;
+	
+	cr(ptp_transact_buffer(dev, &params_out, &params_in, arena->recv));
+	
+	if (params_in.code != PTP_RC_OK)
+	{
+		return PTP_ERROR_RC;
+	}
+	
+	dynbuf_clear(buf);
+	
+	ctx.ptr = arena->recv->data;
+	ctx.size = arena->recv->size;
+	ctx.buf = buf;
+	
+	return ptp_sony_decode_prop_desc_sized(&ctx, desc);
+}
+
+static int ptp_sony_known_type(const ptp_arena *arena, ptp_pima_prop_code code, ptp_pima_type_code *type)
+{
+	uint32_t i;
+	
+	for (i = 0; i < arena->type_count; i++)
+	{
+		if (arena->types[i].code == code)
+		{
+			*type = arena->types[i].type;
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+static void ptp_sony_learn_type(ptp_arena *arena, ptp_pima_prop_code code, ptp_pima_type_code type)
+{
+	uint32_t i;
+	
+	for (i = 0; i < arena->type_count; i++)
+	{
+		if (arena->types[i].code == code)
+		{
+			arena->types[i].type = type;
+			return;
+		}
+	}
+	
+	if (arena->type_count < PTP_ARENA_MAX_TYPES)
+	{
+		arena->types[arena->type_count].code = code;
+		arena->types[arena->type_count].type = type;
+		arena->type_count++;
+	}
+}
+
+// Reads a single descriptor with the arena held. A poll of one property 
+// moves a few dozen bytes this way instead of the whole GetAllDevPropData: 
+// Sony's GetDevicePropDesc is tried first, then the standard one, then the 
+// indexed read of all properties. Once the device rejects an opcode it is 
+// not sent again.
+static int ptp_sony_fetch_prop_desc(ptp_device *dev, ptp_arena *arena, ptp_pima_prop_code code, dynbuf *buf, ptp_pima_prop_desc *desc)
+{
+	int retval = PTP_ERROR_NOT_FOUND, done = 0;
+	
+	if (!ptp_op_rejected(dev, PTP_OP_SONY_GETDEVICEPROPDESC))
+	{
+		retval = ptp_sony_read_prop_desc(dev, arena, code, buf, desc);
+		done = !ptp_op_rejected(dev, PTP_OP_SONY_GETDEVICEPROPDESC);
+	}
+	
+	if (!done && !ptp_op_rejected(dev, PTP_OP_PIMA_GetDevicePropDesc))
+	{
+		dynbuf_clear(buf);
+		
+		retval = ptp_pima_get_device_prop_desc(dev, code, arena->recv, buf, desc);
+		done = !ptp_op_rejected(dev, PTP_OP_PIMA_GetDevicePropDesc);
+	}
+	
+	if (!done)
+	{
+		retval = ptp_sony_read_indexed_prop(dev, arena, code, buf, desc);
+	}
+	
+	if (retval == PTP_OK)
+	{
+		ptp_sony_learn_type(arena, code, desc->type);
+	}
+	
+	return retval;
+}
+
+// Reads only the current value of a property of type 'type'. Without 
+// Sony's GetDevicePropDesc the standard GetDevicePropValue is the smallest 
+// read there is, otherwise this falls back to the descriptor. Its data does 
+// not carry the type, so it is only used once a descriptor has told the 
+// real one, and a caller asking for another type fails instead of 
+// misreading the value.
+static int ptp_sony_fetch_prop_value(ptp_device *dev, ptp_arena *arena, ptp_pima_prop_code code, ptp_pima_type_code type, dynbuf *buf, ptp_pima_prop_value *value)
+{
+	ptp_pima_prop_desc desc;
+	ptp_pima_type_code known;
+	int retval, learned;
+	
+	learned = ptp_sony_known_type(arena, code, &known);
+	
+	if (learned && known != type)
+	{
+		return PTP_ERROR_PROP_TYPE;
+	}
+	
+	if (learned && ptp_op_rejected(dev, PTP_OP_SONY_GETDEVICEPROPDESC) && !ptp_op_rejected(dev, PTP_OP_PIMA_GetDevicePropValue))
+	{
+		dynbuf_clear(buf);
+		
+		retval = ptp_pima_get_device_prop_value(dev, code, type, arena->recv, buf, value);
+		
+		if (!ptp_op_rejected(dev, PTP_OP_PIMA_GetDevicePropValue))
+		{
+			return retval;
+		}
+	}
+	
+	cr(ptp_sony_fetch_prop_desc(dev, arena, code, buf, &desc));
+	
+	if (desc.type != type)
+	{
+		return PTP_ERROR_PROP_TYPE;
+	}
+	
+	*value = desc.val;
+	
+	return PTP_OK;
+}
+
+// Single property reads. 'buf' is cleared and holds the decoded values.
+int ptp_sony_get_prop_desc(ptp_device *dev, ptp_pima_prop_code code, dynbuf *buf, ptp_pima_prop_desc *desc)
+{
+	ptp_arena *arena;
+	int retval;
+	
+	if (!dev || !buf || !desc)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cr(ptp_arena_acquire(dev, &arena));
+	
+	retval = ptp_sony_fetch_prop_desc(dev, arena, code, buf, desc);
+	ptp_arena_release(dev, arena);
+	
+	return retval;
+}
+
+int ptp_sony_get_prop_value(ptp_device *dev, ptp_pima_prop_code code, ptp_pima_type_code type, dynbuf *buf, ptp_pima_prop_value *value)
+{
+	ptp_arena *arena;
+	int retval;
+	
+	if (!dev || !buf || !value)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cr(ptp_arena_acquire(dev, &arena));
+	
+	retval = ptp_sony_fetch_prop_value(dev, arena, code, type, buf, value);
+	ptp_arena_release(dev, arena);
+	
+	return retval;
+}
+
 int ptp_sony_wait_object(ptp_device *dev, uint32_t *object_handle, int timeout)
 {
 	ptp_params params;
@@ -326,97 +545,53 @@ int ptp_sony_wait_property(ptp_device *dev, ptp_pima_prop_code *code, int timeou
 	return PTP_OK;
 }
 
-int ptp_sony_wait_pending_object(ptp_device *dev)
+// Reads PendingImages with the arena held: bit 15 is set while an image is 
+// ready, the rest is the number of images waiting
+static int ptp_sony_read_pending_objects(ptp_device *dev, ptp_arena *arena)
 {
-	#if PTP_SONY_READ_OPT == 1
-	
-	ptp_params params_out, params_in;
-	void *data;
-	int retval;
-	uint32_t data_size;
-	uint16_t val;
+	ptp_pima_prop_value value;
 	
-	params_out.code = PTP_OP_SONY_GETALLDEVPROPDATA;
-	params_out.num_params = 0;
-	
-	do
-	{
-		retval = ptp_transact(dev, &params_out, NULL, 0, &params_in, &data, &data_size);
-		
-		if (retval != PTP_OK)
-		{
-			return retval;
-		}
-		
-		if (params_in.code != PTP_RC_OK)
-		{
-			free(data);
-			return PTP_ERROR_RC;
-		}
-		
-		val = *(uint16_t *)(((uint8_t *)data) + 0x451);
-		
-		free(data);
-	}
-	while (!(val & 0x8000));
-	
-	return PTP_OK;
+	cr(ptp_sony_fetch_prop_value(dev, arena, PTP_DPC_SONY_PendingImages, PTP_DTC_UINT16, arena->decode, &value));
 	
-	#else
-	
-	int pending;
-	
-	do
+	if (value.value == NULL)
 	{
-		pending = ptp_sony_get_pending_objects(dev);
+		return PTP_ERROR_PROP_VALUE;
 	}
-	while (pending >= 0);
 	
-	return (pending < 0) ? pending : PTP_OK;
-	
-	#endif
+	return value.value->u16;
 }
 
-int ptp_sony_get_pending_objects(ptp_device *dev)
+int ptp_sony_wait_pending_object(ptp_device *dev)
 {
-	#if PTP_SONY_READ_OPT == 1
-	
-	ptp_params params_out, params_in;
-	void *data;
+	ptp_arena *arena;
 	int retval;
-	uint32_t data_size;
-	uint16_t val;
 	
 	if (dev == NULL)
 	{
 		return PTP_ERROR_PARAM;
 	}
 	
-	params_out.code = PTP_OP_SONY_GETALLDEVPROPDATA;
-	params_out.num_params = 0;
-	
-	retval = ptp_transact(dev, &params_out, NULL, 0, &params_in, &data, &data_size);
+	retval = ptp_arena_acquire(dev, &arena);
 	
 	if (retval != PTP_OK)
 	{
 		return retval;
 	}
 	
-	if (params_in.code != PTP_RC_OK)
+	do
 	{
-		free(data);
-		return PTP_ERROR_RC;
+		retval = ptp_sony_read_pending_objects(dev, arena);
 	}
+	while (retval >= 0 && !(retval & 0x8000));
 	
-	val = *(uint16_t *)(((uint8_t *)data) + 0x451);
-	val = val & 0x7FFF;
-	free(data);
-	
-	return val;
-	
-	#else
+	ptp_arena_release(dev, arena);
 	
-	ptp_pima_prop_desc_list *list;
+	return (retval < 0) ? retval : PTP_OK;
+}
+
+int ptp_sony_get_pending_objects(ptp_device *dev)
+{
+	ptp_arena *arena;
 	int retval;
 	
 	if (dev == NULL)
@@ -424,42 +599,17 @@ int ptp_sony_get_pending_objects(ptp_device *dev)
 		return PTP_ERROR_PARAM;
 	}
 	
-	retval = ptp_pima_proplist_create(&list);
+	retval = ptp_arena_acquire(dev, &arena);
 	
-	if (retval == PTP_OK)
+	if (retval != PTP_OK)
 	{
-		retval = ptp_sony_get_all_dev_prop_data(dev, list);
-		
-		if (retval == PTP_OK)
-		{
-			ptp_pima_prop_desc *desc;
-			
-			desc = ptp_pima_proplist_get_prop(list, PTP_DPC_SONY_PendingImages);
-			
-			if (desc == NULL)
-			{
-				retval = PTP_ERROR_NOT_FOUND;
-			}
-			else if (desc->type != PTP_DTC_UINT16)
-			{
-				retval = PTP_ERROR_PROP_TYPE;
-			}
-			else if (desc->val.value == NULL)
-			{
-				retval = PTP_ERROR_PROP_VALUE;
-			}
-			else
-			{
-				retval = desc->val.value->u16;
-			}
-		}
-		
-		ptp_pima_proplist_free(list);
+		return retval;
 	}
 	
-	return retval;
+	retval = ptp_sony_read_pending_objects(dev, arena);
+	ptp_arena_release(dev, arena);
 	
-	#endif
+	return retval;
 }
 
 int ptp_sony_handshake(ptp_device *dev)
@@ -575,11 +725,12 @@ static int prop_compare_uint32(void *p1, void *p2)
 int ptp_sony_set_control_prop(ptp_device *dev, ptp_pima_prop_code code, void *value, compare_func compare)
 {
 	int retval, prev_comp, first_iter;
-	ptp_pima_prop_desc_list *list;
-	ptp_pima_prop_desc *prop;
+	ptp_pima_prop_desc prop;
+	ptp_pima_prop_value current;
 	ptp_pima_basic_value prev;
+	ptp_arena *arena;
 	
-	retval = ptp_pima_proplist_create(&list);
+	retval = ptp_arena_acquire(dev, &arena);
 	
 	if (retval)
 	{
@@ -587,18 +738,24 @@ int ptp_sony_set_control_prop(ptp_device *dev, ptp_pima_prop_code code, void *va
 	}
 	
 	first_iter = 1;
+	prev_comp = 0;
 	
 	do
 	{	
-		prop = ptp_sony_get_property(dev, list, code);
+		retval = ptp_sony_fetch_prop_desc(dev, arena, code, arena->decode, &prop);
+		
+		if (retval != PTP_OK)
+		{
+			break;
+		}
 		
-		if (!prop)
+		if (!prop.val.value)
 		{
-			retval = PTP_ERROR_NOT_FOUND;
+			retval = PTP_ERROR_PROP_VALUE;
 			break;
 		}
 		
-		retval = compare(prop->val.value, value);
+		retval = compare(prop.val.value, value);
 		
 		if (retval == 0) // We got the desired value
 		{
@@ -622,24 +779,28 @@ int ptp_sony_set_control_prop(ptp_device *dev, ptp_pima_prop_code code, void *va
 			struct timeval tv;
 			timer tm;
 			
-			prev = *(prop->val.value);
+			prev = *(prop.val.value);
 			done = 0;
 			
 			timer_start(&tm);
 			
+			// Only the value is polled until the camera has applied the step
 			do
 			{
-				ptp_pima_proplist_clear(list);
+				retval = ptp_sony_fetch_prop_value(dev, arena, code, prop.type, arena->decode, &current);
 				
-				prop = ptp_sony_get_property(dev, list, code);
+				if (retval != PTP_OK)
+				{
+					break;
+				}
 				
-				if (!prop)
+				if (!current.value)
 				{
-					retval = PTP_ERROR_NOT_FOUND;
+					retval = PTP_ERROR_PROP_VALUE;
 					break;
 				}
 				
-				if (compare(&prev, prop->val.value) != 0)
+				if (compare(&prev, current.value) != 0)
 				{
 					break;
 				}
@@ -659,12 +820,11 @@ int ptp_sony_set_control_prop(ptp_device *dev, ptp_pima_prop_code code, void *va
 			}
 		}
 		
-		ptp_pima_proplist_clear(list);
 		first_iter = 0;
 	}
 	while (retval == PTP_OK);
 	
-	ptp_pima_proplist_free(list);
+	ptp_arena_release(dev, arena);
 	
 	return retval;
 }
@@ -698,35 +858,41 @@ int ptp_sony_set_iso(ptp_device *dev, uint32_t iso)
 	return ptp_sony_set_control_prop(dev, PTP_DPC_SONY_ISO, &iso, prop_compare_uint32);
 }
 
-int ptp_sony_get_battery(ptp_device *dev)
+// The level is returned through 'level', -1 is a valid reading for an 
+// unknown level and must not be confused with an error code
+int ptp_sony_get_battery(ptp_device *dev, int8_t *level)
 {
 	int retval;
-	ptp_pima_prop_desc *prop;
-	ptp_pima_prop_desc_list *list;
+	ptp_pima_prop_value value;
+	ptp_arena *arena;
 	
-	if (!dev)
+	if (!dev || !level)
 	{
 		return PTP_ERROR_PARAM;
 	}
-	retval = ptp_pima_proplist_create(&list);
+	
+	retval = ptp_arena_acquire(dev, &arena);
 	
 	if (retval)
 	{
 		return retval;
 	}
 	
-	prop = ptp_sony_get_property(dev, list, PTP_DPC_SONY_BatteryLevel);
+	retval = ptp_sony_fetch_prop_value(dev, arena, PTP_DPC_SONY_BatteryLevel, PTP_DTC_INT8, arena->decode, &value);
 	
-	if (prop != NULL)
-	{
-		retval = prop->val.value->u16;
-	}
-	else
+	if (retval == PTP_OK)
 	{
-		return PTP_ERROR_NOT_FOUND;
+		if (value.value)
+		{
+			*level = value.value->s8;
+		}
+		else
+		{
+			retval = PTP_ERROR_PROP_VALUE;
+		}
 	}
 	
-	ptp_pima_proplist_free(list);
+	ptp_arena_release(dev, arena);
 	
 	return retval;
 }
@@ -759,17 +925,88 @@ const char *ptp_sony_get_op_name(ptp_pima_op_code code)
 	return ptp_pima_get_code_name(code, g_op_names);
 }
 
-int ptp_sony_decode_prop_desc(ptp_pima_decode_context *ctx, ptp_pima_prop_desc *desc)
+int ptp_sony_size_prop_desc(ptp_pima_decode_context *ctx, size_t *size)
 {
-	dynbuf_adjust_context actx;
-	uint8_t unk;
+	uint16_t code, type;
+	uint8_t get_set, unk;
 	
-	if (!ctx || !desc)
+	if (!ctx || !size)
 	{
 		return PTP_ERROR_PARAM;
 	}
 	
-	dynbuf_adjust_begin(&actx, ctx->buf);
+	cr(ptp_pima_decode_int(ctx, &code, sizeof(uint16_t)));
+	cr(ptp_pima_decode_int(ctx, &type, sizeof(uint16_t)));
+	cr(ptp_pima_decode_int(ctx, &get_set, sizeof(uint8_t)));
+	cr(ptp_pima_decode_int(ctx, &unk, sizeof(uint8_t)));
+	
+	cr(ptp_pima_size_prop_value(ctx, type, size));
+	cr(ptp_pima_size_prop_value(ctx, type, size));
+	cr(ptp_pima_size_prop_form(ctx, type, size));
+	
+	return PTP_OK;
+}
+
+int ptp_sony_size_prop_desc_list(ptp_pima_decode_context *ctx, size_t *size)
+{
+	uint32_t count, unk, i;
+	
+	if (!ctx || !size)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cr(ptp_pima_decode_int(ctx, &count, sizeof(uint32_t)));
+	cr(ptp_pima_decode_int(ctx, &unk, sizeof(uint32_t)));
+	
+	// Every descriptor takes at least 6 bytes, a larger count is corrupt
+	if (count > ctx->size / 6)
+	{
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	*size += sizeof(ptp_pima_prop_desc) * (size_t)count;
+	
+	for (i = 0; i < count; i++)
+	{
+		cr(ptp_sony_size_prop_desc(ctx, size));
+	}
+	
+	return PTP_OK;
+}
+
+int ptp_sony_size_device_info(ptp_pima_decode_context *ctx, size_t *size)
+{
+	uint32_t properties, controls;
+	uint16_t version;
+	
+	if (!ctx || !size)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cr(ptp_pima_decode_int(ctx, &version, sizeof(uint16_t)));
+	
+	cr(ptp_pima_size_int_array(ctx, sizeof(uint16_t), &properties));
+	cr(ptp_pima_size_int_array(ctx, sizeof(uint16_t), &controls));
+	
+	// The control values are appended to a copy of the properties
+	*size += sizeof(uint16_t) * ((size_t)properties * 2 + controls);
+	
+	return PTP_OK;
+}
+
+int ptp_sony_decode_prop_desc(ptp_pima_decode_context *ctx, ptp_pima_prop_desc *desc)
+{
+	dynbuf_adjust_context actx;
+	uint8_t unk;
+	
+	if (!ctx || !desc)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	dynbuf_adjust_begin(&actx, ctx->buf);
 	
 	cr(ptp_pima_decode_int(ctx, &desc->code, sizeof(uint16_t)));
 	cr(ptp_pima_decode_int(ctx, &desc->type, sizeof(uint16_t)));
@@ -822,6 +1059,230 @@ int ptp_sony_decode_prop_desc_list(ptp_pima_decode_context *ctx, ptp_pima_prop_d
 	return PTP_OK;
 }
 
+static void ptp_sony_fill_prop_desc(ptp_pima_decode_context *ctx, ptp_pima_prop_desc *desc)
+{
+	uint8_t unk;
+	
+	ptp_pima_decode_int(ctx, &desc->code, sizeof(uint16_t));
+	ptp_pima_decode_int(ctx, &desc->type, sizeof(uint16_t));
+	ptp_pima_decode_int(ctx, &desc->get_set, sizeof(uint8_t));
+	ptp_pima_decode_int(ctx, &unk, sizeof(uint8_t));
+	
+	ptp_pima_fill_prop_value(ctx, desc->type, &desc->def);
+	ptp_pima_fill_prop_value(ctx, desc->type, &desc->val);
+	ptp_pima_fill_prop_form(ctx, desc->type, &desc->form);
+}
+
+int ptp_sony_decode_prop_desc_sized(ptp_pima_decode_context *ctx, ptp_pima_prop_desc *desc)
+{
+	if (!desc)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cr(ptp_pima_reserve(ctx, ptp_sony_size_prop_desc));
+	
+	ptp_sony_fill_prop_desc(ctx, desc);
+	
+	return PTP_OK;
+}
+
+// Two pass decode: the sizing pass validates the whole dataset and computes 
+// the decoded size, the dynbuf is grown once, then the descriptors are 
+// filled in without length checks, moves or pointer adjustments
+int ptp_sony_decode_prop_desc_list_sized(ptp_pima_decode_context *ctx, ptp_pima_prop_desc_list *list)
+{
+	uint32_t count, unk, i;
+	ptp_pima_prop_desc *desc;
+	
+	if (!ctx || !list)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cr(ptp_pima_reserve(ctx, ptp_sony_size_prop_desc_list));
+	
+	ptp_pima_decode_int(ctx, &count, sizeof(uint32_t));
+	ptp_pima_decode_int(ctx, &unk, sizeof(uint32_t));
+	
+	desc = dynbuf_append(ctx->buf, NULL, sizeof(ptp_pima_prop_desc) * (size_t)count);
+	
+	if (!desc)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	list->desc = desc;
+	list->count = count;
+	
+	for (i = 0; i < count; i++)
+	{
+		ptp_sony_fill_prop_desc(ctx, &desc[i]);
+	}
+	
+	return PTP_OK;
+}
+
+static int ptp_sony_index_matches(const ptp_sony_prop_index *index, const uint8_t *data, uint32_t size)
+{
+	const ptp_sony_prop_range *range;
+	uint32_t i;
+	
+	if (index->data_size != size || size < 4 || 
+		(data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24)) != index->count)
+	{
+		return 0;
+	}
+	
+	// Same size as when the offsets were validated, so they are in bounds
+	for (i = 0; i < index->count; i++)
+	{
+		range = &index->ranges[i];
+		
+		if ((data[range->offset] | (data[range->offset + 1] << 8)) != range->code || 
+			(data[range->offset + 2] | (data[range->offset + 3] << 8)) != range->type)
+		{
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+// Indexes a GetAllDevPropData payload into 'buf', or reuses the index 
+// already there when the payload's layout matches it
+int ptp_sony_index_prop_data(dynbuf *buf, const void *data, uint32_t size, ptp_sony_prop_index **index)
+{
+	ptp_pima_decode_context ctx, next;
+	ptp_sony_prop_index *idx;
+	ptp_sony_prop_range *range;
+	uint32_t count, unk, i;
+	size_t decoded;
+	
+	if (!buf || !data || !index)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	idx = buf->data;
+	
+	if (buf->size >= sizeof(ptp_sony_prop_index) && ptp_sony_index_matches(idx, data, size))
+	{
+		*index = idx;
+		return PTP_OK;
+	}
+	
+	dynbuf_clear(buf);
+	
+	ctx.ptr = (void *)data;
+	ctx.size = size;
+	ctx.buf = NULL;
+	
+	cr(ptp_pima_decode_int(&ctx, &count, sizeof(uint32_t)));
+	cr(ptp_pima_decode_int(&ctx, &unk, sizeof(uint32_t)));
+	
+	// Every descriptor takes at least 6 bytes, a larger count is corrupt
+	if (count > ctx.size / 6)
+	{
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	if (dynbuf_reserve(buf, sizeof(ptp_sony_prop_index) + sizeof(ptp_sony_prop_range) * (size_t)count) != DYNBUF_OK)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	idx = buf->data;
+	idx->data_size = size;
+	idx->count = count;
+	idx->ranges = (ptp_sony_prop_range *)(idx + 1);
+	
+	for (i = 0; i < count; i++)
+	{
+		range = &idx->ranges[i];
+		next = ctx;
+		decoded = 0;
+		
+		cr(ptp_sony_size_prop_desc(&next, &decoded));
+		
+		range->code = ((uint8_t *)ctx.ptr)[0] | (((uint8_t *)ctx.ptr)[1] << 8);
+		range->type = ((uint8_t *)ctx.ptr)[2] | (((uint8_t *)ctx.ptr)[3] << 8);
+		range->offset = (uint32_t)((uint8_t *)ctx.ptr - (const uint8_t *)data);
+		range->size = (uint32_t)(ctx.size - next.size);
+		
+		ctx = next;
+	}
+	
+	// Only a complete index is ever reused
+	buf->size = sizeof(ptp_sony_prop_index) + sizeof(ptp_sony_prop_range) * (size_t)count;
+	*index = idx;
+	
+	return PTP_OK;
+}
+
+const ptp_sony_prop_range *ptp_sony_index_find(const ptp_sony_prop_index *index, ptp_pima_prop_code code)
+{
+	uint32_t i;
+	
+	if (!index)
+	{
+		return NULL;
+	}
+	
+	for (i = 0; i < index->count; i++)
+	{
+		if (index->ranges[i].code == code)
+		{
+			return &index->ranges[i];
+		}
+	}
+	
+	return NULL;
+}
+
+// Decodes one property of an indexed payload into 'buf'. The descriptor is 
+// sized again within its recorded range, which it has to fill exactly, so a 
+// payload that only looked like the indexed one is caught here.
+int ptp_sony_decode_indexed_prop(const ptp_sony_prop_index *index, const void *data, ptp_pima_prop_code code, dynbuf *buf, ptp_pima_prop_desc *desc)
+{
+	const ptp_sony_prop_range *range;
+	ptp_pima_decode_context ctx, next;
+	size_t size = 0;
+	
+	if (!index || !data || !buf || !desc)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	range = ptp_sony_index_find(index, code);
+	
+	if (!range)
+	{
+		return PTP_ERROR_NOT_FOUND;
+	}
+	
+	ctx.ptr = ((uint8_t *)data) + range->offset;
+	ctx.size = range->size;
+	ctx.buf = buf;
+	
+	next = ctx;
+	cr(ptp_sony_size_prop_desc(&next, &size));
+	
+	if (next.size != 0)
+	{
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	if (dynbuf_reserve(buf, buf->size + size) != DYNBUF_OK)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	ptp_sony_fill_prop_desc(&ctx, desc);
+	
+	return PTP_OK;
+}
+
 int ptp_sony_decode_device_info(ptp_pima_decode_context *ctx, ptp_pima_device_info *info)
 {
 	if (!ctx || !info)
@@ -840,6 +1301,13 @@ int ptp_sony_decode_device_info(ptp_pima_decode_context *ctx, ptp_pima_device_in
 	return PTP_OK;
 }
 
+int ptp_sony_decode_device_info_sized(ptp_pima_decode_context *ctx, ptp_pima_device_info *info)
+{
+	cr(ptp_pima_reserve(ctx, ptp_sony_size_device_info));
+	
+	return ptp_sony_decode_device_info(ctx, info);
+}
+
 void ptp_sony_print_prop_desc(const ptp_pima_prop_desc *desc)
 {
 	const char *name, *type;
@@ -920,3 +1388,312 @@ void ptp_sony_print_device_info(const ptp_pima_device_info *info)
 	printf("Device version: %S\n", info->device_version);
 	printf("Serial number: %S\n", info->serial_number);
 }
+
+int ptp_sony_proptable_create(ptp_device *dev, ptp_sony_prop_table **table)
+{
+	ptp_sony_prop_table *t;
+	int retval;
+	
+	if (!dev || !table)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	t = calloc(1, sizeof(ptp_sony_prop_table));
+	
+	if (!t)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	t->dev = dev;
+	t->pages[PTP_DPC_Undefined >> 8] = calloc(PTP_SONY_PROPTABLE_PAGE, sizeof(ptp_sony_prop_entry));
+	t->pages[PTP_DPC_SONY_DPCCompensation >> 8] = calloc(PTP_SONY_PROPTABLE_PAGE, sizeof(ptp_sony_prop_entry));
+	
+	if (!t->pages[PTP_DPC_Undefined >> 8] || !t->pages[PTP_DPC_SONY_DPCCompensation >> 8])
+	{
+		ptp_sony_proptable_free(t);
+		return PTP_ERROR_MEMORY;
+	}
+	
+	retval = ptp_buffer_alloc(dev, 0, &t->data);
+	
+	if (retval == PTP_OK)
+	{
+		retval = ptp_buffer_alloc(dev, 0, &t->spare);
+	}
+	
+	if (retval != PTP_OK)
+	{
+		ptp_sony_proptable_free(t);
+		return retval;
+	}
+	
+	*table = t;
+	
+	return PTP_OK;
+}
+
+void ptp_sony_proptable_free(ptp_sony_prop_table *table)
+{
+	int i, j;
+	
+	if (!table)
+	{
+		return;
+	}
+	
+	for (i = 0; i < PTP_SONY_PROPTABLE_PAGES; i++)
+	{
+		if (table->pages[i])
+		{
+			for (j = 0; j < PTP_SONY_PROPTABLE_PAGE; j++)
+			{
+				dynbuf_free(table->pages[i][j].buf);
+			}
+			
+			free(table->pages[i]);
+		}
+	}
+	
+	if (table->data)
+	{
+		ptp_buffer_free(table->dev, table->data);
+	}
+	
+	if (table->spare)
+	{
+		ptp_buffer_free(table->dev, table->spare);
+	}
+	
+	free(table->codes);
+	free(table);
+}
+
+static ptp_sony_prop_entry *ptp_sony_proptable_entry(ptp_sony_prop_table *table, ptp_pima_prop_code code, int create)
+{
+	ptp_sony_prop_entry **page = &table->pages[(code >> 8) & 0xFF];
+	
+	if (!*page)
+	{
+		if (!create)
+		{
+			return NULL;
+		}
+		
+		*page = calloc(PTP_SONY_PROPTABLE_PAGE, sizeof(ptp_sony_prop_entry));
+		
+		if (!*page)
+		{
+			return NULL;
+		}
+	}
+	
+	return &(*page)[code & 0xFF];
+}
+
+// Decodes a descriptor that was validated by ptp_sony_size_prop_desc(), 
+// which also gave the size of its values
+static int ptp_sony_proptable_decode(ptp_sony_prop_entry *entry, const ptp_pima_decode_context *ctx, size_t size)
+{
+	ptp_pima_decode_context dctx = *ctx;
+	
+	if (!entry->buf)
+	{
+		entry->buf = dynbuf_create(4, NULL, NULL);
+		
+		if (!entry->buf)
+		{
+			return PTP_ERROR_MEMORY;
+		}
+	}
+	
+	dynbuf_clear(entry->buf);
+	
+	if (dynbuf_reserve(entry->buf, size) != DYNBUF_OK)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	dctx.buf = entry->buf;
+	ptp_sony_fill_prop_desc(&dctx, &entry->desc);
+	
+	return PTP_OK;
+}
+
+// Returns the number of properties that changed, appeared or went away
+int ptp_sony_proptable_refresh(ptp_sony_prop_table *table)
+{
+	ptp_params params_out, params_in;
+	ptp_pima_decode_context ctx, next;
+	ptp_sony_prop_entry *entry;
+	ptp_buffer *swap;
+	uint32_t count, unk, i, j, generation, extent;
+	uint16_t code;
+	size_t size;
+	int retval, changed;
+	
+	if (!table)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	params_out.code = PTP_OP_SONY_GETALLDEVPROPDATA;
+	params_out.num_params = 0;
+	
+	retval = ptp_transact_buffer(table->dev, &params_out, &params_in, table->spare);
+	
+	if (retval != PTP_OK)
+	{
+		return retval;
+	}
+	
+	if (params_in.code != PTP_RC_OK)
+	{
+		return PTP_ERROR_RC;
+	}
+	
+	ctx.ptr = table->spare->data;
+	ctx.size = table->spare->size;
+	ctx.buf = NULL;
+	
+	// Validate the whole dataset before the table is touched
+	next = ctx;
+	size = 0;
+	cr(ptp_sony_size_prop_desc_list(&next, &size));
+	
+	ptp_pima_decode_int(&ctx, &count, sizeof(uint32_t));
+	ptp_pima_decode_int(&ctx, &unk, sizeof(uint32_t));
+	
+	if (count > table->codes_capacity)
+	{
+		uint16_t *codes = realloc(table->codes, sizeof(uint16_t) * (size_t)count);
+		
+		if (!codes)
+		{
+			return PTP_ERROR_MEMORY;
+		}
+		
+		table->codes = codes;
+		table->codes_capacity = count;
+	}
+	
+	table->refresh++;
+	table->count = 0;
+	generation = table->generation + 1;
+	changed = 0;
+	
+	for (i = 0; i < count; i++)
+	{
+		next = ctx;
+		size = 0;
+		ptp_sony_size_prop_desc(&next, &size);
+		extent = (uint32_t)(ctx.size - next.size);
+		code = ((uint8_t *)ctx.ptr)[0] | (((uint8_t *)ctx.ptr)[1] << 8);
+		
+		entry = ptp_sony_proptable_entry(table, code, 1);
+		
+		if (!entry)
+		{
+			retval = PTP_ERROR_MEMORY;
+			ctx = next;
+			continue;
+		}
+		
+		// Reported twice in one dataset, the last one wins
+		if (entry->seen == table->refresh)
+		{
+			entry->present = 0;
+		}
+		else
+		{
+			table->codes[table->count++] = code;
+		}
+		
+		if (!entry->present || entry->raw_size != extent || 
+			memcmp(((uint8_t *)table->data->data) + entry->raw_offset, ctx.ptr, extent) != 0)
+		{
+			if (ptp_sony_proptable_decode(entry, &ctx, size) == PTP_OK)
+			{
+				entry->present = 1;
+			}
+			else
+			{
+				entry->present = 0;
+				retval = PTP_ERROR_MEMORY;
+			}
+			
+			entry->generation = generation;
+			changed++;
+		}
+		
+		entry->raw_offset = (uint32_t)((uint8_t *)ctx.ptr - (uint8_t *)table->spare->data);
+		entry->raw_size = extent;
+		entry->seen = table->refresh;
+		
+		ctx = next;
+	}
+	
+	// Properties the camera stopped reporting
+	for (i = 0; i < PTP_SONY_PROPTABLE_PAGES; i++)
+	{
+		if (!table->pages[i])
+		{
+			continue;
+		}
+		
+		for (j = 0; j < PTP_SONY_PROPTABLE_PAGE; j++)
+		{
+			entry = &table->pages[i][j];
+			
+			if (entry->present && entry->seen != table->refresh)
+			{
+				entry->present = 0;
+				entry->generation = generation;
+				changed++;
+			}
+		}
+	}
+	
+	// The entries now point into what was just received
+	swap = table->data;
+	table->data = table->spare;
+	table->spare = swap;
+	
+	if (changed > 0)
+	{
+		table->generation = generation;
+	}
+	
+	return (retval != PTP_OK) ? retval : changed;
+}
+
+// O(1), NULL unless the last refresh reported the property
+ptp_pima_prop_desc *ptp_sony_proptable_get_prop(ptp_sony_prop_table *table, ptp_pima_prop_code code)
+{
+	ptp_sony_prop_entry *entry;
+	
+	if (!table)
+	{
+		return NULL;
+	}
+	
+	entry = ptp_sony_proptable_entry(table, code, 0);
+	
+	return (entry && entry->present) ? &entry->desc : NULL;
+}
+
+// The table generation the property last changed in, 0 if it never was reported
+uint32_t ptp_sony_proptable_generation(ptp_sony_prop_table *table, ptp_pima_prop_code code)
+{
+	ptp_sony_prop_entry *entry;
+	
+	if (!table)
+	{
+		return 0;
+	}
+	
+	entry = ptp_sony_proptable_entry(table, code, 0);
+	
+	return entry ? entry->generation : 0;
+}
@@ -44,6 +44,63 @@ typedef struct _ptp_sony_shutter_speed
 	uint16_t denom;
 } ptp_sony_shutter_speed;
 
+typedef struct _ptp_sony_prop_range
+{
+	uint16_t code;
+	uint16_t type;
+	uint32_t offset;			// Descriptor bytes in the payload
+	uint32_t size;
+} ptp_sony_prop_range;
+
+// Where each descriptor of a GetAllDevPropData payload is, found by a skim 
+// that validates the payload without decoding any value. The payload size, 
+// the count and the code and type found at each offset fingerprint the 
+// layout, a payload that matches them reuses the index without a skim.
+typedef struct _ptp_sony_prop_index
+{
+	uint32_t data_size;
+	uint32_t count;
+	ptp_sony_prop_range *ranges;
+} ptp_sony_prop_index;
+
+// Properties are kept in pages of 256 codes, indexed by the high byte. The 
+// PIMA (0x50xx) and Sony (0xD2xx) pages are allocated up front, others when 
+// a property in them is first reported.
+#define PTP_SONY_PROPTABLE_PAGE		256
+#define PTP_SONY_PROPTABLE_PAGES	256
+
+typedef struct _ptp_sony_prop_entry
+{
+	ptp_pima_prop_desc desc;	// Values are laid out in 'buf'
+	dynbuf *buf;
+	int present;
+	uint32_t generation;		// Table generation of the last change
+	uint32_t seen;				// Last refresh that reported the property
+	uint32_t raw_offset;		// Descriptor bytes in the table's current data phase
+	uint32_t raw_size;
+} ptp_sony_prop_entry;
+
+// Long-lived copy of the properties, refreshed from GetAllDevPropData. A 
+// refresh only decodes the descriptors whose bytes differ from the previous 
+// refresh. 'generation' goes up by one on every refresh that changed 
+// anything, and each property remembers the generation it last changed in, 
+// so a reader that saved 'generation' can tell what changed since. 'codes' 
+// lists the present properties in the order the camera reports them.
+// 
+// Not thread safe. Free the table before the device.
+typedef struct _ptp_sony_prop_table
+{
+	ptp_device *dev;
+	ptp_buffer *data;			// Payload the entries were last compared with
+	ptp_buffer *spare;			// Receives the next refresh
+	uint32_t refresh;
+	uint32_t generation;
+	uint16_t *codes;
+	uint32_t count;
+	uint32_t codes_capacity;
+	ptp_sony_prop_entry *pages[PTP_SONY_PROPTABLE_PAGES];
+} ptp_sony_prop_table;
+
 int ptp_sony_sdio_connect(ptp_device *dev, uint32_t param1, uint32_t param2, uint32_t param3);
 int ptp_sony_get_sdio_ext_devinfo(ptp_device *dev, uint32_t version, ptp_pima_device_info *info);
 int ptp_sony_get_all_dev_prop_data(ptp_device *dev, ptp_pima_prop_desc_list *list);
@@ -55,6 +112,8 @@ int ptp_sony_set_control_device_b_u16(ptp_device *dev, uint32_t propcode, uint16
 int ptp_sony_set_control_device_b_u32(ptp_device *dev, uint32_t propcode, uint32_t value);
 int ptp_sony_adjust_property(ptp_device *dev, ptp_pima_prop_code propcode, int up);
 ptp_pima_prop_desc *ptp_sony_get_property(ptp_device *dev, ptp_pima_prop_desc_list *list, ptp_pima_prop_code propcode);
+int ptp_sony_get_prop_desc(ptp_device *dev, ptp_pima_prop_code code, dynbuf *buf, ptp_pima_prop_desc *desc);
+int ptp_sony_get_prop_value(ptp_device *dev, ptp_pima_prop_code code, ptp_pima_type_code type, dynbuf *buf, ptp_pima_prop_value *value);
 int ptp_sony_wait_object(ptp_device *dev, uint32_t *object_handle, int timeout);
 int ptp_sony_wait_property(ptp_device *dev, ptp_pima_prop_code *code, int timeout);
 int ptp_sony_wait_pending_object(ptp_device *dev);
@@ -64,16 +123,32 @@ int ptp_sony_set_drive_mode(ptp_device *dev, uint16_t mode);
 int ptp_sony_set_shutter_speed(ptp_device *dev, const ptp_sony_shutter_speed *speed);
 int ptp_sony_set_fnumber(ptp_device *dev, uint16_t fnumber);
 int ptp_sony_set_iso(ptp_device *dev, uint32_t iso);
-int ptp_sony_get_battery(ptp_device *dev);
+int ptp_sony_get_battery(ptp_device *dev, int8_t *level);
+
+int ptp_sony_proptable_create(ptp_device *dev, ptp_sony_prop_table **table);
+void ptp_sony_proptable_free(ptp_sony_prop_table *table);
+int ptp_sony_proptable_refresh(ptp_sony_prop_table *table);
+ptp_pima_prop_desc *ptp_sony_proptable_get_prop(ptp_sony_prop_table *table, ptp_pima_prop_code code);
+uint32_t ptp_sony_proptable_generation(ptp_sony_prop_table *table, ptp_pima_prop_code code);
 
 const char *ptp_sony_get_prop_name(ptp_pima_prop_code code);
 const char *ptp_sony_get_op_name(ptp_pima_op_code code);
 
+int ptp_sony_size_prop_desc(ptp_pima_decode_context *ctx, size_t *size);
+int ptp_sony_size_prop_desc_list(ptp_pima_decode_context *ctx, size_t *size);
+int ptp_sony_size_device_info(ptp_pima_decode_context *ctx, size_t *size);
+
 int ptp_sony_decode_prop_desc(ptp_pima_decode_context *ctx, ptp_pima_prop_desc *desc);
+int ptp_sony_decode_prop_desc_sized(ptp_pima_decode_context *ctx, ptp_pima_prop_desc *desc);
 int ptp_sony_decode_prop_desc_list(ptp_pima_decode_context *ctx, ptp_pima_prop_desc_list *list);
+int ptp_sony_decode_prop_desc_list_sized(ptp_pima_decode_context *ctx, ptp_pima_prop_desc_list *list);
+int ptp_sony_index_prop_data(dynbuf *buf, const void *data, uint32_t size, ptp_sony_prop_index **index);
+const ptp_sony_prop_range *ptp_sony_index_find(const ptp_sony_prop_index *index, ptp_pima_prop_code code);
+int ptp_sony_decode_indexed_prop(const ptp_sony_prop_index *index, const void *data, ptp_pima_prop_code code, dynbuf *buf, ptp_pima_prop_desc *desc);
 void ptp_sony_print_prop_desc(const ptp_pima_prop_desc *desc);
 
 int ptp_sony_decode_device_info(ptp_pima_decode_context *ctx, ptp_pima_device_info *info);
+int ptp_sony_decode_device_info_sized(ptp_pima_decode_context *ctx, ptp_pima_device_info *info);
 void ptp_sony_print_device_info(const ptp_pima_device_info *info);
 
 #endif /* __PTP_SONY_H__ */
@@ -0,0 +1,144 @@
+#include "ptp.h"
+#include "ptp-trace.h"
+#include <stdlib.h>
+
+int ptp_trace_write_header(FILE *f)
+{
+	ptp_trace_header header;
+	
+	header.magic = htod32(PTP_TRACE_MAGIC);
+	header.version = htod16(PTP_TRACE_VERSION);
+	header.record_size = htod16(sizeof(ptp_trace_record));
+	
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+	{
+		return PTP_ERROR_IO;
+	}
+	
+	return PTP_OK;
+}
+
+// 'record' is in host byte order, 'payload' holds record->stored bytes
+int ptp_trace_write_record(FILE *f, const ptp_trace_record *record, const void *payload)
+{
+	ptp_trace_record out;
+	
+	out.timestamp_ns = htole64(record->timestamp_ns);
+	out.transaction_id = htod32(record->transaction_id);
+	out.length = htod32(record->length);
+	out.stored = htod32(record->stored);
+	out.code = htod16(record->code);
+	out.direction = record->direction;
+	out.phase = record->phase;
+	
+	if (fwrite(&out, sizeof(out), 1, f) != 1)
+	{
+		return PTP_ERROR_IO;
+	}
+	
+	if (record->stored && fwrite(payload, record->stored, 1, f) != 1)
+	{
+		return PTP_ERROR_IO;
+	}
+	
+	return PTP_OK;
+}
+
+int ptp_trace_reader_open(ptp_trace_reader *reader, const char *path)
+{
+	ptp_trace_header header;
+	
+	if (!reader || !path)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	reader->payload = NULL;
+	reader->payload_size = 0;
+	reader->f = fopen(path, "rb");
+	
+	if (!reader->f)
+	{
+		fprintf(stderr, "[ptp_trace_reader_open] Could not open %s\n", path);
+		return PTP_ERROR_IO;
+	}
+	
+	if (fread(&header, sizeof(header), 1, reader->f) != 1 ||
+		dtoh32(header.magic) != PTP_TRACE_MAGIC ||
+		dtoh16(header.version) != PTP_TRACE_VERSION ||
+		dtoh16(header.record_size) != sizeof(ptp_trace_record))
+	{
+		fprintf(stderr, "[ptp_trace_reader_open] %s is not a version %d trace\n", path, PTP_TRACE_VERSION);
+		fclose(reader->f);
+		reader->f = NULL;
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	return PTP_OK;
+}
+
+// Reads the next record. '*payload' stays valid until the next call. 
+// Returns 1 for a record, 0 at the end of the trace.
+int ptp_trace_reader_next(ptp_trace_reader *reader, ptp_trace_record *record, void **payload)
+{
+	if (!reader || !reader->f || !record || !payload)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	if (fread(record, sizeof(*record), 1, reader->f) != 1)
+	{
+		return 0;
+	}
+	
+	record->timestamp_ns = le64toh(record->timestamp_ns);
+	record->transaction_id = dtoh32(record->transaction_id);
+	record->length = dtoh32(record->length);
+	record->stored = dtoh32(record->stored);
+	record->code = dtoh16(record->code);
+	
+	if (record->stored > record->length)
+	{
+		fprintf(stderr, "[ptp_trace_reader_next] Invalid record: stored=%u, length=%u\n", record->stored, record->length);
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	if (record->stored > reader->payload_size)
+	{
+		void *buf = realloc(reader->payload, record->stored);
+		
+		if (!buf)
+		{
+			return PTP_ERROR_MEMORY;
+		}
+		
+		reader->payload = buf;
+		reader->payload_size = record->stored;
+	}
+	
+	if (record->stored && fread(reader->payload, record->stored, 1, reader->f) != 1)
+	{
+		fprintf(stderr, "[ptp_trace_reader_next] Trace ends inside a record\n");
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	*payload = reader->payload;
+	
+	return 1;
+}
+
+void ptp_trace_reader_close(ptp_trace_reader *reader)
+{
+	if (reader)
+	{
+		if (reader->f)
+		{
+			fclose(reader->f);
+		}
+		
+		free(reader->payload);
+		reader->f = NULL;
+		reader->payload = NULL;
+		reader->payload_size = 0;
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef __PTP_TRACE_H__
+#define __PTP_TRACE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Transaction trace written by ptp_trace_start(). The file starts with a 
+// ptp_trace_header, followed by one ptp_trace_record per container, each 
+// followed by 'stored' bytes of the container's payload (everything after 
+// the 12 byte container header). All fields are little endian.
+
+#define PTP_TRACE_MAGIC		0x43525450	// "PTRC"
+#define PTP_TRACE_VERSION	1
+
+#define PTP_TRACE_OUT		0	// Host to camera
+#define PTP_TRACE_IN		1	// Camera to host
+
+// Phases are the PTP container types
+#define PTP_TRACE_COMMAND	1
+#define PTP_TRACE_DATA		2
+#define PTP_TRACE_RESPONSE	3
+#define PTP_TRACE_EVENT		4
+
+#define PTP_TRACE_ALL		0xFFFFFFFF	// Keep data phases whole
+
+#pragma pack(push, 1)
+
+typedef struct _ptp_trace_header
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+} ptp_trace_header;
+
+typedef struct _ptp_trace_record
+{
+	uint64_t timestamp_ns;		// CLOCK_MONOTONIC
+	uint32_t transaction_id;
+	uint32_t length;			// Payload bytes on the wire
+	uint32_t stored;			// Payload bytes that follow, less than 'length' if truncated
+	uint16_t code;
+	uint8_t direction;
+	uint8_t phase;
+} ptp_trace_record;
+
+#pragma pack(pop)
+
+typedef struct _ptp_trace_reader
+{
+	FILE *f;
+	void *payload;
+	uint32_t payload_size;
+} ptp_trace_reader;
+
+int ptp_trace_write_header(FILE *f);
+int ptp_trace_write_record(FILE *f, const ptp_trace_record *record, const void *payload);
+
+int ptp_trace_reader_open(ptp_trace_reader *reader, const char *path);
+int ptp_trace_reader_next(ptp_trace_reader *reader, ptp_trace_record *record, void **payload);
+void ptp_trace_reader_close(ptp_trace_reader *reader);
+
+#endif // __PTP_TRACE_H__
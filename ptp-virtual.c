@@ -0,0 +1,1105 @@
+#include "ptp-virtual.h"
+#include "ptp-pima.h"
+#include "ptp-sony.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define PTP_VIRTUAL_HEADER_SIZE		12
+#define PTP_VIRTUAL_MAX_CONTAINER	(PTP_VIRTUAL_HEADER_SIZE + PTP_MAX_PARAMS * 4)
+#define PTP_VIRTUAL_SEGMENTS		2		// Data phase and response
+#define PTP_VIRTUAL_EVENTS			64
+#define PTP_VIRTUAL_OUT_MAX			4096	// Largest data-out phase accepted
+#define PTP_VIRTUAL_FILL			0x5A	// Content of generated images
+
+#define PTP_VIRTUAL_TYPE_COMMAND	1
+#define PTP_VIRTUAL_TYPE_DATA		2
+#define PTP_VIRTUAL_TYPE_RESPONSE	3
+#define PTP_VIRTUAL_TYPE_EVENT		4
+
+#define PTP_VIRTUAL_REQ_CANCEL		0x64
+#define PTP_VIRTUAL_REQ_RESET		0x66
+#define PTP_VIRTUAL_REQ_STATUS		0x67
+
+// One container queued on the bulk IN pipe. The payload is either a copy or, 
+// for images, generated on the fly.
+typedef struct _ptp_virtual_segment
+{
+	uint8_t header[PTP_VIRTUAL_MAX_CONTAINER];
+	uint32_t header_len;
+	uint8_t *payload;
+	uint32_t payload_len;
+	uint32_t payload_capacity;
+	int generated;
+	uint32_t pos;
+	uint64_t ready_ns;
+} ptp_virtual_segment;
+
+typedef struct _ptp_virtual_builder
+{
+	uint8_t *data;
+	uint32_t len;
+	uint32_t capacity;
+	int failed;
+} ptp_virtual_builder;
+
+struct _ptp_virtual_camera
+{
+	ptp_virtual_config config;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	
+	// Command in progress
+	uint16_t code;
+	uint32_t transaction_id;
+	uint32_t params[PTP_MAX_PARAMS];
+	uint32_t num_params;
+	int awaiting_data;
+	uint8_t *out_buf;
+	uint32_t out_len;
+	
+	// Bulk IN pipe
+	ptp_virtual_segment segments[PTP_VIRTUAL_SEGMENTS];
+	uint32_t seg_head;
+	uint32_t seg_count;
+	uint8_t *spare;				// A sent payload, built into again by the next command
+	uint32_t spare_capacity;
+	uint64_t link_free_ns;
+	
+	// Interrupt pipe
+	uint8_t events[PTP_VIRTUAL_EVENTS][PTP_VIRTUAL_MAX_CONTAINER];
+	uint32_t event_len[PTP_VIRTUAL_EVENTS];
+	uint32_t event_head;
+	uint32_t event_count;
+	
+	// Camera state
+	int shutter_held;
+	int shot_owed;
+	uint64_t next_capture_ns;
+	uint32_t stored;
+	uint32_t taken;
+	uint16_t aflock;
+};
+
+static const uint16_t g_virtual_operations[] = {
+	PTP_OP_PIMA_GetDeviceInfo,
+	PTP_OP_PIMA_OpenSession,
+	PTP_OP_PIMA_CloseSession,
+	PTP_OP_PIMA_GetObjectInfo,
+	PTP_OP_PIMA_GetObject,
+	PTP_OP_PIMA_GetDevicePropDesc,
+	PTP_OP_PIMA_GetDevicePropValue,
+	PTP_OP_SONY_SDIOCONNECT,
+	PTP_OP_SONY_GETSDIOEXTDEVINFO,
+	PTP_OP_SONY_SETCONTROLDEVICEA,
+	PTP_OP_SONY_SETCONTROLDEVICEB,
+	PTP_OP_SONY_GETALLDEVPROPDATA
+};
+
+// Property set modelled on an ILCE-6000 in PC remote mode, so that 
+// GetAllDevPropData is about the size and shape of the camera's own
+typedef struct _ptp_virtual_prop
+{
+	uint16_t code;
+	uint16_t type;
+	uint8_t form;
+	uint32_t value;
+	const uint32_t *values;		// Enumeration, or minimum, maximum and step
+	uint32_t count;
+} ptp_virtual_prop;
+
+#define SS(num, denom)	(((uint32_t)(num) << 16) | (denom))
+
+static const uint32_t g_virtual_shutter_speeds[] = {
+	SS(300, 10), SS(250, 10), SS(200, 10), SS(150, 10), SS(130, 10), SS(100, 10), 
+	SS(80, 10), SS(60, 10), SS(50, 10), SS(40, 10), SS(32, 10), SS(25, 10), 
+	SS(20, 10), SS(16, 10), SS(13, 10), SS(10, 10), SS(8, 10), SS(6, 10), 
+	SS(5, 10), SS(4, 10), SS(1, 3), SS(1, 4), SS(1, 5), SS(1, 6), SS(1, 8), 
+	SS(1, 10), SS(1, 13), SS(1, 15), SS(1, 20), SS(1, 25), SS(1, 30), SS(1, 40), 
+	SS(1, 50), SS(1, 60), SS(1, 80), SS(1, 100), SS(1, 125), SS(1, 160), 
+	SS(1, 200), SS(1, 250), SS(1, 320), SS(1, 400), SS(1, 500), SS(1, 640), 
+	SS(1, 800), SS(1, 1000), SS(1, 1250), SS(1, 1600), SS(1, 2000), 
+	SS(1, 2500), SS(1, 3200), SS(1, 4000)
+};
+
+static const uint32_t g_virtual_isos[] = {
+	100, 125, 160, 200, 250, 320, 400, 500, 640, 800, 1000, 1250, 1600, 2000, 
+	2500, 3200, 4000, 5000, 6400, 8000, 10000, 12800, 16000, 20000, 25600, 
+	0x00FFFFFF
+};
+
+static const uint32_t g_virtual_fnumbers[] = {
+	350, 400, 450, 500, 560, 630, 710, 800, 900, 1000, 1100, 1300, 1400, 1600, 
+	1800, 2000, 2200
+};
+
+static const uint32_t g_virtual_exposure_bias[] = {
+	(uint16_t)-3000, (uint16_t)-2700, (uint16_t)-2300, (uint16_t)-2000, 
+	(uint16_t)-1700, (uint16_t)-1300, (uint16_t)-1000, (uint16_t)-700, 
+	(uint16_t)-300, 0, 300, 700, 1000, 1300, 1700, 2000, 2300, 2700, 3000
+};
+
+static const uint32_t g_virtual_white_balance[] = {
+	0x0002, 0x0004, 0x8011, 0x8010, 0x0006, 0x8001, 0x8002, 0x8003, 0x8004, 
+	0x0007, 0x8012, 0x8020
+};
+
+static const uint32_t g_virtual_program_modes[] = {
+	0x0001, 0x0002, 0x0003, 0x0004, 0x8000, 0x8001, 0x8015, 0x8050, 0x8051
+};
+
+static const uint32_t g_virtual_focus_modes[] = { 0x0001, 0x0002, 0x8004, 0x8005, 0x8006 };
+static const uint32_t g_virtual_metering_modes[] = { 0x8001, 0x8002, 0x8003, 0x8004, 0x8005 };
+static const uint32_t g_virtual_flash_modes[] = { 0x0002, 0x0003, 0x8032, 0x8003, 0x8031 };
+
+static const uint32_t g_virtual_drive_modes[] = {
+	PTP_VAL_SONY_SCM_SINGLE, PTP_VAL_SONY_SCM_HIGH, PTP_VAL_SONY_SCM_MID, 
+	PTP_VAL_SONY_SCM_LOW, 0x8004, 0x8003, 0x8005, 0x8008, 0x8009
+};
+
+static const uint32_t g_virtual_drange[] = { 0x0001, 0x001F, 0x0010, 0x0011, 0x0012, 0x0013, 0x0014, 0x0015 };
+static const uint32_t g_virtual_picture_effects[] = {
+	0x8000, 0x8001, 0x8002, 0x8003, 0x8004, 0x8005, 0x8006, 0x8007, 0x8008, 
+	0x8009, 0x800A, 0x800B, 0x800C, 0x800D, 0x800E
+};
+
+static const uint32_t g_virtual_image_sizes[] = { 1, 2, 3 };
+static const uint32_t g_virtual_aspect_ratios[] = { 1, 2 };
+static const uint32_t g_virtual_color_temp[] = { 2500, 9900, 100 };
+static const uint32_t g_virtual_cc_filter[] = { 0x0000, 0x00FF, 1 };
+static const uint32_t g_virtual_battery[] = { (uint8_t)-1, 100, 1 };
+
+#define PROP_NONE(code, type, value)			{ code, type, PTP_FORM_NONE, value, NULL, 0 }
+#define PROP_ENUM(code, type, value, values)	{ code, type, PTP_FORM_ENUM, value, values, sizeof(values) / sizeof((values)[0]) }
+#define PROP_RANGE(code, type, value, range)	{ code, type, PTP_FORM_RANGE, value, range, 3 }
+
+static const ptp_virtual_prop g_virtual_props[] = {
+	PROP_ENUM(PTP_DPC_WhiteBalance, PTP_DTC_UINT16, 0x0002, g_virtual_white_balance),
+	PROP_ENUM(PTP_DPC_FNumber, PTP_DTC_UINT16, 560, g_virtual_fnumbers),
+	PROP_NONE(PTP_DPC_FocalLength, PTP_DTC_UINT32, 1600),
+	PROP_ENUM(PTP_DPC_FocusMode, PTP_DTC_UINT16, 0x0002, g_virtual_focus_modes),
+	PROP_ENUM(PTP_DPC_ExposureMeteringMode, PTP_DTC_UINT16, 0x8001, g_virtual_metering_modes),
+	PROP_ENUM(PTP_DPC_FlashMode, PTP_DTC_UINT16, 0x0002, g_virtual_flash_modes),
+	PROP_ENUM(PTP_DPC_ExposureProgramMode, PTP_DTC_UINT16, 0x0002, g_virtual_program_modes),
+	PROP_ENUM(PTP_DPC_ExposureBiasCompensation, PTP_DTC_INT16, 0, g_virtual_exposure_bias),
+	PROP_ENUM(PTP_DPC_StillCaptureMode, PTP_DTC_UINT16, PTP_VAL_SONY_SCM_SINGLE, g_virtual_drive_modes),
+	PROP_ENUM(PTP_DPC_SONY_DRangeOptimize, PTP_DTC_UINT16, 0x0001, g_virtual_drange),
+	PROP_ENUM(PTP_DPC_SONY_ImageSize, PTP_DTC_UINT8, 1, g_virtual_image_sizes),
+	PROP_ENUM(PTP_DPC_SONY_ShutterSpeed, PTP_DTC_UINT32, SS(1, 60), g_virtual_shutter_speeds),
+	PROP_RANGE(PTP_DPC_SONY_ColorTemp, PTP_DTC_UINT16, 5500, g_virtual_color_temp),
+	PROP_RANGE(PTP_DPC_SONY_CCFilter, PTP_DTC_UINT8, 0x0080, g_virtual_cc_filter),
+	PROP_ENUM(PTP_DPC_SONY_AspectRatio, PTP_DTC_UINT8, 1, g_virtual_aspect_ratios),
+	PROP_NONE(PTP_DPC_SONY_PendingImages, PTP_DTC_UINT16, 0),
+	PROP_NONE(PTP_DPC_SONY_ExposeIndex, PTP_DTC_UINT16, 0),
+	PROP_RANGE(PTP_DPC_SONY_BatteryLevel, PTP_DTC_INT8, 80, g_virtual_battery),
+	PROP_ENUM(PTP_DPC_SONY_PictureEffect, PTP_DTC_UINT16, 0x8000, g_virtual_picture_effects),
+	PROP_RANGE(PTP_DPC_SONY_ABFilter, PTP_DTC_UINT8, 0x0080, g_virtual_cc_filter),
+	PROP_ENUM(PTP_DPC_SONY_ISO, PTP_DTC_UINT32, 100, g_virtual_isos)
+};
+
+static const uint16_t g_virtual_controls[] = {
+	PTP_DPC_SONY_CTRL_AFLock,
+	PTP_DPC_SONY_CTRL_Shutter
+};
+
+#define countof(a)	(sizeof(a) / sizeof((a)[0]))
+
+static uint64_t ptp_virtual_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ptp_virtual_sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+	
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Waits on the camera's condition until 'until_ns', 0 waits without limit. 
+// Returns ETIMEDOUT once the time has passed.
+static int ptp_virtual_wait(ptp_virtual_camera *cam, uint64_t until_ns)
+{
+	struct timespec ts;
+	
+	if (until_ns == 0)
+	{
+		return pthread_cond_wait(&cam->cond, &cam->mutex);
+	}
+	
+	if (ptp_virtual_now() >= until_ns)
+	{
+		return ETIMEDOUT;
+	}
+	
+	ts.tv_sec = until_ns / 1000000000ULL;
+	ts.tv_nsec = until_ns % 1000000000ULL;
+	
+	return pthread_cond_timedwait(&cam->cond, &cam->mutex, &ts);
+}
+
+static void ptp_virtual_put(ptp_virtual_builder *b, uint64_t value, int size)
+{
+	uint8_t *data;
+	uint32_t capacity;
+	int i;
+	
+	if (b->failed)
+	{
+		return;
+	}
+	
+	if (b->len + size > b->capacity)
+	{
+		capacity = (b->capacity + size) * 2;
+		data = realloc(b->data, capacity);
+		
+		if (!data)
+		{
+			b->failed = 1;
+			return;
+		}
+		
+		b->data = data;
+		b->capacity = capacity;
+	}
+	
+	for (i = 0; i < size; i++)
+	{
+		b->data[b->len++] = (uint8_t)(value >> (8 * i));
+	}
+}
+
+static void ptp_virtual_put_string(ptp_virtual_builder *b, const char *str)
+{
+	size_t i, len = strlen(str);
+	
+	if (len == 0)
+	{
+		ptp_virtual_put(b, 0, 1);
+		return;
+	}
+	
+	// Character count including the terminator, then UCS-2
+	ptp_virtual_put(b, len + 1, 1);
+	
+	for (i = 0; i <= len; i++)
+	{
+		ptp_virtual_put(b, (uint8_t)str[i], 2);
+	}
+}
+
+static void ptp_virtual_put_array(ptp_virtual_builder *b, const uint16_t *values, uint32_t count)
+{
+	uint32_t i;
+	
+	ptp_virtual_put(b, count, 4);
+	
+	for (i = 0; i < count; i++)
+	{
+		ptp_virtual_put(b, values[i], 2);
+	}
+}
+
+static void ptp_virtual_put_prop_codes(ptp_virtual_builder *b)
+{
+	uint32_t i;
+	
+	ptp_virtual_put(b, countof(g_virtual_props), 4);
+	
+	for (i = 0; i < countof(g_virtual_props); i++)
+	{
+		ptp_virtual_put(b, g_virtual_props[i].code, 2);
+	}
+}
+
+static int ptp_virtual_prop_size(const ptp_virtual_prop *prop)
+{
+	return (prop->type == PTP_DTC_UINT32) ? 4 : (prop->type == PTP_DTC_UINT16 || prop->type == PTP_DTC_INT16) ? 2 : 1;
+}
+
+static const ptp_virtual_prop *ptp_virtual_find_prop(uint32_t code)
+{
+	uint32_t i;
+	
+	for (i = 0; i < countof(g_virtual_props); i++)
+	{
+		if (g_virtual_props[i].code == code)
+		{
+			return &g_virtual_props[i];
+		}
+	}
+	
+	return NULL;
+}
+
+// PendingImages follows the images waiting in the camera, the rest are fixed
+static uint32_t ptp_virtual_prop_value(const ptp_virtual_camera *cam, const ptp_virtual_prop *prop)
+{
+	if (prop->code == PTP_DPC_SONY_PendingImages)
+	{
+		return cam->stored | (cam->stored ? 0x8000 : 0);
+	}
+	
+	return prop->value;
+}
+
+// Sony's layout has an extra byte after get/set, the standard one does not
+static void ptp_virtual_put_prop(ptp_virtual_builder *b, const ptp_virtual_prop *prop, uint32_t value, int sony)
+{
+	int size = ptp_virtual_prop_size(prop);
+	uint32_t i;
+	
+	ptp_virtual_put(b, prop->code, 2);
+	ptp_virtual_put(b, prop->type, 2);
+	ptp_virtual_put(b, 1, 1);		// Get/set
+	
+	if (sony)
+	{
+		ptp_virtual_put(b, 0, 1);
+	}
+	
+	ptp_virtual_put(b, prop->value, size);	// Default
+	ptp_virtual_put(b, value, size);		// Current
+	ptp_virtual_put(b, prop->form, 1);
+	
+	if (prop->form == PTP_FORM_ENUM)
+	{
+		ptp_virtual_put(b, prop->count, 2);
+	}
+	
+	for (i = 0; i < prop->count; i++)
+	{
+		ptp_virtual_put(b, prop->values[i], size);
+	}
+}
+
+static void ptp_virtual_header(uint8_t *header, uint32_t len, uint16_t type, uint16_t code, uint32_t transaction_id)
+{
+	ptp_virtual_builder b = { header, 0, PTP_VIRTUAL_MAX_CONTAINER, 0 };
+	
+	ptp_virtual_put(&b, len, 4);
+	ptp_virtual_put(&b, type, 2);
+	ptp_virtual_put(&b, code, 2);
+	ptp_virtual_put(&b, transaction_id, 4);
+}
+
+static ptp_virtual_segment *ptp_virtual_push_segment(ptp_virtual_camera *cam, uint64_t ready_ns)
+{
+	ptp_virtual_segment *seg;
+	
+	seg = &cam->segments[(cam->seg_head + cam->seg_count) % PTP_VIRTUAL_SEGMENTS];
+	memset(seg, 0, sizeof(ptp_virtual_segment));
+	seg->ready_ns = ready_ns;
+	cam->seg_count++;
+	
+	return seg;
+}
+
+static void ptp_virtual_recycle(ptp_virtual_camera *cam, uint8_t *payload, uint32_t capacity)
+{
+	if (!payload)
+	{
+		return;
+	}
+	
+	if (!cam->spare)
+	{
+		cam->spare = payload;
+		cam->spare_capacity = capacity;
+	}
+	else
+	{
+		free(payload);
+	}
+}
+
+static void ptp_virtual_drop_segments(ptp_virtual_camera *cam)
+{
+	while (cam->seg_count > 0)
+	{
+		ptp_virtual_recycle(cam, cam->segments[cam->seg_head].payload, cam->segments[cam->seg_head].payload_capacity);
+		cam->segments[cam->seg_head].payload = NULL;
+		cam->seg_head = (cam->seg_head + 1) % PTP_VIRTUAL_SEGMENTS;
+		cam->seg_count--;
+	}
+	
+	cam->awaiting_data = 0;
+	cam->out_len = 0;
+}
+
+static void ptp_virtual_queue_event(ptp_virtual_camera *cam, uint16_t code, uint32_t param)
+{
+	uint8_t *event;
+	
+	if (cam->event_count == PTP_VIRTUAL_EVENTS)
+	{
+		return;
+	}
+	
+	event = cam->events[(cam->event_head + cam->event_count) % PTP_VIRTUAL_EVENTS];
+	ptp_virtual_header(event, PTP_VIRTUAL_HEADER_SIZE + 4, PTP_VIRTUAL_TYPE_EVENT, code, 0xFFFFFFFF);
+	event[12] = param & 0xFF;
+	event[13] = (param >> 8) & 0xFF;
+	event[14] = (param >> 16) & 0xFF;
+	event[15] = (param >> 24) & 0xFF;
+	
+	cam->event_len[(cam->event_head + cam->event_count) % PTP_VIRTUAL_EVENTS] = PTP_VIRTUAL_HEADER_SIZE + 4;
+	cam->event_count++;
+	
+	pthread_cond_broadcast(&cam->cond);
+}
+
+// Takes the pictures that are due. While the shutter is held a picture is 
+// taken every capture_usec, as long as the buffer has room.
+static void ptp_virtual_update(ptp_virtual_camera *cam)
+{
+	uint64_t now = ptp_virtual_now();
+	
+	while ((cam->shutter_held || cam->shot_owed) && now >= cam->next_capture_ns)
+	{
+		if (cam->stored >= cam->config.burst_depth)
+		{
+			cam->next_capture_ns = now + (uint64_t)cam->config.capture_usec * 1000;
+			break;
+		}
+		
+		cam->stored++;
+		cam->taken++;
+		cam->shot_owed = 0;
+		cam->next_capture_ns += (uint64_t)cam->config.capture_usec * 1000;
+		
+		ptp_virtual_queue_event(cam, PTP_EC_SONY_ObjectAdded, PTP_VIRTUAL_OBJECT_HANDLE);
+	}
+}
+
+static void ptp_virtual_set_control(ptp_virtual_camera *cam, uint16_t prop, const uint8_t *data, uint32_t len)
+{
+	uint16_t value;
+	
+	if (len < 2)
+	{
+		return;
+	}
+	
+	value = data[0] | (data[1] << 8);
+	
+	if (prop == PTP_DPC_SONY_CTRL_AFLock)
+	{
+		cam->aflock = value;
+	}
+	else if (prop == PTP_DPC_SONY_CTRL_Shutter)
+	{
+		if (value == 2 && !cam->shutter_held)
+		{
+			// Pressing always takes at least one picture
+			cam->shutter_held = 1;
+			cam->shot_owed = 1;
+			cam->next_capture_ns = ptp_virtual_now() + (uint64_t)cam->config.capture_usec * 1000;
+		}
+		else if (value == 1)
+		{
+			cam->shutter_held = 0;
+		}
+	}
+}
+
+static uint16_t ptp_virtual_build_data(ptp_virtual_camera *cam, ptp_virtual_builder *b, int *generated)
+{
+	const ptp_virtual_prop *prop;
+	char name[32];
+	uint32_t i;
+	
+	*generated = 0;
+	
+	switch (cam->code)
+	{
+	case PTP_OP_PIMA_OpenSession:
+	case PTP_OP_PIMA_CloseSession:
+	case PTP_OP_SONY_SETCONTROLDEVICEA:
+	case PTP_OP_SONY_SETCONTROLDEVICEB:
+		return PTP_RC_OK;
+	
+	case PTP_OP_PIMA_GetDeviceInfo:
+		ptp_virtual_put(b, 100, 2);
+		ptp_virtual_put(b, 0x11, 4);
+		ptp_virtual_put(b, 100, 2);
+		ptp_virtual_put_string(b, "Sony PTP Extensions");
+		ptp_virtual_put(b, 0, 2);
+		ptp_virtual_put_array(b, g_virtual_operations, countof(g_virtual_operations));
+		ptp_virtual_put(b, 2, 4);
+		ptp_virtual_put(b, PTP_EC_SONY_ObjectAdded, 2);
+		ptp_virtual_put(b, PTP_EC_SONY_PropertyChanged, 2);
+		ptp_virtual_put_prop_codes(b);
+		ptp_virtual_put(b, 0, 4);
+		ptp_virtual_put(b, 1, 4);
+		ptp_virtual_put(b, 0x3801, 2);
+		ptp_virtual_put_string(b, "Sony Corporation");
+		ptp_virtual_put_string(b, "ILCE-6000 (virtual)");
+		ptp_virtual_put_string(b, "1.00");
+		ptp_virtual_put_string(b, "00000000");
+		return PTP_RC_OK;
+	
+	case PTP_OP_SONY_SDIOCONNECT:
+		ptp_virtual_put(b, 0, 8);
+		return PTP_RC_OK;
+	
+	case PTP_OP_SONY_GETSDIOEXTDEVINFO:
+		ptp_virtual_put(b, cam->num_params > 0 ? cam->params[0] : 200, 2);
+		ptp_virtual_put_prop_codes(b);
+		ptp_virtual_put_array(b, g_virtual_controls, countof(g_virtual_controls));
+		return PTP_RC_OK;
+	
+	case PTP_OP_SONY_GETALLDEVPROPDATA:
+		ptp_virtual_put(b, countof(g_virtual_props), 4);
+		ptp_virtual_put(b, 0, 4);
+		
+		for (i = 0; i < countof(g_virtual_props); i++)
+		{
+			ptp_virtual_put_prop(b, &g_virtual_props[i], ptp_virtual_prop_value(cam, &g_virtual_props[i]), 1);
+		}
+		
+		return PTP_RC_OK;
+	
+	// Sony's GetDevicePropDesc falls through to the default and is rejected, 
+	// as on bodies without it, so clients take the standard reads below
+	case PTP_OP_PIMA_GetDevicePropDesc:
+	case PTP_OP_PIMA_GetDevicePropValue:
+		prop = ptp_virtual_find_prop(cam->num_params > 0 ? cam->params[0] : 0);
+		
+		if (!prop)
+		{
+			return PTP_RC_DEVICEPROP_NOT_SUPPORTED;
+		}
+		
+		if (cam->code == PTP_OP_PIMA_GetDevicePropDesc)
+		{
+			ptp_virtual_put_prop(b, prop, ptp_virtual_prop_value(cam, prop), 0);
+		}
+		else
+		{
+			ptp_virtual_put(b, ptp_virtual_prop_value(cam, prop), ptp_virtual_prop_size(prop));
+		}
+		
+		return PTP_RC_OK;
+	
+	case PTP_OP_PIMA_GetObjectInfo:
+		if (cam->num_params < 1 || cam->params[0] != PTP_VIRTUAL_OBJECT_HANDLE || cam->stored == 0)
+		{
+			return PTP_RC_INVALID_OBJECT_HANDLE;
+		}
+		
+		ptp_virtual_put(b, 0x00010001, 4);		// Storage
+		ptp_virtual_put(b, 0x3801, 2);			// EXIF/JPEG
+		ptp_virtual_put(b, 0, 2);
+		ptp_virtual_put(b, cam->config.object_size, 4);
+		ptp_virtual_put(b, 0x3808, 2);			// JFIF thumbnail
+		ptp_virtual_put(b, 0, 4);
+		ptp_virtual_put(b, 160, 4);
+		ptp_virtual_put(b, 120, 4);
+		ptp_virtual_put(b, 6000, 4);
+		ptp_virtual_put(b, 4000, 4);
+		ptp_virtual_put(b, 24, 4);
+		ptp_virtual_put(b, 0, 4);
+		ptp_virtual_put(b, 0, 2);
+		ptp_virtual_put(b, 0, 4);
+		ptp_virtual_put(b, 0, 4);
+		snprintf(name, sizeof(name), "DSC%05u.JPG", cam->taken - cam->stored + 1);
+		ptp_virtual_put_string(b, name);
+		ptp_virtual_put_string(b, "");
+		ptp_virtual_put_string(b, "");
+		ptp_virtual_put_string(b, "");
+		return PTP_RC_OK;
+	
+	case PTP_OP_PIMA_GetObject:
+		if (cam->num_params < 1 || cam->params[0] != PTP_VIRTUAL_OBJECT_HANDLE || cam->stored == 0)
+		{
+			return PTP_RC_INVALID_OBJECT_HANDLE;
+		}
+		
+		cam->stored--;
+		*generated = 1;
+		return PTP_RC_OK;
+	
+	default:
+		return PTP_RC_OPERATION_NOT_SUPPORTED;
+	}
+}
+
+// Runs the command received on the OUT pipe and queues its data phase, if 
+// any, and its response
+static void ptp_virtual_execute(ptp_virtual_camera *cam)
+{
+	ptp_virtual_builder b = { cam->spare, 0, cam->spare_capacity, 0 };
+	ptp_virtual_segment *seg;
+	uint64_t ready;
+	uint16_t rc;
+	int generated;
+	
+	cam->spare = NULL;
+	cam->spare_capacity = 0;
+	
+	if (cam->code == PTP_OP_SONY_SETCONTROLDEVICEA || cam->code == PTP_OP_SONY_SETCONTROLDEVICEB)
+	{
+		ptp_virtual_set_control(cam, cam->num_params > 0 ? cam->params[0] : 0, cam->out_buf, cam->out_len);
+	}
+	
+	rc = ptp_virtual_build_data(cam, &b, &generated);
+	ready = ptp_virtual_now() + (uint64_t)cam->config.latency_usec * 1000;
+	
+	if (b.failed)
+	{
+		rc = PTP_RC_DEVICE_BUSY;
+	}
+	else if (b.len > 0 || generated)
+	{
+		seg = ptp_virtual_push_segment(cam, ready);
+		seg->payload = b.data;
+		seg->payload_len = generated ? cam->config.object_size : b.len;
+		seg->payload_capacity = b.capacity;
+		seg->generated = generated;
+		seg->header_len = PTP_VIRTUAL_HEADER_SIZE;
+		ptp_virtual_header(seg->header, PTP_VIRTUAL_HEADER_SIZE + seg->payload_len, PTP_VIRTUAL_TYPE_DATA, cam->code, cam->transaction_id);
+		b.data = NULL;
+	}
+	
+	ptp_virtual_recycle(cam, b.data, b.capacity);
+	
+	seg = ptp_virtual_push_segment(cam, ready);
+	seg->header_len = PTP_VIRTUAL_HEADER_SIZE;
+	ptp_virtual_header(seg->header, PTP_VIRTUAL_HEADER_SIZE, PTP_VIRTUAL_TYPE_RESPONSE, rc, cam->transaction_id);
+	
+	cam->awaiting_data = 0;
+	cam->out_len = 0;
+	
+	pthread_cond_broadcast(&cam->cond);
+}
+
+static uint32_t ptp_virtual_get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int ptp_virtual_receive(ptp_virtual_camera *cam, const uint8_t *data, int length)
+{
+	uint32_t len, i;
+	uint16_t type;
+	
+	// Every container is expected in a single transfer, as ptp_send() does
+	if (length < PTP_VIRTUAL_HEADER_SIZE)
+	{
+		return LIBUSB_ERROR_PIPE;
+	}
+	
+	len = ptp_virtual_get32(data);
+	type = data[4] | (data[5] << 8);
+	
+	if (len != (uint32_t)length)
+	{
+		return LIBUSB_ERROR_PIPE;
+	}
+	
+	if (type == PTP_VIRTUAL_TYPE_COMMAND)
+	{
+		ptp_virtual_drop_segments(cam);
+		
+		cam->code = data[6] | (data[7] << 8);
+		cam->transaction_id = ptp_virtual_get32(data + 8);
+		cam->num_params = (len - PTP_VIRTUAL_HEADER_SIZE) / 4;
+		
+		if (cam->num_params > PTP_MAX_PARAMS)
+		{
+			cam->num_params = PTP_MAX_PARAMS;
+		}
+		
+		for (i = 0; i < cam->num_params; i++)
+		{
+			cam->params[i] = ptp_virtual_get32(data + PTP_VIRTUAL_HEADER_SIZE + i * 4);
+		}
+		
+		if (cam->code == PTP_OP_SONY_SETCONTROLDEVICEA || cam->code == PTP_OP_SONY_SETCONTROLDEVICEB)
+		{
+			cam->awaiting_data = 1;
+			return 0;
+		}
+		
+		ptp_virtual_execute(cam);
+		return 0;
+	}
+	
+	if (type == PTP_VIRTUAL_TYPE_DATA && cam->awaiting_data)
+	{
+		cam->out_len = len - PTP_VIRTUAL_HEADER_SIZE;
+		
+		if (cam->out_len > PTP_VIRTUAL_OUT_MAX)
+		{
+			return LIBUSB_ERROR_OVERFLOW;
+		}
+		
+		memcpy(cam->out_buf, data + PTP_VIRTUAL_HEADER_SIZE, cam->out_len);
+		ptp_virtual_execute(cam);
+		return 0;
+	}
+	
+	return LIBUSB_ERROR_PIPE;
+}
+
+// Delivers the next piece of the current IN container. Like a USB transfer, 
+// a read never spans two containers.
+static int ptp_virtual_send(ptp_device *dev, ptp_virtual_camera *cam, uint8_t *data, int length, int *transferred, unsigned int timeout)
+{
+	ptp_virtual_segment *seg;
+	uint64_t deadline, until, done;
+	uint32_t total, n, from_header;
+	int r;
+	
+	deadline = timeout ? ptp_virtual_now() + (uint64_t)timeout * 1000000 : 0;
+	
+	while (1)
+	{
+		if (dev->cancel_requested)
+		{
+			return LIBUSB_ERROR_IO;
+		}
+		
+		if (cam->seg_count > 0 && ptp_virtual_now() >= cam->segments[cam->seg_head].ready_ns)
+		{
+			break;
+		}
+		
+		until = deadline;
+		
+		if (cam->seg_count > 0 && (until == 0 || cam->segments[cam->seg_head].ready_ns < until))
+		{
+			until = cam->segments[cam->seg_head].ready_ns;
+		}
+		
+		r = ptp_virtual_wait(cam, until);
+		
+		if (r == ETIMEDOUT && deadline && ptp_virtual_now() >= deadline)
+		{
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+	}
+	
+	seg = &cam->segments[cam->seg_head];
+	total = seg->header_len + seg->payload_len;
+	n = total - seg->pos;
+	
+	if ((uint32_t)length < n)
+	{
+		n = (uint32_t)length;
+	}
+	
+	from_header = 0;
+	
+	if (seg->pos < seg->header_len)
+	{
+		from_header = seg->header_len - seg->pos;
+		
+		if (from_header > n)
+		{
+			from_header = n;
+		}
+		
+		memcpy(data, seg->header + seg->pos, from_header);
+	}
+	
+	if (n > from_header)
+	{
+		if (seg->generated)
+		{
+			memset(data + from_header, PTP_VIRTUAL_FILL, n - from_header);
+		}
+		else
+		{
+			memcpy(data + from_header, seg->payload + (seg->pos + from_header - seg->header_len), n - from_header);
+		}
+	}
+	
+	seg->pos += n;
+	
+	if (seg->pos == total)
+	{
+		ptp_virtual_recycle(cam, seg->payload, seg->payload_capacity);
+		seg->payload = NULL;
+		cam->seg_head = (cam->seg_head + 1) % PTP_VIRTUAL_SEGMENTS;
+		cam->seg_count--;
+	}
+	
+	*transferred = (int)n;
+	
+	if (cam->config.bandwidth == 0)
+	{
+		return 0;
+	}
+	
+	// The link is shared by everything read from this camera
+	done = ptp_virtual_now();
+	
+	if (cam->link_free_ns > done)
+	{
+		done = cam->link_free_ns;
+	}
+	
+	done += (uint64_t)n * 1000000000ULL / cam->config.bandwidth;
+	cam->link_free_ns = done;
+	
+	pthread_mutex_unlock(&cam->mutex);
+	ptp_virtual_sleep_until(done);
+	pthread_mutex_lock(&cam->mutex);
+	
+	return 0;
+}
+
+static int ptp_virtual_open(ptp_device *dev)
+{
+	ptp_virtual_camera *cam = dev->transport_ctx;
+	
+	if (!cam)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	dev->max_packet_in = cam->config.max_packet;
+	dev->max_packet_out = cam->config.max_packet;
+	
+	return PTP_OK;
+}
+
+static int ptp_virtual_bulk(ptp_device *dev, unsigned char endpoint, void *data, int length, int *transferred, unsigned int timeout)
+{
+	ptp_virtual_camera *cam = dev->transport_ctx;
+	int r;
+	
+	*transferred = 0;
+	
+	pthread_mutex_lock(&cam->mutex);
+	
+	ptp_virtual_update(cam);
+	
+	if (endpoint & 0x80)
+	{
+		r = ptp_virtual_send(dev, cam, data, length, transferred, timeout);
+	}
+	else
+	{
+		r = ptp_virtual_receive(cam, data, length);
+		
+		if (r == 0)
+		{
+			*transferred = length;
+		}
+	}
+	
+	pthread_mutex_unlock(&cam->mutex);
+	
+	return r;
+}
+
+static int ptp_virtual_control(ptp_device *dev, uint8_t request_type, uint8_t request, uint16_t value, void *data, uint16_t length, unsigned int timeout)
+{
+	ptp_virtual_camera *cam = dev->transport_ctx;
+	uint8_t *status = data;
+	
+	pthread_mutex_lock(&cam->mutex);
+	
+	switch (request)
+	{
+	case PTP_VIRTUAL_REQ_CANCEL:
+	case PTP_VIRTUAL_REQ_RESET:
+		ptp_virtual_drop_segments(cam);
+		pthread_cond_broadcast(&cam->cond);
+		length = 0;
+		break;
+	
+	case PTP_VIRTUAL_REQ_STATUS:
+		if (length < 4)
+		{
+			pthread_mutex_unlock(&cam->mutex);
+			return LIBUSB_ERROR_OVERFLOW;
+		}
+		
+		status[0] = 4;
+		status[1] = 0;
+		status[2] = PTP_RC_OK & 0xFF;
+		status[3] = PTP_RC_OK >> 8;
+		length = 4;
+		break;
+	
+	default:
+		pthread_mutex_unlock(&cam->mutex);
+		return LIBUSB_ERROR_PIPE;
+	}
+	
+	pthread_mutex_unlock(&cam->mutex);
+	
+	return length;
+}
+
+static int ptp_virtual_event(ptp_device *dev, void *data, int length, int *transferred, unsigned int timeout)
+{
+	ptp_virtual_camera *cam = dev->transport_ctx;
+	uint64_t deadline, until;
+	uint32_t len;
+	
+	deadline = timeout ? ptp_virtual_now() + (uint64_t)timeout * 1000000 : 0;
+	*transferred = 0;
+	
+	pthread_mutex_lock(&cam->mutex);
+	
+	while (1)
+	{
+		ptp_virtual_update(cam);
+		
+		if (cam->event_count > 0)
+		{
+			break;
+		}
+		
+		if (deadline && ptp_virtual_now() >= deadline)
+		{
+			pthread_mutex_unlock(&cam->mutex);
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+		
+		// Wake up for the next picture as well
+		until = deadline;
+		
+		if ((cam->shutter_held || cam->shot_owed) && (until == 0 || cam->next_capture_ns < until))
+		{
+			until = cam->next_capture_ns;
+		}
+		
+		ptp_virtual_wait(cam, until);
+	}
+	
+	len = cam->event_len[cam->event_head];
+	
+	if (len > (uint32_t)length)
+	{
+		len = (uint32_t)length;
+	}
+	
+	memcpy(data, cam->events[cam->event_head], len);
+	cam->event_head = (cam->event_head + 1) % PTP_VIRTUAL_EVENTS;
+	cam->event_count--;
+	
+	pthread_mutex_unlock(&cam->mutex);
+	
+	*transferred = (int)len;
+	
+	return 0;
+}
+
+static int ptp_virtual_clear_halt(ptp_device *dev, unsigned char endpoint)
+{
+	return 0;
+}
+
+static void ptp_virtual_cancel(ptp_device *dev)
+{
+	ptp_virtual_camera *cam = dev->transport_ctx;
+	
+	pthread_mutex_lock(&cam->mutex);
+	pthread_cond_broadcast(&cam->cond);
+	pthread_mutex_unlock(&cam->mutex);
+}
+
+const ptp_transport ptp_transport_virtual = {
+	"virtual",
+	ptp_virtual_open,
+	NULL,
+	ptp_virtual_bulk,
+	ptp_virtual_control,
+	ptp_virtual_event,
+	ptp_virtual_clear_halt,
+	ptp_virtual_cancel,
+	NULL
+};
+
+// Roughly an A6000 on a USB 2.0 port
+void ptp_virtual_default_config(ptp_virtual_config *config)
+{
+	config->bandwidth = 30 * 1024 * 1024;
+	config->latency_usec = 1000;
+	config->burst_depth = 20;
+	config->object_size = 6 * 1024 * 1024;
+	config->capture_usec = 100000;
+	config->max_packet = 512;
+}
+
+int ptp_virtual_create(ptp_virtual_camera **camera, const ptp_virtual_config *config)
+{
+	ptp_virtual_camera *cam;
+	pthread_condattr_t attr;
+	
+	if (!camera || !config || config->max_packet == 0)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	cam = calloc(1, sizeof(ptp_virtual_camera));
+	
+	if (!cam)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	cam->out_buf = malloc(PTP_VIRTUAL_OUT_MAX);
+	
+	if (!cam->out_buf)
+	{
+		free(cam);
+		return PTP_ERROR_MEMORY;
+	}
+	
+	cam->config = *config;
+	
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cam->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&cam->mutex, NULL);
+	
+	*camera = cam;
+	
+	return PTP_OK;
+}
+
+// Only once no ptp_device uses the camera any more
+void ptp_virtual_destroy(ptp_virtual_camera *camera)
+{
+	if (camera)
+	{
+		ptp_virtual_drop_segments(camera);
+		free(camera->spare);
+		pthread_cond_destroy(&camera->cond);
+		pthread_mutex_destroy(&camera->mutex);
+		free(camera->out_buf);
+		free(camera);
+	}
+}
+
+// Pictures taken since the camera was created
+uint32_t ptp_virtual_get_taken(ptp_virtual_camera *camera)
+{
+	uint32_t taken;
+	
+	pthread_mutex_lock(&camera->mutex);
+	ptp_virtual_update(camera);
+	taken = camera->taken;
+	pthread_mutex_unlock(&camera->mutex);
+	
+	return taken;
+}
@@ -0,0 +1,31 @@
+#ifndef __PTP_VIRTUAL_H__
+#define __PTP_VIRTUAL_H__
+
+#include "ptp.h"
+
+// In-process stand-in for an A6000 in remote control mode, used through 
+// ptp_device_init_transport(&dev, &ptp_transport_virtual, camera, ...)
+
+#define PTP_VIRTUAL_OBJECT_HANDLE	0xFFFFC001
+
+typedef struct _ptp_virtual_config
+{
+	uint32_t bandwidth;			// Bulk IN bytes per second, 0 for no limit
+	uint32_t latency_usec;		// Added before the reply to every command
+	uint32_t burst_depth;		// Images buffered before the shutter stalls
+	uint32_t object_size;		// Bytes per image
+	uint32_t capture_usec;		// Time between shots while the shutter is held
+	uint16_t max_packet;		// Bulk packet size reported to the PTP layer
+} ptp_virtual_config;
+
+struct _ptp_virtual_camera;
+typedef struct _ptp_virtual_camera	ptp_virtual_camera;
+
+extern const ptp_transport ptp_transport_virtual;
+
+void ptp_virtual_default_config(ptp_virtual_config *config);
+int ptp_virtual_create(ptp_virtual_camera **camera, const ptp_virtual_config *config);
+void ptp_virtual_destroy(ptp_virtual_camera *camera);
+uint32_t ptp_virtual_get_taken(ptp_virtual_camera *camera);
+
+#endif // __PTP_VIRTUAL_H__
@@ -1,14 +1,36 @@
 #include "ptp.h"
 #include "ptp-pima.h"
+#include "ptp-trace.h"
+#include "timer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/eventfd.h>
 
 #define PTP_RETRY_COUNT	2
 
-#define PTP_EP_IN		0x81
-#define PTP_EP_OUT		0x02
-#define PTP_EP_EVENT	0x83
+// Still image class requests
+#define PTP_REQ_CANCEL				0x64
+#define PTP_REQ_DEVICE_RESET		0x66
+#define PTP_REQ_GET_DEVICE_STATUS	0x67
+#define PTP_EC_CANCEL_TRANSACTION	0x4001
+
+#define PTP_CONTROL_TIMEOUT		1000	// ms
+#define PTP_CANCEL_STATUS_TRIES	100
+#define PTP_DEVICE_STATUS_SIZE	32
+#define PTP_DRAIN_TIMEOUT		50		// ms
+#define PTP_DRAIN_MAX_READS		64
+#define PTP_EVENT_READ_TIMEOUT	100		// ms, how often the event reader checks for shutdown
+#define PTP_CANCEL_EVENTS_TIMEOUT	100	// ms, events handled at a time while closing waits for a transfer
+
+// Used when the interface descriptors do not describe a still image interface
+#define PTP_DEFAULT_INTERFACE	0
+#define PTP_DEFAULT_EP_IN		0x81
+#define PTP_DEFAULT_EP_OUT		0x02
+#define PTP_DEFAULT_EP_EVENT	0x83
 
 typedef enum _ptp_container_type
 {
@@ -37,19 +59,63 @@ typedef struct _ptp_command_container
 
 #pragma pack(pop)
 
-static void ptp_event_handle_completion(struct libusb_transfer *transfer, ptp_event_transfer *xfer);
+static void ptp_event_handle_data(ptp_device *dev, const void *buf, int length);
 static void ptp_event_transfer_callback(struct libusb_transfer *transfer);
-static void ptp_submit_event_transfer(ptp_event_transfer *xfer);
-static void ptp_cancel_event_transfer(ptp_event_transfer *xfer);
 static void ptp_submit_event_transfers(ptp_device *dev);
 static void ptp_cancel_event_transfers(ptp_device *dev);
+static int ptp_event_queue_init(ptp_event_queue *queue);
+static void ptp_event_queue_destroy(ptp_event_queue *queue);
+static int ptp_event_queue_get(ptp_event_queue *queue, ptp_event *event, int timeout, volatile int *stop);
+static void *ptp_event_dispatch_proc(void *p);
+static int ptp_dispatch_start(ptp_device *dev);
+static int ptp_alloc_pipeline(ptp_device *dev);
+static void ptp_free_pipeline(ptp_device *dev);
+static void ptp_free_buffer_pool(ptp_device *dev);
+static void ptp_free_arena(ptp_device *dev);
+static int ptp_decode_response(ptp_device *dev, const ptp_response_container *response, int transferred, int retval, ptp_params *params);
+static int ptp_check_data_header(ptp_device *dev, const ptp_container *container, int transferred, int retval, uint32_t *len);
+static void ptp_transact_acquire(ptp_device *dev);
+static void ptp_transact_release(ptp_device *dev);
+static void ptp_async_cancel_all(ptp_device *dev);
+static void ptp_async_start_next(ptp_device *dev);
+static void ptp_async_dispatch(ptp_device *dev);
+static int ptp_prepost_arm(ptp_device *dev, void *buf, int length);
+static void ptp_prepost_cancel(ptp_device *dev);
+static void ptp_recv_size_prepare(ptp_device *dev, uint16_t code);
+static void ptp_find_endpoints(ptp_device *dev);
+static int ptp_transfer_timeout(ptp_device *dev, unsigned int *timeout);
+static int ptp_wait_device_ready(ptp_device *dev, uint8_t *data, int *length);
+static int ptp_do_transact(
+	ptp_device *dev, 
+	const ptp_params *params_out, const void *data_out, uint32_t data_out_size, 
+	ptp_params *params_in, void **data_in, uint32_t *data_in_size);
+static void ptp_deadline_start(ptp_device *dev);
+static int ptp_transact_finish(ptp_device *dev, int retval, int *resynced);
+static void ptp_recv_history_add(ptp_device *dev, uint16_t code, uint32_t len);
+static void ptp_transport_close(ptp_device *dev);
+static int ptp_control(ptp_device *dev, uint8_t request_type, uint8_t request, void *data, uint16_t length);
+static void ptp_clear_halt(ptp_device *dev, unsigned char endpoint);
+static void ptp_device_destroy(ptp_device *dev);
+static void ptp_trace_write(ptp_device *dev, int direction, const ptp_container *container, const void *payload, uint32_t available);
 
 
 int ptp_device_init(ptp_device **dev, usb_device_handle *usbdev, ptp_event_callback event_cb, void *user_ctx)
+{
+	if (!usbdev)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	return ptp_device_init_transport(dev, &ptp_transport_usb, usbdev, event_cb, user_ctx);
+}
+
+// Opens a PTP session over any transport. 'transport_ctx' is left in 
+// dev->transport_ctx for the transport, for USB it is the usb_device_handle.
+int ptp_device_init_transport(ptp_device **dev, const ptp_transport *transport, void *transport_ctx, ptp_event_callback event_cb, void *user_ctx)
 {
 	int ret;
 	
-	if (!dev || !usbdev)
+	if (!dev || !transport || !transport->bulk || !transport->control)
 	{
 		return PTP_ERROR_PARAM;
 	}
@@ -59,47 +125,132 @@ int ptp_device_init(ptp_device **dev, usb_device_handle *usbdev, ptp_event_callb
 		return PTP_ERROR_MEMORY;
 	}
 	
-	(*dev)->usbdev = usbdev->handle;
-	(*dev)->usbctx = usbdev->ctx->ctx;
+	(*dev)->transport = transport;
+	(*dev)->transport_ctx = transport_ctx;
+	(*dev)->usbdev = NULL;
+	(*dev)->usbctx = NULL;
 	(*dev)->transaction_id = (uint32_t)-1;
-	(*dev)->recv_size = 512;
+	(*dev)->recv_size = PTP_RECV_SIZE_MIN;
+	(*dev)->recv_capacity = PTP_RECV_SIZE_MIN;
+	(*dev)->interface = PTP_DEFAULT_INTERFACE;
+	(*dev)->ep_in = PTP_DEFAULT_EP_IN;
+	(*dev)->ep_out = PTP_DEFAULT_EP_OUT;
+	(*dev)->ep_event = PTP_DEFAULT_EP_EVENT;
+	(*dev)->max_packet_in = 512;
+	(*dev)->max_packet_out = 512;
+	(*dev)->expect_zlp = 0;
+	(*dev)->timeout_ms = 0;
+	(*dev)->deadline_set = 0;
+	(*dev)->cancel_requested = 0;
+	(*dev)->resync_pending = 0;
+	memset(&(*dev)->recovery, 0, sizeof((*dev)->recovery));
+	memset((*dev)->recv_history, 0, sizeof((*dev)->recv_history));
+	(*dev)->recv_history_next = 0;
+	(*dev)->data_phases = 0;
+	(*dev)->second_transfers = 0;
+	(*dev)->bytes_in = 0;
 	(*dev)->event_cb = event_cb;
 	(*dev)->user_ctx = user_ctx;
 	(*dev)->bulk_xfer = NULL;
-	memset((*dev)->event_xfers, 0, sizeof((*dev)->event_xfers));
+	(*dev)->pipeline_depth = PTP_PIPELINE_DEPTH;
+	(*dev)->pipeline_chunk_size = PTP_PIPELINE_CHUNK_SIZE;
+	(*dev)->last_data.bytes = 0;
+	(*dev)->last_data.usec = 0;
+	(*dev)->prepost = 1;
+	(*dev)->prepost_xfer = NULL;
+	(*dev)->prepost_completed = 1;
+	(*dev)->prepost_buf = NULL;
+	memset((*dev)->stats_keys, 0, sizeof((*dev)->stats_keys));
+	memset((*dev)->stats, 0, sizeof((*dev)->stats));
+	memset((*dev)->rejected, 0, sizeof((*dev)->rejected));
+	(*dev)->send_retries = 0;
+	(*dev)->event_xfers = NULL;
+	(*dev)->event_depth = PTP_EVENT_TRANSFER_COUNT;
+	(*dev)->event_inflight = 0;
+	(*dev)->events_idle = 1;
+	memset((*dev)->pipeline, 0, sizeof((*dev)->pipeline));
+	(*dev)->pipeline_buf = NULL;
+	(*dev)->pipeline_buf_size = 0;
+	memset((*dev)->buffer_pool, 0, sizeof((*dev)->buffer_pool));
+	(*dev)->arena.recv = NULL;
+	(*dev)->arena.decode = NULL;
+	(*dev)->arena.index = NULL;
+	(*dev)->arena.type_count = 0;
+	(*dev)->transact_busy = 0;
+	(*dev)->transact_waiting = 0;
+	(*dev)->closing = 0;
+	(*dev)->async_xfer = NULL;
+	(*dev)->async_head = NULL;
+	(*dev)->async_tail = NULL;
+	(*dev)->async_current = NULL;
+	(*dev)->async_done_head = NULL;
+	(*dev)->async_done_tail = NULL;
+	(*dev)->events_started = 0;
+	(*dev)->thread_dispatch_valid = 0;
+	(*dev)->dispatch_stop = 0;
+	(*dev)->dispatch_fd = -1;
+	(*dev)->event_reader_valid = 0;
+	(*dev)->event_reader_stop = 0;
+	(*dev)->recv_buf = NULL;
+	(*dev)->send_buf = NULL;
+	(*dev)->trace = NULL;
+	(*dev)->trace_max_data = PTP_TRACE_ALL;
+	pthread_mutex_init(&(*dev)->mutex_transact, NULL);
+	pthread_cond_init(&(*dev)->cond_transact, NULL);
+	pthread_mutex_init(&(*dev)->mutex_trace, NULL);
+	pthread_mutex_init(&(*dev)->mutex_arena, NULL);
+	
+	(*dev)->wait_subscribers = 0;
 	
-	(*dev)->recv_buf = malloc((*dev)->recv_size);
+	(*dev)->dispatch_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 	
-	if (!((*dev)->recv_buf))
+	if (ptp_event_queue_init(&(*dev)->event_queue) != PTP_OK || ptp_event_queue_init(&(*dev)->wait_queue) != PTP_OK || (*dev)->dispatch_fd < 0)
 	{
+		if ((*dev)->dispatch_fd >= 0)
+		{
+			close((*dev)->dispatch_fd);
+		}
+		
+		ptp_event_queue_destroy(&(*dev)->wait_queue);
+		ptp_event_queue_destroy(&(*dev)->event_queue);
+		pthread_cond_destroy(&(*dev)->cond_transact);
+		pthread_mutex_destroy(&(*dev)->mutex_transact);
+		pthread_mutex_destroy(&(*dev)->mutex_trace);
+		pthread_mutex_destroy(&(*dev)->mutex_arena);
 		free(*dev);
 		return PTP_ERROR_MEMORY;
 	}
 	
-	ret = libusb_claim_interface((*dev)->usbdev, 0);
+	ret = transport->open ? transport->open(*dev) : PTP_OK;
 	
-	if (ret < 0)
+	if (ret != PTP_OK)
 	{
-		fprintf(stderr, "libusb_claim_interface: %d: Could not claim interface 0\n", ret);
-		free((*dev)->recv_buf);
-		free(*dev);
+		ptp_device_destroy(*dev);
 		return ret;
 	}
 	
-	if (event_cb)
+	// The first read must always cover at least one full packet
+	if ((*dev)->recv_capacity < (*dev)->max_packet_in)
 	{
-		ptp_submit_event_transfers(*dev);
+		(*dev)->recv_size = (*dev)->max_packet_in;
+		(*dev)->recv_capacity = (*dev)->max_packet_in;
 	}
 	
-	(*dev)->bulk_xfer = libusb_alloc_transfer(0);
+	(*dev)->recv_buf = malloc((*dev)->recv_capacity);
+	(*dev)->send_size = PTP_SEND_BUF_SIZE;
+	(*dev)->send_buf = malloc((*dev)->send_size);
 	
-	if (!(*dev)->bulk_xfer)
+	if (!((*dev)->recv_buf) || !((*dev)->send_buf))
 	{
-		ptp_cancel_event_transfers(*dev);
-		libusb_release_interface((*dev)->usbdev, 0);
-		free((*dev)->recv_buf);
-		free(*dev);
-		return LIBUSB_ERROR_NO_MEM;
+		ptp_transport_close(*dev);
+		ptp_device_destroy(*dev);
+		return PTP_ERROR_MEMORY;
+	}
+	
+	if (event_cb)
+	{
+		ptp_submit_event_transfers(*dev);
+		(*dev)->events_started = 1;
 	}
 	
 	ret = ptp_pima_open_session(*dev, 1);
@@ -107,12 +258,24 @@ int ptp_device_init(ptp_device **dev, usb_device_handle *usbdev, ptp_event_callb
 	if (ret != PTP_OK)
 	{
 		ptp_cancel_event_transfers(*dev);
-		libusb_release_interface((*dev)->usbdev, 0);
-		free((*dev)->recv_buf);
-		free(*dev);
+		ptp_transport_close(*dev);
+		ptp_device_destroy(*dev);
 		return ret;
 	}
 	
+	if (event_cb)
+	{
+		// User code never runs on the event thread, callbacks get their own
+		ret = ptp_dispatch_start(*dev);
+		
+		if (ret != PTP_OK)
+		{
+			ptp_device_free(*dev);
+			*dev = NULL;
+			return ret;
+		}
+	}
+	
 	return PTP_OK;
 }
 
@@ -120,649 +283,4213 @@ void ptp_device_free(ptp_device *dev)
 {
 	if (dev)
 	{
+		ptp_async_cancel_all(dev);
 		ptp_pima_close_session(dev);
-		libusb_free_transfer(dev->bulk_xfer);
+		ptp_free_arena(dev);
+		ptp_free_buffer_pool(dev);
 		ptp_cancel_event_transfers(dev);
-		libusb_release_interface(dev->usbdev, 0);
-		free(dev->recv_buf);
-		free(dev);
+		
+		if (dev->thread_dispatch_valid)
+		{
+			__atomic_store_n(&dev->dispatch_stop, 1, __ATOMIC_RELEASE);
+			eventfd_write(dev->dispatch_fd, 1);
+			pthread_join(dev->thread_dispatch, NULL);
+		}
+		
+		ptp_transport_close(dev);
+		ptp_device_destroy(dev);
 	}
 }
 
-static void ptp_event_handle_completion(struct libusb_transfer *transfer, ptp_event_transfer *xfer)
+static void ptp_transport_close(ptp_device *dev)
 {
-	uint32_t len;
-	ptp_params params;
-	ptp_event_container *event;
-	int i;
+	if (dev->transport->close)
+	{
+		dev->transport->close(dev);
+	}
+}
+
+// Frees what ptp_device_init_transport() set up before opening the transport
+static void ptp_device_destroy(ptp_device *dev)
+{
+	ptp_trace_stop(dev);
+	free(dev->send_buf);
+	free(dev->recv_buf);
+	free(dev->pipeline_buf);
+	ptp_event_queue_destroy(&dev->wait_queue);
+	ptp_event_queue_destroy(&dev->event_queue);
+	close(dev->dispatch_fd);
+	pthread_cond_destroy(&dev->cond_transact);
+	pthread_mutex_destroy(&dev->mutex_transact);
+	pthread_mutex_destroy(&dev->mutex_trace);
+	pthread_mutex_destroy(&dev->mutex_arena);
+	free(dev);
+}
+
+// Only a relaxed load when no trace is being recorded
+static inline void ptp_trace(ptp_device *dev, int direction, const ptp_container *container, const void *payload, uint32_t available)
+{
+	if (__builtin_expect(__atomic_load_n(&dev->trace, __ATOMIC_RELAXED) != NULL, 0))
+	{
+		ptp_trace_write(dev, direction, container, payload, available);
+	}
+}
+
+// Starts appending every container to 'path' (see ptp-trace.h). Data phases 
+// keep at most 'max_data' payload bytes, PTP_TRACE_ALL keeps them whole.
+int ptp_trace_start(ptp_device *dev, const char *path, uint32_t max_data)
+{
+	FILE *f;
 	
-	if (!xfer->dev->event_cb)
+	if (!dev || !path)
 	{
-		return;
+		return PTP_ERROR_PARAM;
 	}
 	
-	event = (ptp_event_container *)xfer->buf;
+	f = fopen(path, "wb");
 	
-	if (transfer->actual_length < sizeof(event->container))
+	if (!f)
 	{
-		return;
+		fprintf(stderr, "[ptp_trace_start] Could not open %s\n", path);
+		return PTP_ERROR_IO;
 	}
 	
-	len = dtoh32(event->container.len);
-		
-	if (len != (uint32_t)transfer->actual_length)
+	if (ptp_trace_write_header(f) != PTP_OK)
 	{
-		return;
+		fclose(f);
+		return PTP_ERROR_IO;
 	}
 	
-	if (event->container.type != htod32(PTP_TYPE_EVENT))
+	ptp_trace_stop(dev);
+	
+	pthread_mutex_lock(&dev->mutex_trace);
+	dev->trace_max_data = max_data;
+	__atomic_store_n(&dev->trace, f, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dev->mutex_trace);
+	
+	return PTP_OK;
+}
+
+void ptp_trace_stop(ptp_device *dev)
+{
+	FILE *f;
+	
+	if (!dev)
 	{
 		return;
 	}
 	
-	params.code = dtoh16(event->container.code);
-	params.num_params = (len - sizeof(event->container)) / sizeof(event->params[0]);
+	pthread_mutex_lock(&dev->mutex_trace);
+	f = dev->trace;
+	__atomic_store_n(&dev->trace, NULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&dev->mutex_trace);
 	
-	for (i = 0; i < params.num_params; i++)
+	if (f)
 	{
-		params.params[i] = dtoh32(event->params[i]);
+		fclose(f);
 	}
-	
-	xfer->dev->event_cb(xfer->dev, &params, xfer->dev->user_ctx);
 }
 
-static void ptp_event_transfer_callback(struct libusb_transfer *transfer)
+// Called from the transaction and event threads, so records are appended 
+// under mutex_trace. 'available' is how much of the payload is at 'payload'.
+static void ptp_trace_write(ptp_device *dev, int direction, const ptp_container *container, const void *payload, uint32_t available)
 {
-	ptp_event_transfer *xfer = transfer->user_data;
+	ptp_trace_record record;
+	struct timespec ts;
+	uint32_t len;
 	
-	switch (transfer->status)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	len = dtoh32(container->len);
+	len = (len > sizeof(ptp_container)) ? len - sizeof(ptp_container) : 0;
+	
+	if (available > len)
 	{
-	case LIBUSB_TRANSFER_CANCELLED:
-		xfer->completed = 1;
-		break;
-		
-	case LIBUSB_TRANSFER_COMPLETED:
-		ptp_event_handle_completion(transfer, xfer);
-		// Fall through and resubmit
-		
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_TIMED_OUT:
-	case LIBUSB_TRANSFER_STALL:
-	case LIBUSB_TRANSFER_NO_DEVICE:
-	case LIBUSB_TRANSFER_OVERFLOW:
-	default:
-		if (libusb_submit_transfer(transfer) != 0)
-		{
-			xfer->completed = 1;
-		}
-		
-		break;
+		available = len;
 	}
-}
-
-static void ptp_submit_event_transfer(ptp_event_transfer *xfer)
-{
-	xfer->completed = 0;
-	xfer->buf = NULL;
-	xfer->xfer = libusb_alloc_transfer(0);
 	
-	if (xfer->xfer)
+	pthread_mutex_lock(&dev->mutex_trace);
+	
+	if (dev->trace)
 	{
-		int retval;
-		
-		xfer->buf = malloc(sizeof(ptp_event_container));
-		
-		if (!xfer->buf)
-		{
-			libusb_free_transfer(xfer->xfer);
-			xfer->xfer = NULL;
-		}
-		else
+		if (dtoh16(container->type) == PTP_TYPE_DATA && available > dev->trace_max_data)
 		{
-			libusb_fill_interrupt_transfer(
-				xfer->xfer, 
-				xfer->dev->usbdev, 
-				PTP_EP_EVENT, 
-				xfer->buf, 
-				sizeof(ptp_event_container), 
-				ptp_event_transfer_callback, 
-				xfer, 
-				0
-			);
-			
-			retval = libusb_submit_transfer(xfer->xfer);
-			
-			if (retval)
-			{
-				// Failed to submit
-				free(xfer->buf);
-				libusb_free_transfer(xfer->xfer);
-				xfer->buf = NULL;
-				xfer->xfer = NULL;
-			}
+			available = dev->trace_max_data;
 		}
-	}
-}
-
-static void ptp_cancel_event_transfer(ptp_event_transfer *xfer)
-{
-	if (xfer->xfer)
-	{
-		libusb_cancel_transfer(xfer->xfer);
 		
-		// Wait for completion
-		while (!xfer->completed) {
-			libusb_handle_events_completed(xfer->dev->usbctx, &xfer->completed);
-		}
+		record.timestamp_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		record.transaction_id = dtoh32(container->transaction_id);
+		record.length = len;
+		record.stored = available;
+		record.code = dtoh16(container->code);
+		record.direction = (uint8_t)direction;
+		record.phase = (uint8_t)dtoh16(container->type);
 		
-		libusb_free_transfer(xfer->xfer);
-		xfer->xfer = NULL;
+		ptp_trace_write_record(dev->trace, &record, payload);
 	}
 	
-	if (xfer->buf)
-	{
-		free(xfer->buf);
-		xfer->buf = NULL;
-	}
+	pthread_mutex_unlock(&dev->mutex_trace);
 }
 
-static void ptp_submit_event_transfers(ptp_device *dev)
+int ptp_set_pipeline(ptp_device *dev, uint32_t depth, uint32_t chunk_size)
 {
-	int i;
-
-	for (i = 0; i < PTP_EVENT_TRANSFER_COUNT; i++)
+	if (!dev || depth < 1 || depth > PTP_PIPELINE_MAX_DEPTH || chunk_size == 0 || (chunk_size % dev->max_packet_in) != 0)
 	{
-		dev->event_xfers[i].dev = dev;
-		
-		ptp_submit_event_transfer(&dev->event_xfers[i]);
+		return PTP_ERROR_PARAM;
 	}
+	
+	dev->pipeline_depth = depth;
+	dev->pipeline_chunk_size = chunk_size;
+	
+	return PTP_OK;
 }
 
-static void ptp_cancel_event_transfers(ptp_device *dev)
+double ptp_get_data_rate(const ptp_device *dev)
 {
-	int i;
-
-	for (i = 0; i < PTP_EVENT_TRANSFER_COUNT; i++)
+	if (!dev || dev->last_data.usec == 0)
 	{
-		ptp_cancel_event_transfer(&dev->event_xfers[i]);
-	}
-}
-
-// Based on libusb-1.0.19/libusb/sync.c
-static void LIBUSB_CALL ptp_bulk_callback(struct libusb_transfer *transfer)
-{
-	int *completed = transfer->user_data;
-	*completed = 1;
-}
-
-// Based on libusb-1.0.19/libusb/sync.c
-static void ptp_transfer_wait_for_completion(ptp_device *dev)
-{
-	int r, *completed = dev->bulk_xfer->user_data;
-
-	while (!*completed) {
-		r = libusb_handle_events_completed(dev->usbctx, completed);
-		if (r < 0) {
-			if (r == LIBUSB_ERROR_INTERRUPTED)
-				continue;
-			libusb_cancel_transfer(dev->bulk_xfer);
-			continue;
-		}
+		return 0.0;
 	}
+	
+	// MB/s over the last data-in phase
+	return ((double)dev->last_data.bytes / (double)dev->last_data.usec) * (1000000.0 / (1024.0 * 1024.0));
 }
 
-// Based on libusb-1.0.19/libusb/sync.c
-static int ptp_bulk_transfer(ptp_device *dev, unsigned char endpoint, void *data, int length, int *transferred)
+// Looks for the still image class interface (6/1/1) and its bulk-in, bulk-out 
+// and interrupt-in endpoints. Falls back to the first interface that has all 
+// three, and to the defaults if there is none.
+static void ptp_find_endpoints(ptp_device *dev)
 {
-	int completed = 0;
-	int r;
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface_descriptor *alt, *found = NULL;
+	const struct libusb_endpoint_descriptor *ep, *ep_in, *ep_out, *ep_event;
+	int i, j, k, r;
 	
-	if (!transferred)
+	r = libusb_get_active_config_descriptor(libusb_get_device(dev->usbdev), &config);
+	
+	if (r < 0)
 	{
-		return PTP_ERROR_PARAM;
+		fprintf(stderr, "[ptp_find_endpoints] libusb_get_active_config_descriptor: %d, using default endpoints\n", r);
+		return;
 	}
-
-	if (endpoint & 0x80)
+	
+	for (i = 0; i < config->bNumInterfaces; i++)
 	{
-		// IN endpoint
-		
-		do
+		for (j = 0; j < config->interface[i].num_altsetting; j++)
 		{
-			*transferred = 0;
-			r = libusb_bulk_transfer(dev->usbdev, endpoint, data, length, transferred, 0);
+			alt = &config->interface[i].altsetting[j];
+			ep_in = ep_out = ep_event = NULL;
 			
-			if (r == 0 && *transferred == 0)
+			for (k = 0; k < alt->bNumEndpoints; k++)
 			{
-				fprintf(stderr, "WARNING: Detected zero-length packet\n");
+				ep = &alt->endpoint[k];
+				
+				switch (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+				{
+				case LIBUSB_TRANSFER_TYPE_BULK:
+					if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+					{
+						if (!ep_in) ep_in = ep;
+					}
+					else
+					{
+						if (!ep_out) ep_out = ep;
+					}
+					break;
+					
+				case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+					if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) && !ep_event) ep_event = ep;
+					break;
+				}
 			}
-		}
-		while (r == 0 && *transferred == 0);
-		
-		return r;
-	}
-	else
-	{
-		// OUT endpoint
-		
-		if (!dev->bulk_xfer)
-		{
-			return libusb_bulk_transfer(dev->usbdev, endpoint, data, length, transferred, 0);
-		}
-
-		libusb_fill_bulk_transfer(dev->bulk_xfer, dev->usbdev, endpoint, data, length, ptp_bulk_callback, &completed, 0);
-		dev->bulk_xfer->type = LIBUSB_TRANSFER_TYPE_BULK;
-
-		completed = 0;
-		r = libusb_submit_transfer(dev->bulk_xfer);
-		
-		if (r < 0)
-		{
-			return r;
-		}
-
-		ptp_transfer_wait_for_completion(dev);
 			
-		*transferred = dev->bulk_xfer->actual_length;
-		switch (dev->bulk_xfer->status) {
-		case LIBUSB_TRANSFER_COMPLETED:
-			r = 0;
-			break;
-		case LIBUSB_TRANSFER_TIMED_OUT:
-			r = LIBUSB_ERROR_TIMEOUT;
-			break;
-		case LIBUSB_TRANSFER_STALL:
-			r = LIBUSB_ERROR_PIPE;
-			break;
-		case LIBUSB_TRANSFER_OVERFLOW:
-			r = LIBUSB_ERROR_OVERFLOW;
-			break;
-		case LIBUSB_TRANSFER_NO_DEVICE:
-			r = LIBUSB_ERROR_NO_DEVICE;
-			break;
-		case LIBUSB_TRANSFER_ERROR:
-		case LIBUSB_TRANSFER_CANCELLED:
-			r = LIBUSB_ERROR_IO;
-			break;
+			if (!ep_in || !ep_out || !ep_event)
+			{
+				continue;
+			}
 			
-		default:
-			r = LIBUSB_ERROR_OTHER;
+			if (!found || 
+				(alt->bInterfaceClass == LIBUSB_CLASS_IMAGE && alt->bInterfaceSubClass == 1 && alt->bInterfaceProtocol == 1))
+			{
+				found = alt;
+				dev->interface = alt->bInterfaceNumber;
+				dev->ep_in = ep_in->bEndpointAddress;
+				dev->ep_out = ep_out->bEndpointAddress;
+				dev->ep_event = ep_event->bEndpointAddress;
+				dev->max_packet_in = ep_in->wMaxPacketSize & 0x7FF;
+				dev->max_packet_out = ep_out->wMaxPacketSize & 0x7FF;
+			}
 		}
-		
-		return r;
 	}
-}
-
-static int ptp_send(ptp_device *dev, void *data, int size)
-{
-	int retval, i, transferred;
 	
-	for (i = 0; i < PTP_RETRY_COUNT; i++)
+	if (!found)
 	{
-		retval = ptp_bulk_transfer(dev, PTP_EP_OUT, data, size, &transferred);
-		
-		if (retval == LIBUSB_ERROR_PIPE)
-		{
-			libusb_clear_halt(dev->usbdev, PTP_EP_OUT);
-			
-			if (i == PTP_RETRY_COUNT - 1)
-			{
-				fprintf(stderr, "[ptp_send] ptp_bulk_transfer: LIBUSB_ERROR_PIPE\n");
-				return retval;
-			}
-		}
-		else if (retval != 0)
-		{
-			fprintf(stderr, "[ptp_send] ptp_bulk_transfer: %d\n", retval);
-			return retval;
-		}
-		else
-		{
-			break;
-		}
+		fprintf(stderr, "[ptp_find_endpoints] No PTP interface found, using default endpoints\n");
 	}
 	
-	return PTP_OK;
-}
-
-int ptp_send_command(ptp_device *dev, const ptp_params *params)
-{
-	ptp_command_container command;
-	uint32_t i;
-	int size;
+	libusb_free_config_descriptor(config);
 	
-	if (!dev || !params || params->num_params > PTP_MAX_PARAMS)
+	// Covers USB 3 where the descriptor value is not the real packet size
+	r = libusb_get_max_packet_size(libusb_get_device(dev->usbdev), dev->ep_in);
+	
+	if (r > 0)
 	{
-		fprintf(stderr, "[ptp_send_command] PTP_ERROR_PARAM\n");
-		return PTP_ERROR_PARAM;
+		dev->max_packet_in = (uint16_t)r;
 	}
 	
-	size = sizeof(ptp_container) + params->num_params * sizeof(uint32_t);
-	
-	command.container.len = htod32((uint32_t)size);
-	command.container.type = htod16(PTP_TYPE_COMMAND);
-	command.container.code = htod16(params->code);
-	command.container.transaction_id = htod32(dev->transaction_id);
+	r = libusb_get_max_packet_size(libusb_get_device(dev->usbdev), dev->ep_out);
 	
-	for (i = 0; i < params->num_params; i++)
+	if (r > 0)
 	{
-		command.params[i] = htod32(params->params[i]);
+		dev->max_packet_out = (uint16_t)r;
 	}
 	
-	return ptp_send(dev, &command, size);
+	if (dev->max_packet_in == 0) dev->max_packet_in = 512;
+	if (dev->max_packet_out == 0) dev->max_packet_out = 512;
 }
 
-int ptp_send_data(ptp_device *dev, uint16_t code, const void *data, int size)
+// When enabled, the first bulk-IN transfer of a transaction (the response, 
+// or the start of the data phase) is submitted before the command is sent, 
+// so the reply lands in a transfer that is already armed.
+int ptp_set_prepost(ptp_device *dev, int enable)
 {
-	int retval;
-	ptp_container *container;
-	
-	if (!dev || !data || size < 0)
+	if (!dev)
 	{
-		fprintf(stderr, "[ptp_send_data] PTP_ERROR_PARAM\n");
 		return PTP_ERROR_PARAM;
 	}
 	
-	container = malloc(sizeof(ptp_container) + size);
+	dev->prepost = enable ? 1 : 0;
 	
-	if (!container)
+	return PTP_OK;
+}
+
+// Deadline for each transaction as a whole, 0 waits forever
+int ptp_set_timeout(ptp_device *dev, unsigned int timeout_ms)
+{
+	if (!dev)
 	{
-		fprintf(stderr, "[ptp_send_data] Invalid container: PTP_ERROR_MEMORY\n");
-		return PTP_ERROR_MEMORY;
+		return PTP_ERROR_PARAM;
 	}
 	
-	memcpy(container + 1, data, size);
-	
-	size += sizeof(ptp_container);
+	dev->timeout_ms = timeout_ms;
 	
-	container->len = htod32((uint32_t)size);
-	container->type = htod16(PTP_TYPE_DATA);
-	container->code = htod16(code);
-	container->transaction_id = htod32(dev->transaction_id);
+	return PTP_OK;
+}
+
+// Aborts the transaction in progress, may be called from any thread. The 
+// transaction returns PTP_ERROR_CANCELLED once the device has acknowledged 
+// the still image class Cancel request.
+int ptp_cancel(ptp_device *dev)
+{
+	if (!dev)
+	{
+		return PTP_ERROR_PARAM;
+	}
 	
-	retval = ptp_send(dev, container, size);
+	pthread_mutex_lock(&dev->mutex_transact);
+	
+	if (!dev->transact_busy)
+	{
+		pthread_mutex_unlock(&dev->mutex_transact);
+		return PTP_OK;
+	}
 	
-	free(container);
+	dev->cancel_requested = 1;
 	
-	return retval;
+	if (dev->transport->cancel)
+	{
+		dev->transport->cancel(dev);
+	}
+	
+	pthread_mutex_unlock(&dev->mutex_transact);
+	
+	return PTP_OK;
 }
 
-int ptp_recv_response(ptp_device *dev, ptp_params *params)
+// The deadline is on the monotonic clock so that a step of the wall clock 
+// neither expires a transaction early nor stretches it
+static void ptp_deadline_start(ptp_device *dev)
 {
-	int retval, transferred;
-	uint32_t len, i;
-	ptp_response_container response;
+	if (dev->timeout_ms == 0)
+	{
+		dev->deadline_set = 0;
+		return;
+	}
 	
-	if (!dev || !params)
+	clock_gettime(CLOCK_MONOTONIC, &dev->deadline);
+	
+	dev->deadline.tv_sec += dev->timeout_ms / 1000;
+	dev->deadline.tv_nsec += (long)(dev->timeout_ms % 1000) * 1000000;
+	
+	if (dev->deadline.tv_nsec >= 1000000000)
 	{
-		fprintf(stderr, "[ptp_recv_response] PTP_ERROR_PARAM\n");
-		return PTP_ERROR_PARAM;
+		dev->deadline.tv_sec++;
+		dev->deadline.tv_nsec -= 1000000000;
 	}
 	
-	retval = ptp_bulk_transfer(dev, PTP_EP_IN, &response, sizeof(response), &transferred);
+	dev->deadline_set = 1;
+}
+
+// Timeout for the next transfer of the current transaction. Fails once the 
+// deadline has passed or the transaction has been cancelled.
+static int ptp_transfer_timeout(ptp_device *dev, unsigned int *timeout)
+{
+	struct timespec ts_now;
+	int64_t left_ns;
+	
+	*timeout = 0;
 	
-	if (retval != 0 && retval != LIBUSB_ERROR_TIMEOUT)
+	if (dev->cancel_requested)
 	{
-		fprintf(stderr, "[ptp_recv_response] ptp_bulk_transfer: %d\n", retval);
-		return retval;
+		return LIBUSB_ERROR_INTERRUPTED;
 	}
 	
-	if (transferred < sizeof(response.container))
+	if (!dev->deadline_set)
 	{
-		fprintf(stderr, "[ptp_recv_response] Data length too short: transferred=%d, retval=%d\n", transferred, retval);
-		return PTP_ERROR_DATA_LEN;
+		return 0;
 	}
 	
-	len = dtoh32(response.container.len);
+	clock_gettime(CLOCK_MONOTONIC, &ts_now);
 	
-	if (len != (uint32_t)transferred)
+	left_ns = (int64_t)(dev->deadline.tv_sec - ts_now.tv_sec) * 1000000000 + (dev->deadline.tv_nsec - ts_now.tv_nsec);
+	
+	if (left_ns <= 0)
 	{
-		fprintf(stderr, "[ptp_recv_response] Transfer length mismatch: transferred=%d, expected=%u, retval=%d\n", transferred, len, retval);
-		return retval ? retval : PTP_ERROR_DATA_LEN;
+		return LIBUSB_ERROR_TIMEOUT;
 	}
 	
-	if (dtoh32(response.container.transaction_id) != dev->transaction_id)
+	*timeout = (unsigned int)(left_ns / 1000000);
+	
+	if (*timeout == 0)
 	{
-		fprintf(stderr, "[ptp_recv_response] PTP_ERROR_CONTAINER_ID\n");
-		return PTP_ERROR_TRANSACTION_ID;
+		*timeout = 1;
 	}
 	
-	if (response.container.type != htod32(PTP_TYPE_RESPONSE))
+	return 0;
+}
+
+static int ptp_get_device_status(ptp_device *dev, uint16_t *code, uint8_t *data, int *length)
+{
+	int r;
+	
+	r = ptp_control(dev, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, PTP_REQ_GET_DEVICE_STATUS, data, PTP_DEVICE_STATUS_SIZE);
+	
+	if (r < 0)
 	{
-		fprintf(stderr, "[ptp_recv_response] PTP_ERROR_CONTAINER_TYPE\n");
-		return PTP_ERROR_CONTAINER_TYPE;
+		return r;
 	}
 	
-	params->code = dtoh16(response.container.code);
-	params->num_params = (len - sizeof(response.container)) / sizeof(response.params[0]);
-	
-	for (i = 0; i < params->num_params; i++)
+	if (r < 4)
 	{
-		params->params[i] = dtoh32(response.params[i]);
+		return PTP_ERROR_DATA_LEN;
 	}
 	
+	*code = data[2] | (data[3] << 8);
+	*length = r;
+	
 	return PTP_OK;
 }
 
-int ptp_recv_data(ptp_device *dev, void **data)
+// Issues the class Cancel request for the current transaction and waits for 
+// the device to become ready again, clearing any endpoint it reports halted
+static int ptp_class_cancel(ptp_device *dev)
 {
-	int retval, transferred, buf_size;
-	uint32_t len;
-	uint8_t *buf;
-	ptp_container *container;
+	uint8_t data[PTP_DEVICE_STATUS_SIZE];
+	int r, i, length;
 	
-	if (!dev || !data)
-	{
-		fprintf(stderr, "[ptp_recv_data] PTP_ERROR_PARAM\n");
-		return PTP_ERROR_PARAM;
-	}
+	data[0] = PTP_EC_CANCEL_TRANSACTION & 0xFF;
+	data[1] = PTP_EC_CANCEL_TRANSACTION >> 8;
+	data[2] = dev->transaction_id & 0xFF;
+	data[3] = (dev->transaction_id >> 8) & 0xFF;
+	data[4] = (dev->transaction_id >> 16) & 0xFF;
+	data[5] = (dev->transaction_id >> 24) & 0xFF;
 	
-	container = dev->recv_buf;
+	r = ptp_control(dev, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, PTP_REQ_CANCEL, data, 6);
 	
-	if (!container)
+	if (r < 0)
 	{
-		fprintf(stderr, "[ptp_recv_data] Invalid container (PTP_ERROR_MEMORY)\n");
-		return PTP_ERROR_MEMORY;
+		fprintf(stderr, "[ptp_class_cancel] Cancel request: %d\n", r);
+		return r;
 	}
 	
-	retval = ptp_bulk_transfer(dev, PTP_EP_IN, container, dev->recv_size, &transferred);
+	length = 0;
+	r = ptp_wait_device_ready(dev, data, &length);
 	
-	if (retval != 0 && retval != LIBUSB_ERROR_TIMEOUT)
+	// Any endpoints listed after the code are stalled
+	for (i = 4; i + 4 <= length; i += 4)
 	{
-		fprintf(stderr, "[ptp_recv_data] ptp_bulk_transfer: %d\n", retval);
-		return retval;
+		ptp_clear_halt(dev, data[i]);
 	}
 	
-	if (transferred < sizeof(ptp_container))
+	if (r != PTP_OK)
 	{
-		fprintf(stderr, "[ptp_recv_data] Data length too short: transferred=%d, retval=%d\n", transferred, retval);
-		return retval ? retval : PTP_ERROR_DATA_LEN;
+		fprintf(stderr, "[ptp_class_cancel] Device not ready: %d\n", r);
+		return r;
 	}
 	
-	len = dtoh32(container->len);
+	return PTP_OK;
+}
+
+// Polls the device status until it stops reporting busy
+static int ptp_wait_device_ready(ptp_device *dev, uint8_t *data, int *length)
+{
+	uint16_t code = 0;
+	int r, i;
 	
-	if (len > transferred && transferred < dev->recv_size)
+	for (i = 0; i < PTP_CANCEL_STATUS_TRIES; i++)
 	{
-		fprintf(stderr, "[ptp_recv_data] Early termination: transferred=%d, len=%d, retval=%d\n", transferred, len, retval);
-		return retval ? retval : PTP_ERROR_DATA_LEN;
+		r = ptp_get_device_status(dev, &code, data, length);
+		
+		if (r != PTP_OK)
+		{
+			return r;
+		}
+		
+		if (code != PTP_RC_DEVICE_BUSY)
+		{
+			break;
+		}
+		
+		usleep(1000);
 	}
 	
-	if (dtoh32(container->transaction_id) != dev->transaction_id)
+	return (code == PTP_RC_OK) ? PTP_OK : PTP_ERROR_RC;
+}
+
+// Errors that leave the pipe in an unknown state
+static int ptp_is_transport_error(int retval)
+{
+	switch (retval)
 	{
-		fprintf(stderr, "[ptp_recv_data] Transaction ID mismatch: transaction_id=0x%08x, expected=0x%08x\n", dtoh32(container->transaction_id), dev->transaction_id);
-		return PTP_ERROR_TRANSACTION_ID;
+	case PTP_ERROR_DATA_LEN:
+	case PTP_ERROR_TRANSACTION_ID:
+	case PTP_ERROR_CONTAINER_TYPE:
+	case LIBUSB_ERROR_IO:
+	case LIBUSB_ERROR_PIPE:
+	case LIBUSB_ERROR_OVERFLOW:
+		return 1;
+	default:
+		return 0;
 	}
+}
+
+// Brings the pipe back to a known state after a transport error: drains 
+// whatever the device still has queued, clears both bulk endpoints and, 
+// if the device does not report ready, resets it and reopens the session.
+// Must be called with the pipe held.
+static int ptp_resync(ptp_device *dev)
+{
+	uint8_t status[PTP_DEVICE_STATUS_SIZE];
+	ptp_params params_out, params_in;
+	struct timeval tv;
+	uint64_t usec;
+	int r, i, length, transferred;
+	timer tm;
 	
-	if (container->type != htod32(PTP_TYPE_DATA))
-	{
-		fprintf(stderr, "[ptp_recv_data] PTP_ERROR_CONTAINER_TYPE\n");
-		return PTP_ERROR_CONTAINER_TYPE;
-	}
+	timer_start(&tm);
 	
-	buf_size = len - sizeof(ptp_container);
-	buf = malloc(buf_size);
+	dev->resync_pending = 0;
+	dev->deadline_set = 0;
+	ptp_prepost_cancel(dev);
 	
-	if (!buf)
+	// Drain stale containers until the device goes quiet
+	for (i = 0; i < PTP_DRAIN_MAX_READS; i++)
 	{
-		fprintf(stderr, "[ptp_recv_data] Could not allocate buffer (PTP_ERROR_MEMORY)\n");
-		return PTP_ERROR_MEMORY;
+		transferred = 0;
+		r = dev->transport->bulk(dev, dev->ep_in, dev->recv_buf, (dev->recv_capacity / dev->max_packet_in) * dev->max_packet_in, &transferred, PTP_DRAIN_TIMEOUT);
+		
+		if (r != 0)
+		{
+			break;
+		}
 	}
 	
-	memcpy(buf, container + 1, transferred - sizeof(ptp_container));
+	ptp_clear_halt(dev, dev->ep_in);
+	ptp_clear_halt(dev, dev->ep_out);
+	dev->expect_zlp = 0;
 	
-	if (len > transferred)
+	r = ptp_wait_device_ready(dev, status, &length);
+	
+	if (r != PTP_OK)
 	{
-		uint32_t remaining = len - (uint32_t)transferred;
+		fprintf(stderr, "[ptp_resync] Device not ready (%d), resetting\n", r);
 		
-		retval = libusb_bulk_transfer(
-			dev->usbdev, 
-			PTP_EP_IN, 
-			buf + transferred - sizeof(ptp_container), 
-			(int)remaining, 
-			&transferred, 
-			0);
+		dev->recovery.resets++;
 		
-		if (retval != 0 && retval != LIBUSB_ERROR_TIMEOUT)
+		r = ptp_control(dev, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, PTP_REQ_DEVICE_RESET, NULL, 0);
+		
+		if (r >= 0)
 		{
-			free(buf);
-			fprintf(stderr, "[ptp_recv_data] ptp_bulk_transfer #2: %d\n", retval);
-			return retval;
+			r = ptp_wait_device_ready(dev, status, &length);
 		}
 		
-		if ((uint32_t)transferred != remaining)
+		if (r == PTP_OK)
 		{
-			free(buf);
-			fprintf(stderr, "[ptp_recv_data] ptp_bulk_transfer #2: transferred=%d, remaining=%d\n", transferred, (int)remaining);
-			return retval ? retval : PTP_ERROR_DATA_LEN;
+			// A reset closes the session, open it again as ptp_device_init() did
+			dev->transaction_id = (uint32_t)-1;
+			
+			params_out.code = PTP_OP_PIMA_OpenSession;
+			params_out.num_params = 1;
+			params_out.params[0] = 1;
+			
+			r = ptp_do_transact(dev, &params_out, NULL, 0, &params_in, NULL, NULL);
+			
+			if (r == PTP_OK && params_in.code != PTP_RC_OK && params_in.code != PTP_RC_SESSION_ALREADY_OPEN)
+			{
+				r = PTP_ERROR_RC;
+			}
 		}
 	}
 	
-	*data = buf;
-	return buf_size;
-}
-
-int ptp_transact(
-	ptp_device *dev, 
-	const ptp_params *params_out, const void *data_out, uint32_t data_out_size, 
-	ptp_params *params_in, void **data_in, uint32_t *data_in_size)
-{
-	int retval, temp_data_in_size;
-	void *temp_data_in;
+	timer_stop(&tm);
+	timer_elapsed(&tm, &tv);
+	usec = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 	
-	if (!params_out || !params_in || params_out->num_params > PTP_MAX_PARAMS || 
-		(data_out && data_in) || (data_in && !data_in_size))
+	dev->recovery.count++;
+	dev->recovery.total_usec += usec;
+	
+	if (usec > dev->recovery.max_usec)
 	{
-		fprintf(stderr, "[ptp_transact] PTP_ERROR_PARAM\n");
-		return PTP_ERROR_PARAM;
+		dev->recovery.max_usec = usec;
 	}
 	
-	if (!data_out) data_out_size = 0;
+	if (r != PTP_OK)
+	{
+		dev->recovery.failures++;
+		fprintf(stderr, "[ptp_resync] Recovery failed: %d\n", r);
+	}
 	
-	if (data_in)
+	return r;
+}
+
+void ptp_get_recovery_stats(const ptp_device *dev, ptp_recovery *recovery)
+{
+	if (dev && recovery)
 	{
-		*data_in = NULL;
-		*data_in_size = 0;
+		*recovery = dev->recovery;
 	}
+}
+
+// Turns a timed out or cancelled transaction into a class cancel, and 
+// resynchronises the pipe after a transport error, so that the session 
+// stays usable. 'resynced' tells whether the transaction may be retried.
+static int ptp_transact_finish(ptp_device *dev, int retval, int *resynced)
+{
+	int cancelled = dev->cancel_requested;
 	
-	dev->transaction_id++;
+	dev->deadline_set = 0;
 	
-	retval = ptp_send_command(dev, params_out);
+	if (resynced)
+	{
+		*resynced = 0;
+	}
 	
-	if (retval != PTP_OK)
+	if (retval >= 0)
 	{
-		fprintf(stderr, "[ptp_transact] ptp_send_command: %d\n", retval);
+		dev->cancel_requested = 0;
 		return retval;
 	}
 	
-	if (data_out != NULL)
+	if (cancelled || retval == LIBUSB_ERROR_TIMEOUT)
 	{
-		retval = ptp_send_data(dev, params_out->code, data_out, data_out_size);
+		ptp_prepost_cancel(dev);
+		ptp_class_cancel(dev);
 		
-		if (retval != PTP_OK)
-		{
-			fprintf(stderr, "[ptp_transact] ptp_send_data: %d\n", retval);
-			return retval;
-		}
+		dev->cancel_requested = 0;
+		
+		return cancelled ? PTP_ERROR_CANCELLED : PTP_ERROR_TIMEOUT;
 	}
-	else if (data_in)
+	
+	if (ptp_is_transport_error(retval))
 	{
-		retval = ptp_recv_data(dev, &temp_data_in);
+		fprintf(stderr, "[ptp_transact] Transport error %d, resynchronising\n", retval);
 		
-		if (retval < 0)
+		if (ptp_resync(dev) == PTP_OK && resynced)
 		{
-			fprintf(stderr, "[ptp_transact] ptp_recv_data: %d\n", retval);
-			return retval;
+			*resynced = 1;
 		}
-		
-		temp_data_in_size = retval;
 	}
 	
-	retval = ptp_recv_response(dev, params_in);
+	return retval;
+}
+
+void ptp_get_recv_stats(const ptp_device *dev, uint64_t *data_phases, uint64_t *second_transfers)
+{
+	if (!dev)
+	{
+		return;
+	}
 	
-	if (retval != PTP_OK)
+	if (data_phases)
 	{
-		if (data_in)
-		{
-			free(temp_data_in);
-		}
-		
-		fprintf(stderr, "[ptp_transact] ptp_recv_response: %d\n", retval);
+		*data_phases = dev->data_phases;
 	}
-	else if (data_in)
+	
+	if (second_transfers)
+	{
+		*second_transfers = dev->second_transfers;
+	}
+}
+
+// Data-in payload bytes since the device was opened
+uint64_t ptp_get_bytes_in(const ptp_device *dev)
+{
+	if (!dev)
 	{
-		*data_in = temp_data_in;
-		*data_in_size = temp_data_in_size;
+		return 0;
 	}
 	
-	return retval;
+	return __atomic_load_n(&dev->bytes_in, __ATOMIC_RELAXED);
 }
 
-int ptp_wait_event(ptp_device *dev, ptp_params *params, int timeout)
+static inline uint64_t ptp_stats_now(void)
 {
-	int retval, transferred;
-	uint32_t len, i;
-	ptp_event_container event;
+	struct timespec ts;
 	
-	if (!dev || !params)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t ptp_hist_bucket(uint64_t usec)
+{
+	uint32_t bits;
+	
+	if (usec < PTP_HIST_SUB_COUNT)
 	{
-		fprintf(stderr, "[ptp_wait_event] PTP_ERROR_PARAM\n");
-		return PTP_ERROR_PARAM;
+		return (uint32_t)usec;
 	}
 	
-	retval = libusb_interrupt_transfer(dev->usbdev, PTP_EP_EVENT, (unsigned char *)&event, sizeof(event), &transferred, timeout);
+	bits = 63 - __builtin_clzll(usec);
 	
-	if (retval != 0 && retval != LIBUSB_ERROR_TIMEOUT)
+	if (bits > PTP_HIST_MAX_BITS)
 	{
-		fprintf(stderr, "[ptp_wait_event] libusb_interrupt_transfer: %d\n", retval);
-		return retval;
+		return PTP_HIST_BUCKETS - 1;
 	}
 	
-	if (transferred < sizeof(event.container))
+	return PTP_HIST_SUB_COUNT * (bits - PTP_HIST_SUB_BITS + 1) + (uint32_t)((usec >> (bits - PTP_HIST_SUB_BITS)) & (PTP_HIST_SUB_COUNT - 1));
+}
+
+// Highest value that falls into 'bucket'
+static uint64_t ptp_hist_bucket_value(uint32_t bucket)
+{
+	uint32_t bits, sub;
+	
+	if (bucket < PTP_HIST_SUB_COUNT)
 	{
-		fprintf(stderr, "[ptp_wait_event] Data length too short: transferred=%d, retval=%d\n", transferred, retval);
-		return retval ? retval : PTP_ERROR_DATA_LEN;
+		return bucket;
 	}
 	
-	len = dtoh32(event.container.len);
+	bits = bucket / PTP_HIST_SUB_COUNT + PTP_HIST_SUB_BITS - 1;
+	sub = bucket % PTP_HIST_SUB_COUNT;
 	
-	if (len != (uint32_t)transferred)
+	return ((uint64_t)(PTP_HIST_SUB_COUNT + sub + 1) << (bits - PTP_HIST_SUB_BITS)) - 1;
+}
+
+static void ptp_hist_add(ptp_histogram *hist, uint64_t usec)
+{
+	uint64_t max = __atomic_load_n(&hist->max_usec, __ATOMIC_RELAXED);
+	
+	__atomic_add_fetch(&hist->buckets[ptp_hist_bucket(usec)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->total_usec, usec, __ATOMIC_RELAXED);
+	
+	while (usec > max && !__atomic_compare_exchange_n(&hist->max_usec, &max, usec, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Finds or claims the counters of 'code' without locking. Slots are claimed 
+// in order and never released. NULL once all of them are taken.
+static ptp_opcode_stats *ptp_stats_get(ptp_device *dev, uint16_t code)
+{
+	uint32_t key = 0x10000 | code, found;
+	int i;
+	
+	for (i = 0; i < PTP_STATS_MAX_OPCODES; i++)
 	{
-		fprintf(stderr, "[ptp_wait_event] Transfer length mismatch: transferred=%d, expected=%u, retval=%d\n", transferred, len, retval);
-		return retval ? retval : PTP_ERROR_DATA_LEN;
+		found = __atomic_load_n(&dev->stats_keys[i], __ATOMIC_ACQUIRE);
+		
+		if (found == 0)
+		{
+			if (__atomic_compare_exchange_n(&dev->stats_keys[i], &found, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				return &dev->stats[i];
+			}
+			
+			// Lost the race, 'found' is now the other thread's key
+		}
+		
+		if (found == key)
+		{
+			return &dev->stats[i];
+		}
 	}
 	
-	if (event.container.type != htod32(PTP_TYPE_EVENT))
+	return NULL;
+}
+
+static ptp_opcode_stats *ptp_stats_begin(ptp_device *dev, uint16_t code, uint64_t *start)
+{
+	ptp_opcode_stats *stats = ptp_stats_get(dev, code);
+	
+	if (stats)
 	{
-		fprintf(stderr, "[ptp_wait_event] PTP_ERROR_CONTAINER_TYPE\n");
-		return PTP_ERROR_CONTAINER_TYPE;
+		__atomic_add_fetch(&stats->transactions, 1, __ATOMIC_RELAXED);
 	}
 	
-	params->code = dtoh16(event.container.code);
-	params->num_params = (len - sizeof(event.container)) / sizeof(event.params[0]);
+	*start = ptp_stats_now();
 	
-	for (i = 0; i < params->num_params; i++)
+	return stats;
+}
+
+// Records a phase that started at 'start' and returns its end
+static uint64_t ptp_stats_phase(ptp_opcode_stats *stats, ptp_phase phase, uint64_t start)
+{
+	uint64_t now = ptp_stats_now();
+	
+	if (stats)
 	{
-		params->params[i] = dtoh32(event.params[i]);
+		ptp_hist_add(&stats->phases[phase], (now - start) / 1000);
 	}
 	
+	return now;
+}
+
+static uint64_t ptp_stats_data(ptp_opcode_stats *stats, uint64_t start, uint32_t bytes, int in)
+{
+	if (stats)
+	{
+		__atomic_add_fetch(in ? &stats->bytes_in : &stats->bytes_out, bytes, __ATOMIC_RELAXED);
+	}
+	
+	return ptp_stats_phase(stats, PTP_PHASE_DATA, start);
+}
+
+static void ptp_stats_end(ptp_opcode_stats *stats, uint64_t start, uint64_t phase_start)
+{
+	ptp_stats_phase(stats, PTP_PHASE_RESPONSE, phase_start);
+	ptp_stats_phase(stats, PTP_PHASE_TOTAL, start);
+}
+
+static void ptp_stats_retry(ptp_device *dev, uint16_t code)
+{
+	ptp_opcode_stats *stats = ptp_stats_get(dev, code);
+	
+	if (stats)
+	{
+		__atomic_add_fetch(&stats->retries, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// Remembers opcodes the device answered with OperationNotSupported, so that 
+// callers with another way to get the same data stop trying them. Slots are 
+// claimed like the stats ones and never released.
+static void ptp_note_response(ptp_device *dev, const ptp_params *params_out, const ptp_params *params_in, int retval)
+{
+	uint32_t key, found;
+	int i;
+	
+	if (retval != PTP_OK || params_in->code != PTP_RC_OPERATION_NOT_SUPPORTED)
+	{
+		return;
+	}
+	
+	key = 0x10000 | params_out->code;
+	
+	for (i = 0; i < PTP_REJECTED_MAX_OPCODES; i++)
+	{
+		found = 0;
+		
+		if (__atomic_compare_exchange_n(&dev->rejected[i], &found, key, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE) || found == key)
+		{
+			return;
+		}
+	}
+}
+
+int ptp_op_rejected(const ptp_device *dev, uint16_t code)
+{
+	uint32_t key = 0x10000 | code, found;
+	int i;
+	
+	if (!dev)
+	{
+		return 0;
+	}
+	
+	for (i = 0; i < PTP_REJECTED_MAX_OPCODES; i++)
+	{
+		found = __atomic_load_n(&dev->rejected[i], __ATOMIC_ACQUIRE);
+		
+		if (found == key)
+		{
+			return 1;
+		}
+		
+		if (found == 0)
+		{
+			break;
+		}
+	}
+	
+	return 0;
+}
+
+static uint64_t ptp_stats_take(uint64_t *counter, int reset)
+{
+	return reset ? __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED) : __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void ptp_hist_take(ptp_histogram *dst, ptp_histogram *src, int reset)
+{
+	int i;
+	
+	for (i = 0; i < PTP_HIST_BUCKETS; i++)
+	{
+		dst->buckets[i] = reset ? __atomic_exchange_n(&src->buckets[i], 0, __ATOMIC_RELAXED) : __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	}
+	
+	dst->count = ptp_stats_take(&src->count, reset);
+	dst->total_usec = ptp_stats_take(&src->total_usec, reset);
+	dst->max_usec = ptp_stats_take(&src->max_usec, reset);
+}
+
+// Copies the per-opcode counters into 'stats'. With 'reset' every counter is 
+// swapped for zero as it is read, so transactions running concurrently are 
+// counted in either this snapshot or the next one, never lost. Counters are 
+// read one by one, a snapshot taken while transactions run may be off by 
+// the transactions in flight.
+int ptp_device_get_stats(ptp_device *dev, ptp_stats *stats, int reset)
+{
+	ptp_opcode_stats *src, *dst;
+	uint32_t key;
+	int i, j;
+	
+	if (!dev || !stats)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	stats->send_retries = ptp_stats_take(&dev->send_retries, reset);
+	stats->count = 0;
+	
+	for (i = 0; i < PTP_STATS_MAX_OPCODES; i++)
+	{
+		key = __atomic_load_n(&dev->stats_keys[i], __ATOMIC_ACQUIRE);
+		
+		if (key == 0)
+		{
+			break;
+		}
+		
+		src = &dev->stats[i];
+		dst = &stats->opcodes[stats->count++];
+		
+		dst->code = (uint16_t)key;
+		dst->transactions = ptp_stats_take(&src->transactions, reset);
+		dst->retries = ptp_stats_take(&src->retries, reset);
+		dst->bytes_out = ptp_stats_take(&src->bytes_out, reset);
+		dst->bytes_in = ptp_stats_take(&src->bytes_in, reset);
+		
+		for (j = 0; j < PTP_PHASE_COUNT; j++)
+		{
+			ptp_hist_take(&dst->phases[j], &src->phases[j], reset);
+		}
+		
+		// Only completed transactions reach the total
+		dst->failed = (dst->transactions > dst->phases[PTP_PHASE_TOTAL].count) ? 
+			dst->transactions - dst->phases[PTP_PHASE_TOTAL].count : 0;
+	}
+	
+	return PTP_OK;
+}
+
+// Folds the whole-transaction times of one opcode into 'latency'
+static void ptp_latency_merge(ptp_latency *latency, const ptp_histogram *hist)
+{
+	uint64_t min;
+	int i;
+	
+	if (hist->count == 0)
+	{
+		return;
+	}
+	
+	for (i = 0; i < PTP_HIST_BUCKETS - 1 && hist->buckets[i] == 0; i++);
+	
+	min = (i > 0) ? ptp_hist_bucket_value(i - 1) + 1 : 0;
+	
+	if (latency->count == 0 || min < latency->min_usec)
+	{
+		latency->min_usec = min;
+	}
+	
+	if (hist->max_usec > latency->max_usec)
+	{
+		latency->max_usec = hist->max_usec;
+	}
+	
+	latency->count += hist->count;
+	latency->total_usec += hist->total_usec;
+}
+
+// Round trip times split by whether the opcode has a data phase, taken from 
+// ptp_device_get_stats(). Reset them along with the stats.
+int ptp_get_latency(ptp_device *dev, ptp_latency *control, ptp_latency *data)
+{
+	const ptp_opcode_stats *op;
+	ptp_latency *latency;
+	ptp_stats *stats;
+	uint32_t i;
+	int ret;
+	
+	if (control)
+	{
+		memset(control, 0, sizeof(*control));
+	}
+	
+	if (data)
+	{
+		memset(data, 0, sizeof(*data));
+	}
+	
+	stats = malloc(sizeof(*stats));
+	
+	if (!stats)
+	{
+		fprintf(stderr, "[ptp_get_latency] Could not allocate stats (PTP_ERROR_MEMORY)\n");
+		return PTP_ERROR_MEMORY;
+	}
+	
+	ret = ptp_device_get_stats(dev, stats, 0);
+	
+	for (i = 0; ret == PTP_OK && i < stats->count; i++)
+	{
+		op = &stats->opcodes[i];
+		latency = (op->phases[PTP_PHASE_DATA].count > 0) ? data : control;
+		
+		if (latency)
+		{
+			ptp_latency_merge(latency, &op->phases[PTP_PHASE_TOTAL]);
+		}
+	}
+	
+	free(stats);
+	
+	return ret;
+}
+
+// Upper bound of the bucket holding the given percentile (0-100), in us
+uint64_t ptp_histogram_percentile(const ptp_histogram *hist, double percentile)
+{
+	uint64_t target, seen = 0;
+	int i;
+	
+	if (!hist || hist->count == 0)
+	{
+		return 0;
+	}
+	
+	target = (uint64_t)((double)hist->count * percentile / 100.0 + 0.5);
+	
+	if (target < 1)
+	{
+		target = 1;
+	}
+	
+	for (i = 0; i < PTP_HIST_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		
+		if (seen >= target)
+		{
+			break;
+		}
+	}
+	
+	if (i == PTP_HIST_BUCKETS || ptp_hist_bucket_value(i) > hist->max_usec)
+	{
+		return hist->max_usec;
+	}
+	
+	return ptp_hist_bucket_value(i);
+}
+
+void ptp_stats_print(const ptp_stats *stats, FILE *f)
+{
+	static const char *phase_names[PTP_PHASE_COUNT] = { "Command", "Data", "Response", "Total" };
+	const ptp_opcode_stats *op;
+	const ptp_histogram *hist;
+	uint32_t i;
+	int j;
+	
+	if (!stats || !f)
+	{
+		return;
+	}
+	
+	fprintf(f, "Send retries: %llu\n", (unsigned long long)stats->send_retries);
+	
+	for (i = 0; i < stats->count; i++)
+	{
+		op = &stats->opcodes[i];
+		
+		if (op->transactions == 0)
+		{
+			continue;
+		}
+		
+		fprintf(f, "0x%04x: %llu transaction(s), %llu failed, %llu retried, %llu bytes out, %llu bytes in\n", 
+			op->code, 
+			(unsigned long long)op->transactions, 
+			(unsigned long long)op->failed, 
+			(unsigned long long)op->retries, 
+			(unsigned long long)op->bytes_out, 
+			(unsigned long long)op->bytes_in
+		);
+		
+		for (j = 0; j < PTP_PHASE_COUNT; j++)
+		{
+			hist = &op->phases[j];
+			
+			if (hist->count == 0)
+			{
+				continue;
+			}
+			
+			fprintf(f, "  %-8s avg %7llu  p50 %7llu  p90 %7llu  p99 %7llu  max %7llu us\n", 
+				phase_names[j], 
+				(unsigned long long)(hist->total_usec / hist->count), 
+				(unsigned long long)ptp_histogram_percentile(hist, 50.0), 
+				(unsigned long long)ptp_histogram_percentile(hist, 90.0), 
+				(unsigned long long)ptp_histogram_percentile(hist, 99.0), 
+				(unsigned long long)hist->max_usec
+			);
+		}
+	}
+}
+
+// Sizes the first read of a data phase to cover the payload last seen for 
+// this operation, in whole packets, so that most data phases complete in 
+// a single transfer
+static void ptp_recv_size_prepare(ptp_device *dev, uint16_t code)
+{
+	uint32_t size = PTP_RECV_SIZE_MIN;
+	uint32_t mps = dev->max_packet_in;
+	uint32_t i;
+	void *buf;
+	
+	for (i = 0; i < PTP_RECV_HISTORY_SIZE; i++)
+	{
+		if (dev->recv_history[i].len && dev->recv_history[i].code == code)
+		{
+			if (dev->recv_history[i].len > size)
+			{
+				size = dev->recv_history[i].len;
+			}
+			
+			break;
+		}
+	}
+	
+	if (size > PTP_RECV_SIZE_MAX)
+	{
+		size = PTP_RECV_SIZE_MAX;
+	}
+	
+	size = ((size + mps - 1) / mps) * mps;
+	
+	if (size > dev->recv_capacity)
+	{
+		buf = realloc(dev->recv_buf, size);
+		
+		if (!buf)
+		{
+			// Keep going with what we have, rounded down to whole packets
+			size = (dev->recv_capacity / mps) * mps;
+		}
+		else
+		{
+			dev->recv_buf = buf;
+			dev->recv_capacity = size;
+		}
+	}
+	
+	dev->recv_size = size;
+}
+
+static void ptp_recv_history_add(ptp_device *dev, uint16_t code, uint32_t len)
+{
+	uint32_t i;
+	
+	for (i = 0; i < PTP_RECV_HISTORY_SIZE; i++)
+	{
+		if (dev->recv_history[i].len && dev->recv_history[i].code == code)
+		{
+			dev->recv_history[i].len = len;
+			return;
+		}
+	}
+	
+	dev->recv_history[dev->recv_history_next].code = code;
+	dev->recv_history[dev->recv_history_next].len = len;
+	dev->recv_history_next = (dev->recv_history_next + 1) % PTP_RECV_HISTORY_SIZE;
+}
+
+static int ptp_alloc_pipeline(ptp_device *dev)
+{
+	int i;
+	
+	for (i = 0; i < PTP_PIPELINE_MAX_DEPTH; i++)
+	{
+		dev->pipeline[i].completed = 1;
+		dev->pipeline[i].xfer = libusb_alloc_transfer(0);
+		
+		if (!dev->pipeline[i].xfer)
+		{
+			return PTP_ERROR_MEMORY;
+		}
+	}
+	
+	return PTP_OK;
+}
+
+static void ptp_free_pipeline(ptp_device *dev)
+{
+	int i;
+	
+	for (i = 0; i < PTP_PIPELINE_MAX_DEPTH; i++)
+	{
+		if (dev->pipeline[i].xfer)
+		{
+			libusb_free_transfer(dev->pipeline[i].xfer);
+			dev->pipeline[i].xfer = NULL;
+		}
+	}
+}
+
+static int ptp_event_queue_init(ptp_event_queue *queue)
+{
+	queue->head = 0;
+	queue->tail = 0;
+	queue->dropped = 0;
+	queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	
+	if (queue->fd < 0)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	pthread_mutex_init(&queue->mutex_get, NULL);
+	
+	return PTP_OK;
+}
+
+static void ptp_event_queue_destroy(ptp_event_queue *queue)
+{
+	if (queue->fd >= 0)
+	{
+		close(queue->fd);
+		queue->fd = -1;
+		pthread_mutex_destroy(&queue->mutex_get);
+	}
+}
+
+// Producer side, only ever runs from libusb completion callbacks, which 
+// libusb serializes under its event lock
+static void ptp_event_queue_put(ptp_event_queue *queue, const ptp_event *event)
+{
+	uint32_t tail = queue->tail;
+	uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	
+	if (tail - head >= PTP_EVENT_QUEUE_SIZE)
+	{
+		__atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	
+	queue->events[tail & (PTP_EVENT_QUEUE_SIZE - 1)] = *event;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+	
+	eventfd_write(queue->fd, 1);
+}
+
+// Takes the oldest event, waiting up to 'timeout' ms for one (0 does not 
+// wait, negative waits forever). Returns PTP_ERROR_TIMEOUT if none arrived 
+// and PTP_ERROR_CANCELLED once 'stop' is set.
+static int ptp_event_queue_get(ptp_event_queue *queue, ptp_event *event, int timeout, volatile int *stop)
+{
+	struct pollfd pfd;
+	struct timespec ts_now, ts_end;
+	eventfd_t value;
+	uint32_t head, tail;
+	int wait_ms, r;
+	
+	if (timeout > 0)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &ts_end);
+		ts_end.tv_sec += timeout / 1000;
+		ts_end.tv_nsec += (long)(timeout % 1000) * 1000000;
+		
+		if (ts_end.tv_nsec >= 1000000000)
+		{
+			ts_end.tv_nsec -= 1000000000;
+			ts_end.tv_sec++;
+		}
+	}
+	
+	while (1)
+	{
+		if (stop && *stop)
+		{
+			return PTP_ERROR_CANCELLED;
+		}
+		
+		pthread_mutex_lock(&queue->mutex_get);
+		
+		head = queue->head;
+		tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+		
+		if (head != tail)
+		{
+			*event = queue->events[head & (PTP_EVENT_QUEUE_SIZE - 1)];
+			__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+			
+			pthread_mutex_unlock(&queue->mutex_get);
+			
+			// Another consumer may have cleared the counter for this one
+			if (head + 1 != tail)
+			{
+				eventfd_write(queue->fd, 1);
+			}
+			
+			return PTP_OK;
+		}
+		
+		pthread_mutex_unlock(&queue->mutex_get);
+		
+		if (timeout == 0)
+		{
+			return PTP_ERROR_TIMEOUT;
+		}
+		
+		wait_ms = -1;
+		
+		if (timeout > 0)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &ts_now);
+			
+			wait_ms = (int)((ts_end.tv_sec - ts_now.tv_sec) * 1000 + (ts_end.tv_nsec - ts_now.tv_nsec) / 1000000);
+			
+			if (wait_ms <= 0)
+			{
+				return PTP_ERROR_TIMEOUT;
+			}
+		}
+		
+		pfd.fd = queue->fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		
+		r = poll(&pfd, 1, wait_ms);
+		
+		if (r < 0 && errno != EINTR)
+		{
+			return PTP_ERROR_IO;
+		}
+		
+		if (r > 0)
+		{
+			eventfd_read(queue->fd, &value);
+		}
+	}
+}
+
+// Runs the user's event callback for every queued event, and the blocking 
+// work and async completions the libusb event thread hands over through 
+// dispatch_fd
+static void *ptp_event_dispatch_proc(void *p)
+{
+	ptp_device *dev = p;
+	ptp_event event;
+	struct pollfd pfd[2];
+	eventfd_t value;
+	nfds_t count;
+	
+	while (!__atomic_load_n(&dev->dispatch_stop, __ATOMIC_ACQUIRE))
+	{
+		// Handed over by ptp_async_complete(), releasing the pipe 
+		// afterwards restarts the queue
+		if (__atomic_load_n(&dev->resync_pending, __ATOMIC_ACQUIRE))
+		{
+			ptp_transact_acquire(dev);
+			ptp_transact_release(dev);
+		}
+		
+		ptp_async_dispatch(dev);
+		
+		if (dev->event_cb)
+		{
+			while (ptp_event_queue_get(&dev->event_queue, &event, 0, NULL) == PTP_OK)
+			{
+				dev->event_cb(dev, &event.params, dev->user_ctx);
+			}
+		}
+		
+		pfd[0].fd = dev->dispatch_fd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = dev->event_queue.fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		count = dev->event_cb ? 2 : 1;
+		
+		if (poll(pfd, count, -1) < 0 && errno != EINTR)
+		{
+			break;
+		}
+		
+		if (pfd[0].revents & POLLIN)
+		{
+			eventfd_read(dev->dispatch_fd, &value);
+		}
+		
+		if (pfd[1].revents & POLLIN)
+		{
+			eventfd_read(dev->event_queue.fd, &value);
+		}
+	}
+	
+	// Completions that came in after the last pass
+	ptp_async_dispatch(dev);
+	
+	return NULL;
+}
+
+// Started with the device when it has an event callback, otherwise by the 
+// first asynchronous transaction
+static int ptp_dispatch_start(ptp_device *dev)
+{
+	int ret;
+	
+	if (dev->thread_dispatch_valid)
+	{
+		return PTP_OK;
+	}
+	
+	ret = pthread_create(&dev->thread_dispatch, NULL, ptp_event_dispatch_proc, dev);
+	
+	if (ret)
+	{
+		fprintf(stderr, "pthread_create: %d: Could not start the event dispatcher\n", ret);
+		return PTP_ERROR_MEMORY;
+	}
+	
+	dev->thread_dispatch_valid = 1;
+	
+	return PTP_OK;
+}
+
+// Starts receiving events into the queue when no callback was given to 
+// ptp_device_init(), for use with ptp_event_get() and ptp_event_fd()
+int ptp_event_start(ptp_device *dev)
+{
+	if (!dev)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	// May be reached from several polling threads at once
+	if (__atomic_exchange_n(&dev->events_started, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		ptp_submit_event_transfers(dev);
+	}
+	
+	return PTP_OK;
+}
+
+int ptp_event_get(ptp_device *dev, ptp_event *event, int timeout)
+{
+	if (!dev || !event || dev->event_cb)
+	{
+		// Events already go to the callback
+		return PTP_ERROR_PARAM;
+	}
+	
+	return ptp_event_queue_get(&dev->event_queue, event, timeout, NULL);
+}
+
+// Becomes readable when events are queued
+int ptp_event_fd(const ptp_device *dev)
+{
+	return dev ? dev->event_queue.fd : -1;
+}
+
+uint64_t ptp_event_dropped(const ptp_device *dev)
+{
+	return dev ? __atomic_load_n(&dev->event_queue.dropped, __ATOMIC_RELAXED) : 0;
+}
+
+static void ptp_event_handle_data(ptp_device *dev, const void *buf, int length)
+{
+	uint32_t len;
+	ptp_event event;
+	const ptp_event_container *container;
+	int i;
+	
+	clock_gettime(CLOCK_MONOTONIC, &event.timestamp);
+	
+	container = buf;
+	
+	if (length < (int)sizeof(container->container))
+	{
+		return;
+	}
+	
+	ptp_trace(dev, PTP_TRACE_IN, &container->container, container->params, (uint32_t)length - sizeof(container->container));
+	
+	len = dtoh32(container->container.len);
+		
+	if (len != (uint32_t)length)
+	{
+		return;
+	}
+	
+	if (container->container.type != htod32(PTP_TYPE_EVENT))
+	{
+		return;
+	}
+	
+	event.params.code = dtoh16(container->container.code);
+	event.params.num_params = (len - sizeof(container->container)) / sizeof(container->params[0]);
+	
+	for (i = 0; i < event.params.num_params; i++)
+	{
+		event.params.params[i] = dtoh32(container->params[i]);
+	}
+	
+	ptp_event_queue_put(&dev->event_queue, &event);
+	
+	// With a callback the dispatcher owns the main queue, waiters get a copy
+	if (dev->event_cb && __atomic_load_n(&dev->wait_subscribers, __ATOMIC_ACQUIRE) > 0)
+	{
+		ptp_event_queue_put(&dev->wait_queue, &event);
+	}
+}
+
+// Called when a transfer leaves the pool for good
+static void ptp_event_transfer_retired(ptp_device *dev)
+{
+	if (__atomic_sub_fetch(&dev->event_inflight, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		dev->events_idle = 1;
+	}
+}
+
+static void ptp_event_transfer_callback(struct libusb_transfer *transfer)
+{
+	ptp_event_transfer *xfer = transfer->user_data;
+	
+	switch (transfer->status)
+	{
+	case LIBUSB_TRANSFER_CANCELLED:
+		ptp_event_transfer_retired(xfer->dev);
+		break;
+		
+	case LIBUSB_TRANSFER_COMPLETED:
+		ptp_event_handle_data(xfer->dev, xfer->buf, transfer->actual_length);
+		// Fall through and resubmit
+		
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_STALL:
+	case LIBUSB_TRANSFER_NO_DEVICE:
+	case LIBUSB_TRANSFER_OVERFLOW:
+	default:
+		if (libusb_submit_transfer(transfer) != 0)
+		{
+			ptp_event_transfer_retired(xfer->dev);
+		}
+		
+		break;
+	}
+}
+
+// The transfer slots and their buffers live in a single allocation
+static int ptp_alloc_event_transfers(ptp_device *dev)
+{
+	uint8_t *bufs;
+	uint32_t i;
+	
+	dev->event_xfers = calloc(1, dev->event_depth * (sizeof(ptp_event_transfer) + sizeof(ptp_event_container)));
+	
+	if (!dev->event_xfers)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	bufs = (uint8_t *)(dev->event_xfers + dev->event_depth);
+	
+	for (i = 0; i < dev->event_depth; i++)
+	{
+		dev->event_xfers[i].dev = dev;
+		dev->event_xfers[i].buf = bufs + i * sizeof(ptp_event_container);
+		dev->event_xfers[i].xfer = libusb_alloc_transfer(0);
+		
+		if (!dev->event_xfers[i].xfer)
+		{
+			return PTP_ERROR_MEMORY;
+		}
+	}
+	
+	return PTP_OK;
+}
+
+static void ptp_free_event_transfers(ptp_device *dev)
+{
+	uint32_t i;
+	
+	if (!dev->event_xfers)
+	{
+		return;
+	}
+	
+	for (i = 0; i < dev->event_depth; i++)
+	{
+		libusb_free_transfer(dev->event_xfers[i].xfer);
+	}
+	
+	free(dev->event_xfers);
+	dev->event_xfers = NULL;
+}
+
+// Transports without the interrupt transfer pool are read from a thread
+static void *ptp_event_reader_proc(void *p)
+{
+	ptp_device *dev = p;
+	ptp_event_container container;
+	int r, transferred;
+	
+	while (!__atomic_load_n(&dev->event_reader_stop, __ATOMIC_RELAXED))
+	{
+		transferred = 0;
+		r = dev->transport->event(dev, &container, sizeof(container), &transferred, PTP_EVENT_READ_TIMEOUT);
+		
+		if (r == 0)
+		{
+			ptp_event_handle_data(dev, &container, transferred);
+		}
+		else if (r == LIBUSB_ERROR_NO_DEVICE)
+		{
+			break;
+		}
+		else if (r != LIBUSB_ERROR_TIMEOUT)
+		{
+			usleep(PTP_EVENT_READ_TIMEOUT * 1000);
+		}
+	}
+	
+	return NULL;
+}
+
+static void ptp_submit_event_transfers(ptp_device *dev)
+{
+	ptp_event_transfer *xfer;
+	uint32_t i;
+	int r;
+	
+	if (!dev->usbdev)
+	{
+		if (dev->transport->event && !dev->event_reader_valid)
+		{
+			dev->event_reader_stop = 0;
+			r = pthread_create(&dev->thread_event_reader, NULL, ptp_event_reader_proc, dev);
+			dev->event_reader_valid = (r == 0);
+			
+			if (r)
+			{
+				fprintf(stderr, "[ptp_submit_event_transfers] pthread_create: %d\n", r);
+			}
+		}
+		
+		return;
+	}
+	
+	if (ptp_alloc_event_transfers(dev) != PTP_OK)
+	{
+		fprintf(stderr, "[ptp_submit_event_transfers] PTP_ERROR_MEMORY\n");
+		ptp_free_event_transfers(dev);
+		return;
+	}
+	
+	dev->events_idle = 0;
+	__atomic_add_fetch(&dev->event_inflight, 1, __ATOMIC_ACQ_REL);
+	
+	for (i = 0; i < dev->event_depth; i++)
+	{
+		xfer = &dev->event_xfers[i];
+		
+		libusb_fill_interrupt_transfer(
+			xfer->xfer, 
+			dev->usbdev, 
+			dev->ep_event, 
+			xfer->buf, 
+			sizeof(ptp_event_container), 
+			ptp_event_transfer_callback, 
+			xfer, 
+			0
+		);
+		
+		__atomic_add_fetch(&dev->event_inflight, 1, __ATOMIC_ACQ_REL);
+		
+		if (libusb_submit_transfer(xfer->xfer) != 0)
+		{
+			__atomic_sub_fetch(&dev->event_inflight, 1, __ATOMIC_ACQ_REL);
+		}
+	}
+	
+	// Drop the reference that kept the pool from looking idle while submitting
+	ptp_event_transfer_retired(dev);
+}
+
+// Cancels the whole pool at once and waits for all completions together
+static void ptp_cancel_event_transfers(ptp_device *dev)
+{
+	uint32_t i;
+	
+	if (dev->event_reader_valid)
+	{
+		__atomic_store_n(&dev->event_reader_stop, 1, __ATOMIC_RELAXED);
+		pthread_join(dev->thread_event_reader, NULL);
+		dev->event_reader_valid = 0;
+	}
+	
+	if (!dev->event_xfers)
+	{
+		return;
+	}
+	
+	for (i = 0; i < dev->event_depth; i++)
+	{
+		libusb_cancel_transfer(dev->event_xfers[i].xfer);
+	}
+	
+	while (!dev->events_idle)
+	{
+		libusb_handle_events_completed(dev->usbctx, &dev->events_idle);
+	}
+	
+	ptp_free_event_transfers(dev);
+}
+
+// Changes the number of event transfers kept in flight, restarting the 
+// pool if it is running. Call from the thread that owns the device.
+int ptp_set_event_depth(ptp_device *dev, uint32_t depth)
+{
+	if (!dev || depth < 1 || depth > PTP_EVENT_TRANSFER_MAX)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	if (depth == dev->event_depth)
+	{
+		return PTP_OK;
+	}
+	
+	if (dev->event_xfers)
+	{
+		ptp_cancel_event_transfers(dev);
+		dev->event_depth = depth;
+		ptp_submit_event_transfers(dev);
+	}
+	else
+	{
+		dev->event_depth = depth;
+	}
+	
+	return PTP_OK;
+}
+
+// Based on libusb-1.0.19/libusb/sync.c
+static void LIBUSB_CALL ptp_bulk_callback(struct libusb_transfer *transfer)
+{
+	int *completed = transfer->user_data;
+	*completed = 1;
+}
+
+// Based on libusb-1.0.19/libusb/sync.c
+static void ptp_transfer_wait_for_completion(ptp_device *dev, struct libusb_transfer *xfer, int *completed)
+{
+	int r;
+
+	while (!*completed) {
+		r = libusb_handle_events_completed(dev->usbctx, completed);
+		if (r < 0) {
+			if (r == LIBUSB_ERROR_INTERRUPTED)
+				continue;
+			libusb_cancel_transfer(xfer);
+			continue;
+		}
+	}
+}
+
+// Based on libusb-1.0.19/libusb/sync.c
+static int ptp_transfer_status(struct libusb_transfer *xfer)
+{
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_IO;
+	default:
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
+static int ptp_prepost_arm(ptp_device *dev, void *buf, int length)
+{
+	unsigned int timeout;
+	int r;
+	
+	if (!dev->prepost || dev->prepost_buf || !dev->prepost_xfer)
+	{
+		return PTP_OK;
+	}
+	
+	r = ptp_transfer_timeout(dev, &timeout);
+	
+	if (r < 0)
+	{
+		return r;
+	}
+	
+	libusb_fill_bulk_transfer(dev->prepost_xfer, dev->usbdev, dev->ep_in, buf, length, ptp_bulk_callback, &dev->prepost_completed, timeout);
+	
+	dev->prepost_completed = 0;
+	r = libusb_submit_transfer(dev->prepost_xfer);
+	
+	if (r < 0)
+	{
+		// Not fatal, the read is simply done the regular way
+		dev->prepost_completed = 1;
+		return r;
+	}
+	
+	dev->prepost_buf = buf;
+	
+	return PTP_OK;
+}
+
+// Collects the pre-posted transfer if it was armed for this buffer
+static int ptp_prepost_collect(ptp_device *dev, void *buf, int length, int *transferred, int *retval)
+{
+	if (!dev->prepost_buf || dev->prepost_buf != buf || dev->prepost_xfer->length != length)
+	{
+		return 0;
+	}
+	
+	ptp_transfer_wait_for_completion(dev, dev->prepost_xfer, &dev->prepost_completed);
+	dev->prepost_buf = NULL;
+	
+	*transferred = dev->prepost_xfer->actual_length;
+	*retval = ptp_transfer_status(dev->prepost_xfer);
+	
+	return 1;
+}
+
+// Called at the end of every transaction, a transfer is only still armed here on failure
+static void ptp_prepost_cancel(ptp_device *dev)
+{
+	if (!dev->prepost_buf)
+	{
+		return;
+	}
+	
+	libusb_cancel_transfer(dev->prepost_xfer);
+	ptp_transfer_wait_for_completion(dev, dev->prepost_xfer, &dev->prepost_completed);
+	dev->prepost_buf = NULL;
+}
+
+// A data phase that ends on a packet boundary is terminated by a zero-length 
+// packet, which then shows up in front of the response
+static void ptp_zlp_seen(ptp_device *dev)
+{
+	if (dev->expect_zlp)
+	{
+		dev->expect_zlp = 0;
+	}
+	else
+	{
+		fprintf(stderr, "WARNING: Detected zero-length packet\n");
+	}
+}
+
+// Based on libusb-1.0.19/libusb/sync.c
+static int ptp_usb_bulk(ptp_device *dev, unsigned char endpoint, void *data, int length, int *transferred, unsigned int timeout)
+{
+	int completed = 0;
+	int r;
+	
+	if (!dev->bulk_xfer)
+	{
+		return libusb_bulk_transfer(dev->usbdev, endpoint, data, length, transferred, timeout);
+	}
+	
+	libusb_fill_bulk_transfer(dev->bulk_xfer, dev->usbdev, endpoint, data, length, ptp_bulk_callback, &completed, timeout);
+	dev->bulk_xfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+	
+	// A container that ends on a packet boundary must be terminated by a zero-length packet
+	if (!(endpoint & LIBUSB_ENDPOINT_IN) && length > 0 && (length % dev->max_packet_out) == 0)
+	{
+		dev->bulk_xfer->flags |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+	}
+	else
+	{
+		dev->bulk_xfer->flags &= ~LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+	}
+	
+	completed = 0;
+	r = libusb_submit_transfer(dev->bulk_xfer);
+	
+	if (r < 0)
+	{
+		return r;
+	}
+	
+	ptp_transfer_wait_for_completion(dev, dev->bulk_xfer, &completed);
+	
+	*transferred = dev->bulk_xfer->actual_length;
+	
+	return ptp_transfer_status(dev->bulk_xfer);
+}
+
+static int ptp_usb_control(ptp_device *dev, uint8_t request_type, uint8_t request, uint16_t value, void *data, uint16_t length, unsigned int timeout)
+{
+	return libusb_control_transfer(dev->usbdev, request_type, request, value, dev->interface, data, length, timeout);
+}
+
+static int ptp_usb_clear_halt(ptp_device *dev, unsigned char endpoint)
+{
+	return libusb_clear_halt(dev->usbdev, endpoint);
+}
+
+// Called with mutex_transact held
+static void ptp_usb_cancel(ptp_device *dev)
+{
+	int i;
+	
+	// Transfers that are not in flight just report LIBUSB_ERROR_NOT_FOUND
+	libusb_cancel_transfer(dev->bulk_xfer);
+	libusb_cancel_transfer(dev->prepost_xfer);
+	libusb_cancel_transfer(dev->async_xfer);
+	
+	for (i = 0; i < PTP_PIPELINE_MAX_DEPTH; i++)
+	{
+		libusb_cancel_transfer(dev->pipeline[i].xfer);
+	}
+}
+
+// Only the application's loop pumps an external context, and that may well 
+// be the thread waiting here
+static int ptp_usb_handle_events(ptp_device *dev, unsigned int timeout)
+{
+	const usb_device_handle *usbdev = dev->transport_ctx;
+	struct timeval tv;
+	
+	if (!usbdev || usbdev->ctx->mode != USB_EVENTS_EXTERNAL)
+	{
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	
+	return libusb_handle_events_timeout_completed(dev->usbctx, &tv, NULL);
+}
+
+static void ptp_usb_close(ptp_device *dev)
+{
+	ptp_free_pipeline(dev);
+	libusb_free_transfer(dev->prepost_xfer);
+	libusb_free_transfer(dev->async_xfer);
+	libusb_free_transfer(dev->bulk_xfer);
+	dev->prepost_xfer = NULL;
+	dev->async_xfer = NULL;
+	dev->bulk_xfer = NULL;
+	libusb_release_interface(dev->usbdev, dev->interface);
+}
+
+static int ptp_usb_open(ptp_device *dev)
+{
+	usb_device_handle *usbdev = dev->transport_ctx;
+	int ret;
+	
+	if (!usbdev)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	dev->usbdev = usbdev->handle;
+	dev->usbctx = usbdev->ctx->ctx;
+	
+	ptp_find_endpoints(dev);
+	
+	ret = libusb_claim_interface(dev->usbdev, dev->interface);
+	
+	if (ret < 0)
+	{
+		fprintf(stderr, "libusb_claim_interface: %d: Could not claim interface %d\n", ret, dev->interface);
+		return ret;
+	}
+	
+	dev->bulk_xfer = libusb_alloc_transfer(0);
+	dev->async_xfer = libusb_alloc_transfer(0);
+	dev->prepost_xfer = libusb_alloc_transfer(0);
+	
+	if (!dev->bulk_xfer || !dev->async_xfer || !dev->prepost_xfer || ptp_alloc_pipeline(dev) != PTP_OK)
+	{
+		ptp_usb_close(dev);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	
+	return PTP_OK;
+}
+
+// Events come from the interrupt transfer pool rather than 'event', and the 
+// pre-posted, pipelined and asynchronous transfers go to libusb directly
+const ptp_transport ptp_transport_usb = {
+	"usb",
+	ptp_usb_open,
+	ptp_usb_close,
+	ptp_usb_bulk,
+	ptp_usb_control,
+	NULL,
+	ptp_usb_clear_halt,
+	ptp_usb_cancel,
+	ptp_usb_handle_events
+};
+
+static int ptp_bulk_transfer_once(ptp_device *dev, unsigned char endpoint, void *data, int length, int *transferred)
+{
+	unsigned int timeout;
+	int r;
+	
+	r = ptp_transfer_timeout(dev, &timeout);
+	
+	if (r < 0)
+	{
+		return r;
+	}
+	
+	return dev->transport->bulk(dev, endpoint, data, length, transferred, timeout);
+}
+
+static int ptp_control(ptp_device *dev, uint8_t request_type, uint8_t request, void *data, uint16_t length)
+{
+	return dev->transport->control(dev, request_type, request, 0, data, length, PTP_CONTROL_TIMEOUT);
+}
+
+static void ptp_clear_halt(ptp_device *dev, unsigned char endpoint)
+{
+	if (dev->transport->clear_halt)
+	{
+		dev->transport->clear_halt(dev, endpoint);
+	}
+}
+
+static int ptp_bulk_transfer(ptp_device *dev, unsigned char endpoint, void *data, int length, int *transferred)
+{
+	int r;
+	
+	if (!transferred)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	if (endpoint & 0x80)
+	{
+		// IN endpoint
+		
+		if (ptp_prepost_collect(dev, data, length, transferred, &r))
+		{
+			if (r != 0 || *transferred != 0)
+			{
+				return r;
+			}
+			
+			ptp_zlp_seen(dev);
+		}
+		
+		do
+		{
+			*transferred = 0;
+			r = ptp_bulk_transfer_once(dev, endpoint, data, length, transferred);
+			
+			if (r == 0 && *transferred == 0)
+			{
+				ptp_zlp_seen(dev);
+			}
+		}
+		while (r == 0 && *transferred == 0);
+		
+		dev->expect_zlp = 0;
+		
+		return r;
+	}
+	else
+	{
+		// OUT endpoint
+		
+		return ptp_bulk_transfer_once(dev, endpoint, data, length, transferred);
+	}
+}
+
+static void LIBUSB_CALL ptp_pipeline_callback(struct libusb_transfer *transfer)
+{
+	ptp_pipeline_slot *slot = transfer->user_data;
+	slot->completed = 1;
+}
+
+static int ptp_pipeline_alloc_buffers(ptp_device *dev)
+{
+	size_t size = (size_t)dev->pipeline_depth * dev->pipeline_chunk_size;
+	
+	if (dev->pipeline_buf && dev->pipeline_buf_size >= size)
+	{
+		return PTP_OK;
+	}
+	
+	free(dev->pipeline_buf);
+	dev->pipeline_buf_size = 0;
+	dev->pipeline_buf = malloc(size);
+	
+	if (!dev->pipeline_buf)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	dev->pipeline_buf_size = size;
+	
+	return PTP_OK;
+}
+
+// Transports without the transfer ring read the data phase one chunk at a 
+// time, with the same semantics as ptp_pipeline_read()
+static int ptp_chunked_read(ptp_device *dev, uint8_t *dst, uint32_t length, const ptp_data_sink *sink, int *sink_result)
+{
+	uint32_t received, chunk;
+	uint8_t *target;
+	int r, transferred;
+	
+	if (!dst)
+	{
+		r = ptp_pipeline_alloc_buffers(dev);
+		
+		if (r != PTP_OK)
+		{
+			return r;
+		}
+	}
+	
+	for (received = 0; received < length; received += (uint32_t)transferred)
+	{
+		chunk = length - received;
+		
+		if (chunk > dev->pipeline_chunk_size)
+		{
+			chunk = dev->pipeline_chunk_size;
+		}
+		
+		target = dst ? dst + received : (uint8_t *)dev->pipeline_buf;
+		transferred = 0;
+		
+		r = ptp_bulk_transfer(dev, dev->ep_in, target, (int)chunk, &transferred);
+		
+		if (r != 0)
+		{
+			fprintf(stderr, "[ptp_chunked_read] Transfer failed: %d, received=%u, length=%u\n", r, received, length);
+			return r;
+		}
+		
+		if ((uint32_t)transferred != chunk)
+		{
+			fprintf(stderr, "[ptp_chunked_read] Short transfer: actual=%d, requested=%u\n", transferred, chunk);
+			return PTP_ERROR_DATA_LEN;
+		}
+		
+		if (sink && *sink_result == PTP_OK)
+		{
+			*sink_result = sink->write(dev, target, (uint32_t)transferred, sink->ctx);
+		}
+	}
+	
+	return PTP_OK;
+}
+
+// Reads exactly 'length' bytes from the bulk IN endpoint, keeping up to 
+// pipeline_depth transfers of pipeline_chunk_size bytes in flight at once.
+// Bulk transfers on the same endpoint complete in submission order, so the 
+// oldest slot in the ring is always the next one to retire.
+// If 'dst' is set, the data is received straight into it. Otherwise each 
+// slot receives into its own ring buffer and is handed to the sink as it 
+// retires. A failing sink is not called again but the data phase is still 
+// drained to keep the pipe in sync; its error is stored in 'sink_result'.
+static int ptp_pipeline_read(ptp_device *dev, uint8_t *dst, uint32_t length, const ptp_data_sink *sink, int *sink_result)
+{
+	uint32_t depth, submitted, received, chunk;
+	uint32_t head, inflight, index, i;
+	ptp_pipeline_slot *slot;
+	uint8_t *target;
+	unsigned int timeout;
+	int r, retval;
+	
+	if (!dev->pipeline[0].xfer)
+	{
+		return ptp_chunked_read(dev, dst, length, sink, sink_result);
+	}
+	
+	depth = dev->pipeline_depth;
+	
+	if (!dst)
+	{
+		retval = ptp_pipeline_alloc_buffers(dev);
+		
+		if (retval != PTP_OK)
+		{
+			return retval;
+		}
+	}
+	
+	submitted = 0;
+	received = 0;
+	head = 0;
+	inflight = 0;
+	retval = PTP_OK;
+	
+	while (inflight > 0 || (retval == PTP_OK && submitted < length))
+	{
+		// Keep the ring full
+		while (retval == PTP_OK && inflight < depth && submitted < length)
+		{
+			index = (head + inflight) % depth;
+			slot = &dev->pipeline[index];
+			chunk = length - submitted;
+			
+			if (chunk > dev->pipeline_chunk_size)
+			{
+				chunk = dev->pipeline_chunk_size;
+			}
+			
+			if (dst)
+			{
+				target = dst + submitted;
+			}
+			else
+			{
+				target = ((uint8_t *)dev->pipeline_buf) + (size_t)index * dev->pipeline_chunk_size;
+			}
+			
+			r = ptp_transfer_timeout(dev, &timeout);
+			
+			if (r < 0)
+			{
+				retval = r;
+				break;
+			}
+			
+			libusb_fill_bulk_transfer(slot->xfer, dev->usbdev, dev->ep_in, target, (int)chunk, ptp_pipeline_callback, slot, timeout);
+			slot->completed = 0;
+			
+			r = libusb_submit_transfer(slot->xfer);
+			
+			if (r < 0)
+			{
+				slot->completed = 1;
+				fprintf(stderr, "[ptp_pipeline_read] libusb_submit_transfer: %d\n", r);
+				retval = r;
+				break;
+			}
+			
+			submitted += chunk;
+			inflight++;
+		}
+		
+		if (inflight == 0)
+		{
+			break;
+		}
+		
+		// Retire the oldest transfer
+		slot = &dev->pipeline[head];
+		ptp_transfer_wait_for_completion(dev, slot->xfer, &slot->completed);
+		
+		head = (head + 1) % depth;
+		inflight--;
+		
+		if (retval != PTP_OK)
+		{
+			continue;
+		}
+		
+		r = ptp_transfer_status(slot->xfer);
+		
+		if (r != 0)
+		{
+			fprintf(stderr, "[ptp_pipeline_read] Transfer failed: %d, received=%u, length=%u\n", r, received, length);
+			retval = r;
+		}
+		else if (slot->xfer->actual_length != slot->xfer->length)
+		{
+			fprintf(stderr, "[ptp_pipeline_read] Short transfer: actual=%d, requested=%d\n", slot->xfer->actual_length, slot->xfer->length);
+			retval = PTP_ERROR_DATA_LEN;
+		}
+		else
+		{
+			received += (uint32_t)slot->xfer->actual_length;
+			
+			if (sink && *sink_result == PTP_OK)
+			{
+				*sink_result = sink->write(dev, slot->xfer->buffer, (uint32_t)slot->xfer->actual_length, sink->ctx);
+			}
+			
+			continue;
+		}
+		
+		// Abort everything still in flight, the loop drains the completions
+		for (i = 0; i < inflight; i++)
+		{
+			libusb_cancel_transfer(dev->pipeline[(head + i) % depth].xfer);
+		}
+	}
+	
+	return retval;
+}
+
+static int ptp_send(ptp_device *dev, void *data, int size)
+{
+	int retval, i, transferred;
+	
+	for (i = 0; i < PTP_RETRY_COUNT; i++)
+	{
+		retval = ptp_bulk_transfer(dev, dev->ep_out, data, size, &transferred);
+		
+		if (retval == LIBUSB_ERROR_PIPE)
+		{
+			ptp_clear_halt(dev, dev->ep_out);
+			
+			if (i == PTP_RETRY_COUNT - 1)
+			{
+				fprintf(stderr, "[ptp_send] ptp_bulk_transfer: LIBUSB_ERROR_PIPE\n");
+				return retval;
+			}
+			
+			__atomic_add_fetch(&dev->send_retries, 1, __ATOMIC_RELAXED);
+		}
+		else if (retval != 0)
+		{
+			fprintf(stderr, "[ptp_send] ptp_bulk_transfer: %d\n", retval);
+			return retval;
+		}
+		else
+		{
+			break;
+		}
+	}
+	
+	return PTP_OK;
+}
+
+int ptp_send_command(ptp_device *dev, const ptp_params *params)
+{
+	ptp_command_container command;
+	uint32_t i;
+	int size, retval;
+	
+	if (!dev || !params || params->num_params > PTP_MAX_PARAMS)
+	{
+		fprintf(stderr, "[ptp_send_command] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	size = sizeof(ptp_container) + params->num_params * sizeof(uint32_t);
+	
+	command.container.len = htod32((uint32_t)size);
+	command.container.type = htod16(PTP_TYPE_COMMAND);
+	command.container.code = htod16(params->code);
+	command.container.transaction_id = htod32(dev->transaction_id);
+	
+	for (i = 0; i < params->num_params; i++)
+	{
+		command.params[i] = htod32(params->params[i]);
+	}
+	
+	retval = ptp_send(dev, &command, size);
+	
+	if (retval == PTP_OK)
+	{
+		ptp_trace(dev, PTP_TRACE_OUT, &command.container, command.params, size - sizeof(ptp_container));
+	}
+	
+	return retval;
+}
+
+// Returns where the payload of the next data-out phase goes, right after 
+// the header slot of the device's transmit buffer. Callers can encode the 
+// payload there directly and pass the pointer as data_out to ptp_transact().
+void *ptp_get_send_payload(ptp_device *dev, uint32_t size)
+{
+	size_t needed;
+	
+	if (!dev)
+	{
+		return NULL;
+	}
+	
+	needed = sizeof(ptp_container) + (size_t)size;
+	
+	if (needed > dev->send_size)
+	{
+		void *buf = realloc(dev->send_buf, needed);
+		
+		if (!buf)
+		{
+			return NULL;
+		}
+		
+		dev->send_buf = buf;
+		dev->send_size = needed;
+	}
+	
+	return ((ptp_container *)dev->send_buf) + 1;
+}
+
+int ptp_send_data(ptp_device *dev, uint16_t code, const void *data, int size)
+{
+	ptp_container *container;
+	void *payload;
+	int retval;
+	
+	if (!dev || !data || size < 0)
+	{
+		fprintf(stderr, "[ptp_send_data] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	if (data != ((ptp_container *)dev->send_buf) + 1)
+	{
+		// Not encoded in place, copy the payload into the transmit buffer
+		payload = ptp_get_send_payload(dev, (uint32_t)size);
+		
+		if (!payload)
+		{
+			fprintf(stderr, "[ptp_send_data] Invalid container: PTP_ERROR_MEMORY\n");
+			return PTP_ERROR_MEMORY;
+		}
+		
+		memcpy(payload, data, size);
+	}
+	
+	container = dev->send_buf;
+	size += sizeof(ptp_container);
+	
+	container->len = htod32((uint32_t)size);
+	container->type = htod16(PTP_TYPE_DATA);
+	container->code = htod16(code);
+	container->transaction_id = htod32(dev->transaction_id);
+	
+	retval = ptp_send(dev, container, size);
+	
+	if (retval == PTP_OK)
+	{
+		ptp_trace(dev, PTP_TRACE_OUT, container, container + 1, size - sizeof(ptp_container));
+	}
+	
+	return retval;
+}
+
+int ptp_recv_response(ptp_device *dev, ptp_params *params)
+{
+	int retval, transferred;
+	ptp_response_container *response;
+	
+	if (!dev || !params)
+	{
+		fprintf(stderr, "[ptp_recv_response] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	// Received into recv_buf so that it can be pre-posted with the command
+	response = dev->recv_buf;
+	
+	// Read a whole packet so that a stray oversized container cannot overflow the transfer
+	retval = ptp_bulk_transfer(dev, dev->ep_in, response, dev->max_packet_in, &transferred);
+	
+	// A timeout with nothing received is reported as such, so that the 
+	// transaction gets cancelled rather than treated as a transport error
+	if (retval != 0 && (retval != LIBUSB_ERROR_TIMEOUT || transferred == 0))
+	{
+		fprintf(stderr, "[ptp_recv_response] ptp_bulk_transfer: %d\n", retval);
+		return retval;
+	}
+	
+	return ptp_decode_response(dev, response, transferred, retval, params);
+}
+
+static int ptp_decode_response(ptp_device *dev, const ptp_response_container *response, int transferred, int retval, ptp_params *params)
+{
+	uint32_t len, i;
+	
+	if (transferred >= (int)sizeof(response->container))
+	{
+		ptp_trace(dev, PTP_TRACE_IN, &response->container, response->params, 
+			(uint32_t)((transferred < (int)sizeof(*response)) ? transferred : (int)sizeof(*response)) - sizeof(response->container));
+	}
+	
+	if (transferred < sizeof(response->container))
+	{
+		fprintf(stderr, "[ptp_recv_response] Data length too short: transferred=%d, retval=%d\n", transferred, retval);
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	if (transferred > sizeof(ptp_response_container))
+	{
+		fprintf(stderr, "[ptp_recv_response] Response too long: transferred=%d\n", transferred);
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	len = dtoh32(response->container.len);
+	
+	if (len != (uint32_t)transferred)
+	{
+		fprintf(stderr, "[ptp_recv_response] Transfer length mismatch: transferred=%d, expected=%u, retval=%d\n", transferred, len, retval);
+		return retval ? retval : PTP_ERROR_DATA_LEN;
+	}
+	
+	if (dtoh32(response->container.transaction_id) != dev->transaction_id)
+	{
+		fprintf(stderr, "[ptp_recv_response] PTP_ERROR_CONTAINER_ID\n");
+		return PTP_ERROR_TRANSACTION_ID;
+	}
+	
+	if (response->container.type != htod32(PTP_TYPE_RESPONSE))
+	{
+		fprintf(stderr, "[ptp_recv_response] PTP_ERROR_CONTAINER_TYPE\n");
+		return PTP_ERROR_CONTAINER_TYPE;
+	}
+	
+	params->code = dtoh16(response->container.code);
+	params->num_params = (len - sizeof(response->container)) / sizeof(response->params[0]);
+	
+	for (i = 0; i < params->num_params; i++)
+	{
+		params->params[i] = dtoh32(response->params[i]);
+	}
+	
+	return PTP_OK;
+}
+
+// Receives the first chunk of a data phase into 'container' and validates its header
+static int ptp_recv_data_header(ptp_device *dev, ptp_container *container, int *transferred, uint32_t *len)
+{
+	int retval;
+	
+	if (!container)
+	{
+		fprintf(stderr, "[ptp_recv_data] Invalid container (PTP_ERROR_MEMORY)\n");
+		return PTP_ERROR_MEMORY;
+	}
+	
+	retval = ptp_bulk_transfer(dev, dev->ep_in, container, dev->recv_size, transferred);
+	
+	if (retval != 0 && retval != LIBUSB_ERROR_TIMEOUT)
+	{
+		fprintf(stderr, "[ptp_recv_data] ptp_bulk_transfer: %d\n", retval);
+		return retval;
+	}
+	
+	// The device may skip the data phase and answer with a response right 
+	// away, usually to reject the operation. The pipe is still in sync.
+	if (*transferred >= (int)sizeof(ptp_container) && 
+		container->type == htod16(PTP_TYPE_RESPONSE) && 
+		dtoh32(container->len) == (uint32_t)*transferred)
+	{
+		*len = (uint32_t)*transferred;
+		return PTP_ERROR_NO_DATA;
+	}
+	
+	return ptp_check_data_header(dev, container, *transferred, retval, len);
+}
+
+static int ptp_check_data_header(ptp_device *dev, const ptp_container *container, int transferred, int retval, uint32_t *len)
+{
+	if (transferred < sizeof(ptp_container))
+	{
+		fprintf(stderr, "[ptp_recv_data] Data length too short: transferred=%d, retval=%d\n", transferred, retval);
+		return retval ? retval : PTP_ERROR_DATA_LEN;
+	}
+	
+	*len = dtoh32(container->len);
+	
+	if (*len > transferred && transferred < dev->recv_size)
+	{
+		fprintf(stderr, "[ptp_recv_data] Early termination: transferred=%d, len=%d, retval=%d\n", transferred, *len, retval);
+		return retval ? retval : PTP_ERROR_DATA_LEN;
+	}
+	
+	if (*len < sizeof(ptp_container) || transferred > *len)
+	{
+		fprintf(stderr, "[ptp_recv_data] Invalid container length: transferred=%d, len=%u\n", transferred, *len);
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	if (dtoh32(container->transaction_id) != dev->transaction_id)
+	{
+		fprintf(stderr, "[ptp_recv_data] Transaction ID mismatch: transaction_id=0x%08x, expected=0x%08x\n", dtoh32(container->transaction_id), dev->transaction_id);
+		return PTP_ERROR_TRANSACTION_ID;
+	}
+	
+	if (container->type != htod32(PTP_TYPE_DATA))
+	{
+		fprintf(stderr, "[ptp_recv_data] PTP_ERROR_CONTAINER_TYPE\n");
+		return PTP_ERROR_CONTAINER_TYPE;
+	}
+	
+	ptp_recv_history_add(dev, dtoh16(container->code), *len);
+	
+	dev->data_phases++;
+	
+	// Read from other threads for aggregate throughput
+	__atomic_add_fetch(&dev->bytes_in, *len - sizeof(ptp_container), __ATOMIC_RELAXED);
+	
+	if (*len > transferred)
+	{
+		dev->second_transfers++;
+	}
+	
+	return PTP_OK;
+}
+
+static void ptp_recv_data_done(ptp_device *dev, timer *tm, uint32_t len)
+{
+	struct timeval tv;
+	
+	timer_stop(tm);
+	timer_elapsed(tm, &tv);
+	
+	dev->last_data.bytes = len;
+	dev->last_data.usec = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	
+	dev->expect_zlp = (len % dev->max_packet_in) == 0;
+}
+
+int ptp_recv_data(ptp_device *dev, void **data)
+{
+	int retval, transferred, buf_size;
+	uint32_t len;
+	uint8_t *buf;
+	timer tm;
+	
+	if (!dev || !data)
+	{
+		fprintf(stderr, "[ptp_recv_data] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	timer_start(&tm);
+	
+	retval = ptp_recv_data_header(dev, dev->recv_buf, &transferred, &len);
+	
+	if (retval != PTP_OK)
+	{
+		return retval;
+	}
+	
+	buf_size = len - sizeof(ptp_container);
+	buf = malloc(buf_size);
+	
+	if (!buf)
+	{
+		fprintf(stderr, "[ptp_recv_data] Could not allocate buffer (PTP_ERROR_MEMORY)\n");
+		return PTP_ERROR_MEMORY;
+	}
+	
+	memcpy(buf, ((ptp_container *)dev->recv_buf) + 1, transferred - sizeof(ptp_container));
+	
+	if (len > transferred)
+	{
+		uint32_t remaining = len - (uint32_t)transferred;
+		
+		retval = ptp_pipeline_read(dev, buf + transferred - sizeof(ptp_container), remaining, NULL, NULL);
+		
+		if (retval != PTP_OK)
+		{
+			free(buf);
+			fprintf(stderr, "[ptp_recv_data] ptp_pipeline_read: %d\n", retval);
+			return retval;
+		}
+	}
+	
+	ptp_recv_data_done(dev, &tm, len);
+	ptp_trace(dev, PTP_TRACE_IN, dev->recv_buf, buf, buf_size);
+	
+	*data = buf;
+	return buf_size;
+}
+
+// Streams a data phase into a sink, returns the payload size.
+// The sink's own result is reported separately through 'sink_result'.
+int ptp_recv_data_stream(ptp_device *dev, const ptp_data_sink *sink, int *sink_result)
+{
+	int retval, transferred;
+	uint32_t len;
+	timer tm;
+	
+	if (!dev || !sink || !sink->write || !sink_result)
+	{
+		fprintf(stderr, "[ptp_recv_data_stream] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	*sink_result = PTP_OK;
+	
+	timer_start(&tm);
+	
+	retval = ptp_recv_data_header(dev, dev->recv_buf, &transferred, &len);
+	
+	if (retval != PTP_OK)
+	{
+		return retval;
+	}
+	
+	if (sink->begin)
+	{
+		*sink_result = sink->begin(dev, len - sizeof(ptp_container), sink->ctx);
+	}
+	
+	if (*sink_result == PTP_OK && transferred > sizeof(ptp_container))
+	{
+		*sink_result = sink->write(dev, ((ptp_container *)dev->recv_buf) + 1, transferred - sizeof(ptp_container), sink->ctx);
+	}
+	
+	if (len > transferred)
+	{
+		retval = ptp_pipeline_read(dev, NULL, len - (uint32_t)transferred, sink, sink_result);
+		
+		if (retval != PTP_OK)
+		{
+			fprintf(stderr, "[ptp_recv_data_stream] ptp_pipeline_read: %d\n", retval);
+			return retval;
+		}
+	}
+	
+	ptp_recv_data_done(dev, &tm, len);
+	
+	// Streamed payloads are not kept, only what came with the header is traced
+	ptp_trace(dev, PTP_TRACE_IN, dev->recv_buf, ((ptp_container *)dev->recv_buf) + 1, transferred - sizeof(ptp_container));
+	
+	return (int)(len - sizeof(ptp_container));
+}
+
+static size_t ptp_page_size(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	
+	return (page > 0) ? (size_t)page : 4096;
+}
+
+// Room for the largest first read of a data phase, in whole pages
+static size_t ptp_buffer_headroom(void)
+{
+	size_t page = ptp_page_size();
+	
+	return ((PTP_RECV_SIZE_MAX + page - 1) / page) * page;
+}
+
+static uint8_t *ptp_buffer_aligned(const ptp_buffer *buf)
+{
+	return ((uint8_t *)buf->base) + ptp_buffer_headroom();
+}
+
+// Allocates the backing store of a buffer: the headroom followed by 'size' 
+// bytes starting on a page boundary. usbfs device memory is used when 
+// available so the host controller can DMA into it without a bounce buffer.
+static int ptp_buffer_alloc_base(ptp_device *dev, ptp_buffer *buf, size_t size)
+{
+	size_t page = ptp_page_size();
+	size_t capacity = ptp_buffer_headroom() + ((size + page - 1) / page) * page;
+	
+	buf->devmem = 0;
+	buf->base = NULL;
+	
+	#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (dev->usbdev)
+	{
+		buf->base = libusb_dev_mem_alloc(dev->usbdev, capacity);
+		
+		if (buf->base)
+		{
+			buf->devmem = 1;
+		}
+	}
+	#endif
+	
+	if (!buf->base && posix_memalign(&buf->base, page, capacity) != 0)
+	{
+		buf->base = NULL;
+		return PTP_ERROR_MEMORY;
+	}
+	
+	buf->capacity = capacity - ptp_buffer_headroom();
+	buf->data = ptp_buffer_aligned(buf);
+	
+	return PTP_OK;
+}
+
+static void ptp_buffer_free_base(ptp_device *dev, ptp_buffer *buf)
+{
+	if (!buf->base)
+	{
+		return;
+	}
+	
+	#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (buf->devmem)
+	{
+		libusb_dev_mem_free(dev->usbdev, buf->base, buf->capacity + ptp_buffer_headroom());
+	}
+	else
+	#endif
+	{
+		free(buf->base);
+	}
+	
+	buf->base = NULL;
+	buf->data = NULL;
+	buf->capacity = 0;
+}
+
+// Grows the aligned area of a buffer to at least 'size' bytes, keeping the 
+// first read that was received into the headroom
+static int ptp_buffer_reserve(ptp_device *dev, ptp_buffer *buf, size_t size)
+{
+	ptp_buffer grown;
+	size_t first;
+	int retval;
+	
+	if (buf->capacity >= size)
+	{
+		return PTP_OK;
+	}
+	
+	retval = ptp_buffer_alloc_base(dev, &grown, size);
+	
+	if (retval != PTP_OK)
+	{
+		return retval;
+	}
+	
+	first = (size_t)(ptp_buffer_aligned(buf) - ((uint8_t *)buf->data - sizeof(ptp_container)));
+	memcpy(ptp_buffer_aligned(&grown) - first, ptp_buffer_aligned(buf) - first, first);
+	
+	ptp_buffer_free_base(dev, buf);
+	
+	buf->base = grown.base;
+	buf->data = ptp_buffer_aligned(&grown) - first + sizeof(ptp_container);
+	buf->capacity = grown.capacity;
+	buf->devmem = grown.devmem;
+	
+	return PTP_OK;
+}
+
+int ptp_buffer_alloc(ptp_device *dev, size_t size, ptp_buffer **buf)
+{
+	ptp_buffer *b;
+	int i, retval;
+	
+	if (!dev || !buf)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	// Reuse a pooled buffer if one is large enough
+	for (i = 0; i < PTP_BUFFER_POOL_SIZE; i++)
+	{
+		b = dev->buffer_pool[i];
+		
+		if (b && b->capacity >= size)
+		{
+			dev->buffer_pool[i] = NULL;
+			b->size = 0;
+			*buf = b;
+			return PTP_OK;
+		}
+	}
+	
+	b = malloc(sizeof(ptp_buffer));
+	
+	if (!b)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	retval = ptp_buffer_alloc_base(dev, b, size);
+	
+	if (retval != PTP_OK)
+	{
+		free(b);
+		return retval;
+	}
+	
+	b->size = 0;
+	*buf = b;
+	
+	return PTP_OK;
+}
+
+void ptp_buffer_free(ptp_device *dev, ptp_buffer *buf)
+{
+	int i;
+	
+	if (!dev || !buf)
+	{
+		return;
+	}
+	
+	// Return the buffer to the pool if there's room
+	for (i = 0; i < PTP_BUFFER_POOL_SIZE; i++)
+	{
+		if (!dev->buffer_pool[i])
+		{
+			dev->buffer_pool[i] = buf;
+			return;
+		}
+	}
+	
+	ptp_buffer_free_base(dev, buf);
+	free(buf);
+}
+
+static void ptp_free_buffer_pool(ptp_device *dev)
+{
+	int i;
+	
+	for (i = 0; i < PTP_BUFFER_POOL_SIZE; i++)
+	{
+		if (dev->buffer_pool[i])
+		{
+			ptp_buffer_free_base(dev, dev->buffer_pool[i]);
+			free(dev->buffer_pool[i]);
+			dev->buffer_pool[i] = NULL;
+		}
+	}
+}
+
+// Holds the device's arena until ptp_arena_release(). Its buffers are 
+// allocated on first use and only grow after that.
+int ptp_arena_acquire(ptp_device *dev, ptp_arena **arena)
+{
+	int retval;
+	
+	if (!dev || !arena)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	pthread_mutex_lock(&dev->mutex_arena);
+	
+	if (!dev->arena.recv)
+	{
+		retval = ptp_buffer_alloc(dev, 0, &dev->arena.recv);
+		
+		if (retval != PTP_OK)
+		{
+			dev->arena.recv = NULL;
+			pthread_mutex_unlock(&dev->mutex_arena);
+			return retval;
+		}
+	}
+	
+	if (!dev->arena.decode)
+	{
+		dev->arena.decode = dynbuf_create(4, NULL, NULL);
+		
+		if (!dev->arena.decode)
+		{
+			pthread_mutex_unlock(&dev->mutex_arena);
+			return PTP_ERROR_MEMORY;
+		}
+	}
+	
+	if (!dev->arena.index)
+	{
+		dev->arena.index = dynbuf_create(4, NULL, NULL);
+		
+		if (!dev->arena.index)
+		{
+			pthread_mutex_unlock(&dev->mutex_arena);
+			return PTP_ERROR_MEMORY;
+		}
+	}
+	
+	*arena = &dev->arena;
+	
+	return PTP_OK;
+}
+
+void ptp_arena_release(ptp_device *dev, ptp_arena *arena)
+{
+	if (dev && arena == &dev->arena)
+	{
+		// Whatever the last user decoded must not point back into it
+		arena->decode->adjust_callback = NULL;
+		arena->decode->context = NULL;
+		dynbuf_clear(arena->decode);
+		
+		pthread_mutex_unlock(&dev->mutex_arena);
+	}
+}
+
+static void ptp_free_arena(ptp_device *dev)
+{
+	if (dev->arena.recv)
+	{
+		ptp_buffer_free(dev, dev->arena.recv);
+		dev->arena.recv = NULL;
+	}
+	
+	dynbuf_free(dev->arena.decode);
+	dynbuf_free(dev->arena.index);
+	dev->arena.decode = NULL;
+	dev->arena.index = NULL;
+}
+
+// Receives a data phase into a buffer without copying the payload. The 
+// first read ends where the aligned area starts, a data phase longer than 
+// that read continues there on a page boundary.
+int ptp_recv_data_buffer(ptp_device *dev, ptp_buffer *buf)
+{
+	int retval, transferred;
+	uint32_t len, payload;
+	uint8_t *header;
+	timer tm;
+	
+	if (!dev || !buf || !buf->base || dev->recv_size > ptp_buffer_headroom())
+	{
+		fprintf(stderr, "[ptp_recv_data_buffer] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	buf->size = 0;
+	header = ptp_buffer_aligned(buf) - dev->recv_size;
+	buf->data = header + sizeof(ptp_container);
+	
+	timer_start(&tm);
+	
+	retval = ptp_recv_data_header(dev, (ptp_container *)header, &transferred, &len);
+	
+	if (retval != PTP_OK)
+	{
+		return retval;
+	}
+	
+	payload = len - sizeof(ptp_container);
+	transferred -= sizeof(ptp_container);
+	
+	// Only a full first read is continued, so the rest starts on the page 
+	// boundary
+	retval = ptp_buffer_reserve(dev, buf, (payload > transferred) ? payload - (uint32_t)transferred : 0);
+	
+	if (retval != PTP_OK)
+	{
+		fprintf(stderr, "[ptp_recv_data_buffer] Could not grow buffer to %u bytes\n", payload);
+		
+		// Drain the rest of the data phase to keep the pipe in sync
+		if (payload > transferred)
+		{
+			ptp_data_sink sink;
+			int sink_result = PTP_OK;
+			
+			ptp_sink_init_file(&sink, NULL);
+			ptp_pipeline_read(dev, NULL, payload - (uint32_t)transferred, &sink, &sink_result);
+		}
+		
+		return retval;
+	}
+	
+	if (payload > transferred)
+	{
+		retval = ptp_pipeline_read(dev, ((uint8_t *)buf->data) + transferred, payload - (uint32_t)transferred, NULL, NULL);
+		
+		if (retval != PTP_OK)
+		{
+			fprintf(stderr, "[ptp_recv_data_buffer] ptp_pipeline_read: %d\n", retval);
+			return retval;
+		}
+	}
+	
+	ptp_recv_data_done(dev, &tm, len);
+	ptp_trace(dev, PTP_TRACE_IN, (ptp_container *)(((uint8_t *)buf->data) - sizeof(ptp_container)), buf->data, payload);
+	
+	buf->size = payload;
+	
+	return (int)payload;
+}
+
+static int ptp_file_sink_write(ptp_device *dev, const void *data, uint32_t size, void *ctx)
+{
+	FILE *f = ctx;
+	
+	if (f && fwrite(data, 1, size, f) != size)
+	{
+		return PTP_ERROR_IO;
+	}
+	
+	return PTP_OK;
+}
+
+void ptp_sink_init_file(ptp_data_sink *sink, FILE *f)
+{
+	if (sink)
+	{
+		sink->begin = NULL;
+		sink->write = ptp_file_sink_write;
+		sink->ctx = f;
+	}
+}
+
+// Decodes a response that arrived in place of the data phase. The caller 
+// gets no data and checks the response code as usual.
+static int ptp_recv_early_response(ptp_device *dev, const void *container, ptp_params *params_in, ptp_opcode_stats *stats, uint64_t start, uint64_t phase_start)
+{
+	int retval = ptp_decode_response(dev, container, (int)dtoh32(((const ptp_container *)container)->len), 0, params_in);
+	
+	if (retval == PTP_OK)
+	{
+		ptp_stats_end(stats, start, phase_start);
+	}
+	
+	return retval;
+}
+
+static int ptp_do_transact(
+	ptp_device *dev, 
+	const ptp_params *params_out, const void *data_out, uint32_t data_out_size, 
+	ptp_params *params_in, void **data_in, uint32_t *data_in_size)
+{
+	int retval, temp_data_in_size = 0;
+	void *temp_data_in = NULL;
+	ptp_opcode_stats *stats;
+	uint64_t start, phase_start;
+	
+	if (!params_out || !params_in || params_out->num_params > PTP_MAX_PARAMS || 
+		(data_out && data_in) || (data_in && !data_in_size))
+	{
+		fprintf(stderr, "[ptp_transact] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	if (!data_out) data_out_size = 0;
+	
+	if (data_in)
+	{
+		*data_in = NULL;
+		*data_in_size = 0;
+	}
+	
+	dev->transaction_id++;
+	
+	stats = ptp_stats_begin(dev, params_out->code, &start);
+	
+	if (data_in)
+	{
+		ptp_recv_size_prepare(dev, params_out->code);
+	}
+	
+	// Either the start of the data phase or the response is read next
+	ptp_prepost_arm(dev, dev->recv_buf, data_in ? (int)dev->recv_size : (int)dev->max_packet_in);
+	
+	retval = ptp_send_command(dev, params_out);
+	
+	if (retval != PTP_OK)
+	{
+		fprintf(stderr, "[ptp_transact] ptp_send_command: %d\n", retval);
+		ptp_prepost_cancel(dev);
+		return retval;
+	}
+	
+	phase_start = ptp_stats_phase(stats, PTP_PHASE_COMMAND, start);
+	
+	if (data_out != NULL)
+	{
+		retval = ptp_send_data(dev, params_out->code, data_out, data_out_size);
+		
+		if (retval != PTP_OK)
+		{
+			fprintf(stderr, "[ptp_transact] ptp_send_data: %d\n", retval);
+			ptp_prepost_cancel(dev);
+			return retval;
+		}
+		
+		phase_start = ptp_stats_data(stats, phase_start, data_out_size, 0);
+	}
+	else if (data_in)
+	{
+		retval = ptp_recv_data(dev, &temp_data_in);
+		
+		if (retval == PTP_ERROR_NO_DATA)
+		{
+			retval = ptp_recv_early_response(dev, dev->recv_buf, params_in, stats, start, phase_start);
+			ptp_prepost_cancel(dev);
+			return retval;
+		}
+		
+		if (retval < 0)
+		{
+			fprintf(stderr, "[ptp_transact] ptp_recv_data: %d\n", retval);
+			ptp_prepost_cancel(dev);
+			return retval;
+		}
+		
+		temp_data_in_size = retval;
+		phase_start = ptp_stats_data(stats, phase_start, (uint32_t)temp_data_in_size, 1);
+	}
+	
+	retval = ptp_recv_response(dev, params_in);
+	
+	ptp_prepost_cancel(dev);
+	
+	if (retval != PTP_OK)
+	{
+		if (data_in)
+		{
+			free(temp_data_in);
+		}
+		
+		fprintf(stderr, "[ptp_transact] ptp_recv_response: %d\n", retval);
+	}
+	else
+	{
+		ptp_stats_end(stats, start, phase_start);
+		
+		if (data_in)
+		{
+			*data_in = temp_data_in;
+			*data_in_size = temp_data_in_size;
+		}
+	}
+	
+	return retval;
+}
+
+static int ptp_do_transact_stream(
+	ptp_device *dev, 
+	const ptp_params *params_out, 
+	ptp_params *params_in, const ptp_data_sink *sink, uint32_t *data_in_size)
+{
+	int retval, sink_result;
+	ptp_opcode_stats *stats;
+	uint64_t start, phase_start;
+	
+	if (!dev || !params_out || !params_in || !sink || params_out->num_params > PTP_MAX_PARAMS)
+	{
+		fprintf(stderr, "[ptp_transact_stream] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	if (data_in_size)
+	{
+		*data_in_size = 0;
+	}
+	
+	dev->transaction_id++;
+	
+	stats = ptp_stats_begin(dev, params_out->code, &start);
+	
+	ptp_recv_size_prepare(dev, params_out->code);
+	ptp_prepost_arm(dev, dev->recv_buf, (int)dev->recv_size);
+	
+	retval = ptp_send_command(dev, params_out);
+	
+	if (retval != PTP_OK)
+	{
+		fprintf(stderr, "[ptp_transact_stream] ptp_send_command: %d\n", retval);
+		ptp_prepost_cancel(dev);
+		return retval;
+	}
+	
+	phase_start = ptp_stats_phase(stats, PTP_PHASE_COMMAND, start);
+	
+	retval = ptp_recv_data_stream(dev, sink, &sink_result);
+	
+	if (retval == PTP_ERROR_NO_DATA)
+	{
+		retval = ptp_recv_early_response(dev, dev->recv_buf, params_in, stats, start, phase_start);
+		ptp_prepost_cancel(dev);
+		return retval;
+	}
+	
+	if (retval < 0)
+	{
+		fprintf(stderr, "[ptp_transact_stream] ptp_recv_data_stream: %d\n", retval);
+		ptp_prepost_cancel(dev);
+		return retval;
+	}
+	
+	if (data_in_size)
+	{
+		*data_in_size = (uint32_t)retval;
+	}
+	
+	phase_start = ptp_stats_data(stats, phase_start, (uint32_t)retval, 1);
+	
+	retval = ptp_recv_response(dev, params_in);
+	
+	if (retval != PTP_OK)
+	{
+		fprintf(stderr, "[ptp_transact_stream] ptp_recv_response: %d\n", retval);
+		return retval;
+	}
+	
+	ptp_stats_end(stats, start, phase_start);
+	
+	if (sink_result != PTP_OK)
+	{
+		fprintf(stderr, "[ptp_transact_stream] Sink failed: %d\n", sink_result);
+		return sink_result;
+	}
+	
+	return PTP_OK;
+}
+
+static int ptp_do_transact_buffer(
+	ptp_device *dev, 
+	const ptp_params *params_out, 
+	ptp_params *params_in, ptp_buffer *buf)
+{
+	ptp_opcode_stats *stats;
+	uint64_t start, phase_start;
+	int retval;
+	
+	if (!dev || !params_out || !params_in || !buf || params_out->num_params > PTP_MAX_PARAMS)
+	{
+		fprintf(stderr, "[ptp_transact_buffer] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	dev->transaction_id++;
+	
+	stats = ptp_stats_begin(dev, params_out->code, &start);
+	ptp_recv_size_prepare(dev, params_out->code);
+	
+	retval = ptp_send_command(dev, params_out);
+	
+	if (retval != PTP_OK)
+	{
+		fprintf(stderr, "[ptp_transact_buffer] ptp_send_command: %d\n", retval);
+		return retval;
+	}
+	
+	phase_start = ptp_stats_phase(stats, PTP_PHASE_COMMAND, start);
+	
+	retval = ptp_recv_data_buffer(dev, buf);
+	
+	if (retval == PTP_ERROR_NO_DATA)
+	{
+		return ptp_recv_early_response(dev, ((uint8_t *)buf->data) - sizeof(ptp_container), params_in, stats, start, phase_start);
+	}
+	
+	if (retval < 0)
+	{
+		fprintf(stderr, "[ptp_transact_buffer] ptp_recv_data_buffer: %d\n", retval);
+		return retval;
+	}
+	
+	phase_start = ptp_stats_data(stats, phase_start, (uint32_t)retval, 1);
+	
+	retval = ptp_recv_response(dev, params_in);
+	
+	if (retval != PTP_OK)
+	{
+		fprintf(stderr, "[ptp_transact_buffer] ptp_recv_response: %d\n", retval);
+	}
+	else
+	{
+		ptp_stats_end(stats, start, phase_start);
+	}
+	
+	return retval;
+}
+
+// The synchronous entry points below share the pipe with the asynchronous 
+// queue, so each one waits for the current async transaction to finish and 
+// holds off the queue until it is done.
+
+int ptp_transact(
+	ptp_device *dev, 
+	const ptp_params *params_out, const void *data_out, uint32_t data_out_size, 
+	ptp_params *params_in, void **data_in, uint32_t *data_in_size)
+{
+	int retval, resynced;
+	
+	if (!dev)
+	{
+		fprintf(stderr, "[ptp_transact] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	ptp_transact_acquire(dev);
+	ptp_deadline_start(dev);
+	retval = ptp_transact_finish(dev, ptp_do_transact(dev, params_out, data_out, data_out_size, params_in, data_in, data_in_size), &resynced);
+	
+	// Reads have no side effects on the device, repeat them once on the clean pipe
+	if (resynced && data_in)
+	{
+		ptp_stats_retry(dev, params_out->code);
+		ptp_deadline_start(dev);
+		retval = ptp_transact_finish(dev, ptp_do_transact(dev, params_out, data_out, data_out_size, params_in, data_in, data_in_size), NULL);
+	}
+	
+	ptp_note_response(dev, params_out, params_in, retval);
+	ptp_transact_release(dev);
+	
+	return retval;
+}
+
+int ptp_transact_stream(
+	ptp_device *dev, 
+	const ptp_params *params_out, 
+	ptp_params *params_in, const ptp_data_sink *sink, uint32_t *data_in_size)
+{
+	int retval;
+	
+	if (!dev)
+	{
+		fprintf(stderr, "[ptp_transact_stream] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	ptp_transact_acquire(dev);
+	ptp_deadline_start(dev);
+	retval = ptp_transact_finish(dev, ptp_do_transact_stream(dev, params_out, params_in, sink, data_in_size), NULL);
+	ptp_note_response(dev, params_out, params_in, retval);
+	ptp_transact_release(dev);
+	
+	return retval;
+}
+
+int ptp_transact_buffer(
+	ptp_device *dev, 
+	const ptp_params *params_out, 
+	ptp_params *params_in, ptp_buffer *buf)
+{
+	int retval, resynced;
+	
+	if (!dev || !params_out)
+	{
+		fprintf(stderr, "[ptp_transact_buffer] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	ptp_transact_acquire(dev);
+	ptp_deadline_start(dev);
+	retval = ptp_transact_finish(dev, ptp_do_transact_buffer(dev, params_out, params_in, buf), &resynced);
+	
+	// Always a read, so it gets the same single retry as ptp_transact()
+	if (resynced)
+	{
+		ptp_stats_retry(dev, params_out->code);
+		ptp_deadline_start(dev);
+		retval = ptp_transact_finish(dev, ptp_do_transact_buffer(dev, params_out, params_in, buf), NULL);
+	}
+	
+	ptp_note_response(dev, params_out, params_in, retval);
+	ptp_transact_release(dev);
+	
+	return retval;
+}
+
+static void ptp_transact_acquire(ptp_device *dev)
+{
+	pthread_mutex_lock(&dev->mutex_transact);
+	
+	dev->transact_waiting++;
+	
+	while (dev->transact_busy)
+	{
+		pthread_cond_wait(&dev->cond_transact, &dev->mutex_transact);
+	}
+	
+	dev->transact_waiting--;
+	dev->transact_busy = 1;
+	dev->cancel_requested = 0;
+	
+	pthread_mutex_unlock(&dev->mutex_transact);
+	
+	// Left behind by a failed asynchronous transaction
+	if (dev->resync_pending)
+	{
+		ptp_resync(dev);
+	}
+}
+
+static void ptp_transact_release(ptp_device *dev)
+{
+	pthread_mutex_lock(&dev->mutex_transact);
+	
+	dev->transact_busy = 0;
+	pthread_cond_broadcast(&dev->cond_transact);
+	
+	pthread_mutex_unlock(&dev->mutex_transact);
+	
+	ptp_async_start_next(dev);
+}
+
+// Asynchronous transactions
+//
+// Each queued transaction walks through the command, data and response 
+// phases on a single libusb transfer. Every phase is submitted from the 
+// completion callback of the previous one, so the whole transaction runs 
+// on whichever thread handles libusb events (normally the usb.c event 
+// thread). Completion callbacks are handed to the dispatcher thread that 
+// also runs the event callback, so they never hold up the event thread.
+
+typedef enum _ptp_async_phase
+{
+	PTP_ASYNC_COMMAND = 0,
+	PTP_ASYNC_DATA_OUT,
+	PTP_ASYNC_DATA_IN_FIRST,
+	PTP_ASYNC_DATA_IN_REST,
+	PTP_ASYNC_RESPONSE,
+	PTP_ASYNC_CANCEL,
+	PTP_ASYNC_CANCEL_STATUS
+} ptp_async_phase;
+
+struct _ptp_async_transaction
+{
+	ptp_device *dev;
+	ptp_params params_out;
+	ptp_params params_in;
+	ptp_async_phase phase;
+	int data_in;
+	uint8_t *out_buf;
+	uint32_t out_size;
+	uint8_t *in_buf;
+	uint32_t in_size;
+	ptp_command_container command;
+	uint8_t ctrl[LIBUSB_CONTROL_SETUP_SIZE + PTP_DEVICE_STATUS_SIZE];
+	int abort_result;
+	int result;
+	int status_tries;
+	ptp_transact_callback cb;
+	void *ctx;
+	ptp_opcode_stats *stats;
+	uint64_t stats_start;
+	uint64_t stats_phase;
+	ptp_async_transaction *next;
+};
+
+static void LIBUSB_CALL ptp_async_callback(struct libusb_transfer *transfer);
+
+static void ptp_async_free(ptp_async_transaction *txn)
+{
+	free(txn->out_buf);
+	free(txn->in_buf);
+	free(txn);
+}
+
+static int ptp_async_submit(ptp_async_transaction *txn, ptp_async_phase phase, unsigned char endpoint, void *buf, uint32_t size)
+{
+	ptp_device *dev = txn->dev;
+	unsigned int timeout;
+	int r;
+	
+	txn->phase = phase;
+	
+	r = ptp_transfer_timeout(dev, &timeout);
+	
+	if (r < 0)
+	{
+		return r;
+	}
+	
+	libusb_fill_bulk_transfer(dev->async_xfer, dev->usbdev, endpoint, buf, (int)size, ptp_async_callback, txn, timeout);
+	
+	if (!(endpoint & LIBUSB_ENDPOINT_IN) && size > 0 && (size % dev->max_packet_out) == 0)
+	{
+		dev->async_xfer->flags |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+	}
+	else
+	{
+		dev->async_xfer->flags &= ~LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+	}
+	
+	return libusb_submit_transfer(dev->async_xfer);
+}
+
+// Hands the transaction to the dispatcher thread, which runs the callback 
+// and any resync the failure calls for
+static void ptp_async_complete(ptp_async_transaction *txn, int result)
+{
+	ptp_device *dev = txn->dev;
+	
+	ptp_note_response(dev, &txn->params_out, &txn->params_in, result);
+	
+	txn->result = result;
+	txn->next = NULL;
+	
+	pthread_mutex_lock(&dev->mutex_transact);
+	
+	if (ptp_is_transport_error(result))
+	{
+		dev->resync_pending = 1;
+	}
+	
+	if (dev->async_done_tail)
+	{
+		dev->async_done_tail->next = txn;
+	}
+	else
+	{
+		dev->async_done_head = txn;
+	}
+	
+	dev->async_done_tail = txn;
+	dev->async_current = NULL;
+	dev->deadline_set = 0;
+	dev->cancel_requested = 0;
+	dev->transact_busy = 0;
+	pthread_cond_broadcast(&dev->cond_transact);
+	
+	pthread_mutex_unlock(&dev->mutex_transact);
+	
+	eventfd_write(dev->dispatch_fd, 1);
+	ptp_async_start_next(dev);
+}
+
+// Runs the callbacks of the finished transactions, in completion order
+static void ptp_async_dispatch(ptp_device *dev)
+{
+	ptp_async_transaction *txn, *next;
+	void *data;
+	uint32_t size;
+	
+	pthread_mutex_lock(&dev->mutex_transact);
+	
+	txn = dev->async_done_head;
+	dev->async_done_head = NULL;
+	dev->async_done_tail = NULL;
+	
+	pthread_mutex_unlock(&dev->mutex_transact);
+	
+	while (txn)
+	{
+		next = txn->next;
+		data = NULL;
+		size = 0;
+		
+		if (txn->result == PTP_OK && txn->data_in)
+		{
+			// Ownership of the data passes to the callback
+			data = txn->in_buf;
+			size = txn->in_size;
+			txn->in_buf = NULL;
+		}
+		
+		if (txn->cb)
+		{
+			txn->cb(dev, txn->result, (txn->result == PTP_OK) ? &txn->params_in : NULL, data, size, txn->ctx);
+		}
+		else
+		{
+			free(data);
+		}
+		
+		ptp_async_free(txn);
+		txn = next;
+	}
+}
+
+static int ptp_async_submit_control(ptp_async_transaction *txn, ptp_async_phase phase, uint8_t request_type, uint8_t request, uint16_t length)
+{
+	ptp_device *dev = txn->dev;
+	
+	txn->phase = phase;
+	
+	libusb_fill_control_setup(txn->ctrl, request_type, request, 0, dev->interface, length);
+	libusb_fill_control_transfer(dev->async_xfer, dev->usbdev, txn->ctrl, ptp_async_callback, txn, PTP_CONTROL_TIMEOUT);
+	dev->async_xfer->flags &= ~LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+	
+	return libusb_submit_transfer(dev->async_xfer);
+}
+
+// Same sequence as ptp_class_cancel(), run from the completion callbacks
+static void ptp_async_cancel(ptp_async_transaction *txn, int result)
+{
+	ptp_device *dev = txn->dev;
+	uint8_t *data = txn->ctrl + LIBUSB_CONTROL_SETUP_SIZE;
+	int r;
+	
+	txn->abort_result = result;
+	txn->status_tries = 0;
+	
+	data[0] = PTP_EC_CANCEL_TRANSACTION & 0xFF;
+	data[1] = PTP_EC_CANCEL_TRANSACTION >> 8;
+	data[2] = dev->transaction_id & 0xFF;
+	data[3] = (dev->transaction_id >> 8) & 0xFF;
+	data[4] = (dev->transaction_id >> 16) & 0xFF;
+	data[5] = (dev->transaction_id >> 24) & 0xFF;
+	
+	r = ptp_async_submit_control(txn, PTP_ASYNC_CANCEL, 
+		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, PTP_REQ_CANCEL, 6);
+	
+	if (r < 0)
+	{
+		fprintf(stderr, "[ptp_transact_async] Cancel request: %d\n", r);
+		ptp_async_complete(txn, result);
+	}
+}
+
+static void ptp_async_cancel_status(ptp_async_transaction *txn)
+{
+	int r;
+	
+	txn->status_tries++;
+	
+	r = ptp_async_submit_control(txn, PTP_ASYNC_CANCEL_STATUS, 
+		LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, PTP_REQ_GET_DEVICE_STATUS, PTP_DEVICE_STATUS_SIZE);
+	
+	if (r < 0)
+	{
+		fprintf(stderr, "[ptp_transact_async] Get device status: %d\n", r);
+		ptp_async_complete(txn, txn->abort_result);
+	}
+}
+
+static void ptp_async_fail(ptp_async_transaction *txn, int result, const char *what)
+{
+	fprintf(stderr, "[ptp_transact_async] %s: %d\n", what, result);
+	
+	if (txn->dev->cancel_requested)
+	{
+		ptp_async_cancel(txn, PTP_ERROR_CANCELLED);
+	}
+	else if (result == LIBUSB_ERROR_TIMEOUT)
+	{
+		ptp_async_cancel(txn, PTP_ERROR_TIMEOUT);
+	}
+	else
+	{
+		ptp_async_complete(txn, result);
+	}
+}
+
+static void ptp_async_start_response(ptp_async_transaction *txn)
+{
+	int r = ptp_async_submit(txn, PTP_ASYNC_RESPONSE, txn->dev->ep_in, txn->dev->recv_buf, txn->dev->max_packet_in);
+	
+	if (r < 0)
+	{
+		ptp_async_fail(txn, r, "Submit response");
+	}
+}
+
+static void ptp_async_handle_data_in(ptp_async_transaction *txn, struct libusb_transfer *transfer)
+{
+	ptp_device *dev = txn->dev;
+	ptp_container *container = dev->recv_buf;
+	uint32_t len, first;
+	int r;
+	
+	// The device may skip the data phase and answer with a response right away
+	if (transfer->actual_length >= sizeof(ptp_container) && 
+		container->type == htod16(PTP_TYPE_RESPONSE))
+	{
+		txn->data_in = 0;
+		
+		r = ptp_decode_response(dev, dev->recv_buf, transfer->actual_length, 0, &txn->params_in);
+		
+		if (r == PTP_OK)
+		{
+			ptp_stats_end(txn->stats, txn->stats_start, txn->stats_phase);
+		}
+		
+		ptp_async_complete(txn, r);
+		return;
+	}
+	
+	r = ptp_check_data_header(dev, container, transfer->actual_length, 0, &len);
+	
+	if (r != PTP_OK)
+	{
+		ptp_async_fail(txn, r, "Data header");
+		return;
+	}
+	
+	txn->in_size = len - sizeof(ptp_container);
+	txn->in_buf = malloc(txn->in_size ? txn->in_size : 1);
+	
+	if (!txn->in_buf)
+	{
+		ptp_async_fail(txn, PTP_ERROR_MEMORY, "Data buffer");
+		return;
+	}
+	
+	first = (uint32_t)transfer->actual_length - sizeof(ptp_container);
+	memcpy(txn->in_buf, container + 1, first);
+	
+	if (first < txn->in_size)
+	{
+		r = ptp_async_submit(txn, PTP_ASYNC_DATA_IN_REST, dev->ep_in, txn->in_buf + first, txn->in_size - first);
+		
+		if (r < 0)
+		{
+			ptp_async_fail(txn, r, "Submit data");
+		}
+		
+		return;
+	}
+	
+	ptp_trace(dev, PTP_TRACE_IN, container, txn->in_buf, txn->in_size);
+	txn->stats_phase = ptp_stats_data(txn->stats, txn->stats_phase, txn->in_size, 1);
+	ptp_async_start_response(txn);
+}
+
+static void LIBUSB_CALL ptp_async_callback(struct libusb_transfer *transfer)
+{
+	ptp_async_transaction *txn = transfer->user_data;
+	const uint8_t *status;
+	int r;
+	
+	r = ptp_transfer_status(transfer);
+	
+	if (txn->phase == PTP_ASYNC_CANCEL || txn->phase == PTP_ASYNC_CANCEL_STATUS)
+	{
+		if (r != 0)
+		{
+			fprintf(stderr, "[ptp_transact_async] Cancel sequence: %d\n", r);
+			ptp_async_complete(txn, txn->abort_result);
+			return;
+		}
+		
+		if (txn->phase == PTP_ASYNC_CANCEL)
+		{
+			ptp_async_cancel_status(txn);
+			return;
+		}
+		
+		status = libusb_control_transfer_get_data(transfer);
+		
+		if (transfer->actual_length >= 4 && 
+			(status[2] | (status[3] << 8)) == PTP_RC_DEVICE_BUSY && 
+			txn->status_tries < PTP_CANCEL_STATUS_TRIES)
+		{
+			ptp_async_cancel_status(txn);
+			return;
+		}
+		
+		ptp_async_complete(txn, txn->abort_result);
+		return;
+	}
+	
+	if (r != 0)
+	{
+		ptp_async_fail(txn, r, "Transfer");
+		return;
+	}
+	
+	switch (txn->phase)
+	{
+	case PTP_ASYNC_COMMAND:
+		ptp_trace(txn->dev, PTP_TRACE_OUT, &txn->command.container, txn->command.params, (uint32_t)transfer->actual_length - sizeof(ptp_container));
+		txn->stats_phase = ptp_stats_phase(txn->stats, PTP_PHASE_COMMAND, txn->stats_start);
+		
+		if (txn->out_buf)
+		{
+			r = ptp_async_submit(txn, PTP_ASYNC_DATA_OUT, txn->dev->ep_out, txn->out_buf, txn->out_size);
+		}
+		else if (txn->data_in)
+		{
+			r = ptp_async_submit(txn, PTP_ASYNC_DATA_IN_FIRST, txn->dev->ep_in, txn->dev->recv_buf, txn->dev->recv_size);
+		}
+		else
+		{
+			ptp_async_start_response(txn);
+			return;
+		}
+		
+		if (r < 0)
+		{
+			ptp_async_fail(txn, r, "Submit data");
+		}
+		
+		break;
+		
+	case PTP_ASYNC_DATA_OUT:
+		ptp_trace(txn->dev, PTP_TRACE_OUT, (ptp_container *)txn->out_buf, ((ptp_container *)txn->out_buf) + 1, txn->out_size - sizeof(ptp_container));
+		txn->stats_phase = ptp_stats_data(txn->stats, txn->stats_phase, txn->out_size - sizeof(ptp_container), 0);
+		ptp_async_start_response(txn);
+		break;
+		
+	case PTP_ASYNC_DATA_IN_FIRST:
+		ptp_async_handle_data_in(txn, transfer);
+		break;
+		
+	case PTP_ASYNC_DATA_IN_REST:
+		if (transfer->actual_length != transfer->length)
+		{
+			ptp_async_fail(txn, PTP_ERROR_DATA_LEN, "Short data transfer");
+			break;
+		}
+		
+		ptp_trace(txn->dev, PTP_TRACE_IN, txn->dev->recv_buf, txn->in_buf, txn->in_size);
+		txn->stats_phase = ptp_stats_data(txn->stats, txn->stats_phase, txn->in_size, 1);
+		ptp_async_start_response(txn);
+		break;
+		
+	case PTP_ASYNC_RESPONSE:
+		if (transfer->actual_length == 0)
+		{
+			// Zero-length packet terminating the data phase, read again
+			ptp_async_start_response(txn);
+			break;
+		}
+		
+		r = ptp_decode_response(txn->dev, txn->dev->recv_buf, transfer->actual_length, 0, &txn->params_in);
+		
+		if (r == PTP_OK)
+		{
+			ptp_stats_end(txn->stats, txn->stats_start, txn->stats_phase);
+		}
+		
+		ptp_async_complete(txn, r);
+		break;
+		
+	default:
+		break;
+	}
+}
+
+static void ptp_async_start(ptp_async_transaction *txn)
+{
+	ptp_device *dev = txn->dev;
+	uint32_t i, size;
+	int r;
+	
+	dev->transaction_id++;
+	
+	ptp_deadline_start(dev);
+	txn->stats = ptp_stats_begin(dev, txn->params_out.code, &txn->stats_start);
+	
+	if (txn->data_in)
+	{
+		ptp_recv_size_prepare(dev, txn->params_out.code);
+	}
+	
+	size = sizeof(ptp_container) + txn->params_out.num_params * sizeof(uint32_t);
+	
+	txn->command.container.len = htod32(size);
+	txn->command.container.type = htod16(PTP_TYPE_COMMAND);
+	txn->command.container.code = htod16(txn->params_out.code);
+	txn->command.container.transaction_id = htod32(dev->transaction_id);
+	
+	for (i = 0; i < txn->params_out.num_params; i++)
+	{
+		txn->command.params[i] = htod32(txn->params_out.params[i]);
+	}
+	
+	if (txn->out_buf)
+	{
+		ptp_container *container = (ptp_container *)txn->out_buf;
+		
+		container->len = htod32(txn->out_size);
+		container->type = htod16(PTP_TYPE_DATA);
+		container->code = htod16(txn->params_out.code);
+		container->transaction_id = htod32(dev->transaction_id);
+	}
+	
+	r = ptp_async_submit(txn, PTP_ASYNC_COMMAND, dev->ep_out, &txn->command, size);
+	
+	if (r < 0)
+	{
+		ptp_async_fail(txn, r, "Submit command");
+	}
+}
+
+// Starts the next queued transaction if the pipe is free and no synchronous 
+// caller is waiting for it
+static void ptp_async_start_next(ptp_device *dev)
+{
+	ptp_async_transaction *txn = NULL;
+	
+	pthread_mutex_lock(&dev->mutex_transact);
+	
+	// A pending resync needs blocking calls, the dispatcher thread runs it 
+	// and starts the queue again afterwards
+	if (!dev->transact_busy && !dev->transact_waiting && dev->async_head && !dev->resync_pending)
+	{
+		txn = dev->async_head;
+		dev->async_head = txn->next;
+		
+		if (!dev->async_head)
+		{
+			dev->async_tail = NULL;
+		}
+		
+		txn->next = NULL;
+		dev->async_current = txn;
+		dev->transact_busy = 1;
+	}
+	
+	pthread_mutex_unlock(&dev->mutex_transact);
+	
+	if (txn)
+	{
+		ptp_async_start(txn);
+	}
+}
+
+int ptp_transact_async(
+	ptp_device *dev, 
+	const ptp_params *params_out, const void *data_out, uint32_t data_out_size, int data_in, 
+	ptp_transact_callback cb, void *ctx)
+{
+	ptp_async_transaction *txn;
+	ptp_params params_in;
+	void *in_buf = NULL;
+	uint32_t in_size = 0;
+	int retval;
+	
+	if (!dev || !params_out || params_out->num_params > PTP_MAX_PARAMS || (data_out && data_in))
+	{
+		fprintf(stderr, "[ptp_transact_async] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	if (!dev->async_xfer)
+	{
+		// Transports without asynchronous transfers complete the 
+		// transaction before returning
+		retval = ptp_transact(dev, params_out, data_out, data_out_size, &params_in, data_in ? &in_buf : NULL, &in_size);
+		
+		if (cb)
+		{
+			cb(dev, retval, (retval == PTP_OK) ? &params_in : NULL, in_buf, in_size, ctx);
+		}
+		else
+		{
+			free(in_buf);
+		}
+		
+		return PTP_OK;
+	}
+	
+	txn = calloc(1, sizeof(ptp_async_transaction));
+	
+	if (!txn)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	txn->dev = dev;
+	txn->params_out = *params_out;
+	txn->data_in = data_in ? 1 : 0;
+	txn->cb = cb;
+	txn->ctx = ctx;
+	
+	if (data_out)
+	{
+		// Keep a copy of the payload behind a header slot, the caller's buffer may go away
+		txn->out_size = sizeof(ptp_container) + data_out_size;
+		txn->out_buf = malloc(txn->out_size);
+		
+		if (!txn->out_buf)
+		{
+			free(txn);
+			return PTP_ERROR_MEMORY;
+		}
+		
+		memcpy(txn->out_buf + sizeof(ptp_container), data_out, data_out_size);
+	}
+	
+	pthread_mutex_lock(&dev->mutex_transact);
+	
+	if (dev->closing)
+	{
+		pthread_mutex_unlock(&dev->mutex_transact);
+		ptp_async_free(txn);
+		return PTP_ERROR_CANCELLED;
+	}
+	
+	retval = ptp_dispatch_start(dev);
+	
+	if (retval != PTP_OK)
+	{
+		pthread_mutex_unlock(&dev->mutex_transact);
+		ptp_async_free(txn);
+		return retval;
+	}
+	
+	if (dev->async_tail)
+	{
+		dev->async_tail->next = txn;
+	}
+	else
+	{
+		dev->async_head = txn;
+	}
+	
+	dev->async_tail = txn;
+	
+	pthread_mutex_unlock(&dev->mutex_transact);
+	
+	ptp_async_start_next(dev);
+	
+	return PTP_OK;
+}
+
+// Fails every queued transaction and waits for the one in flight to finish
+static void ptp_async_cancel_all(ptp_device *dev)
+{
+	ptp_async_transaction *txn;
+	int r;
+	
+	pthread_mutex_lock(&dev->mutex_transact);
+	
+	dev->closing = 1;
+	txn = dev->async_head;
+	dev->async_head = NULL;
+	dev->async_tail = NULL;
+	
+	// Abort the transaction in flight rather than wait for the device
+	if (dev->async_current)
+	{
+		dev->cancel_requested = 1;
+		
+		if (dev->transport->cancel)
+		{
+			dev->transport->cancel(dev);
+		}
+	}
+	
+	while (dev->transact_busy)
+	{
+		if (dev->async_current && dev->transport->handle_events)
+		{
+			pthread_mutex_unlock(&dev->mutex_transact);
+			r = dev->transport->handle_events(dev, PTP_CANCEL_EVENTS_TIMEOUT);
+			pthread_mutex_lock(&dev->mutex_transact);
+			
+			if (r != LIBUSB_ERROR_NOT_SUPPORTED)
+			{
+				continue;
+			}
+		}
+		
+		pthread_cond_wait(&dev->cond_transact, &dev->mutex_transact);
+	}
+	
+	pthread_mutex_unlock(&dev->mutex_transact);
+	
+	while (txn)
+	{
+		ptp_async_transaction *next = txn->next;
+		
+		if (txn->cb)
+		{
+			txn->cb(dev, PTP_ERROR_CANCELLED, NULL, NULL, 0, txn->ctx);
+		}
+		
+		ptp_async_free(txn);
+		txn = next;
+	}
+}
+
+// With an event callback set, events are only copied for 
+// ptp_event_get_timed() while someone is subscribed. A subscription keeps 
+// the events that arrive between two waits, the copies are dropped once the 
+// last one ends.
+void ptp_event_subscribe(ptp_device *dev)
+{
+	if (dev)
+	{
+		__atomic_add_fetch(&dev->wait_subscribers, 1, __ATOMIC_ACQ_REL);
+	}
+}
+
+void ptp_event_unsubscribe(ptp_device *dev)
+{
+	ptp_event event;
+	
+	if (dev && __atomic_sub_fetch(&dev->wait_subscribers, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		while (ptp_event_queue_get(&dev->wait_queue, &event, 0, NULL) == PTP_OK);
+	}
+}
+
+// Like ptp_event_get(), but also usable alongside the event callback: with 
+// a callback set, waiters read their own copy and the callback still sees 
+// every event. Waits up to 'timeout' ms, 0 only polls and negative waits 
+// forever, as for ptp_event_get() and unlike the older ptp_wait_event(). 
+// Returns PTP_ERROR_TIMEOUT if no event arrived.
+int ptp_event_get_timed(ptp_device *dev, ptp_event *event, int timeout)
+{
+	int retval;
+	
+	if (!dev || !event)
+	{
+		return PTP_ERROR_PARAM;
+	}
+	
+	if (!dev->event_cb)
+	{
+		ptp_event_start(dev);
+		return ptp_event_queue_get(&dev->event_queue, event, timeout, NULL);
+	}
+	
+	// Copies are made for as long as the call waits
+	ptp_event_subscribe(dev);
+	retval = ptp_event_queue_get(&dev->wait_queue, event, timeout, NULL);
+	ptp_event_unsubscribe(dev);
+	
+	return retval;
+}
+
+// Waits up to 'timeout' ms for the next event, 0 or negative waits forever. 
+// Returns LIBUSB_ERROR_TIMEOUT if none arrived, as the interrupt transfer it 
+// used to be did.
+int ptp_wait_event(ptp_device *dev, ptp_params *params, int timeout)
+{
+	ptp_event event;
+	int retval;
+	
+	if (!dev || !params)
+	{
+		fprintf(stderr, "[ptp_wait_event] PTP_ERROR_PARAM\n");
+		return PTP_ERROR_PARAM;
+	}
+	
+	retval = ptp_event_get_timed(dev, &event, timeout > 0 ? timeout : -1);
+	
+	if (retval == PTP_ERROR_TIMEOUT)
+	{
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+	
+	if (retval != PTP_OK)
+	{
+		fprintf(stderr, "[ptp_wait_event] ptp_event_queue_get: %d\n", retval);
+		return retval;
+	}
+	
+	*params = event.params;
+	
 	return PTP_OK;
 }
@@ -2,9 +2,13 @@
 #define __PTP_H__
 
 #include <stdint.h>
+#include <stdio.h>
 #include <endian.h>
+#include <sys/time.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 #include "usb.h"
+#include "dynbuf.h"
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN	
 	//#define htod16(x)	(x)
@@ -20,6 +24,7 @@
 #define htod32(x)	htole32(x)
 #define dtoh16(x)	le16toh(x)
 #define dtoh32(x)	le32toh(x)
+#define dtoh64(x)	le64toh(x)
 
 #define PTP_OK						0
 #define PTP_ERROR_BASE				-50
@@ -34,10 +39,39 @@
 #define PTP_ERROR_NOT_FOUND			(PTP_ERROR_BASE-9)
 #define PTP_ERROR_PROP_TYPE			(PTP_ERROR_BASE-10)
 #define PTP_ERROR_PROP_VALUE		(PTP_ERROR_BASE-11)
+#define PTP_ERROR_IO				(PTP_ERROR_BASE-12)
+#define PTP_ERROR_CANCELLED			(PTP_ERROR_BASE-13)
+#define PTP_ERROR_TIMEOUT			(PTP_ERROR_BASE-14)
+#define PTP_ERROR_NO_DATA			(PTP_ERROR_BASE-15)
 
 #define PTP_MAX_PARAMS	5
 
-#define PTP_EVENT_TRANSFER_COUNT	10
+#define PTP_EVENT_TRANSFER_COUNT	10	// Default depth of the event transfer pool
+#define PTP_EVENT_TRANSFER_MAX		64
+#define PTP_EVENT_QUEUE_SIZE		64	// Power of two
+
+#define PTP_PIPELINE_MAX_DEPTH		16
+#define PTP_PIPELINE_DEPTH			4
+#define PTP_PIPELINE_CHUNK_SIZE		(128 * 1024)
+
+#define PTP_BUFFER_POOL_SIZE		4
+
+#define PTP_SEND_BUF_SIZE			512
+
+#define PTP_RECV_SIZE_MIN			512
+#define PTP_RECV_SIZE_MAX			(64 * 1024)
+#define PTP_RECV_HISTORY_SIZE		16
+
+#define PTP_STATS_MAX_OPCODES		32	// Opcodes beyond this many are not tracked
+#define PTP_REJECTED_MAX_OPCODES	16	// Rejections beyond this many are not remembered
+#define PTP_ARENA_MAX_TYPES			64	// Property types beyond this many are not remembered
+
+// Log-linear latency buckets in us: every power of two is split into 
+// PTP_HIST_SUB_COUNT buckets, so a bucket is within 1/8 of its value
+#define PTP_HIST_SUB_BITS			3
+#define PTP_HIST_SUB_COUNT			(1 << PTP_HIST_SUB_BITS)
+#define PTP_HIST_MAX_BITS			27	// Up to 2^28 us, larger values land in the last bucket
+#define PTP_HIST_BUCKETS			(PTP_HIST_SUB_COUNT * (PTP_HIST_MAX_BITS - PTP_HIST_SUB_BITS + 2))
 
 typedef struct _ptp_params
 {
@@ -51,33 +85,310 @@ typedef struct _ptp_device	ptp_device;
 
 typedef void (*ptp_event_callback)(ptp_device *dev, const ptp_params *params, void *ctx);
 
+// Completion of an asynchronous transaction. params_in is NULL unless the 
+// response was received. data_in belongs to the callback and must be freed.
+typedef void (*ptp_transact_callback)(ptp_device *dev, int result, const ptp_params *params_in, void *data_in, uint32_t data_in_size, void *ctx);
+
+struct _ptp_async_transaction;
+typedef struct _ptp_async_transaction	ptp_async_transaction;
+
+// Moves bytes between the PTP layer and a device. Operations return 0 (or 
+// the byte count for control requests) on success, or a LIBUSB_ERROR_* code 
+// as libusb would, since that is what the transaction layer acts on. A 
+// timeout of 0 waits forever. 'handle_events' runs completions for up to 
+// 'timeout' ms when no transport thread does, and returns 
+// LIBUSB_ERROR_NOT_SUPPORTED otherwise. 'open', 'event', 'clear_halt', 
+// 'cancel' and 'handle_events' may be NULL.
+typedef struct _ptp_transport
+{
+	const char *name;
+	int (*open)(ptp_device *dev);
+	void (*close)(ptp_device *dev);
+	int (*bulk)(ptp_device *dev, unsigned char endpoint, void *data, int length, int *transferred, unsigned int timeout);
+	int (*control)(ptp_device *dev, uint8_t request_type, uint8_t request, uint16_t value, void *data, uint16_t length, unsigned int timeout);
+	int (*event)(ptp_device *dev, void *data, int length, int *transferred, unsigned int timeout);
+	int (*clear_halt)(ptp_device *dev, unsigned char endpoint);
+	void (*cancel)(ptp_device *dev);
+	int (*handle_events)(ptp_device *dev, unsigned int timeout);
+} ptp_transport;
+
+// Consumer for an incoming data phase. begin() is optional and receives the 
+// total payload size, write() is called for every chunk in order. Returning 
+// anything other than PTP_OK stops the sink but the data phase is still drained.
+typedef struct _ptp_data_sink
+{
+	int (*begin)(ptp_device *dev, uint32_t size, void *ctx);
+	int (*write)(ptp_device *dev, const void *data, uint32_t size, void *ctx);
+	void *ctx;
+} ptp_data_sink;
+
+// Decoded event, stamped with CLOCK_MONOTONIC when its transfer completed
+typedef struct _ptp_event
+{
+	ptp_params params;
+	struct timespec timestamp;
+} ptp_event;
+
+// Bounded ring filled from the libusb event thread without locking. 
+// Consumers serialize on mutex_get and sleep on the eventfd.
+typedef struct _ptp_event_queue
+{
+	ptp_event events[PTP_EVENT_QUEUE_SIZE];
+	uint32_t head;
+	uint32_t tail;
+	uint64_t dropped;
+	int fd;
+	pthread_mutex_t mutex_get;
+} ptp_event_queue;
+
 typedef struct _ptp_event_transfer
 {
 	ptp_device *dev;
 	struct libusb_transfer *xfer;
-	int completed;
 	void *buf;
 } ptp_event_transfer;
 
+typedef struct _ptp_pipeline_slot
+{
+	struct libusb_transfer *xfer;
+	int completed;
+} ptp_pipeline_slot;
+
+typedef struct _ptp_data_rate
+{
+	uint64_t bytes;
+	uint64_t usec;
+} ptp_data_rate;
+
+// Last data phase length seen for an operation code, used to size the 
+// first read of the next data phase with the same code
+typedef struct _ptp_recv_history
+{
+	uint16_t code;
+	uint32_t len;
+} ptp_recv_history;
+
+// Command-to-response round trip times, summed up from the per-opcode 
+// stats. min_usec is the lower bound of the histogram bucket it fell into.
+typedef struct _ptp_latency
+{
+	uint64_t count;
+	uint64_t total_usec;
+	uint64_t min_usec;
+	uint64_t max_usec;
+} ptp_latency;
+
+// Pipe resynchronisations after transport errors
+typedef struct _ptp_recovery
+{
+	uint64_t count;
+	uint64_t resets;
+	uint64_t failures;
+	uint64_t total_usec;
+	uint64_t max_usec;
+} ptp_recovery;
+
+typedef enum _ptp_phase
+{
+	PTP_PHASE_COMMAND = 0,	// Command container sent
+	PTP_PHASE_DATA,			// Data phase, either direction
+	PTP_PHASE_RESPONSE,		// From the end of the previous phase to the response
+	PTP_PHASE_TOTAL,		// Whole transaction
+	PTP_PHASE_COUNT
+} ptp_phase;
+
+typedef struct _ptp_histogram
+{
+	uint32_t buckets[PTP_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t total_usec;
+	uint64_t max_usec;
+} ptp_histogram;
+
+// Per-opcode counters. Phase histograms only count completed phases, 
+// 'failed' transactions ended without a response.
+typedef struct _ptp_opcode_stats
+{
+	uint16_t code;
+	uint64_t transactions;
+	uint64_t failed;
+	uint64_t retries;
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	ptp_histogram phases[PTP_PHASE_COUNT];
+} ptp_opcode_stats;
+
+typedef struct _ptp_stats
+{
+	uint64_t send_retries;
+	uint32_t count;
+	ptp_opcode_stats opcodes[PTP_STATS_MAX_OPCODES];
+} ptp_stats;
+
+// Receive buffer made of a headroom followed by a page aligned area. The 
+// first read of a data phase fills the end of the headroom, so the rest of 
+// the payload is received on a page boundary right behind it. 'data' points 
+// at the payload and 'capacity' is the size of the aligned area.
+typedef struct _ptp_buffer
+{
+	void *base;
+	void *data;
+	size_t capacity;
+	uint32_t size;
+	int devmem;
+} ptp_buffer;
+
+typedef struct _ptp_prop_type
+{
+	uint16_t code;
+	uint16_t type;
+} ptp_prop_type;
+
+// Per-device storage for property polling: the data phase is received into 
+// 'recv' and decoded into 'decode'. Both keep their capacity between polls, 
+// so once they have grown to fit a poll takes no heap operations. 'index' 
+// and 'types' are not cleared on release, vendor code keeps what it learned 
+// about the layout of the data and the type of each property there.
+typedef struct _ptp_arena
+{
+	ptp_buffer *recv;
+	dynbuf *decode;
+	dynbuf *index;
+	ptp_prop_type types[PTP_ARENA_MAX_TYPES];
+	uint32_t type_count;
+} ptp_arena;
+
 struct _ptp_device
 {
+	const ptp_transport *transport;
+	void *transport_ctx;
 	libusb_device_handle *usbdev;
 	libusb_context *usbctx;
 	uint32_t transaction_id;
 	uint32_t recv_size;
+	uint32_t recv_capacity;
 	void *recv_buf;
+	int interface;
+	unsigned char ep_in;
+	unsigned char ep_out;
+	unsigned char ep_event;
+	uint16_t max_packet_in;
+	uint16_t max_packet_out;
+	int expect_zlp;
+	unsigned int timeout_ms;
+	struct timespec deadline;
+	int deadline_set;
+	volatile int cancel_requested;
+	int resync_pending;
+	ptp_recovery recovery;
+	ptp_recv_history recv_history[PTP_RECV_HISTORY_SIZE];
+	uint32_t recv_history_next;
+	uint64_t data_phases;
+	uint64_t second_transfers;
+	uint64_t bytes_in;
+	size_t send_size;
+	void *send_buf;
 	ptp_event_callback event_cb;
 	void *user_ctx;
-	ptp_event_transfer event_xfers[PTP_EVENT_TRANSFER_COUNT];
+	ptp_event_transfer *event_xfers;
+	uint32_t event_depth;
+	int event_inflight;
+	int events_idle;
+	int events_started;
+	ptp_event_queue event_queue;
+	ptp_event_queue wait_queue;
+	int wait_subscribers;
+	pthread_t thread_dispatch;
+	int thread_dispatch_valid;
+	volatile int dispatch_stop;
+	int dispatch_fd;
+	pthread_t thread_event_reader;
+	int event_reader_valid;
+	int event_reader_stop;
 	struct libusb_transfer *bulk_xfer;
+	uint32_t pipeline_depth;
+	uint32_t pipeline_chunk_size;
+	ptp_pipeline_slot pipeline[PTP_PIPELINE_MAX_DEPTH];
+	void *pipeline_buf;
+	size_t pipeline_buf_size;
+	ptp_buffer *buffer_pool[PTP_BUFFER_POOL_SIZE];
+	ptp_arena arena;
+	pthread_mutex_t mutex_arena;
+	ptp_data_rate last_data;
+	int prepost;
+	struct libusb_transfer *prepost_xfer;
+	int prepost_completed;
+	void *prepost_buf;
+	uint32_t stats_keys[PTP_STATS_MAX_OPCODES];
+	ptp_opcode_stats stats[PTP_STATS_MAX_OPCODES];
+	uint32_t rejected[PTP_REJECTED_MAX_OPCODES];
+	uint64_t send_retries;
+	pthread_mutex_t mutex_transact;
+	pthread_cond_t cond_transact;
+	int transact_busy;
+	int transact_waiting;
+	int closing;
+	struct libusb_transfer *async_xfer;
+	ptp_async_transaction *async_head;
+	ptp_async_transaction *async_tail;
+	ptp_async_transaction *async_current;
+	ptp_async_transaction *async_done_head;
+	ptp_async_transaction *async_done_tail;
+	FILE *trace;
+	uint32_t trace_max_data;
+	pthread_mutex_t mutex_trace;
 };
 
+extern const ptp_transport ptp_transport_usb;
+
 int ptp_device_init(ptp_device **dev, usb_device_handle *usbdev, ptp_event_callback event_cb, void *user_ctx);
+int ptp_device_init_transport(ptp_device **dev, const ptp_transport *transport, void *transport_ctx, ptp_event_callback event_cb, void *user_ctx);
 void ptp_device_free(ptp_device *dev);
 int ptp_transact(
 	ptp_device *dev, 
 	const ptp_params *params_out, const void *data_out, uint32_t data_out_size, 
 	ptp_params *params_in, void **data_in, uint32_t *data_in_size);
+void *ptp_get_send_payload(ptp_device *dev, uint32_t size);
+int ptp_transact_stream(
+	ptp_device *dev, 
+	const ptp_params *params_out, 
+	ptp_params *params_in, const ptp_data_sink *sink, uint32_t *data_in_size);
+int ptp_transact_buffer(
+	ptp_device *dev, 
+	const ptp_params *params_out, 
+	ptp_params *params_in, ptp_buffer *buf);
+int ptp_transact_async(
+	ptp_device *dev, 
+	const ptp_params *params_out, const void *data_out, uint32_t data_out_size, int data_in, 
+	ptp_transact_callback cb, void *ctx);
+int ptp_buffer_alloc(ptp_device *dev, size_t size, ptp_buffer **buf);
+void ptp_buffer_free(ptp_device *dev, ptp_buffer *buf);
+int ptp_arena_acquire(ptp_device *dev, ptp_arena **arena);
+void ptp_arena_release(ptp_device *dev, ptp_arena *arena);
+void ptp_sink_init_file(ptp_data_sink *sink, FILE *f);
+int ptp_set_pipeline(ptp_device *dev, uint32_t depth, uint32_t chunk_size);
+double ptp_get_data_rate(const ptp_device *dev);
+int ptp_set_prepost(ptp_device *dev, int enable);
+int ptp_set_timeout(ptp_device *dev, unsigned int timeout_ms);
+int ptp_cancel(ptp_device *dev);
+void ptp_get_recovery_stats(const ptp_device *dev, ptp_recovery *recovery);
+int ptp_get_latency(ptp_device *dev, ptp_latency *control, ptp_latency *data);
+void ptp_get_recv_stats(const ptp_device *dev, uint64_t *data_phases, uint64_t *second_transfers);
+int ptp_device_get_stats(ptp_device *dev, ptp_stats *stats, int reset);
+uint64_t ptp_histogram_percentile(const ptp_histogram *hist, double percentile);
+void ptp_stats_print(const ptp_stats *stats, FILE *f);
+uint64_t ptp_get_bytes_in(const ptp_device *dev);
+int ptp_op_rejected(const ptp_device *dev, uint16_t code);
 int ptp_wait_event(ptp_device *dev, ptp_params *params, int timeout);
+int ptp_event_start(ptp_device *dev);
+int ptp_set_event_depth(ptp_device *dev, uint32_t depth);
+int ptp_event_get(ptp_device *dev, ptp_event *event, int timeout);
+int ptp_event_get_timed(ptp_device *dev, ptp_event *event, int timeout);
+void ptp_event_subscribe(ptp_device *dev);
+void ptp_event_unsubscribe(ptp_device *dev);
+int ptp_event_fd(const ptp_device *dev);
+uint64_t ptp_event_dropped(const ptp_device *dev);
+int ptp_trace_start(ptp_device *dev, const char *path, uint32_t max_data);
+void ptp_trace_stop(ptp_device *dev);
 
 #endif /* __PTP_H__ */
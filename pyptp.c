@@ -195,8 +195,10 @@ static void pyptp_call_callback(Camera *self, const char *path)
 
 static int pyptp_transfer_image(Camera *self, uint32_t handle, uint8_t unlock)
 {
-	int retval, image_size;
-	void *image_data;
+	int retval;
+	char image_path[MAX_IMAGE_PATH + 1];
+	ptp_data_sink sink;
+	FILE *f = NULL;
 
 	pyptp_log("pyptp_transfer_image: Getting object info\n");
 
@@ -216,10 +218,31 @@ static int pyptp_transfer_image(Camera *self, uint32_t handle, uint8_t unlock)
 		return retval;
 	}
 
+	retval = snprintf(image_path, MAX_IMAGE_PATH, "%s/image-%u.jpg", self->image_dir, self->image_index);
+
+	if (retval < 0 || retval > MAX_IMAGE_PATH)
+	{
+		pyptp_log("pyptp_transfer_image: Could not create image filename\n");
+		// Could not create filename, drop image
+	}
+	else
+	{
+		image_path[MAX_IMAGE_PATH] = '\0';
+
+		pyptp_log("pyptp_transfer_image: Opening \"%s\" for writing\n", image_path);
+		f = fopen(image_path, "wb");
+
+		if (!f)
+		{
+			pyptp_log("pyptp_transfer_image: Could not open file\n");
+		}
+	}
+
 	pyptp_log("pyptp_transfer_image: Getting object data\n");
 
-	// Get the object's data
-	retval = ptp_pima_get_object(self->ptpdev, handle, &image_data);
+	// Get the object's data, writing it to the file as it arrives (or dropping it if there is no file)
+	ptp_sink_init_file(&sink, f);
+	retval = ptp_pima_get_object_stream(self->ptpdev, handle, &sink);
 
 	// Unlock the transfer mutex if needed
 	if (unlock)
@@ -228,50 +251,29 @@ static int pyptp_transfer_image(Camera *self, uint32_t handle, uint8_t unlock)
 		pthread_mutex_unlock(&self->mutex_transfer);
 	}
 
-	if (retval >= 0)
+	if (f)
 	{
-		char image_path[MAX_IMAGE_PATH + 1];
-
-		pyptp_log("pyptp_transfer_image: Got %d bytes\n", retval);
-
-		image_size = retval;
+		pyptp_log("pyptp_transfer_image: Closing file\n");
+		fclose(f);
 
-		retval = snprintf(image_path, MAX_IMAGE_PATH, "%s/image-%u.jpg", self->image_dir, self->image_index);
-
-		if (retval < 0 || retval > MAX_IMAGE_PATH)
+		// Don't leave a truncated image behind
+		if (retval < 0)
 		{
-			pyptp_log("pyptp_transfer_image: Could not create image filename\n");
-			// Could not create filename, drop image
+			remove(image_path);
 		}
-		else
-		{
-			FILE *f;
-
-			image_path[MAX_IMAGE_PATH] = '\0';
-
-			pyptp_log("pyptp_transfer_image: Opening \"%s\" for writing\n", image_path);
-			f = fopen(image_path, "wb");
-
-			if (f)
-			{
-				pyptp_log("pyptp_transfer_image: Writing image data\n");
-				fwrite(image_data, 1, image_size, f);
+	}
 
-				pyptp_log("pyptp_transfer_image: Closing file\n");
-				fclose(f);
+	if (retval >= 0)
+	{
+		pyptp_log("pyptp_transfer_image: Got %d bytes\n", retval);
 
-				pyptp_log("pyptp_transfer_image: Calling callback\n");
-				pyptp_call_callback(self, image_path);
-				pyptp_log("pyptp_transfer_image: Callback done\n");
-			}
-			else
-			{
-				pyptp_log("pyptp_transfer_image: Could not open file\n");
-			}
+		if (f)
+		{
+			pyptp_log("pyptp_transfer_image: Calling callback\n");
+			pyptp_call_callback(self, image_path);
+			pyptp_log("pyptp_transfer_image: Callback done\n");
 		}
 
-		free(image_data);
-
 		self->image_index++;
 
 		retval = PTP_OK;
@@ -1057,6 +1059,7 @@ static PyObject * Camera_setparams(Camera *self, PyObject *args, PyObject *kwds)
 static PyObject * Camera_getbattery(Camera *self, PyObject *args)
 {
 	int ret;
+	int8_t level;
 
 	if (!self->ptpdev)
 	{
@@ -1069,15 +1072,15 @@ static PyObject * Camera_getbattery(Camera *self, PyObject *args)
 		return NULL;
 	}
 
-	ret = ptp_sony_get_battery(self->ptpdev);
+	ret = ptp_sony_get_battery(self->ptpdev, &level);
 
 	Camera_unlock_transfer(self);
 
-	if (ret < 0)
+	if (ret != PTP_OK)
 	{
 		PyErr_Format(PyExc_RuntimeError, "Could not get battery level: PTP error %d", ret);
 		return NULL;
 	}
 
-	return PyInt_FromLong(ret);
+	return PyInt_FromLong(level);
 }
@@ -0,0 +1,457 @@
+/*
+ * Feeds the data phases of a recorded trace back through the decoders at
+ * full speed and reports the time per decode, for results that are reused
+ * across decodes, fresh results that grow while decoding and fresh results
+ * sized ahead of the decode
+ *
+ * Usage: tracereplay trace [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ptp.h"
+#include "ptp-pima.h"
+#include "ptp-sony.h"
+#include "ptp-trace.h"
+
+#define REPLAY_ITERATIONS	1000
+#define REPLAY_MAX_SAMPLES	4096
+
+typedef struct _replay_sample
+{
+	void *data;
+	uint32_t size;
+	uint32_t transaction_id;
+} replay_sample;
+
+// Reused: one result for every decode, the way a polling client keeps one, 
+// so its buffer only grows on the first pass. Grow: a fresh result per 
+// decode, growing as the decoder appends. Sized: a fresh result per decode, 
+// sized by the sizing pass and grown once before decoding.
+#define REPLAY_REUSED		0
+#define REPLAY_GROW			1
+#define REPLAY_SIZED		2
+#define REPLAY_MODES		3
+
+typedef struct _replay_decoder
+{
+	const char *name;
+	uint16_t code;
+	int (*create)(void **result);
+	void (*destroy)(void *result);
+	void (*clear)(void *result);
+	dynbuf * (*get_buf)(void *result);
+	ptp_pima_size_func size;
+	int (*decode)(ptp_pima_decode_context *ctx, void *result);
+	int (*decode_sized)(ptp_pima_decode_context *ctx, void *result);
+	void *result;
+	replay_sample samples[REPLAY_MAX_SAMPLES];
+	int count;
+	int truncated;
+	int failed;
+	uint64_t bytes;
+	uint64_t decodes;
+	uint64_t ns[REPLAY_MODES];
+} replay_decoder;
+
+static int create_prop_desc_list(void **result)
+{
+	return ptp_pima_proplist_create((ptp_pima_prop_desc_list **)result);
+}
+
+static void destroy_prop_desc_list(void *result)
+{
+	ptp_pima_proplist_free(result);
+}
+
+static void clear_prop_desc_list(void *result)
+{
+	ptp_pima_proplist_clear(result);
+}
+
+static dynbuf *get_buf_prop_desc_list(void *result)
+{
+	return ((ptp_pima_prop_desc_list *)result)->buf;
+}
+
+static int decode_prop_desc_list(ptp_pima_decode_context *ctx, void *result)
+{
+	return ptp_sony_decode_prop_desc_list(ctx, result);
+}
+
+static int decode_sized_prop_desc_list(ptp_pima_decode_context *ctx, void *result)
+{
+	return ptp_sony_decode_prop_desc_list_sized(ctx, result);
+}
+
+static int create_device_info(void **result)
+{
+	return ptp_pima_devinfo_create((ptp_pima_device_info **)result);
+}
+
+static void destroy_device_info(void *result)
+{
+	ptp_pima_devinfo_free(result);
+}
+
+static void clear_device_info(void *result)
+{
+	ptp_pima_devinfo_clear(result);
+}
+
+static dynbuf *get_buf_device_info(void *result)
+{
+	return ((ptp_pima_device_info *)result)->buf;
+}
+
+static int decode_device_info(ptp_pima_decode_context *ctx, void *result)
+{
+	return ptp_sony_decode_device_info(ctx, result);
+}
+
+static int decode_sized_device_info(ptp_pima_decode_context *ctx, void *result)
+{
+	return ptp_sony_decode_device_info_sized(ctx, result);
+}
+
+static int create_object_info(void **result)
+{
+	return ptp_pima_objinfo_create((ptp_pima_object_info **)result);
+}
+
+static void destroy_object_info(void *result)
+{
+	ptp_pima_objinfo_free(result);
+}
+
+static void clear_object_info(void *result)
+{
+	ptp_pima_objinfo_clear(result);
+}
+
+static dynbuf *get_buf_object_info(void *result)
+{
+	return ((ptp_pima_object_info *)result)->buf;
+}
+
+static int decode_object_info(ptp_pima_decode_context *ctx, void *result)
+{
+	return ptp_pima_decode_object_info(ctx, result);
+}
+
+static int decode_sized_object_info(ptp_pima_decode_context *ctx, void *result)
+{
+	return ptp_pima_decode_object_info_sized(ctx, result);
+}
+
+static replay_decoder decoders[] =
+{
+	{
+		"GetAllDevPropData", PTP_OP_SONY_GETALLDEVPROPDATA,
+		create_prop_desc_list, destroy_prop_desc_list, clear_prop_desc_list, get_buf_prop_desc_list,
+		ptp_sony_size_prop_desc_list, decode_prop_desc_list, decode_sized_prop_desc_list
+	},
+	{
+		"GetSDIOExtDevInfo", PTP_OP_SONY_GETSDIOEXTDEVINFO,
+		create_device_info, destroy_device_info, clear_device_info, get_buf_device_info,
+		ptp_sony_size_device_info, decode_device_info, decode_sized_device_info
+	},
+	{
+		"GetObjectInfo", PTP_OP_PIMA_GetObjectInfo,
+		create_object_info, destroy_object_info, clear_object_info, get_buf_object_info,
+		ptp_pima_size_object_info, decode_object_info, decode_sized_object_info
+	},
+};
+
+#define DECODER_COUNT	(sizeof(decoders) / sizeof(decoders[0]))
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int load_trace(const char *path, uint64_t *records)
+{
+	ptp_trace_reader reader;
+	ptp_trace_record record;
+	replay_decoder *decoder;
+	void *payload;
+	int ret, i;
+	
+	ret = ptp_trace_reader_open(&reader, path);
+	
+	if (ret != PTP_OK)
+	{
+		return ret;
+	}
+	
+	*records = 0;
+	
+	while ((ret = ptp_trace_reader_next(&reader, &record, &payload)) > 0)
+	{
+		(*records)++;
+		
+		if (record.direction != PTP_TRACE_IN || record.phase != PTP_TRACE_DATA)
+		{
+			continue;
+		}
+		
+		for (i = 0, decoder = NULL; i < DECODER_COUNT; i++)
+		{
+			if (decoders[i].code == record.code)
+			{
+				decoder = &decoders[i];
+				break;
+			}
+		}
+		
+		if (!decoder)
+		{
+			continue;
+		}
+		
+		if (record.stored < record.length)
+		{
+			decoder->truncated++;
+			continue;
+		}
+		
+		if (decoder->count == REPLAY_MAX_SAMPLES)
+		{
+			continue;
+		}
+		
+		decoder->samples[decoder->count].data = malloc(record.stored ? record.stored : 1);
+		
+		if (!decoder->samples[decoder->count].data)
+		{
+			ret = PTP_ERROR_MEMORY;
+			break;
+		}
+		
+		memcpy(decoder->samples[decoder->count].data, payload, record.stored);
+		decoder->samples[decoder->count].size = record.stored;
+		decoder->samples[decoder->count].transaction_id = record.transaction_id;
+		decoder->count++;
+	}
+	
+	ptp_trace_reader_close(&reader);
+	
+	return (ret < 0) ? ret : PTP_OK;
+}
+
+// Decodes one data phase into 'result', which has been cleared or is fresh
+static int replay_decode(replay_decoder *decoder, void *data, uint32_t size, void *result, int mode)
+{
+	ptp_pima_decode_context ctx;
+	
+	ctx.ptr = data;
+	ctx.size = size;
+	ctx.buf = decoder->get_buf(result);
+	
+	if (mode == REPLAY_SIZED)
+	{
+		return decoder->decode_sized(&ctx, result);
+	}
+	
+	return decoder->decode(&ctx, result);
+}
+
+static int replay_sample_run(replay_decoder *decoder, replay_sample *sample, int iterations, int mode, uint64_t *ns)
+{
+	void *result, *data;
+	uint64_t start;
+	int i, ret;
+	
+	// Timed as a whole, reading the clock per decode would dominate small phases
+	start = now_ns();
+	
+	for (i = 0; i < iterations; i++)
+	{
+		if (mode == REPLAY_REUSED)
+		{
+			result = decoder->result;
+			decoder->clear(result);
+			
+			ret = replay_decode(decoder, sample->data, sample->size, result, mode);
+		}
+		else
+		{
+			// Same order as the ptp_*_get_* calls: the result is created 
+			// first and the data phase is received into a buffer behind it, 
+			// so a growing result can not simply be extended in place
+			if (decoder->create(&result) != PTP_OK)
+			{
+				return PTP_ERROR_MEMORY;
+			}
+			
+			data = malloc(sample->size ? sample->size : 1);
+			
+			if (!data)
+			{
+				decoder->destroy(result);
+				return PTP_ERROR_MEMORY;
+			}
+			
+			memcpy(data, sample->data, sample->size);
+			
+			ret = replay_decode(decoder, data, sample->size, result, mode);
+			
+			free(data);
+			decoder->destroy(result);
+		}
+		
+		if (ret != PTP_OK)
+		{
+			return ret;
+		}
+	}
+	
+	*ns = now_ns() - start;
+	
+	return PTP_OK;
+}
+
+// The sizing pass has to account for every byte the decoder appends, 
+// otherwise the sized mode would quietly fall back to growing
+static int replay_sample_check(replay_decoder *decoder, replay_sample *sample)
+{
+	ptp_pima_decode_context ctx;
+	void *result;
+	size_t size = 0;
+	int ret;
+	
+	ctx.ptr = sample->data;
+	ctx.size = sample->size;
+	ctx.buf = NULL;
+	
+	ret = decoder->size(&ctx, &size);
+	
+	if (ret != PTP_OK)
+	{
+		return ret;
+	}
+	
+	if (decoder->create(&result) != PTP_OK)
+	{
+		return PTP_ERROR_MEMORY;
+	}
+	
+	ret = replay_decode(decoder, sample->data, sample->size, result, REPLAY_SIZED);
+	
+	if (ret == PTP_OK && decoder->get_buf(result)->size != size)
+	{
+		fprintf(stderr, "%s: transaction 0x%08x decodes to %zu bytes, %zu sized\n", decoder->name, sample->transaction_id, decoder->get_buf(result)->size, size);
+		ret = PTP_ERROR_DATA_LEN;
+	}
+	
+	decoder->destroy(result);
+	
+	return ret;
+}
+
+static void replay_sample_bench(replay_decoder *decoder, replay_sample *sample, int iterations)
+{
+	uint64_t ns[REPLAY_MODES];
+	int mode, ret;
+	
+	ret = replay_sample_check(decoder, sample);
+	
+	for (mode = 0; mode < REPLAY_MODES && ret == PTP_OK; mode++)
+	{
+		ret = replay_sample_run(decoder, sample, iterations, mode, &ns[mode]);
+	}
+	
+	if (ret != PTP_OK)
+	{
+		fprintf(stderr, "%s: transaction 0x%08x does not decode: %d\n", decoder->name, sample->transaction_id, ret);
+		decoder->failed++;
+		return;
+	}
+	
+	for (mode = 0; mode < REPLAY_MODES; mode++)
+	{
+		decoder->ns[mode] += ns[mode];
+	}
+	
+	decoder->decodes += iterations;
+	decoder->bytes += (uint64_t)sample->size * iterations;
+}
+
+int main(int argc, char **argv)
+{
+	replay_decoder *decoder;
+	uint64_t records;
+	int iterations, i, j, ret;
+	
+	if (argc < 2)
+	{
+		printf("Usage: %s trace [iterations]\n", argv[0]);
+		return 1;
+	}
+	
+	iterations = (argc > 2) ? atoi(argv[2]) : REPLAY_ITERATIONS;
+	
+	if (iterations < 1)
+	{
+		iterations = 1;
+	}
+	
+	ret = load_trace(argv[1], &records);
+	
+	if (ret != PTP_OK)
+	{
+		printf("%s: %d\n", argv[1], ret);
+		return 1;
+	}
+	
+	for (i = 0; i < DECODER_COUNT; i++)
+	{
+		if (decoders[i].create(&decoders[i].result) != PTP_OK)
+		{
+			printf("PTP_ERROR_MEMORY\n");
+			return 1;
+		}
+	}
+	
+	printf("%llu record(s), %d iteration(s) per data phase, ns per decode\n\n", (unsigned long long)records, iterations);
+	printf("%-18s %8s %10s %10s %10s %10s %8s %10s %8s\n", "Decoder", "Phases", "Truncated", "Reused", "Grow", "Sized", "Speedup", "MB/s", "Failed");
+	
+	for (i = 0; i < DECODER_COUNT; i++)
+	{
+		decoder = &decoders[i];
+		
+		for (j = 0; j < decoder->count; j++)
+		{
+			replay_sample_bench(decoder, &decoder->samples[j], iterations);
+			free(decoder->samples[j].data);
+		}
+		
+		decoder->destroy(decoder->result);
+		
+		if (decoder->decodes == 0)
+		{
+			printf("%-18s %8d %10d %10s %10s %10s %8s %10s %8d\n", decoder->name, decoder->count, decoder->truncated, "-", "-", "-", "-", "-", decoder->failed);
+			continue;
+		}
+		
+		// Speedup of sizing over growing, MB/s of the sized decode
+		printf("%-18s %8d %10d %10llu %10llu %10llu %7.2fx %10.1f %8d\n",
+			decoder->name, decoder->count, decoder->truncated,
+			(unsigned long long)(decoder->ns[REPLAY_REUSED] / decoder->decodes),
+			(unsigned long long)(decoder->ns[REPLAY_GROW] / decoder->decodes),
+			(unsigned long long)(decoder->ns[REPLAY_SIZED] / decoder->decodes),
+			decoder->ns[REPLAY_SIZED] ? (double)decoder->ns[REPLAY_GROW] / (double)decoder->ns[REPLAY_SIZED] : 0.0,
+			decoder->ns[REPLAY_SIZED] ? ((double)decoder->bytes / (double)decoder->ns[REPLAY_SIZED]) * (1000000000.0 / (1024.0 * 1024.0)) : 0.0,
+			decoder->failed
+		);
+	}
+	
+	return 0;
+}
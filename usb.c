@@ -1,24 +1,45 @@
 #include "usb.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Only used when libusb cannot interrupt the event handler
+#define USB_EVENT_POLL_MS	100
 
 static void *usb_event_thread_proc(void *p)
 {
 	usb_context *ctx = p;
+	#if LIBUSB_API_VERSION < 0x01000105
+	struct timeval tv;
+	#endif
 	
-	while (sem_trywait(&ctx->sem_stop) != 0)
+	while (!ctx->stop)
 	{
-		libusb_handle_events(ctx->ctx);
+		#if LIBUSB_API_VERSION >= 0x01000105
+		// usb_close() wakes this up with libusb_interrupt_event_handler()
+		libusb_handle_events_completed(ctx->ctx, (int *)&ctx->stop);
+		#else
+		tv.tv_sec = 0;
+		tv.tv_usec = USB_EVENT_POLL_MS * 1000;
+		libusb_handle_events_timeout_completed(ctx->ctx, &tv, (int *)&ctx->stop);
+		#endif
 	}
 	
 	return NULL;
 }
 
 int usb_init(usb_context **context)
+{
+	return usb_init_mode(context, USB_EVENTS_THREAD);
+}
+
+int usb_init_mode(usb_context **context, int mode)
 {
 	int retval;
 	usb_context *ctx;
 	
-	if (context == NULL)
+	if (context == NULL || (mode != USB_EVENTS_THREAD && mode != USB_EVENTS_EXTERNAL))
 	{
 		return USB_ERROR_PARAM;
 	}
@@ -32,6 +53,8 @@ int usb_init(usb_context **context)
 	
 	ctx->devcount = 0;
 	ctx->thread_events_valid = 0;
+	ctx->mode = mode;
+	ctx->stop = 0;
 	
 	retval = pthread_mutex_init(&ctx->mutex_devcount, NULL);
 	
@@ -41,20 +64,10 @@ int usb_init(usb_context **context)
 		return USB_ERROR_MUTEX;
 	}
 	
-	retval = sem_init(&ctx->sem_stop, 0, 0);
-	
-	if (retval)
-	{
-		pthread_mutex_destroy(&ctx->mutex_devcount);
-		free(ctx);
-		return USB_ERROR_SEMAPHORE;
-	}
-	
 	retval = libusb_init(&ctx->ctx);
 	
 	if (retval)
 	{
-		sem_destroy(&ctx->sem_stop);
 		pthread_mutex_destroy(&ctx->mutex_devcount);
 		free(ctx);
 		return retval;
@@ -73,41 +86,108 @@ void usb_exit(usb_context *context)
 	}
 	
 	libusb_exit(context->ctx);
-	sem_destroy(&context->sem_stop);
 	pthread_mutex_destroy(&context->mutex_devcount);
 }
 
-usb_device_handle *usb_open_device_with_vid_pid(usb_context *ctx, int vid, int pid)
+// External mode: fills 'fds' with the descriptors libusb needs watched and 
+// returns their number
+int usb_get_pollfds(usb_context *context, struct pollfd *fds, int max_fds)
 {
-	usb_device_handle *dev;
+	const struct libusb_pollfd **pollfds;
+	int i;
+	
+	if (!context || !fds)
+	{
+		return USB_ERROR_PARAM;
+	}
+	
+	pollfds = libusb_get_pollfds(context->ctx);
+	
+	if (!pollfds)
+	{
+		return USB_ERROR_MEMORY;
+	}
+	
+	for (i = 0; pollfds[i] && i < max_fds; i++)
+	{
+		fds[i].fd = pollfds[i]->fd;
+		fds[i].events = pollfds[i]->events;
+		fds[i].revents = 0;
+	}
+	
+	libusb_free_pollfds(pollfds);
+	
+	return i;
+}
+
+// External mode: the longest the application may sleep before calling 
+// usb_handle_events(), in ms, or -1 if there is no pending timeout
+int usb_get_next_timeout(usb_context *context)
+{
+	struct timeval tv;
 	int retval;
 	
-	if (!ctx)
+	if (!context)
 	{
-		return NULL;
+		return -1;
 	}
 	
-	dev = malloc(sizeof(usb_device_handle));
+	retval = libusb_get_next_timeout(context->ctx, &tv);
 	
-	if (!dev)
+	if (retval <= 0)
 	{
-		return NULL;
+		return -1;
 	}
 	
-	dev->ctx = ctx;
-	dev->handle = libusb_open_device_with_vid_pid(ctx->ctx, vid, pid);
+	return (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+}
+
+// External mode: handles whatever is ready without blocking
+int usb_handle_events(usb_context *context)
+{
+	struct timeval tv = { 0, 0 };
+	
+	if (!context)
+	{
+		return USB_ERROR_PARAM;
+	}
+	
+	return libusb_handle_events_timeout_completed(context->ctx, &tv, NULL);
+}
+
+// External mode: lets an epoll loop follow descriptors as libusb adds and removes them
+void usb_set_pollfd_notifiers(usb_context *context, libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb, void *user_data)
+{
+	if (context)
+	{
+		libusb_set_pollfd_notifiers(context->ctx, added_cb, removed_cb, user_data);
+	}
+}
+
+// Wraps an open libusb handle, starting the event thread with the first device
+static usb_device_handle *usb_attach(usb_context *ctx, libusb_device_handle *handle)
+{
+	usb_device_handle *dev;
+	int retval;
+	
+	dev = malloc(sizeof(usb_device_handle));
 	
-	if (!dev->handle)
+	if (!dev)
 	{
-		free(dev);
+		libusb_close(handle);
 		return NULL;
 	}
 	
+	dev->ctx = ctx;
+	dev->handle = handle;
+	
 	pthread_mutex_lock(&ctx->mutex_devcount);
 	
-	if (ctx->devcount == 0)
+	if (ctx->devcount == 0 && ctx->mode == USB_EVENTS_THREAD)
 	{
-		// Create the event thread after opening the first device
+		// Create the event thread after opening the first device. A single 
+		// thread serves all devices of the context.
+		ctx->stop = 0;
 		retval = pthread_create(&ctx->thread_events, NULL, usb_event_thread_proc, ctx);
 		
 		if (retval)
@@ -117,6 +197,8 @@ usb_device_handle *usb_open_device_with_vid_pid(usb_context *ctx, int vid, int p
 			free(dev);
 			return NULL;
 		}
+		
+		ctx->thread_events_valid = 1;
 	}
 	
 	ctx->devcount++;
@@ -126,6 +208,182 @@ usb_device_handle *usb_open_device_with_vid_pid(usb_context *ctx, int vid, int p
 	return dev;
 }
 
+static void usb_device_path(libusb_device *device, char *path, size_t size)
+{
+	uint8_t ports[8];
+	int count, i, len;
+	
+	len = snprintf(path, size, "%u", libusb_get_bus_number(device));
+	count = libusb_get_port_numbers(device, ports, sizeof(ports));
+	
+	for (i = 0; i < count && len > 0 && (size_t)len < size; i++)
+	{
+		len += snprintf(path + len, size - len, "%c%u", (i == 0) ? '-' : '.', ports[i]);
+	}
+}
+
+// Walks the device list and opens the first device matching all given 
+// criteria. vid/pid of -1 and NULL serial/path match anything. With 'list' 
+// set, nothing is kept open and every match is stored instead.
+static int usb_find(usb_context *ctx, int vid, int pid, const char *serial, const char *path, 
+	libusb_device_handle **handle, usb_device_info *list, int max_count)
+{
+	libusb_device **devices;
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *h;
+	usb_device_info info;
+	ssize_t count, i;
+	int found = 0, retval;
+	
+	count = libusb_get_device_list(ctx->ctx, &devices);
+	
+	if (count < 0)
+	{
+		return (int)count;
+	}
+	
+	for (i = 0; i < count; i++)
+	{
+		if (libusb_get_device_descriptor(devices[i], &desc) != 0)
+		{
+			continue;
+		}
+		
+		if ((vid >= 0 && desc.idVendor != vid) || (pid >= 0 && desc.idProduct != pid))
+		{
+			continue;
+		}
+		
+		memset(&info, 0, sizeof(info));
+		info.vid = desc.idVendor;
+		info.pid = desc.idProduct;
+		usb_device_path(devices[i], info.path, sizeof(info.path));
+		
+		if (path && strcmp(path, info.path) != 0)
+		{
+			continue;
+		}
+		
+		// The serial number can only be read from an open device. One that 
+		// cannot be opened (no permission, claimed by a driver) is still 
+		// listed, with an empty serial.
+		if (libusb_open(devices[i], &h) != 0)
+		{
+			if (!list || serial)
+			{
+				continue;
+			}
+			
+			h = NULL;
+		}
+		
+		if (h && desc.iSerialNumber)
+		{
+			retval = libusb_get_string_descriptor_ascii(h, desc.iSerialNumber, (unsigned char *)info.serial, sizeof(info.serial) - 1);
+			
+			if (retval < 0)
+			{
+				info.serial[0] = 0;
+			}
+		}
+		
+		if (serial && strcmp(serial, info.serial) != 0)
+		{
+			libusb_close(h);
+			continue;
+		}
+		
+		if (list)
+		{
+			if (h)
+			{
+				libusb_close(h);
+			}
+			
+			if (found < max_count)
+			{
+				list[found] = info;
+			}
+			
+			found++;
+			continue;
+		}
+		
+		*handle = h;
+		found = 1;
+		break;
+	}
+	
+	libusb_free_device_list(devices, 1);
+	
+	return found;
+}
+
+// Lists the attached devices with the given vid/pid (-1 for any). Returns the 
+// number of matches, which may exceed 'max_count', or a libusb error.
+int usb_enumerate(usb_context *ctx, int vid, int pid, usb_device_info *list, int max_count)
+{
+	if (!ctx || !list || max_count < 0)
+	{
+		return USB_ERROR_PARAM;
+	}
+	
+	return usb_find(ctx, vid, pid, NULL, NULL, NULL, list, max_count);
+}
+
+usb_device_handle *usb_open_device_with_vid_pid(usb_context *ctx, int vid, int pid)
+{
+	libusb_device_handle *handle;
+	
+	if (!ctx)
+	{
+		return NULL;
+	}
+	
+	handle = libusb_open_device_with_vid_pid(ctx->ctx, vid, pid);
+	
+	if (!handle)
+	{
+		return NULL;
+	}
+	
+	return usb_attach(ctx, handle);
+}
+
+usb_device_handle *usb_open_device_with_serial(usb_context *ctx, int vid, int pid, const char *serial)
+{
+	libusb_device_handle *handle;
+	
+	if (!ctx || !serial)
+	{
+		return NULL;
+	}
+	
+	if (usb_find(ctx, vid, pid, serial, NULL, &handle, NULL, 0) <= 0)
+	{
+		return NULL;
+	}
+	
+	return usb_attach(ctx, handle);
+}
+
+usb_device_handle *usb_open_device_with_path(usb_context *ctx, const char *path)
+{
+	libusb_device_handle *handle;
+	
+	if (!ctx || !path)
+	{
+		return NULL;
+	}
+	
+	if (usb_find(ctx, -1, -1, NULL, path, &handle, NULL, 0) <= 0)
+	{
+		return NULL;
+	}
+	
+	return usb_attach(ctx, handle);
+}
+
 void usb_close(usb_device_handle *dev)
 {
 	if (!dev)
@@ -135,20 +393,19 @@ void usb_close(usb_device_handle *dev)
 	
 	pthread_mutex_lock(&dev->ctx->mutex_devcount);
 	
-	if (dev->ctx->devcount == 1)
+	if (dev->ctx->devcount == 1 && dev->ctx->thread_events_valid)
 	{
-		// Signal the event thread to stop
-		sem_post(&dev->ctx->sem_stop);
+		// Stop the event thread, waking it up right away where libusb allows
+		dev->ctx->stop = 1;
+		#if LIBUSB_API_VERSION >= 0x01000105
+		libusb_interrupt_event_handler(dev->ctx->ctx);
+		#endif
+		pthread_join(dev->ctx->thread_events, NULL);
+		dev->ctx->thread_events_valid = 0;
 	}
 	
 	libusb_close(dev->handle);
 	
-	if (dev->ctx->devcount == 1)
-	{
-		// Wait for the event thread
-		pthread_join(dev->ctx->thread_events, NULL);
-	}
-	
 	dev->ctx->devcount--;
 	
 	pthread_mutex_unlock(&dev->ctx->mutex_devcount);
@@ -1,8 +1,10 @@
 #ifndef __USB_H__
 #define __USB_H__
 
+#include <stdint.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <poll.h>
 #include <libusb-1.0/libusb.h>
 
 #define USB_OK						0
@@ -12,6 +14,13 @@
 #define USB_ERROR_SEMAPHORE			(USB_ERROR_BASE-3)
 #define USB_ERROR_MEMORY			(USB_ERROR_BASE-4)
 
+// Event handling modes
+#define USB_EVENTS_THREAD			0	// usb.c runs its own event thread
+#define USB_EVENTS_EXTERNAL			1	// The application polls usb_get_pollfds()
+
+#define USB_PATH_SIZE				32
+#define USB_SERIAL_SIZE				64
+
 typedef struct _usb_context
 {
 	libusb_context *ctx;
@@ -19,7 +28,8 @@ typedef struct _usb_context
 	int thread_events_valid;
 	pthread_mutex_t mutex_devcount;
 	int devcount;
-	sem_t sem_stop;
+	int mode;
+	volatile int stop;
 } usb_context;
 
 typedef struct _usb_device_handle
@@ -28,9 +38,28 @@ typedef struct _usb_device_handle
 	usb_context *ctx;
 } usb_device_handle;
 
+// Identifies one attached device. 'path' is the bus and port chain as in 
+// sysfs ("1-2.3") and does not change while the device stays plugged into 
+// the same port.
+typedef struct _usb_device_info
+{
+	uint16_t vid;
+	uint16_t pid;
+	char path[USB_PATH_SIZE];
+	char serial[USB_SERIAL_SIZE];
+} usb_device_info;
+
 int usb_init(usb_context **context);
+int usb_init_mode(usb_context **context, int mode);
+int usb_get_pollfds(usb_context *context, struct pollfd *fds, int max_fds);
+int usb_get_next_timeout(usb_context *context);
+int usb_handle_events(usb_context *context);
+void usb_set_pollfd_notifiers(usb_context *context, libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb, void *user_data);
 void usb_exit(usb_context *context);
+int usb_enumerate(usb_context *ctx, int vid, int pid, usb_device_info *list, int max_count);
 usb_device_handle *usb_open_device_with_vid_pid(usb_context *ctx, int vid, int pid);
+usb_device_handle *usb_open_device_with_serial(usb_context *ctx, int vid, int pid, const char *serial);
+usb_device_handle *usb_open_device_with_path(usb_context *ctx, const char *path);
 void usb_close(usb_device_handle *dev);
 
 #endif // __USB_H__
@@ -0,0 +1,700 @@
+/*
+ * Reassembles the PTP containers of a Linux usbmon capture (tcpdump -i usbmonN -w)
+ * into per-opcode payload files, a manifest and a trace for tracereplay
+ *
+ * Usage: usbmonimport [-d bus:dev] [-m max_data] capture.pcap outdir
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ptp.h"
+#include "ptp-trace.h"
+
+#define PCAP_MAGIC_USEC		0xA1B2C3D4
+#define PCAP_MAGIC_NSEC		0xA1B23C4D
+#define PCAPNG_MAGIC		0x0A0D0D0A
+
+#define LINKTYPE_USB_LINUX			189
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+#define USBMON_SUBMIT		'S'
+#define USBMON_COMPLETE		'C'
+
+#define USBMON_XFER_INTERRUPT	1
+#define USBMON_XFER_CONTROL		2
+#define USBMON_XFER_BULK		3
+
+#define USBMON_HEADER_SIZE			48
+#define USBMON_MMAPPED_HEADER_SIZE	64
+
+#define CONTAINER_HEADER_SIZE	12
+
+// Still image class requests that throw away whatever is in flight
+#define PTP_REQ_TYPE_CLASS_OUT	0x21
+#define PTP_REQ_CANCEL			0x64
+#define PTP_REQ_DEVICE_RESET	0x66
+
+#define IMPORT_MAX_STREAMS	8
+#define IMPORT_MAX_OPCODES	256
+#define IMPORT_PATH_SIZE	4096
+
+#pragma pack(push, 1)
+
+typedef struct _pcap_file_header
+{
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+} pcap_file_header;
+
+typedef struct _pcap_packet_header
+{
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t incl_len;
+	uint32_t orig_len;
+} pcap_packet_header;
+
+// Binary usbmon header, in the byte order of the capturing host
+typedef struct _usbmon_header
+{
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	int8_t flag_setup;
+	int8_t flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[8];
+} usbmon_header;
+
+#pragma pack(pop)
+
+// One endpoint's container being reassembled from its URBs
+typedef struct _import_stream
+{
+	uint8_t epnum;
+	uint8_t *buf;
+	uint32_t keep;			// Bytes of the container kept, header included
+	uint32_t len;			// Container length, 0 while waiting for a header
+	uint32_t received;		// Bytes seen on the wire
+	uint32_t stored;		// Bytes captured contiguously from the start
+	int gap;
+} import_stream;
+
+typedef struct _import_opcode
+{
+	uint16_t code;
+	uint32_t count;
+	uint64_t bytes;
+} import_opcode;
+
+typedef struct _import_context
+{
+	const char *outdir;
+	FILE *manifest;
+	FILE *trace;
+	int swapped;
+	int bus;
+	int dev;
+	uint32_t max_data;
+	uint64_t first_ns;
+	import_stream streams[IMPORT_MAX_STREAMS];
+	int stream_count;
+	import_opcode opcodes[IMPORT_MAX_OPCODES];
+	int opcode_count;
+	uint32_t containers[PTP_TRACE_EVENT + 1];
+	uint32_t index;
+	uint32_t truncated;
+	uint32_t unsynchronized;
+	uint32_t resets;
+} import_context;
+
+static uint16_t get16(const import_context *ctx, uint16_t v)
+{
+	return ctx->swapped ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t get32(const import_context *ctx, uint32_t v)
+{
+	return ctx->swapped ? __builtin_bswap32(v) : v;
+}
+
+static uint64_t get64(const import_context *ctx, uint64_t v)
+{
+	return ctx->swapped ? __builtin_bswap64(v) : v;
+}
+
+static import_stream *import_get_stream(import_context *ctx, uint8_t epnum)
+{
+	import_stream *stream;
+	int i;
+	
+	for (i = 0; i < ctx->stream_count; i++)
+	{
+		if (ctx->streams[i].epnum == epnum)
+		{
+			return &ctx->streams[i];
+		}
+	}
+	
+	if (ctx->stream_count == IMPORT_MAX_STREAMS)
+	{
+		return NULL;
+	}
+	
+	stream = &ctx->streams[ctx->stream_count++];
+	memset(stream, 0, sizeof(*stream));
+	stream->epnum = epnum;
+	
+	return stream;
+}
+
+static void import_reset_streams(import_context *ctx)
+{
+	int i;
+	
+	for (i = 0; i < ctx->stream_count; i++)
+	{
+		ctx->streams[i].len = 0;
+	}
+}
+
+static void import_count_opcode(import_context *ctx, uint16_t code, uint32_t bytes)
+{
+	int i;
+	
+	for (i = 0; i < ctx->opcode_count; i++)
+	{
+		if (ctx->opcodes[i].code == code)
+		{
+			break;
+		}
+	}
+	
+	if (i == ctx->opcode_count)
+	{
+		if (ctx->opcode_count == IMPORT_MAX_OPCODES)
+		{
+			return;
+		}
+		
+		ctx->opcodes[i].code = code;
+		ctx->opcodes[i].count = 0;
+		ctx->opcodes[i].bytes = 0;
+		ctx->opcode_count++;
+	}
+	
+	ctx->opcodes[i].count++;
+	ctx->opcodes[i].bytes += bytes;
+}
+
+// Writes out a complete container: the trace record, the manifest line and, 
+// for data phases, the payload file
+static int import_emit(import_context *ctx, import_stream *stream, uint64_t ts_ns)
+{
+	char name[64], path[IMPORT_PATH_SIZE];
+	ptp_trace_record record;
+	const uint8_t *payload;
+	FILE *f;
+	
+	record.timestamp_ns = ts_ns;
+	record.transaction_id = le32toh(*(uint32_t *)(stream->buf + 8));
+	record.code = le16toh(*(uint16_t *)(stream->buf + 6));
+	record.phase = (uint8_t)le16toh(*(uint16_t *)(stream->buf + 4));
+	record.direction = (stream->epnum & 0x80) ? PTP_TRACE_IN : PTP_TRACE_OUT;
+	record.length = stream->len - CONTAINER_HEADER_SIZE;
+	record.stored = stream->stored - CONTAINER_HEADER_SIZE;
+	payload = stream->buf + CONTAINER_HEADER_SIZE;
+	
+	if (ctx->index == 0)
+	{
+		ctx->first_ns = ts_ns;
+	}
+	
+	if (ptp_trace_write_record(ctx->trace, &record, payload) != PTP_OK)
+	{
+		fprintf(stderr, "[import_emit] Could not write the trace\n");
+		return PTP_ERROR_IO;
+	}
+	
+	strcpy(name, "-");
+	
+	if (record.phase == PTP_TRACE_DATA && record.stored > 0)
+	{
+		snprintf(name, sizeof(name), "%05u-%04x-%s.bin", ctx->index, record.code, (record.direction == PTP_TRACE_IN) ? "in" : "out");
+		snprintf(path, sizeof(path), "%s/%s", ctx->outdir, name);
+		
+		f = fopen(path, "wb");
+		
+		if (!f || fwrite(payload, record.stored, 1, f) != 1)
+		{
+			fprintf(stderr, "[import_emit] Could not write %s\n", path);
+			
+			if (f)
+			{
+				fclose(f);
+			}
+			
+			return PTP_ERROR_IO;
+		}
+		
+		fclose(f);
+	}
+	
+	if (record.phase == PTP_TRACE_DATA)
+	{
+		import_count_opcode(ctx, record.code, record.length);
+	}
+	
+	if (record.stored < record.length && (record.phase != PTP_TRACE_DATA || record.stored < ctx->max_data))
+	{
+		// Lost to the capture, not to max_data
+		ctx->truncated++;
+	}
+	
+	fprintf(ctx->manifest, "%u\t%.6f\t0x%08x\t%s\t%u\t0x%04x\t%u\t%u\t%s\n",
+		ctx->index,
+		(double)(ts_ns - ctx->first_ns) / 1000000000.0,
+		record.transaction_id,
+		(record.direction == PTP_TRACE_IN) ? "in" : "out",
+		record.phase,
+		record.code,
+		record.length,
+		record.stored,
+		name
+	);
+	
+	if (record.phase <= PTP_TRACE_EVENT)
+	{
+		ctx->containers[record.phase]++;
+	}
+	
+	ctx->index++;
+	
+	return PTP_OK;
+}
+
+// Feeds the data of one URB into its endpoint's container. 'captured' bytes 
+// of the 'length' on the wire are at 'data'.
+static int import_urb(import_context *ctx, import_stream *stream, const uint8_t *data, uint32_t captured, uint32_t length, uint64_t ts_ns)
+{
+	uint32_t len, type, copy;
+	int ret;
+	
+	if (length == 0)
+	{
+		// Zero-length packet ending a data phase
+		return PTP_OK;
+	}
+	
+	if (stream->len == 0)
+	{
+		if (captured < CONTAINER_HEADER_SIZE)
+		{
+			ctx->unsynchronized++;
+			return PTP_OK;
+		}
+		
+		len = le32toh(*(uint32_t *)data);
+		type = le16toh(*(uint16_t *)(data + 4));
+		
+		if (len < CONTAINER_HEADER_SIZE || type < PTP_TRACE_COMMAND || type > PTP_TRACE_EVENT)
+		{
+			ctx->unsynchronized++;
+			return PTP_OK;
+		}
+		
+		stream->len = len;
+		stream->received = 0;
+		stream->stored = 0;
+		stream->gap = 0;
+		stream->keep = len;
+		
+		if (type == PTP_TRACE_DATA && len - CONTAINER_HEADER_SIZE > ctx->max_data)
+		{
+			stream->keep = CONTAINER_HEADER_SIZE + ctx->max_data;
+		}
+		
+		free(stream->buf);
+		stream->buf = malloc(stream->keep);
+		
+		if (!stream->buf)
+		{
+			stream->len = 0;
+			return PTP_ERROR_MEMORY;
+		}
+	}
+	
+	if (length > stream->len - stream->received)
+	{
+		// More than the container holds, keep what belongs to it
+		length = stream->len - stream->received;
+		
+		if (captured > length)
+		{
+			captured = length;
+		}
+	}
+	
+	if (!stream->gap && stream->stored < stream->keep)
+	{
+		copy = stream->keep - stream->stored;
+		
+		if (copy > captured)
+		{
+			copy = captured;
+		}
+		
+		memcpy(stream->buf + stream->stored, data, copy);
+		stream->stored += copy;
+	}
+	
+	if (captured < length)
+	{
+		// The rest of this URB was not captured, later bytes would not line up
+		stream->gap = 1;
+	}
+	
+	stream->received += length;
+	
+	if (stream->received < stream->len)
+	{
+		return PTP_OK;
+	}
+	
+	ret = import_emit(ctx, stream, ts_ns);
+	stream->len = 0;
+	
+	return ret;
+}
+
+// Without -d, follows the first device that sends a PTP command container
+static int import_select_device(import_context *ctx, const usbmon_header *urb, const uint8_t *data, uint32_t captured)
+{
+	uint32_t len;
+	
+	if (ctx->bus >= 0)
+	{
+		return get16(ctx, urb->busnum) == ctx->bus && urb->devnum == ctx->dev;
+	}
+	
+	if (urb->xfer_type != USBMON_XFER_BULK || urb->type != USBMON_SUBMIT || (urb->epnum & 0x80) || captured < CONTAINER_HEADER_SIZE)
+	{
+		return 0;
+	}
+	
+	len = le32toh(*(uint32_t *)data);
+	
+	if (len < CONTAINER_HEADER_SIZE || len > CONTAINER_HEADER_SIZE + PTP_MAX_PARAMS * 4 ||
+		le16toh(*(uint16_t *)(data + 4)) != PTP_TRACE_COMMAND)
+	{
+		return 0;
+	}
+	
+	ctx->bus = get16(ctx, urb->busnum);
+	ctx->dev = urb->devnum;
+	
+	printf("Following device %d:%d\n", ctx->bus, ctx->dev);
+	
+	return 1;
+}
+
+static int import_packet(import_context *ctx, const uint8_t *packet, uint32_t size, uint32_t header_size)
+{
+	const usbmon_header *urb = (const usbmon_header *)packet;
+	import_stream *stream;
+	const uint8_t *data;
+	uint32_t captured, length;
+	uint64_t ts_ns;
+	
+	if (size < header_size)
+	{
+		return PTP_OK;
+	}
+	
+	data = packet + header_size;
+	captured = get32(ctx, urb->len_cap);
+	length = get32(ctx, urb->length);
+	
+	if (captured > size - header_size)
+	{
+		captured = size - header_size;
+	}
+	
+	if (urb->flag_data != 0)
+	{
+		// No data in this event
+		captured = 0;
+	}
+	
+	if (!import_select_device(ctx, urb, data, captured))
+	{
+		return PTP_OK;
+	}
+	
+	if (urb->xfer_type == USBMON_XFER_CONTROL)
+	{
+		if (urb->type == USBMON_SUBMIT && urb->flag_setup == 0 && urb->setup[0] == PTP_REQ_TYPE_CLASS_OUT &&
+			(urb->setup[1] == PTP_REQ_CANCEL || urb->setup[1] == PTP_REQ_DEVICE_RESET))
+		{
+			import_reset_streams(ctx);
+			ctx->resets++;
+		}
+		
+		return PTP_OK;
+	}
+	
+	if (urb->xfer_type != USBMON_XFER_BULK && urb->xfer_type != USBMON_XFER_INTERRUPT)
+	{
+		return PTP_OK;
+	}
+	
+	// OUT data is captured on submission, IN data on completion
+	if (urb->type != ((urb->epnum & 0x80) ? USBMON_COMPLETE : USBMON_SUBMIT))
+	{
+		return PTP_OK;
+	}
+	
+	if (urb->type == USBMON_COMPLETE && length == 0)
+	{
+		return PTP_OK;
+	}
+	
+	stream = import_get_stream(ctx, urb->epnum);
+	
+	if (!stream)
+	{
+		return PTP_OK;
+	}
+	
+	ts_ns = get64(ctx, urb->ts_sec) * 1000000000 + (uint64_t)get32(ctx, urb->ts_usec) * 1000;
+	
+	return import_urb(ctx, stream, data, captured, length, ts_ns);
+}
+
+static int import_pcap(import_context *ctx, FILE *f)
+{
+	pcap_file_header header;
+	pcap_packet_header packet;
+	uint8_t *buf = NULL;
+	uint32_t header_size, size, capacity = 0;
+	int ret = PTP_OK;
+	
+	if (fread(&header, sizeof(header), 1, f) != 1)
+	{
+		fprintf(stderr, "[import_pcap] Not a pcap file\n");
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	if (header.magic == PCAPNG_MAGIC)
+	{
+		fprintf(stderr, "[import_pcap] pcapng is not supported, convert with: editcap -F pcap in.pcapng out.pcap\n");
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	if (header.magic == PCAP_MAGIC_USEC || header.magic == PCAP_MAGIC_NSEC)
+	{
+		ctx->swapped = 0;
+	}
+	else if (header.magic == __builtin_bswap32(PCAP_MAGIC_USEC) || header.magic == __builtin_bswap32(PCAP_MAGIC_NSEC))
+	{
+		ctx->swapped = 1;
+	}
+	else
+	{
+		fprintf(stderr, "[import_pcap] Not a pcap file\n");
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	switch (get32(ctx, header.linktype))
+	{
+	case LINKTYPE_USB_LINUX:
+		header_size = USBMON_HEADER_SIZE;
+		break;
+	
+	case LINKTYPE_USB_LINUX_MMAPPED:
+		header_size = USBMON_MMAPPED_HEADER_SIZE;
+		break;
+	
+	default:
+		fprintf(stderr, "[import_pcap] Link type %u is not a usbmon capture\n", get32(ctx, header.linktype));
+		return PTP_ERROR_DATA_LEN;
+	}
+	
+	while (fread(&packet, sizeof(packet), 1, f) == 1)
+	{
+		size = get32(ctx, packet.incl_len);
+		
+		if (size > capacity)
+		{
+			uint8_t *grown = realloc(buf, size);
+			
+			if (!grown)
+			{
+				ret = PTP_ERROR_MEMORY;
+				break;
+			}
+			
+			buf = grown;
+			capacity = size;
+		}
+		
+		if (size && fread(buf, size, 1, f) != 1)
+		{
+			fprintf(stderr, "[import_pcap] Capture ends inside a packet\n");
+			break;
+		}
+		
+		ret = import_packet(ctx, buf, size, header_size);
+		
+		if (ret != PTP_OK)
+		{
+			break;
+		}
+	}
+	
+	free(buf);
+	
+	return ret;
+}
+
+static void print_usage(const char *name)
+{
+	printf("Usage: %s [-d bus:dev] [-m max_data] capture.pcap outdir\n", name);
+	printf("  -d  Device to follow, by default the first one that sends a PTP command\n");
+	printf("  -m  Payload bytes kept per data phase, by default all\n");
+}
+
+int main(int argc, char **argv)
+{
+	import_context ctx;
+	char path[IMPORT_PATH_SIZE];
+	FILE *f;
+	int opt, ret, i;
+	
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.bus = -1;
+	ctx.dev = -1;
+	ctx.max_data = PTP_TRACE_ALL;
+	
+	while ((opt = getopt(argc, argv, "d:m:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			if (sscanf(optarg, "%d:%d", &ctx.bus, &ctx.dev) != 2)
+			{
+				print_usage(argv[0]);
+				return 1;
+			}
+			
+			break;
+		
+		case 'm':
+			ctx.max_data = (uint32_t)strtoul(optarg, NULL, 0);
+			break;
+		
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	
+	if (argc - optind != 2)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+	
+	ctx.outdir = argv[optind + 1];
+	
+	if (mkdir(ctx.outdir, 0755) != 0 && errno != EEXIST)
+	{
+		printf("Could not create %s\n", ctx.outdir);
+		return 1;
+	}
+	
+	f = fopen(argv[optind], "rb");
+	
+	if (!f)
+	{
+		printf("Could not open %s\n", argv[optind]);
+		return 1;
+	}
+	
+	snprintf(path, sizeof(path), "%s/manifest.txt", ctx.outdir);
+	ctx.manifest = fopen(path, "w");
+	
+	snprintf(path, sizeof(path), "%s/capture.trc", ctx.outdir);
+	ctx.trace = fopen(path, "wb");
+	
+	if (!ctx.manifest || !ctx.trace || ptp_trace_write_header(ctx.trace) != PTP_OK)
+	{
+		printf("Could not create the corpus in %s\n", ctx.outdir);
+		ret = PTP_ERROR_IO;
+	}
+	else
+	{
+		fprintf(ctx.manifest, "# %s\n", argv[optind]);
+		fprintf(ctx.manifest, "# index\ttime\ttransaction\tdirection\tphase\tcode\tlength\tstored\tfile\n");
+		
+		ret = import_pcap(&ctx, f);
+	}
+	
+	fclose(f);
+	
+	if (ctx.manifest)
+	{
+		fclose(ctx.manifest);
+	}
+	
+	if (ctx.trace)
+	{
+		fclose(ctx.trace);
+	}
+	
+	for (i = 0; i < ctx.stream_count; i++)
+	{
+		free(ctx.streams[i].buf);
+	}
+	
+	if (ret != PTP_OK)
+	{
+		printf("Import failed: %d\n", ret);
+		return 1;
+	}
+	
+	printf("%u container(s): %u command, %u data, %u response, %u event\n", ctx.index,
+		ctx.containers[PTP_TRACE_COMMAND], ctx.containers[PTP_TRACE_DATA],
+		ctx.containers[PTP_TRACE_RESPONSE], ctx.containers[PTP_TRACE_EVENT]);
+	printf("%u truncated by the capture, %u URB(s) outside a container, %u cancel/reset request(s)\n",
+		ctx.truncated, ctx.unsynchronized, ctx.resets);
+	
+	if (ctx.opcode_count > 0)
+	{
+		printf("\n%-8s %8s %12s\n", "Opcode", "Phases", "Bytes");
+		
+		for (i = 0; i < ctx.opcode_count; i++)
+		{
+			printf("0x%04x   %8u %12llu\n", ctx.opcodes[i].code, ctx.opcodes[i].count, (unsigned long long)ctx.opcodes[i].bytes);
+		}
+	}
+	
+	return 0;
+}
@@ -0,0 +1,633 @@
+/*
+ * Throughput and latency run against the virtual camera, no hardware needed
+ *
+ * Usage: virtualbench [images [bandwidth_mbs [latency_usec [object_kb [trace [polls [cameras [triggers]]]]]]]]
+ * 
+ * With more than one camera, each virtual camera shoots and downloads its 
+ * burst from its own thread (see ptp-group.h), and the per-camera and 
+ * aggregate MB/s are reported. No trace is recorded in that mode. Given a 
+ * number of triggers, the cameras are instead fired together that many times 
+ * and the percentiles of the shutter skew over the group are reported.
+ * 
+ * The allocation functions are wrapped at link time (see the Makefile), so 
+ * heap operations in the library and the virtual camera can be counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "ptp.h"
+#include "ptp-pima.h"
+#include "ptp-sony.h"
+#include "ptp-virtual.h"
+#include "ptp-group.h"
+#include "timer.h"
+
+#define BENCH_IMAGES		20
+#define BENCH_EVENT_TIMEOUT	5000
+#define BENCH_TRACE_MAX_DATA	4096
+#define BENCH_POLLS			1000
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+int __real_posix_memalign(void **ptr, size_t alignment, size_t size);
+
+static uint64_t g_heap_ops = 0;
+
+void *__wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&g_heap_ops, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&g_heap_ops, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&g_heap_ops, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+	if (ptr)
+	{
+		__atomic_add_fetch(&g_heap_ops, 1, __ATOMIC_RELAXED);
+	}
+	
+	__real_free(ptr);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	__atomic_add_fetch(&g_heap_ops, 1, __ATOMIC_RELAXED);
+	return __real_posix_memalign(ptr, alignment, size);
+}
+
+static uint64_t heap_ops(void)
+{
+	return __atomic_load_n(&g_heap_ops, __ATOMIC_RELAXED);
+}
+
+static int discard_begin(ptp_device *dev, uint32_t size, void *ctx)
+{
+	return PTP_OK;
+}
+
+static int discard_write(ptp_device *dev, const void *data, uint32_t size, void *ctx)
+{
+	return PTP_OK;
+}
+
+// Shoots a burst of 'images' and downloads every image as it is announced. 
+// '*done' receives the number of images transferred.
+static int capture(ptp_device *dev, int images, int *done)
+{
+	ptp_data_sink sink;
+	uint32_t handle;
+	int i, ret = PTP_OK;
+	
+	sink.begin = discard_begin;
+	sink.write = discard_write;
+	sink.ctx = NULL;
+	
+	ptp_sony_set_control_device_b_u16(dev, PTP_DPC_SONY_CTRL_AFLock, 2);
+	ptp_sony_set_control_device_b_u16(dev, PTP_DPC_SONY_CTRL_Shutter, 2);
+	
+	for (i = 0; i < images; i++)
+	{
+		ret = ptp_sony_wait_object(dev, &handle, BENCH_EVENT_TIMEOUT);
+		
+		if (ret != PTP_OK)
+		{
+			printf("ptp_sony_wait_object: %d\n", ret);
+			break;
+		}
+		
+		if (i == images - 1)
+		{
+			ptp_sony_set_control_device_b_u16(dev, PTP_DPC_SONY_CTRL_Shutter, 1);
+			ptp_sony_set_control_device_b_u16(dev, PTP_DPC_SONY_CTRL_AFLock, 1);
+		}
+		
+		ret = ptp_pima_get_object_info(dev, handle, NULL);
+		
+		if (ret == PTP_OK)
+		{
+			ret = ptp_pima_get_object_stream(dev, handle, &sink);
+		}
+		
+		if (ret < 0)
+		{
+			printf("Transfer %d: %d\n", i, ret);
+			break;
+		}
+		
+		ret = PTP_OK;
+	}
+	
+	*done = i;
+	
+	return ret;
+}
+
+typedef struct _bench_group
+{
+	int images;
+	int done[PTP_GROUP_MAX_DEVICES];
+} bench_group;
+
+static int group_capture(ptp_device *dev, int index, void *ctx)
+{
+	bench_group *bench = ctx;
+	
+	return capture(dev, bench->images, &bench->done[index]);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	
+	return (x > y) - (x < y);
+}
+
+static void print_skew(const char *name, int64_t *skew, int count)
+{
+	if (count == 0)
+	{
+		printf("%s: no samples\n", name);
+		return;
+	}
+	
+	qsort(skew, count, sizeof(int64_t), compare_int64);
+	
+	printf("%s over %d trigger(s): p50 %lld  p90 %lld  p99 %lld  max %lld us\n", name, count,
+		(long long)skew[(count - 1) * 50 / 100],
+		(long long)skew[(count - 1) * 90 / 100],
+		(long long)skew[(count - 1) * 99 / 100],
+		(long long)skew[count - 1]
+	);
+}
+
+// Fires the group 'triggers' times. Each camera keeps its shots, the buffer 
+// must have room for all of them.
+static int run_triggers(ptp_group *group, int triggers)
+{
+	ptp_group_shot shots[PTP_GROUP_MAX_DEVICES];
+	int64_t *send, *object, send_skew, object_skew;
+	int i, sends = 0, objects = 0, ret = PTP_OK;
+	
+	send = malloc(sizeof(int64_t) * triggers);
+	object = malloc(sizeof(int64_t) * triggers);
+	
+	if (!send || !object)
+	{
+		free(send);
+		free(object);
+		return PTP_ERROR_MEMORY;
+	}
+	
+	for (i = 0; i < triggers; i++)
+	{
+		ret = ptp_group_trigger(group, shots, BENCH_EVENT_TIMEOUT);
+		
+		if (ret != PTP_OK)
+		{
+			printf("Trigger %d: %d\n", i, ret);
+			ptp_group_print_skew(group, shots);
+			break;
+		}
+		
+		ptp_group_get_skew(group, shots, &send_skew, &object_skew);
+		
+		if (send_skew >= 0)
+		{
+			send[sends++] = send_skew;
+		}
+		
+		if (object_skew >= 0)
+		{
+			object[objects++] = object_skew;
+		}
+	}
+	
+	print_skew("Send skew", send, sends);
+	print_skew("ObjectAdded skew", object, objects);
+	
+	free(send);
+	free(object);
+	
+	return ret;
+}
+
+// Several virtual cameras at once, the way ptpclient drives all attached 
+// cameras
+static int run_group(const ptp_virtual_config *config, int images, int cameras, int triggers)
+{
+	ptp_virtual_camera *camera[PTP_GROUP_MAX_DEVICES];
+	ptp_device *dev[PTP_GROUP_MAX_DEVICES];
+	ptp_group group;
+	bench_group bench;
+	int i, count, ret = PTP_OK;
+	
+	ptp_group_init(&group);
+	bench.images = images;
+	
+	for (count = 0; count < cameras; count++)
+	{
+		ret = ptp_virtual_create(&camera[count], config);
+		
+		if (ret != PTP_OK)
+		{
+			printf("ptp_virtual_create: %d\n", ret);
+			break;
+		}
+		
+		ret = ptp_device_init_transport(&dev[count], &ptp_transport_virtual, camera[count], NULL, NULL);
+		
+		if (ret != PTP_OK)
+		{
+			printf("ptp_device_init_transport: %d\n", ret);
+			ptp_virtual_destroy(camera[count]);
+			break;
+		}
+		
+		ret = ptp_sony_handshake(dev[count]);
+		
+		if (ret != PTP_OK)
+		{
+			printf("Handshake %d: %d\n", count, ret);
+		}
+		
+		ptp_group_add(&group, dev[count], PTP_GROUP_NO_CPU);
+	}
+	
+	if (count == cameras && triggers > 0)
+	{
+		ret = run_triggers(&group, triggers);
+	}
+	else if (count == cameras)
+	{
+		ret = ptp_group_start(&group, group_capture, &bench);
+		
+		if (ret == PTP_OK)
+		{
+			ret = ptp_group_wait(&group);
+		}
+		
+		for (i = 0; i < count; i++)
+		{
+			printf("Camera %d: %d image(s)\n", i, bench.done[i]);
+		}
+		
+		ptp_group_print_rates(&group);
+	}
+	
+	for (i = 0; i < count; i++)
+	{
+		ptp_device_free(dev[i]);
+		ptp_virtual_destroy(camera[i]);
+	}
+	
+	return (ret == PTP_OK) ? 0 : 1;
+}
+
+// Steady-state property polling, the way a UI refreshes the battery level and 
+// the pending image count. Returns the number of polls done.
+static int poll_props(ptp_device *dev, int polls, uint64_t *heap, uint64_t *bytes)
+{
+	int i, ret;
+	int8_t level;
+	
+	*heap = 0;
+	*bytes = 0;
+	
+	// The first poll sizes the device's arena
+	ret = ptp_sony_get_battery(dev, &level);
+	
+	if (ret != PTP_OK)
+	{
+		printf("ptp_sony_get_battery: %d\n", ret);
+		return 0;
+	}
+	
+	*heap = heap_ops();
+	*bytes = ptp_get_bytes_in(dev);
+	
+	for (i = 0; i < polls; i++)
+	{
+		ret = ptp_sony_get_pending_objects(dev);
+		
+		if (ret >= 0)
+		{
+			ret = ptp_sony_get_battery(dev, &level);
+		}
+		
+		if (ret < 0)
+		{
+			printf("Poll %d: %d\n", i, ret);
+			break;
+		}
+	}
+	
+	*heap = heap_ops() - *heap;
+	*bytes = ptp_get_bytes_in(dev) - *bytes;
+	
+	return i;
+}
+
+// The same through a property table, which only decodes what changed
+static int poll_table(ptp_device *dev, int polls, uint64_t *heap, int *decoded)
+{
+	ptp_sony_prop_table *table = NULL;
+	int i, ret;
+	
+	*heap = 0;
+	*decoded = 0;
+	
+	ret = ptp_sony_proptable_create(dev, &table);
+	
+	if (ret == PTP_OK)
+	{
+		ret = ptp_sony_proptable_refresh(table);
+	}
+	
+	if (ret < 0)
+	{
+		printf("Property table: %d\n", ret);
+		ptp_sony_proptable_free(table);
+		return 0;
+	}
+	
+	*heap = heap_ops();
+	
+	for (i = 0; i < polls; i++)
+	{
+		ret = ptp_sony_proptable_refresh(table);
+		
+		if (ret < 0)
+		{
+			printf("Refresh %d: %d\n", i, ret);
+			break;
+		}
+		
+		*decoded += ret;
+	}
+	
+	*heap = heap_ops() - *heap;
+	ptp_sony_proptable_free(table);
+	
+	return i;
+}
+
+typedef struct _bench_async
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int done;
+	int failed;
+} bench_async;
+
+static void async_done(ptp_device *dev, int result, const ptp_params *params_in, void *data_in, uint32_t data_in_size, void *ctx)
+{
+	bench_async *bench = ctx;
+	
+	free(data_in);
+	
+	pthread_mutex_lock(&bench->mutex);
+	
+	if (result != PTP_OK || params_in->code != PTP_RC_OK)
+	{
+		bench->failed++;
+	}
+	
+	bench->done++;
+	pthread_cond_broadcast(&bench->cond);
+	
+	pthread_mutex_unlock(&bench->mutex);
+}
+
+// The property poll again, with every GetAllDevPropData queued up front 
+// through ptp_transact_async(). The virtual transport has no asynchronous 
+// transfers, so each one completes in the call that queues it. Returns the 
+// number of transactions completed.
+static int poll_async(ptp_device *dev, int polls, uint64_t *usec, int *failed)
+{
+	bench_async bench;
+	ptp_params params_out;
+	struct timeval tv;
+	int i, queued, ret;
+	timer tm;
+	
+	*usec = 0;
+	*failed = 0;
+	
+	pthread_mutex_init(&bench.mutex, NULL);
+	pthread_cond_init(&bench.cond, NULL);
+	bench.done = 0;
+	bench.failed = 0;
+	
+	params_out.code = PTP_OP_SONY_GETALLDEVPROPDATA;
+	params_out.num_params = 0;
+	
+	timer_start(&tm);
+	
+	for (queued = 0; queued < polls; queued++)
+	{
+		ret = ptp_transact_async(dev, &params_out, NULL, 0, 1, async_done, &bench);
+		
+		if (ret != PTP_OK)
+		{
+			printf("ptp_transact_async %d: %d\n", queued, ret);
+			break;
+		}
+	}
+	
+	pthread_mutex_lock(&bench.mutex);
+	
+	while (bench.done < queued)
+	{
+		pthread_cond_wait(&bench.cond, &bench.mutex);
+	}
+	
+	i = bench.done;
+	*failed = bench.failed;
+	
+	pthread_mutex_unlock(&bench.mutex);
+	
+	timer_stop(&tm);
+	timer_elapsed(&tm, &tv);
+	*usec = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	
+	pthread_cond_destroy(&bench.cond);
+	pthread_mutex_destroy(&bench.mutex);
+	
+	return i;
+}
+
+static void print_latency(const char *name, const ptp_latency *latency)
+{
+	if (latency->count == 0)
+	{
+		printf("%s: no transactions\n", name);
+		return;
+	}
+	
+	printf("%s: %llu transactions, avg %llu us, min %llu us, max %llu us\n",
+		name,
+		(unsigned long long)latency->count,
+		(unsigned long long)(latency->total_usec / latency->count),
+		(unsigned long long)latency->min_usec,
+		(unsigned long long)latency->max_usec
+	);
+}
+
+int main(int argc, char **argv)
+{
+	ptp_virtual_config config;
+	ptp_virtual_camera *camera;
+	ptp_device *dev;
+	ptp_pima_prop_desc_list *list;
+	ptp_latency control, data;
+	ptp_stats *stats;
+	struct timeval tv;
+	uint64_t usec, bytes, heap;
+	int images, polls, cameras, triggers, decoded, failed, i, ret;
+	timer tm;
+	
+	ptp_virtual_default_config(&config);
+	
+	images = (argc > 1) ? atoi(argv[1]) : BENCH_IMAGES;
+	polls = (argc > 6) ? atoi(argv[6]) : BENCH_POLLS;
+	cameras = (argc > 7) ? atoi(argv[7]) : 1;
+	triggers = (argc > 8) ? atoi(argv[8]) : 0;
+	
+	if (argc > 2)
+	{
+		config.bandwidth = (uint32_t)(atof(argv[2]) * 1024 * 1024);
+	}
+	
+	if (argc > 3)
+	{
+		config.latency_usec = (uint32_t)atoi(argv[3]);
+	}
+	
+	if (argc > 4)
+	{
+		config.object_size = (uint32_t)atoi(argv[4]) * 1024;
+	}
+	
+	config.burst_depth = images;
+	
+	if (cameras > PTP_GROUP_MAX_DEVICES)
+	{
+		cameras = PTP_GROUP_MAX_DEVICES;
+	}
+	
+	if (cameras > 1)
+	{
+		if (triggers > images)
+		{
+			config.burst_depth = triggers;
+		}
+		
+		return run_group(&config, images, cameras, triggers);
+	}
+	
+	ret = ptp_virtual_create(&camera, &config);
+	
+	if (ret != PTP_OK)
+	{
+		printf("ptp_virtual_create: %d\n", ret);
+		return 1;
+	}
+	
+	ret = ptp_device_init_transport(&dev, &ptp_transport_virtual, camera, NULL, NULL);
+	
+	if (ret != PTP_OK)
+	{
+		printf("ptp_device_init_transport: %d\n", ret);
+		ptp_virtual_destroy(camera);
+		return 1;
+	}
+	
+	if (argc > 5 && ptp_trace_start(dev, argv[5], BENCH_TRACE_MAX_DATA) != PTP_OK)
+	{
+		printf("Could not record a trace to %s\n", argv[5]);
+	}
+	
+	ret = ptp_sony_handshake(dev);
+	
+	if (ret == PTP_OK && ptp_pima_proplist_create(&list) == PTP_OK)
+	{
+		ret = ptp_sony_get_all_dev_prop_data(dev, list);
+		ptp_pima_proplist_free(list);
+	}
+	
+	if (ret != PTP_OK)
+	{
+		printf("Handshake: %d\n", ret);
+	}
+	
+	stats = malloc(sizeof(*stats));
+	
+	if (stats)
+	{
+		ptp_device_get_stats(dev, stats, 1);
+	}
+	
+	bytes = ptp_get_bytes_in(dev);
+	timer_start(&tm);
+	
+	capture(dev, images, &i);
+	
+	timer_stop(&tm);
+	timer_elapsed(&tm, &tv);
+	
+	usec = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	bytes = ptp_get_bytes_in(dev) - bytes;
+	
+	printf("%d image(s), %llu bytes in %ld.%06ld s", i, (unsigned long long)bytes, tv.tv_sec, tv.tv_usec);
+	
+	if (usec > 0)
+	{
+		printf(" (%.2f MB/s)", ((double)bytes / (double)usec) * (1000000.0 / (1024.0 * 1024.0)));
+	}
+	
+	printf("\n");
+	
+	ptp_get_latency(dev, &control, &data);
+	print_latency("Control", &control);
+	print_latency("Data", &data);
+	
+	if (polls > 0)
+	{
+		ret = poll_props(dev, polls, &heap, &bytes);
+		printf("%d property poll(s), %llu heap operation(s), %.1f bytes in per poll\n", ret, (unsigned long long)heap, ret ? (double)bytes / ret : 0.0);
+		
+		ret = poll_table(dev, polls, &heap, &decoded);
+		printf("%d table refresh(es), %d descriptor(s) decoded, %llu heap operation(s)\n", ret, decoded, (unsigned long long)heap);
+		
+		ret = poll_async(dev, polls, &usec, &failed);
+		printf("%d async transaction(s), %d failed, %.1f us per transaction\n", ret, failed, ret ? (double)usec / ret : 0.0);
+	}
+	
+	if (stats && ptp_device_get_stats(dev, stats, 0) == PTP_OK)
+	{
+		printf("\n");
+		ptp_stats_print(stats, stdout);
+	}
+	
+	free(stats);
+	ptp_device_free(dev);
+	ptp_virtual_destroy(camera);
+	
+	return (i == images) ? 0 : 1;
+}